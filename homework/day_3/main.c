@@ -1,12 +1,17 @@
 // Homework for Bitwise, day 3
 // https://github.com/pervognsen/bitwise
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <string.h>
 
 void * xmalloc(size_t size)
 {
@@ -19,6 +24,17 @@ void * xmalloc(size_t size)
     return ptr;
 }
 
+void * xrealloc(void * ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if (!ptr)
+    {
+        printf("xrealloc failed\n");
+        exit(0);
+    }
+    return ptr;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Tokenizer
 ////////////////////////////////////////////////////////////////////////////////
@@ -26,7 +42,8 @@ void * xmalloc(size_t size)
 enum token_type_t
 {
     _TOKEN_TYPE_LAST_ASCII = 127,
-    TOKEN_TYPE_NUMBER
+    TOKEN_TYPE_NUMBER,
+    TOKEN_TYPE_VARIABLE
 };
 typedef enum token_type_t token_type_t;
 
@@ -66,6 +83,13 @@ void next_token()
             input_stream++;
         }
     }
+    else if (islower(*input_stream))
+    {
+        // Variables are single lowercase letters, their value is their index.
+        current_token.type = TOKEN_TYPE_VARIABLE;
+        current_token.value = *input_stream - 'a';
+        input_stream++;
+    }
     else
     {
         current_token.type = *input_stream;
@@ -83,7 +107,10 @@ enum ast_bin_op_t
     AST_BIN_OP_SUBTRACT,
     AST_BIN_OP_MULTIPLY,
     AST_BIN_OP_DIVIDE,
-    AST_BIN_OP_EXPONENT
+    AST_BIN_OP_EXPONENT,
+    // Only produced by the optimizer, the right operand is a literal shift.
+    AST_BIN_OP_SHIFT_LEFT,
+    AST_BIN_OP_SHIFT_RIGHT_DIVIDE
 };
 typedef enum ast_bin_op_t ast_bin_op_t;
 
@@ -97,7 +124,8 @@ enum ast_node_type_t
 {
     AST_NODE_TYPE_UNARY,
     AST_NODE_TYPE_BINARY,
-    AST_NODE_TYPE_LITERAL
+    AST_NODE_TYPE_LITERAL,
+    AST_NODE_TYPE_VARIABLE
 };
 typedef enum ast_node_type_t ast_node_type_t;
 
@@ -120,6 +148,7 @@ struct ast_node_t
         } binary;
 
         int32_t literal;
+        int32_t variable;
     };
 };
 typedef struct ast_node_t ast_node_t;
@@ -141,7 +170,7 @@ ast_node_t * make_ast_node(ast_node_type_t type)
 // mult         = pow, {('*' | '/'), pow};
 // pow          = minus, {'^', pow};
 // minus        = ['-'], term;
-// term         = <NUMBER> | '(', expr, ')';
+// term         = <NUMBER> | <VARIABLE> | '(', expr, ')';
 
 bool is_token(token_type_t type)
 {
@@ -168,6 +197,13 @@ ast_node_t * parse_term()
         next_token();
         return node;
     }
+    else if (is_token(TOKEN_TYPE_VARIABLE))
+    {
+        ast_node_t * node = make_ast_node(AST_NODE_TYPE_VARIABLE);
+        node->variable = current_token.value;
+        next_token();
+        return node;
+    }
     else
     {
         expect_token('(');
@@ -269,15 +305,50 @@ enum vm_opcode_t
     VM_OPCODE_POW,
     VM_OPCODE_INV,
     VM_OPCODE_LIT,
+    VM_OPCODE_CONST,
+    VM_OPCODE_ADD_LIT,
+    VM_OPCODE_SUB_LIT,
+    VM_OPCODE_MULT_LIT,
+    VM_OPCODE_DIV_LIT,
+    VM_OPCODE_POW_LIT,
+    VM_OPCODE_LOAD,
+    VM_OPCODE_SHL,
+    VM_OPCODE_SHR_DIV,
+    VM_OPCODE_ADD_CHECKED,
+    VM_OPCODE_SUB_CHECKED,
+    VM_OPCODE_MULT_CHECKED,
+    VM_OPCODE_DIV_CHECKED,
+    VM_OPCODE_POW_CHECKED,
+    VM_OPCODE_INV_CHECKED,
     VM_OPCODE_HALT
 };
 typedef enum vm_opcode_t vm_opcode_t;
 
+// Instructions are 32 bits wide: the opcode in the low 8 bits and a signed 24
+// bits operand above it. LIT pushes its operand, CONST pushes the constant
+// pool entry its operand indexes, for literals that don't fit in 24 bits.
+// The *_LIT superinstructions apply their operation to the top of the stack
+// and their operand. LOAD pushes the variable its operand indexes. SHL and
+// SHR_DIV multiply and divide the top of the stack by 2 to the power of their
+// operand. The *_CHECKED opcodes trap on overflow where the others wrap around.
+typedef uint32_t vm_instr_t;
+
+enum
+{
+    VM_OPERAND_MIN = -(1 << 23),
+    VM_OPERAND_MAX = (1 << 23) - 1
+};
+
+#define VM_INSTR(opcode, operand) ((vm_instr_t)(opcode) | ((vm_instr_t)(operand) << 8))
+#define VM_GET_OPCODE(instr) ((instr) & 0xff)
+#define VM_GET_OPERAND(instr) ((int32_t)(instr) >> 8)
+
 enum
 {
     VM_STACK_SIZE = 1024
 };
 
+int32_t vm_variables[26];
 int32_t vm_stack[VM_STACK_SIZE];
 int32_t * vm_stack_top = vm_stack;
 
@@ -293,69 +364,300 @@ int32_t vm_pop()
     return *--vm_stack_top;
 }
 
-void vm_execute(uint8_t * code)
+// Arithmetic semantics: the plain operations wrap around in two's complement
+// on overflow, INT32_MIN / -1 giving INT32_MIN, and the checked operations
+// trap instead. Both trap on a division by zero.
+
+void vm_trap(const char * message)
+{
+    printf("%s\n", message);
+    exit(0);
+}
+
+int32_t vm_add(int32_t a, int32_t b)
+{
+    return (int32_t)((uint32_t)a + (uint32_t)b);
+}
+
+int32_t vm_sub(int32_t a, int32_t b)
+{
+    return (int32_t)((uint32_t)a - (uint32_t)b);
+}
+
+int32_t vm_mult(int32_t a, int32_t b)
+{
+    return (int32_t)((uint32_t)a * (uint32_t)b);
+}
+
+int32_t vm_neg(int32_t a)
+{
+    return (int32_t)(0u - (uint32_t)a);
+}
+
+int32_t vm_div(int32_t a, int32_t b)
+{
+    if (b == 0)
+    {
+        vm_trap("Division by zero");
+    }
+    if (a == INT32_MIN && b == -1)
+    {
+        return INT32_MIN;
+    }
+    return a / b;
+}
+
+// The checked_* functions store the wrapped around result and return whether
+// it is exact.
+
+bool checked_add(int32_t a, int32_t b, int32_t * result)
+{
+    int64_t exact = (int64_t)a + b;
+    *result = vm_add(a, b);
+    return exact >= INT32_MIN && exact <= INT32_MAX;
+}
+
+bool checked_sub(int32_t a, int32_t b, int32_t * result)
+{
+    int64_t exact = (int64_t)a - b;
+    *result = vm_sub(a, b);
+    return exact >= INT32_MIN && exact <= INT32_MAX;
+}
+
+bool checked_mult(int32_t a, int32_t b, int32_t * result)
+{
+    int64_t exact = (int64_t)a * b;
+    *result = vm_mult(a, b);
+    return exact >= INT32_MIN && exact <= INT32_MAX;
+}
+
+bool checked_neg(int32_t a, int32_t * result)
+{
+    *result = vm_neg(a);
+    return a != INT32_MIN;
+}
+
+// Exponentiation by squaring, in O(log exponent) multiplications. Squaring
+// the base can only overflow if a higher bit of the exponent is set, in which
+// case the exact result is at least as large, so any overflow is one of the
+// result. A negative exponent gives 1 / value^-exponent truncated towards
+// zero, which is 0 unless value is 1 or -1.
+bool checked_pow(int32_t value, int32_t exponent, int32_t * result)
+{
+    if (exponent < 0)
+    {
+        if (value == 0)
+        {
+            vm_trap("Division by zero");
+        }
+        *result = value == 1 ? 1 : value == -1 ? ((exponent & 1) ? -1 : 1) : 0;
+        return true;
+    }
+
+    bool exact = true;
+    int32_t power = 1;
+    uint32_t bits = (uint32_t)exponent;
+    for (;;)
+    {
+        if (bits & 1)
+        {
+            exact &= checked_mult(power, value, &power);
+        }
+        bits >>= 1;
+        if (!bits)
+        {
+            break;
+        }
+        exact &= checked_mult(value, value, &value);
+    }
+    *result = power;
+    return exact;
+}
+
+int32_t vm_pow(int32_t value, int32_t exponent)
+{
+    int32_t result;
+    checked_pow(value, exponent, &result);
+    return result;
+}
+
+int32_t vm_add_checked(int32_t a, int32_t b)
+{
+    int32_t result;
+    if (!checked_add(a, b, &result))
+    {
+        vm_trap("Integer overflow");
+    }
+    return result;
+}
+
+int32_t vm_sub_checked(int32_t a, int32_t b)
+{
+    int32_t result;
+    if (!checked_sub(a, b, &result))
+    {
+        vm_trap("Integer overflow");
+    }
+    return result;
+}
+
+int32_t vm_mult_checked(int32_t a, int32_t b)
+{
+    int32_t result;
+    if (!checked_mult(a, b, &result))
+    {
+        vm_trap("Integer overflow");
+    }
+    return result;
+}
+
+int32_t vm_neg_checked(int32_t a)
+{
+    int32_t result;
+    if (!checked_neg(a, &result))
+    {
+        vm_trap("Integer overflow");
+    }
+    return result;
+}
+
+int32_t vm_div_checked(int32_t a, int32_t b)
+{
+    if (a == INT32_MIN && b == -1)
+    {
+        vm_trap("Integer overflow");
+    }
+    return vm_div(a, b);
+}
+
+int32_t vm_pow_checked(int32_t value, int32_t exponent)
+{
+    int32_t result;
+    if (!checked_pow(value, exponent, &result))
+    {
+        vm_trap("Integer overflow");
+    }
+    return result;
+}
+
+int32_t vm_shl(int32_t value, int32_t shift)
+{
+    return (int32_t)((uint32_t)value << shift);
+}
+
+// Signed division rounds towards zero, so negative values are biased by
+// 2^shift - 1 before the arithmetic shift.
+int32_t vm_shr_div(int32_t value, int32_t shift)
+{
+    int32_t bias = (value >> 31) & ((1 << shift) - 1);
+    return (value + bias) >> shift;
+}
+
+void vm_execute_switch(vm_instr_t * code, int32_t * constants)
 {
     bool running = true;
     while (running)
     {
-        vm_opcode_t op = *code++;
+        vm_instr_t instr = *code++;
+        vm_opcode_t op = VM_GET_OPCODE(instr);
 
         switch (op)
         {
+        case VM_OPCODE_NOP:
+            break;
         case VM_OPCODE_HALT:
             running = false;
             break;
         case VM_OPCODE_LIT:
-            {
-                int32_t value = 0;
-                value |= *code++;
-                value |= (*code++) << 8; 
-                value |= (*code++) << 16; 
-                value |= (*code++) << 24;
-                vm_push(value);
-            }
+            vm_push(VM_GET_OPERAND(instr));
+            break;
+        case VM_OPCODE_CONST:
+            vm_push(constants[VM_GET_OPERAND(instr)]);
             break;
         case VM_OPCODE_INV:
-            vm_push(-vm_pop());
+            vm_push(vm_neg(vm_pop()));
             break;
         case VM_OPCODE_ADD:
-            vm_push(vm_pop() + vm_pop());
+            vm_push(vm_add(vm_pop(), vm_pop()));
             break;
         case VM_OPCODE_SUB:
-            vm_push(-vm_pop() + vm_pop());
+            {
+                int32_t b = vm_pop();
+                int32_t a = vm_pop();
+                vm_push(vm_sub(a, b));
+            }
             break;
         case VM_OPCODE_MULT:
-            vm_push(vm_pop() * vm_pop());
+            vm_push(vm_mult(vm_pop(), vm_pop()));
             break;
         case VM_OPCODE_DIV:
             {
                 int32_t b = vm_pop();
                 int32_t a = vm_pop();
-                vm_push(a / b);
+                vm_push(vm_div(a, b));
             }
             break;
         case VM_OPCODE_POW:
             {
                 int32_t exponent = vm_pop();
                 int32_t value = vm_pop();
-                int32_t result = 1;
-                bool must_invert = false;
-                if (exponent < 0)
-                {
-                    exponent = -exponent;
-                    must_invert = true;
-                }
-                while (exponent-- > 0)
-                {
-                    result *= value;
-                }
-                if (must_invert)
-                {
-                    result = 1 / result;
-                }
-                vm_push(result);
+                vm_push(vm_pow(value, exponent));
+            }
+            break;
+        case VM_OPCODE_ADD_LIT:
+            vm_push(vm_add(vm_pop(), VM_GET_OPERAND(instr)));
+            break;
+        case VM_OPCODE_SUB_LIT:
+            vm_push(vm_sub(vm_pop(), VM_GET_OPERAND(instr)));
+            break;
+        case VM_OPCODE_MULT_LIT:
+            vm_push(vm_mult(vm_pop(), VM_GET_OPERAND(instr)));
+            break;
+        case VM_OPCODE_DIV_LIT:
+            vm_push(vm_div(vm_pop(), VM_GET_OPERAND(instr)));
+            break;
+        case VM_OPCODE_POW_LIT:
+            vm_push(vm_pow(vm_pop(), VM_GET_OPERAND(instr)));
+            break;
+        case VM_OPCODE_LOAD:
+            vm_push(vm_variables[VM_GET_OPERAND(instr)]);
+            break;
+        case VM_OPCODE_SHL:
+            vm_push(vm_shl(vm_pop(), VM_GET_OPERAND(instr)));
+            break;
+        case VM_OPCODE_SHR_DIV:
+            vm_push(vm_shr_div(vm_pop(), VM_GET_OPERAND(instr)));
+            break;
+        case VM_OPCODE_ADD_CHECKED:
+            vm_push(vm_add_checked(vm_pop(), vm_pop()));
+            break;
+        case VM_OPCODE_SUB_CHECKED:
+            {
+                int32_t b = vm_pop();
+                int32_t a = vm_pop();
+                vm_push(vm_sub_checked(a, b));
+            }
+            break;
+        case VM_OPCODE_MULT_CHECKED:
+            vm_push(vm_mult_checked(vm_pop(), vm_pop()));
+            break;
+        case VM_OPCODE_DIV_CHECKED:
+            {
+                int32_t b = vm_pop();
+                int32_t a = vm_pop();
+                vm_push(vm_div_checked(a, b));
+            }
+            break;
+        case VM_OPCODE_POW_CHECKED:
+            {
+                int32_t exponent = vm_pop();
+                int32_t value = vm_pop();
+                vm_push(vm_pow_checked(value, exponent));
             }
             break;
+        case VM_OPCODE_INV_CHECKED:
+            vm_push(vm_neg_checked(vm_pop()));
+            break;
         default:
             assert(0);
             break;
@@ -363,97 +665,1763 @@ void vm_execute(uint8_t * code)
     }
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Compiler
-////////////////////////////////////////////////////////////////////////////////
+// Direct threaded dispatch: every handler ends with its own indirect jump to
+// the next handler through a table of label addresses, instead of going back
+// to the single shared jump of the switch. The branch predictor then sees one
+// branch per opcode and can learn which opcode usually follows which. Labels
+// as values are a GCC/Clang extension, other compilers use the switch.
+//
+// The stack pointer is kept in a local and the bound checks of vm_push/vm_pop
+// are dropped: the compiler checks the maximum stack depth of the program it
+// emits once, so they can't fail at runtime.
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_HAS_THREADED_DISPATCH 1
 
-enum
+void vm_execute_threaded(vm_instr_t * code, int32_t * constants)
 {
-    COMPILER_CODE_MAX_SIZE = 1024
-};
+    static void * dispatch_table[] =
+    {
+        [VM_OPCODE_NOP] = &&op_nop,
+        [VM_OPCODE_ADD] = &&op_add,
+        [VM_OPCODE_SUB] = &&op_sub,
+        [VM_OPCODE_MULT] = &&op_mult,
+        [VM_OPCODE_DIV] = &&op_div,
+        [VM_OPCODE_POW] = &&op_pow,
+        [VM_OPCODE_INV] = &&op_inv,
+        [VM_OPCODE_LIT] = &&op_lit,
+        [VM_OPCODE_CONST] = &&op_const,
+        [VM_OPCODE_ADD_LIT] = &&op_add_lit,
+        [VM_OPCODE_SUB_LIT] = &&op_sub_lit,
+        [VM_OPCODE_MULT_LIT] = &&op_mult_lit,
+        [VM_OPCODE_DIV_LIT] = &&op_div_lit,
+        [VM_OPCODE_POW_LIT] = &&op_pow_lit,
+        [VM_OPCODE_LOAD] = &&op_load,
+        [VM_OPCODE_SHL] = &&op_shl,
+        [VM_OPCODE_SHR_DIV] = &&op_shr_div,
+        [VM_OPCODE_ADD_CHECKED] = &&op_add_checked,
+        [VM_OPCODE_SUB_CHECKED] = &&op_sub_checked,
+        [VM_OPCODE_MULT_CHECKED] = &&op_mult_checked,
+        [VM_OPCODE_DIV_CHECKED] = &&op_div_checked,
+        [VM_OPCODE_POW_CHECKED] = &&op_pow_checked,
+        [VM_OPCODE_INV_CHECKED] = &&op_inv_checked,
+        [VM_OPCODE_HALT] = &&op_halt
+    };
 
-int8_t code[COMPILER_CODE_MAX_SIZE];
-int8_t * code_current = code;
+    int32_t * top = vm_stack_top;
+    vm_instr_t instr;
 
-void emit_opcode(vm_opcode_t opcode)
-{
-    assert(code_current + 1 <= code + COMPILER_CODE_MAX_SIZE);
-    *code_current++ = opcode;
-}
+#define DISPATCH() instr = *code++; goto *dispatch_table[VM_GET_OPCODE(instr)]
 
-void emit_int32(int32_t value)
-{
-    assert(code_current + 4 <= code + COMPILER_CODE_MAX_SIZE);
-    *code_current++ = value & 0xff;
-    *code_current++ = (value >> 8) & 0xff;
-    *code_current++ = (value >> 16) & 0xff;
-    *code_current++ = (value >> 24) & 0xff;
+    DISPATCH();
+
+op_nop:
+    DISPATCH();
+op_lit:
+    *top++ = VM_GET_OPERAND(instr);
+    DISPATCH();
+op_const:
+    *top++ = constants[VM_GET_OPERAND(instr)];
+    DISPATCH();
+op_inv:
+    top[-1] = vm_neg(top[-1]);
+    DISPATCH();
+op_add:
+    top[-2] = vm_add(top[-2], top[-1]);
+    top--;
+    DISPATCH();
+op_sub:
+    top[-2] = vm_sub(top[-2], top[-1]);
+    top--;
+    DISPATCH();
+op_mult:
+    top[-2] = vm_mult(top[-2], top[-1]);
+    top--;
+    DISPATCH();
+op_div:
+    top[-2] = vm_div(top[-2], top[-1]);
+    top--;
+    DISPATCH();
+op_pow:
+    top[-2] = vm_pow(top[-2], top[-1]);
+    top--;
+    DISPATCH();
+op_add_lit:
+    top[-1] = vm_add(top[-1], VM_GET_OPERAND(instr));
+    DISPATCH();
+op_sub_lit:
+    top[-1] = vm_sub(top[-1], VM_GET_OPERAND(instr));
+    DISPATCH();
+op_mult_lit:
+    top[-1] = vm_mult(top[-1], VM_GET_OPERAND(instr));
+    DISPATCH();
+op_div_lit:
+    top[-1] = vm_div(top[-1], VM_GET_OPERAND(instr));
+    DISPATCH();
+op_pow_lit:
+    top[-1] = vm_pow(top[-1], VM_GET_OPERAND(instr));
+    DISPATCH();
+op_load:
+    *top++ = vm_variables[VM_GET_OPERAND(instr)];
+    DISPATCH();
+op_shl:
+    top[-1] = vm_shl(top[-1], VM_GET_OPERAND(instr));
+    DISPATCH();
+op_shr_div:
+    top[-1] = vm_shr_div(top[-1], VM_GET_OPERAND(instr));
+    DISPATCH();
+op_add_checked:
+    top[-2] = vm_add_checked(top[-2], top[-1]);
+    top--;
+    DISPATCH();
+op_sub_checked:
+    top[-2] = vm_sub_checked(top[-2], top[-1]);
+    top--;
+    DISPATCH();
+op_mult_checked:
+    top[-2] = vm_mult_checked(top[-2], top[-1]);
+    top--;
+    DISPATCH();
+op_div_checked:
+    top[-2] = vm_div_checked(top[-2], top[-1]);
+    top--;
+    DISPATCH();
+op_pow_checked:
+    top[-2] = vm_pow_checked(top[-2], top[-1]);
+    top--;
+    DISPATCH();
+op_inv_checked:
+    top[-1] = vm_neg_checked(top[-1]);
+    DISPATCH();
+op_halt:
+    vm_stack_top = top;
+
+#undef DISPATCH
 }
 
-#define OPCODE(X, Y) case AST_BIN_OP_##X: return VM_OPCODE_##Y;
-vm_opcode_t ast_bin_op_to_vm_opcode(ast_bin_op_t op)
+#else
+#define VM_HAS_THREADED_DISPATCH 0
+#endif
+
+// Same as above, but the top of the stack lives in the tos local, which the
+// compiler keeps in a register: binary operations only load their left operand
+// from memory and unary ones don't touch memory at all. Pushes spill the
+// previous top into memory. The first push spills a meaningless value, which
+// HALT overwrites with the result since an expression pushes one value.
+//
+// Uses threaded dispatch when available and a switch otherwise, TARGET and
+// DISPATCH hiding the difference.
+void vm_execute_cached(vm_instr_t * code, int32_t * constants)
 {
-    switch (op)
+#if VM_HAS_THREADED_DISPATCH
+    static void * dispatch_table[] =
     {
-        OPCODE(ADD, ADD)
-        OPCODE(SUBTRACT, SUB)
-        OPCODE(MULTIPLY, MULT)
-        OPCODE(DIVIDE, DIV)
-        OPCODE(EXPONENT, POW)
+        [VM_OPCODE_NOP] = &&op_NOP,
+        [VM_OPCODE_ADD] = &&op_ADD,
+        [VM_OPCODE_SUB] = &&op_SUB,
+        [VM_OPCODE_MULT] = &&op_MULT,
+        [VM_OPCODE_DIV] = &&op_DIV,
+        [VM_OPCODE_POW] = &&op_POW,
+        [VM_OPCODE_INV] = &&op_INV,
+        [VM_OPCODE_LIT] = &&op_LIT,
+        [VM_OPCODE_CONST] = &&op_CONST,
+        [VM_OPCODE_ADD_LIT] = &&op_ADD_LIT,
+        [VM_OPCODE_SUB_LIT] = &&op_SUB_LIT,
+        [VM_OPCODE_MULT_LIT] = &&op_MULT_LIT,
+        [VM_OPCODE_DIV_LIT] = &&op_DIV_LIT,
+        [VM_OPCODE_POW_LIT] = &&op_POW_LIT,
+        [VM_OPCODE_LOAD] = &&op_LOAD,
+        [VM_OPCODE_SHL] = &&op_SHL,
+        [VM_OPCODE_SHR_DIV] = &&op_SHR_DIV,
+        [VM_OPCODE_ADD_CHECKED] = &&op_ADD_CHECKED,
+        [VM_OPCODE_SUB_CHECKED] = &&op_SUB_CHECKED,
+        [VM_OPCODE_MULT_CHECKED] = &&op_MULT_CHECKED,
+        [VM_OPCODE_DIV_CHECKED] = &&op_DIV_CHECKED,
+        [VM_OPCODE_POW_CHECKED] = &&op_POW_CHECKED,
+        [VM_OPCODE_INV_CHECKED] = &&op_INV_CHECKED,
+        [VM_OPCODE_HALT] = &&op_HALT
+    };
+#define TARGET(op) op_##op:
+#define DISPATCH() instr = *code++; goto *dispatch_table[VM_GET_OPCODE(instr)]
+#else
+#define TARGET(op) case VM_OPCODE_##op:
+#define DISPATCH() continue
+#endif
+
+    int32_t * top = vm_stack_top;
+    int32_t tos = 0;
+    vm_instr_t instr;
+
+#if VM_HAS_THREADED_DISPATCH
+    DISPATCH();
+#else
+    for (;;)
+    {
+        instr = *code++;
+        switch (VM_GET_OPCODE(instr))
+        {
+#endif
+
+    TARGET(NOP)
+        DISPATCH();
+    TARGET(LIT)
+        *top++ = tos;
+        tos = VM_GET_OPERAND(instr);
+        DISPATCH();
+    TARGET(CONST)
+        *top++ = tos;
+        tos = constants[VM_GET_OPERAND(instr)];
+        DISPATCH();
+    TARGET(INV)
+        tos = vm_neg(tos);
+        DISPATCH();
+    TARGET(ADD)
+        tos = vm_add(*--top, tos);
+        DISPATCH();
+    TARGET(SUB)
+        tos = vm_sub(*--top, tos);
+        DISPATCH();
+    TARGET(MULT)
+        tos = vm_mult(*--top, tos);
+        DISPATCH();
+    TARGET(DIV)
+        tos = vm_div(*--top, tos);
+        DISPATCH();
+    TARGET(POW)
+        tos = vm_pow(*--top, tos);
+        DISPATCH();
+    TARGET(ADD_LIT)
+        tos = vm_add(tos, VM_GET_OPERAND(instr));
+        DISPATCH();
+    TARGET(SUB_LIT)
+        tos = vm_sub(tos, VM_GET_OPERAND(instr));
+        DISPATCH();
+    TARGET(MULT_LIT)
+        tos = vm_mult(tos, VM_GET_OPERAND(instr));
+        DISPATCH();
+    TARGET(DIV_LIT)
+        tos = vm_div(tos, VM_GET_OPERAND(instr));
+        DISPATCH();
+    TARGET(POW_LIT)
+        tos = vm_pow(tos, VM_GET_OPERAND(instr));
+        DISPATCH();
+    TARGET(LOAD)
+        *top++ = tos;
+        tos = vm_variables[VM_GET_OPERAND(instr)];
+        DISPATCH();
+    TARGET(SHL)
+        tos = vm_shl(tos, VM_GET_OPERAND(instr));
+        DISPATCH();
+    TARGET(SHR_DIV)
+        tos = vm_shr_div(tos, VM_GET_OPERAND(instr));
+        DISPATCH();
+    TARGET(ADD_CHECKED)
+        tos = vm_add_checked(*--top, tos);
+        DISPATCH();
+    TARGET(SUB_CHECKED)
+        tos = vm_sub_checked(*--top, tos);
+        DISPATCH();
+    TARGET(MULT_CHECKED)
+        tos = vm_mult_checked(*--top, tos);
+        DISPATCH();
+    TARGET(DIV_CHECKED)
+        tos = vm_div_checked(*--top, tos);
+        DISPATCH();
+    TARGET(POW_CHECKED)
+        tos = vm_pow_checked(*--top, tos);
+        DISPATCH();
+    TARGET(INV_CHECKED)
+        tos = vm_neg_checked(tos);
+        DISPATCH();
+    TARGET(HALT)
+        goto halt;
+
+#if !VM_HAS_THREADED_DISPATCH
+        default:
+            assert(0);
+            break;
+        }
     }
-    return VM_OPCODE_NOP;
+#endif
+
+halt:
+    top[-1] = tos;
+    vm_stack_top = top;
+
+#undef TARGET
+#undef DISPATCH
 }
-#undef OPCODE
 
-#define OPCODE(X, Y) case AST_UN_OP_##X: return VM_OPCODE_##Y;
-vm_opcode_t ast_un_op_to_vm_opcode(ast_un_op_t op)
+// Batch execution evaluates the code for many rows at once, variables being
+// read from columns of values. Each stack slot holds VM_BATCH_SIZE values and
+// each instruction loops over all of them, so the dispatch cost is paid once
+// per batch instead of once per row, and the loops are simple enough for the
+// C compiler to vectorize.
+enum
 {
-    switch (op)
+    VM_BATCH_SIZE = 1024
+};
+
+int32_t vm_get_stack_effect(vm_opcode_t opcode)
+{
+    switch (opcode)
     {
-        OPCODE(INVERT, INV)
+    case VM_OPCODE_LIT:
+    case VM_OPCODE_CONST:
+    case VM_OPCODE_LOAD:
+        return 1;
+    case VM_OPCODE_ADD:
+    case VM_OPCODE_SUB:
+    case VM_OPCODE_MULT:
+    case VM_OPCODE_DIV:
+    case VM_OPCODE_POW:
+    case VM_OPCODE_ADD_CHECKED:
+    case VM_OPCODE_SUB_CHECKED:
+    case VM_OPCODE_MULT_CHECKED:
+    case VM_OPCODE_DIV_CHECKED:
+    case VM_OPCODE_POW_CHECKED:
+        return -1;
+    default:
+        return 0;
     }
-    return VM_OPCODE_NOP;
 }
-#undef OPCODE
 
-void compile_inner(ast_node_t * node)
+// columns[i] holds the row_count values of the variable i, it may be NULL if
+// the code doesn't use it. The result of each row is written to results.
+void vm_execute_batch(vm_instr_t * code, int32_t * constants, int32_t ** columns, int32_t * results, int32_t row_count)
 {
-    switch (node->type)
+    int32_t depth = 0;
+    int32_t max_depth = 0;
+    for (vm_instr_t * instr = code; VM_GET_OPCODE(*instr) != VM_OPCODE_HALT; instr++)
     {
-    case AST_NODE_TYPE_LITERAL:
-        emit_opcode(VM_OPCODE_LIT);
-        emit_int32(node->literal);
-        break;
-    case AST_NODE_TYPE_UNARY:
-        compile_inner(node->unary.child);
-        emit_opcode(ast_un_op_to_vm_opcode(node->unary.operator));
-        break;
-    case AST_NODE_TYPE_BINARY:
-        compile_inner(node->binary.left);
-        compile_inner(node->binary.right);
-        emit_opcode(ast_bin_op_to_vm_opcode(node->binary.operator));
-        break;
+        depth += vm_get_stack_effect(VM_GET_OPCODE(*instr));
+        if (depth > max_depth)
+        {
+            max_depth = depth;
+        }
+    }
+    int32_t (*stack)[VM_BATCH_SIZE] = xmalloc(max_depth * sizeof(*stack));
+    memset(stack, 0, max_depth * sizeof(*stack));
+
+    // Operations which can't trap process whole batches, even past the last
+    // row: a constant trip count lets compilers vectorize at -O2. The others
+    // only process the rows of the batch, the values past them being leftovers
+    // of previous batches.
+#define BATCH_UNARY(length, expr) \
+    { \
+        int32_t * a = top[-1]; \
+        for (int32_t i = 0; i < length; i++) \
+        { \
+            a[i] = expr; \
+        } \
+    }
+#define BATCH_BINARY(length, expr) \
+    { \
+        int32_t * restrict a = top[-2]; \
+        int32_t * restrict b = top[-1]; \
+        for (int32_t i = 0; i < length; i++) \
+        { \
+            a[i] = expr; \
+        } \
+        top--; \
+    }
+
+    for (int32_t first_row = 0; first_row < row_count; first_row += VM_BATCH_SIZE)
+    {
+        int32_t count = row_count - first_row < VM_BATCH_SIZE ? row_count - first_row : VM_BATCH_SIZE;
+        int32_t (*top)[VM_BATCH_SIZE] = stack;
+        vm_instr_t * ip = code;
+        bool running = true;
+
+        while (running)
+        {
+            vm_instr_t instr = *ip++;
+            int32_t operand = VM_GET_OPERAND(instr);
+
+            switch (VM_GET_OPCODE(instr))
+            {
+            case VM_OPCODE_NOP:
+                break;
+            case VM_OPCODE_HALT:
+                memcpy(results + first_row, top[-1], count * sizeof(int32_t));
+                running = false;
+                break;
+            case VM_OPCODE_LIT:
+                top++;
+                BATCH_UNARY(VM_BATCH_SIZE, operand);
+                break;
+            case VM_OPCODE_CONST:
+                top++;
+                BATCH_UNARY(VM_BATCH_SIZE, constants[operand]);
+                break;
+            case VM_OPCODE_LOAD:
+                memcpy(*top++, columns[operand] + first_row, count * sizeof(int32_t));
+                break;
+            case VM_OPCODE_INV: BATCH_UNARY(VM_BATCH_SIZE, vm_neg(a[i])); break;
+            case VM_OPCODE_ADD: BATCH_BINARY(VM_BATCH_SIZE, vm_add(a[i], b[i])); break;
+            case VM_OPCODE_SUB: BATCH_BINARY(VM_BATCH_SIZE, vm_sub(a[i], b[i])); break;
+            case VM_OPCODE_MULT: BATCH_BINARY(VM_BATCH_SIZE, vm_mult(a[i], b[i])); break;
+            case VM_OPCODE_DIV: BATCH_BINARY(count, vm_div(a[i], b[i])); break;
+            case VM_OPCODE_POW: BATCH_BINARY(count, vm_pow(a[i], b[i])); break;
+            case VM_OPCODE_ADD_LIT: BATCH_UNARY(VM_BATCH_SIZE, vm_add(a[i], operand)); break;
+            case VM_OPCODE_SUB_LIT: BATCH_UNARY(VM_BATCH_SIZE, vm_sub(a[i], operand)); break;
+            case VM_OPCODE_MULT_LIT: BATCH_UNARY(VM_BATCH_SIZE, vm_mult(a[i], operand)); break;
+            case VM_OPCODE_DIV_LIT: BATCH_UNARY(count, vm_div(a[i], operand)); break;
+            case VM_OPCODE_POW_LIT: BATCH_UNARY(count, vm_pow(a[i], operand)); break;
+            case VM_OPCODE_SHL: BATCH_UNARY(VM_BATCH_SIZE, vm_shl(a[i], operand)); break;
+            case VM_OPCODE_SHR_DIV: BATCH_UNARY(VM_BATCH_SIZE, vm_shr_div(a[i], operand)); break;
+            case VM_OPCODE_ADD_CHECKED: BATCH_BINARY(count, vm_add_checked(a[i], b[i])); break;
+            case VM_OPCODE_SUB_CHECKED: BATCH_BINARY(count, vm_sub_checked(a[i], b[i])); break;
+            case VM_OPCODE_MULT_CHECKED: BATCH_BINARY(count, vm_mult_checked(a[i], b[i])); break;
+            case VM_OPCODE_DIV_CHECKED: BATCH_BINARY(count, vm_div_checked(a[i], b[i])); break;
+            case VM_OPCODE_POW_CHECKED: BATCH_BINARY(count, vm_pow_checked(a[i], b[i])); break;
+            case VM_OPCODE_INV_CHECKED: BATCH_UNARY(count, vm_neg_checked(a[i])); break;
+            default:
+                assert(0);
+                break;
+            }
+        }
     }
+
+#undef BATCH_UNARY
+#undef BATCH_BINARY
+
+    free(stack);
 }
 
-void compile(ast_node_t * node)
+void vm_execute(vm_instr_t * code, int32_t * constants)
 {
-    compile_inner(node);
-    emit_opcode(VM_OPCODE_HALT);
+#if VM_HAS_THREADED_DISPATCH
+    vm_execute_threaded(code, constants);
+#else
+    vm_execute_switch(code, constants);
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+// Optimizer
 ////////////////////////////////////////////////////////////////////////////////
 
-int main(int argc, char * argv[])
+// Rewrites the AST bottom up: subtrees made of literals are evaluated with
+// the semantics of the VM, operations with a neutral operand are removed and
+// multiplications and divisions by powers of 2 become shifts. Operations
+// which would fail at runtime, like a division by zero, are left alone.
+
+// When set, arithmetic traps on overflow instead of wrapping around: the
+// optimizer leaves overflowing operations to the VM and the compiler emits the
+// checked opcodes.
+bool compile_checked;
+
+ast_node_t * make_literal(int32_t value)
 {
-    input_stream = "-50 + -(3 + 3)";
+    ast_node_t * node = make_ast_node(AST_NODE_TYPE_LITERAL);
+    node->literal = value;
+    return node;
+}
 
-    next_token();
-    ast_node_t * ast_root = parse_expr();
+ast_node_t * make_unary(ast_un_op_t operator, ast_node_t * child)
+{
+    ast_node_t * node = make_ast_node(AST_NODE_TYPE_UNARY);
+    node->unary.operator = operator;
+    node->unary.child = child;
+    return node;
+}
+
+ast_node_t * make_binary(ast_bin_op_t operator, ast_node_t * left, ast_node_t * right)
+{
+    ast_node_t * node = make_ast_node(AST_NODE_TYPE_BINARY);
+    node->binary.operator = operator;
+    node->binary.left = left;
+    node->binary.right = right;
+    return node;
+}
+
+bool is_literal(ast_node_t * node, int32_t value)
+{
+    return node->type == AST_NODE_TYPE_LITERAL && node->literal == value;
+}
+
+// Returns n when node is the literal 2^n with n > 0, 0 otherwise.
+int32_t get_power_of_two(ast_node_t * node)
+{
+    if (node->type != AST_NODE_TYPE_LITERAL || node->literal <= 1 || (node->literal & (node->literal - 1)))
+    {
+        return 0;
+    }
+    int32_t shift = 0;
+    while ((1 << shift) != node->literal)
+    {
+        shift++;
+    }
+    return shift;
+}
+
+bool fold_binary(ast_bin_op_t operator, int32_t left, int32_t right, int32_t * result)
+{
+    switch (operator)
+    {
+    case AST_BIN_OP_ADD:
+        return checked_add(left, right, result) || !compile_checked;
+    case AST_BIN_OP_SUBTRACT:
+        return checked_sub(left, right, result) || !compile_checked;
+    case AST_BIN_OP_MULTIPLY:
+        return checked_mult(left, right, result) || !compile_checked;
+    case AST_BIN_OP_DIVIDE:
+        if (right == 0 || (compile_checked && left == INT32_MIN && right == -1))
+        {
+            return false;
+        }
+        *result = vm_div(left, right);
+        return true;
+    case AST_BIN_OP_EXPONENT:
+        if (right < 0 && left == 0)
+        {
+            return false;
+        }
+        return checked_pow(left, right, result) || !compile_checked;
+    case AST_BIN_OP_SHIFT_LEFT:
+        *result = vm_shl(left, right);
+        return true;
+    case AST_BIN_OP_SHIFT_RIGHT_DIVIDE:
+        *result = vm_shr_div(left, right);
+        return true;
+    }
+    return false;
+}
+
+ast_node_t * optimize(ast_node_t * node)
+{
+    switch (node->type)
+    {
+    case AST_NODE_TYPE_LITERAL:
+    case AST_NODE_TYPE_VARIABLE:
+        return node;
+    case AST_NODE_TYPE_UNARY:
+        {
+            ast_node_t * child = optimize(node->unary.child);
+            int32_t result;
+            if (child->type == AST_NODE_TYPE_LITERAL && (checked_neg(child->literal, &result) || !compile_checked))
+            {
+                return make_literal(result);
+            }
+            // -(-x) is x only when negation wraps around, checked the inner
+            // negation traps for INT32_MIN.
+            if (!compile_checked && child->type == AST_NODE_TYPE_UNARY)
+            {
+                return child->unary.child;
+            }
+            node->unary.child = child;
+            return node;
+        }
+    case AST_NODE_TYPE_BINARY:
+        {
+            ast_bin_op_t operator = node->binary.operator;
+            ast_node_t * left = optimize(node->binary.left);
+            ast_node_t * right = optimize(node->binary.right);
+            int32_t result;
+            int32_t shift;
+
+            if (left->type == AST_NODE_TYPE_LITERAL && right->type == AST_NODE_TYPE_LITERAL &&
+                fold_binary(operator, left->literal, right->literal, &result))
+            {
+                return make_literal(result);
+            }
+
+            switch (operator)
+            {
+            case AST_BIN_OP_ADD:
+                if (is_literal(right, 0))
+                {
+                    return left;
+                }
+                if (is_literal(left, 0))
+                {
+                    return right;
+                }
+                break;
+            case AST_BIN_OP_SUBTRACT:
+                if (is_literal(right, 0))
+                {
+                    return left;
+                }
+                if (is_literal(left, 0))
+                {
+                    return optimize(make_unary(AST_UN_OP_INVERT, right));
+                }
+                break;
+            case AST_BIN_OP_MULTIPLY:
+                if (left->type == AST_NODE_TYPE_LITERAL)
+                {
+                    ast_node_t * swap = left;
+                    left = right;
+                    right = swap;
+                }
+                if (is_literal(right, 1))
+                {
+                    return left;
+                }
+                if (is_literal(right, -1))
+                {
+                    return optimize(make_unary(AST_UN_OP_INVERT, left));
+                }
+                // Shifts wrap around.
+                if (!compile_checked && (shift = get_power_of_two(right)))
+                {
+                    return make_binary(AST_BIN_OP_SHIFT_LEFT, left, make_literal(shift));
+                }
+                break;
+            case AST_BIN_OP_DIVIDE:
+                if (is_literal(right, 1))
+                {
+                    return left;
+                }
+                if (is_literal(right, -1))
+                {
+                    return optimize(make_unary(AST_UN_OP_INVERT, left));
+                }
+                if ((shift = get_power_of_two(right)))
+                {
+                    return make_binary(AST_BIN_OP_SHIFT_RIGHT_DIVIDE, left, make_literal(shift));
+                }
+                break;
+            case AST_BIN_OP_EXPONENT:
+                if (is_literal(right, 1))
+                {
+                    return left;
+                }
+                break;
+            default:
+                break;
+            }
+
+            node->binary.left = left;
+            node->binary.right = right;
+            return node;
+        }
+    }
+    return node;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Compiler
+////////////////////////////////////////////////////////////////////////////////
+
+// The code and the constant pool grow as needed, compile() keeps them around
+// and reuses them for the next expression.
+vm_instr_t * code;
+int32_t code_length;
+int32_t code_capacity;
+int32_t * constants;
+int32_t constants_length;
+int32_t constants_capacity;
+int32_t code_stack_depth;
+int32_t code_max_stack_depth;
+bool compile_optimize = true;
+bool compile_peephole = true;
+
+void emit_instr(vm_opcode_t opcode, int32_t operand)
+{
+    assert(operand >= VM_OPERAND_MIN && operand <= VM_OPERAND_MAX);
+    if (code_length == code_capacity)
+    {
+        code_capacity = code_capacity ? code_capacity * 2 : 256;
+        code = (vm_instr_t *)xrealloc(code, code_capacity * sizeof(vm_instr_t));
+    }
+    code[code_length++] = VM_INSTR(opcode, operand);
+}
+
+void emit_opcode(vm_opcode_t opcode)
+{
+    emit_instr(opcode, 0);
+}
+
+int32_t add_constant(int32_t value)
+{
+    for (int32_t i = 0; i < constants_length; i++)
+    {
+        if (constants[i] == value)
+        {
+            return i;
+        }
+    }
+    if (constants_length == constants_capacity)
+    {
+        constants_capacity = constants_capacity ? constants_capacity * 2 : 16;
+        constants = (int32_t *)xrealloc(constants, constants_capacity * sizeof(int32_t));
+    }
+    constants[constants_length] = value;
+    return constants_length++;
+}
+
+void emit_literal(int32_t value)
+{
+    if (value >= VM_OPERAND_MIN && value <= VM_OPERAND_MAX)
+    {
+        emit_instr(VM_OPCODE_LIT, value);
+    }
+    else
+    {
+        emit_instr(VM_OPCODE_CONST, add_constant(value));
+    }
+}
+
+#define OPCODE(X, Y) case AST_BIN_OP_##X: return VM_OPCODE_##Y;
+vm_opcode_t ast_bin_op_to_vm_opcode(ast_bin_op_t op)
+{
+    switch (op)
+    {
+        OPCODE(ADD, ADD)
+        OPCODE(SUBTRACT, SUB)
+        OPCODE(MULTIPLY, MULT)
+        OPCODE(DIVIDE, DIV)
+        OPCODE(EXPONENT, POW)
+        OPCODE(SHIFT_LEFT, SHL)
+        OPCODE(SHIFT_RIGHT_DIVIDE, SHR_DIV)
+    }
+    return VM_OPCODE_NOP;
+}
+#undef OPCODE
+
+#define OPCODE(X, Y) case AST_UN_OP_##X: return VM_OPCODE_##Y;
+vm_opcode_t ast_un_op_to_vm_opcode(ast_un_op_t op)
+{
+    switch (op)
+    {
+        OPCODE(INVERT, INV)
+    }
+    return VM_OPCODE_NOP;
+}
+#undef OPCODE
+
+vm_opcode_t get_checked_opcode(vm_opcode_t opcode)
+{
+    if (compile_checked)
+    {
+        switch (opcode)
+        {
+        case VM_OPCODE_ADD: return VM_OPCODE_ADD_CHECKED;
+        case VM_OPCODE_SUB: return VM_OPCODE_SUB_CHECKED;
+        case VM_OPCODE_MULT: return VM_OPCODE_MULT_CHECKED;
+        case VM_OPCODE_DIV: return VM_OPCODE_DIV_CHECKED;
+        case VM_OPCODE_POW: return VM_OPCODE_POW_CHECKED;
+        case VM_OPCODE_INV: return VM_OPCODE_INV_CHECKED;
+        default: break;
+        }
+    }
+    return opcode;
+}
+
+void compile_inner(ast_node_t * node)
+{
+    switch (node->type)
+    {
+    case AST_NODE_TYPE_LITERAL:
+        emit_literal(node->literal);
+        code_stack_depth++;
+        if (code_stack_depth > code_max_stack_depth)
+        {
+            code_max_stack_depth = code_stack_depth;
+        }
+        break;
+    case AST_NODE_TYPE_VARIABLE:
+        emit_instr(VM_OPCODE_LOAD, node->variable);
+        code_stack_depth++;
+        if (code_stack_depth > code_max_stack_depth)
+        {
+            code_max_stack_depth = code_stack_depth;
+        }
+        break;
+    case AST_NODE_TYPE_UNARY:
+        compile_inner(node->unary.child);
+        emit_opcode(get_checked_opcode(ast_un_op_to_vm_opcode(node->unary.operator)));
+        break;
+    case AST_NODE_TYPE_BINARY:
+        if (node->binary.operator == AST_BIN_OP_SHIFT_LEFT || node->binary.operator == AST_BIN_OP_SHIFT_RIGHT_DIVIDE)
+        {
+            compile_inner(node->binary.left);
+            emit_instr(ast_bin_op_to_vm_opcode(node->binary.operator), node->binary.right->literal);
+            break;
+        }
+        compile_inner(node->binary.left);
+        compile_inner(node->binary.right);
+        emit_opcode(get_checked_opcode(ast_bin_op_to_vm_opcode(node->binary.operator)));
+        code_stack_depth--;
+        break;
+    }
+}
+
+// Returns the instruction doing the work of first followed by second, or 0
+// (a NOP) when there's none.
+vm_instr_t fuse_instrs(vm_instr_t first, vm_instr_t second)
+{
+    vm_opcode_t first_op = VM_GET_OPCODE(first);
+    vm_opcode_t second_op = VM_GET_OPCODE(second);
+    int32_t operand = VM_GET_OPERAND(first);
+
+    if (first_op == VM_OPCODE_LIT)
+    {
+        switch (second_op)
+        {
+        case VM_OPCODE_ADD: return VM_INSTR(VM_OPCODE_ADD_LIT, operand);
+        case VM_OPCODE_SUB: return VM_INSTR(VM_OPCODE_SUB_LIT, operand);
+        case VM_OPCODE_MULT: return VM_INSTR(VM_OPCODE_MULT_LIT, operand);
+        case VM_OPCODE_DIV: return VM_INSTR(VM_OPCODE_DIV_LIT, operand);
+        case VM_OPCODE_POW: return VM_INSTR(VM_OPCODE_POW_LIT, operand);
+        case VM_OPCODE_INV:
+            if (operand != VM_OPERAND_MIN)
+            {
+                return VM_INSTR(VM_OPCODE_LIT, -operand);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    else if (first_op == VM_OPCODE_INV)
+    {
+        // a + -b is a - b and a - -b is a + b.
+        if (second_op == VM_OPCODE_ADD)
+        {
+            return VM_INSTR(VM_OPCODE_SUB, 0);
+        }
+        if (second_op == VM_OPCODE_SUB)
+        {
+            return VM_INSTR(VM_OPCODE_ADD, 0);
+        }
+    }
+    return 0;
+}
+
+// Replaces pairs of instructions by superinstructions, saving one dispatch
+// each. Fused instructions are fused again with the next one, so -3 * x
+// still ends up as a MULT_LIT. Expressions have no jumps, so the code can be
+// rewritten in place.
+void peephole()
+{
+    int32_t length = 0;
+    for (int32_t i = 0; i < code_length; i++)
+    {
+        if (length > 0)
+        {
+            vm_instr_t fused = fuse_instrs(code[length - 1], code[i]);
+            if (fused)
+            {
+                code[length - 1] = fused;
+                continue;
+            }
+        }
+        code[length++] = code[i];
+    }
+    code_length = length;
+}
+
+void compile(ast_node_t * node)
+{
+    code_length = 0;
+    constants_length = 0;
+    code_stack_depth = 0;
+    code_max_stack_depth = 0;
+
+    if (compile_optimize)
+    {
+        node = optimize(node);
+    }
+    compile_inner(node);
+    emit_opcode(VM_OPCODE_HALT);
+    if (compile_peephole)
+    {
+        peephole();
+    }
+
+    if (code_max_stack_depth > VM_STACK_SIZE)
+    {
+        printf("Expression is too deep\n");
+        exit(0);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// JIT
+////////////////////////////////////////////////////////////////////////////////
+
+// Translates compiled code to x86-64 machine code, for the System V calling
+// convention (Linux, macOS). The generated function takes the variables and
+// returns the result: int32_t fn(int32_t * variables).
+//
+// The top of the stack lives in eax and the rest of it on the machine stack,
+// which push/pop maintain. rbx holds the variables. Division, exponentiation
+// and the checked operations call the VM functions, so they trap the same
+// way. The code has no jumps, so the stack depth, and with it the alignment of
+// rsp at each call, is known while translating.
+//
+// jit_compile() returns false when the JIT isn't available on the platform
+// or the executable memory can't be allocated, jit_execute() then falls back
+// to the interpreter.
+
+typedef int32_t (*jit_fn_t)(int32_t * variables);
+
+typedef struct jit_code_t
+{
+    void * memory;
+    size_t size;
+    jit_fn_t fn;
+} jit_code_t;
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define JIT_AVAILABLE 1
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+enum
+{
+    // Longest translation of a single instruction, a call to a binary helper.
+    JIT_MAX_INSTR_SIZE = 32
+};
+
+uint8_t * jit_cursor;
+
+void jit_emit(const char * bytes, size_t length)
+{
+    memcpy(jit_cursor, bytes, length);
+    jit_cursor += length;
+}
+
+void jit_emit8(uint8_t value)
+{
+    *jit_cursor++ = value;
+}
+
+void jit_emit32(int32_t value)
+{
+    memcpy(jit_cursor, &value, sizeof(value));
+    jit_cursor += sizeof(value);
+}
+
+// depth is the number of values pushed on the machine stack. It is odd when
+// rsp is 16 bytes aligned, as the System V ABI requires at calls: rsp is 8
+// bytes off after the return address and the saved rbp and rbx.
+void jit_emit_call(void * function, int32_t depth)
+{
+    bool must_align = depth % 2 == 0;
+    uint64_t address = (uint64_t)(uintptr_t)function;
+
+    if (must_align)
+    {
+        jit_emit("\x48\x83\xEC\x08", 4);            // sub rsp, 8
+    }
+    jit_emit("\x48\xB8", 2);                        // mov rax, imm64
+    memcpy(jit_cursor, &address, sizeof(address));
+    jit_cursor += sizeof(address);
+    jit_emit("\xFF\xD0", 2);                        // call rax
+    if (must_align)
+    {
+        jit_emit("\x48\x83\xC4\x08", 4);            // add rsp, 8
+    }
+}
+
+// Calls function(second value of the stack, eax), popping the second value.
+void jit_emit_binary_call(void * function, int32_t * depth)
+{
+    jit_emit("\x89\xC6", 2);                        // mov esi, eax
+    jit_emit("\x5F", 1);                            // pop rdi
+    (*depth)--;
+    jit_emit_call(function, *depth);
+}
+
+// Calls function(eax, operand).
+void jit_emit_unary_call(void * function, int32_t operand, int32_t depth)
+{
+    jit_emit("\x89\xC7", 2);                        // mov edi, eax
+    jit_emit("\xBE", 1);                            // mov esi, imm32
+    jit_emit32(operand);
+    jit_emit_call(function, depth);
+}
+
+bool jit_compile(vm_instr_t * code, int32_t * constants, jit_code_t * jit)
+{
+    int32_t length = 1;
+    while (VM_GET_OPCODE(code[length - 1]) != VM_OPCODE_HALT)
+    {
+        length++;
+    }
+
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    jit->size = ((size_t)length * JIT_MAX_INSTR_SIZE + 32 + page_size - 1) / page_size * page_size;
+    jit->memory = mmap(NULL, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    jit->fn = NULL;
+    if (jit->memory == MAP_FAILED)
+    {
+        jit->memory = NULL;
+        return false;
+    }
+
+    jit_cursor = (uint8_t *)jit->memory;
+    jit_emit("\x55", 1);                            // push rbp
+    jit_emit("\x48\x89\xE5", 3);                    // mov rbp, rsp
+    jit_emit("\x53", 1);                            // push rbx
+    jit_emit("\x48\x89\xFB", 3);                    // mov rbx, rdi
+
+    int32_t depth = 0;
+    for (int32_t i = 0; i < length; i++)
+    {
+        int32_t operand = VM_GET_OPERAND(code[i]);
+
+        switch (VM_GET_OPCODE(code[i]))
+        {
+        case VM_OPCODE_NOP:
+            break;
+        case VM_OPCODE_LIT:
+        case VM_OPCODE_CONST:
+            jit_emit("\x50", 1);                    // push rax
+            depth++;
+            jit_emit("\xB8", 1);                    // mov eax, imm32
+            jit_emit32(VM_GET_OPCODE(code[i]) == VM_OPCODE_LIT ? operand : constants[operand]);
+            break;
+        case VM_OPCODE_LOAD:
+            jit_emit("\x50", 1);                    // push rax
+            depth++;
+            jit_emit("\x8B\x83", 2);                // mov eax, [rbx + disp32]
+            jit_emit32(operand * (int32_t)sizeof(int32_t));
+            break;
+        case VM_OPCODE_INV:
+            jit_emit("\xF7\xD8", 2);                // neg eax
+            break;
+        case VM_OPCODE_ADD:
+            jit_emit("\x59", 1);                    // pop rcx
+            depth--;
+            jit_emit("\x01\xC8", 2);                // add eax, ecx
+            break;
+        case VM_OPCODE_SUB:
+            jit_emit("\x59", 1);                    // pop rcx
+            depth--;
+            jit_emit("\x29\xC1", 2);                // sub ecx, eax
+            jit_emit("\x89\xC8", 2);                // mov eax, ecx
+            break;
+        case VM_OPCODE_MULT:
+            jit_emit("\x59", 1);                    // pop rcx
+            depth--;
+            jit_emit("\x0F\xAF\xC1", 3);            // imul eax, ecx
+            break;
+        case VM_OPCODE_ADD_LIT:
+            jit_emit("\x05", 1);                    // add eax, imm32
+            jit_emit32(operand);
+            break;
+        case VM_OPCODE_SUB_LIT:
+            jit_emit("\x2D", 1);                    // sub eax, imm32
+            jit_emit32(operand);
+            break;
+        case VM_OPCODE_MULT_LIT:
+            jit_emit("\x69\xC0", 2);                // imul eax, eax, imm32
+            jit_emit32(operand);
+            break;
+        case VM_OPCODE_SHL:
+            jit_emit("\xC1\xE0", 2);                // shl eax, imm8
+            jit_emit8((uint8_t)operand);
+            break;
+        case VM_OPCODE_SHR_DIV:
+            jit_emit("\x89\xC1", 2);                // mov ecx, eax
+            jit_emit("\xC1\xF9\x1F", 3);            // sar ecx, 31
+            jit_emit("\x81\xE1", 2);                // and ecx, imm32
+            jit_emit32((1 << operand) - 1);
+            jit_emit("\x01\xC8", 2);                // add eax, ecx
+            jit_emit("\xC1\xF8", 2);                // sar eax, imm8
+            jit_emit8((uint8_t)operand);
+            break;
+        case VM_OPCODE_DIV: jit_emit_binary_call(vm_div, &depth); break;
+        case VM_OPCODE_POW: jit_emit_binary_call(vm_pow, &depth); break;
+        case VM_OPCODE_DIV_LIT: jit_emit_unary_call(vm_div, operand, depth); break;
+        case VM_OPCODE_POW_LIT: jit_emit_unary_call(vm_pow, operand, depth); break;
+        case VM_OPCODE_ADD_CHECKED: jit_emit_binary_call(vm_add_checked, &depth); break;
+        case VM_OPCODE_SUB_CHECKED: jit_emit_binary_call(vm_sub_checked, &depth); break;
+        case VM_OPCODE_MULT_CHECKED: jit_emit_binary_call(vm_mult_checked, &depth); break;
+        case VM_OPCODE_DIV_CHECKED: jit_emit_binary_call(vm_div_checked, &depth); break;
+        case VM_OPCODE_POW_CHECKED: jit_emit_binary_call(vm_pow_checked, &depth); break;
+        case VM_OPCODE_INV_CHECKED:
+            jit_emit("\x89\xC7", 2);                // mov edi, eax
+            jit_emit_call(vm_neg_checked, depth);
+            break;
+        case VM_OPCODE_HALT:
+            jit_emit("\x48\x8B\x5D\xF8", 4);        // mov rbx, [rbp - 8]
+            jit_emit("\xC9", 1);                    // leave
+            jit_emit("\xC3", 1);                    // ret
+            break;
+        default:
+            assert(0);
+            break;
+        }
+    }
+    assert(jit_cursor <= (uint8_t *)jit->memory + jit->size);
+
+    if (mprotect(jit->memory, jit->size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(jit->memory, jit->size);
+        jit->memory = NULL;
+        return false;
+    }
+    jit->fn = (jit_fn_t)jit->memory;
+    return true;
+}
+
+void jit_free(jit_code_t * jit)
+{
+    if (jit->memory)
+    {
+        munmap(jit->memory, jit->size);
+    }
+    jit->memory = NULL;
+    jit->fn = NULL;
+}
+
+#else
+#define JIT_AVAILABLE 0
+
+bool jit_compile(vm_instr_t * code, int32_t * constants, jit_code_t * jit)
+{
+    jit->memory = NULL;
+    jit->size = 0;
+    jit->fn = NULL;
+    return false;
+}
+
+void jit_free(jit_code_t * jit)
+{
+}
+#endif
+
+int32_t jit_execute(jit_code_t * jit, vm_instr_t * code, int32_t * constants)
+{
+    if (jit->fn)
+    {
+        return jit->fn(vm_variables);
+    }
+    vm_execute(code, constants);
+    return vm_pop();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmark
+////////////////////////////////////////////////////////////////////////////////
+
+// Runs arithmetic heavy programs with each dispatch strategy and reports the
+// time per executed opcode. On Linux, the instructions and branch misses per
+// opcode are read from the hardware counters when perf_event_open is allowed.
+
+#if defined(_WIN32)
+#include <windows.h>
+
+double get_time_seconds()
+{
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+}
+#else
+#include <time.h>
+
+double get_time_seconds()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
+}
+#endif
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int open_perf_counter(uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void start_perf_counter(int fd)
+{
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+int64_t stop_perf_counter(int fd)
+{
+    uint64_t value = 0;
+    if (fd < 0)
+    {
+        return -1;
+    }
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &value, sizeof(value)) != sizeof(value))
+    {
+        return -1;
+    }
+    return (int64_t)value;
+}
+#else
+enum
+{
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_BRANCH_MISSES
+};
+
+int open_perf_counter(uint64_t config)
+{
+    return -1;
+}
+
+void start_perf_counter(int fd)
+{
+}
+
+int64_t stop_perf_counter(int fd)
+{
+    return -1;
+}
+#endif
+
+enum
+{
+    BENCH_SOURCE_MAX_SIZE = 4096,
+    BENCH_DEFAULT_ITERATIONS = 200000
+};
+
+char bench_source[BENCH_SOURCE_MAX_SIZE];
+
+void bench_append(const char * format, int32_t a, int32_t b)
+{
+    size_t length = strlen(bench_source);
+    snprintf(bench_source + length, BENCH_SOURCE_MAX_SIZE - length, format, a, b);
+}
+
+// Each generator fills bench_source with an expression that doesn't overflow
+// int32_t.
+void generate_add_sub()
+{
+    bench_source[0] = '\0';
+    bench_append("%d", 1, 0);
+    for (int32_t i = 0; i < 80; i++)
+    {
+        bench_append(" + %d - %d", i * 7, i * 5);
+    }
+}
+
+void generate_mul_div()
+{
+    bench_source[0] = '\0';
+    bench_append("%d", 0, 0);
+    for (int32_t i = 0; i < 50; i++)
+    {
+        bench_append(" + %d * 6 / %d", i, i % 5 + 1);
+    }
+}
+
+void generate_nested()
+{
+    bench_source[0] = '\0';
+    for (int32_t i = 0; i < 40; i++)
+    {
+        bench_append("(", 0, 0);
+    }
+    bench_append("1", 0, 0);
+    for (int32_t i = 0; i < 40; i++)
+    {
+        bench_append(" * %d - -(%d + 1))", i % 3, i);
+    }
+}
+
+void generate_pow()
+{
+    bench_source[0] = '\0';
+    bench_append("%d", 0, 0);
+    for (int32_t i = 0; i < 40; i++)
+    {
+        bench_append(" + %d ^ %d", i % 4 + 1, i % 6);
+    }
+}
+
+typedef void (*bench_execute_fn_t)(vm_instr_t * code, int32_t * constants);
+
+typedef struct bench_result_t
+{
+    double seconds;
+    int64_t instructions;
+    int64_t branch_misses;
+    int32_t value;
+} bench_result_t;
+
+bench_result_t bench_run(bench_execute_fn_t execute, int32_t iterations)
+{
+    bench_result_t result;
+    int instructions_fd = open_perf_counter(PERF_COUNT_HW_INSTRUCTIONS);
+    int branch_misses_fd = open_perf_counter(PERF_COUNT_HW_BRANCH_MISSES);
+
+    start_perf_counter(instructions_fd);
+    start_perf_counter(branch_misses_fd);
+    double start = get_time_seconds();
+    for (int32_t i = 0; i < iterations; i++)
+    {
+        vm_stack_top = vm_stack;
+        execute(code, constants);
+    }
+    result.seconds = get_time_seconds() - start;
+    result.branch_misses = stop_perf_counter(branch_misses_fd);
+    result.instructions = stop_perf_counter(instructions_fd);
+    result.value = vm_pop();
+
+#if defined(__linux__)
+    if (instructions_fd >= 0)
+    {
+        close(instructions_fd);
+    }
+    if (branch_misses_fd >= 0)
+    {
+        close(branch_misses_fd);
+    }
+#endif
+    return result;
+}
+
+// Counts the loads and stores to the stack memory of a run of the code, with
+// or without the top of the stack cached in a register. The code has no
+// jumps, so every instruction runs once.
+int32_t count_stack_accesses(bool cached)
+{
+    int32_t count = 0;
+    for (int32_t i = 0; i < code_length; i++)
+    {
+        switch (VM_GET_OPCODE(code[i]))
+        {
+        case VM_OPCODE_LIT:
+        case VM_OPCODE_CONST:
+        case VM_OPCODE_LOAD:
+            count += 1;
+            break;
+        case VM_OPCODE_ADD:
+        case VM_OPCODE_SUB:
+        case VM_OPCODE_MULT:
+        case VM_OPCODE_DIV:
+        case VM_OPCODE_POW:
+        case VM_OPCODE_ADD_CHECKED:
+        case VM_OPCODE_SUB_CHECKED:
+        case VM_OPCODE_MULT_CHECKED:
+        case VM_OPCODE_DIV_CHECKED:
+        case VM_OPCODE_POW_CHECKED:
+            count += cached ? 1 : 3;
+            break;
+        case VM_OPCODE_INV:
+        case VM_OPCODE_INV_CHECKED:
+        case VM_OPCODE_ADD_LIT:
+        case VM_OPCODE_SUB_LIT:
+        case VM_OPCODE_MULT_LIT:
+        case VM_OPCODE_DIV_LIT:
+        case VM_OPCODE_POW_LIT:
+        case VM_OPCODE_SHL:
+        case VM_OPCODE_SHR_DIV:
+            count += cached ? 0 : 2;
+            break;
+        case VM_OPCODE_HALT:
+            count += cached ? 1 : 0;
+            break;
+        default:
+            break;
+        }
+    }
+    return count;
+}
+
+void print_bench_result(const char * name, bench_result_t result, int32_t iterations)
+{
+    double ops = (double)code_length * iterations;
+    printf("    %-10s %9.1f ns/run %8.3f ns/op", name, result.seconds * 1e9 / iterations, result.seconds * 1e9 / ops);
+    if (result.instructions >= 0)
+    {
+        printf(" %8.2f instr/op", (double)result.instructions / ops);
+    }
+    else
+    {
+        printf(" %8s instr/op", "n/a");
+    }
+    if (result.branch_misses >= 0)
+    {
+        printf(" %8.4f misses/op", (double)result.branch_misses / ops);
+    }
+    else
+    {
+        printf(" %8s misses/op", "n/a");
+    }
+    printf("\n");
+}
+
+ast_node_t * parse_source(const char * source)
+{
+    input_stream = source;
+    next_token();
+    ast_node_t * node = parse_expr();
+    expect_token('\0');
+    return node;
+}
+
+// Expressions with variables, compiled with and without the optimizer. The
+// results are compared for a few sets of variable values.
+void bench_optimizer(int32_t iterations)
+{
+    const char * sources[] =
+    {
+        "x * 8 + y / 4 - (2 ^ 10) * z",
+        "(x + 0) * 1 - -(y * 1) + 3 * 4 * x",
+        "x * 16 / 2 + (1 + 2 + 3) * y - 0 - z / -1",
+        "-(-x) * (10 - 2 * 5 + 1) + (y ^ 1) / 32"
+    };
+    int32_t values[][3] =
+    {
+        { 0, 0, 0 },
+        { 7, -13, 100 },
+        { -1000, 999, -7 },
+        { 123456, -65536, 31 }
+    };
+
+    printf("optimizer:\n");
+    for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++)
+    {
+        ast_node_t * ast_root = parse_source(sources[i]);
+        int32_t results[sizeof(values) / sizeof(values[0])];
+        bench_result_t unoptimized_result;
+
+        printf("  %s\n", sources[i]);
+        for (int32_t optimized = 0; optimized < 2; optimized++)
+        {
+            compile_optimize = optimized;
+            compile(ast_root);
+
+            for (size_t j = 0; j < sizeof(values) / sizeof(values[0]); j++)
+            {
+                vm_variables['x' - 'a'] = values[j][0];
+                vm_variables['y' - 'a'] = values[j][1];
+                vm_variables['z' - 'a'] = values[j][2];
+                vm_stack_top = vm_stack;
+                vm_execute(code, constants);
+                if (!optimized)
+                {
+                    results[j] = vm_pop();
+                }
+                else
+                {
+                    assert(results[j] == vm_pop());
+                }
+            }
+
+            printf("    %s: %d ops\n", optimized ? "optimized" : "unoptimized", code_length);
+            bench_result_t result = bench_run(vm_execute, iterations);
+            print_bench_result("threaded", result, iterations);
+            if (!optimized)
+            {
+                unoptimized_result = result;
+            }
+            else
+            {
+                printf("    speedup    %8.2fx\n", unoptimized_result.seconds / result.seconds);
+            }
+        }
+    }
+    compile_optimize = true;
+
+    // Wrapping, -(-x) cancels out even for INT32_MIN. Checked, both negations
+    // are kept so that the inner one traps.
+    vm_variables['x' - 'a'] = INT32_MIN;
+    compile(parse_source("-(-x)"));
+    assert(code_length == 2);
+    vm_stack_top = vm_stack;
+    vm_execute(code, constants);
+    assert(vm_pop() == INT32_MIN);
+
+    compile_checked = true;
+    compile(parse_source("-(-x)"));
+    int32_t checked_negations = 0;
+    for (int32_t i = 0; i < code_length; i++)
+    {
+        checked_negations += VM_GET_OPCODE(code[i]) == VM_OPCODE_INV_CHECKED;
+    }
+    assert(checked_negations == 2);
+    compile_checked = false;
+}
+
+// The previous POW implementation, one multiplication per unit of exponent.
+int32_t pow_linear(int32_t value, int32_t exponent)
+{
+    uint32_t result = 1;
+    while (exponent-- > 0)
+    {
+        result *= (uint32_t)value;
+    }
+    return (int32_t)result;
+}
+
+// Runs x ^ y with growing exponents, wrapping and checked (with x = 1 so that
+// it doesn't trap, squaring does the same work for any x), and compares with
+// calls to the linear implementation.
+void bench_pow(int32_t iterations)
+{
+    int32_t exponents[] = { 10, 1000, 100000, 10000000, 1000000000 };
+    volatile int32_t base = 3;
+
+    printf("pow:\n");
+    for (size_t i = 0; i < sizeof(exponents) / sizeof(exponents[0]); i++)
+    {
+        int32_t exponent = exponents[i];
+        vm_variables['y' - 'a'] = exponent;
+
+        compile_checked = false;
+        compile(parse_source("x ^ y"));
+        vm_variables['x' - 'a'] = 3;
+        bench_result_t result = bench_run(vm_execute, iterations);
+
+        compile_checked = true;
+        compile(parse_source("x ^ y"));
+        vm_variables['x' - 'a'] = 1;
+        bench_result_t checked_result = bench_run(vm_execute, iterations);
+        assert(checked_result.value == 1);
+
+        // Keeps the linear version to about 10^8 multiplications.
+        int32_t calls = 100000000 / exponent;
+        calls = calls < 1 ? 1 : calls > iterations ? iterations : calls;
+        int32_t linear_value = 0;
+        double start = get_time_seconds();
+        for (int32_t j = 0; j < calls; j++)
+        {
+            linear_value = pow_linear(base, exponent);
+        }
+        double linear_seconds = get_time_seconds() - start;
+        assert(linear_value == result.value);
+
+        printf("  3 ^ %-10d %9.1f ns/run %9.1f ns/run checked %14.1f ns/call linear\n", exponent,
+            result.seconds * 1e9 / iterations, checked_result.seconds * 1e9 / iterations, linear_seconds * 1e9 / calls);
+    }
+    compile_checked = false;
+}
+
+// Evaluates expressions over columns of random values, one row at a time with
+// vm_execute and in batches with vm_execute_batch.
+void bench_batch()
+{
+    enum
+    {
+        ROW_COUNT = 1 << 20
+    };
+    const char * sources[] =
+    {
+        "x + y * z",
+        "x * 8 + y / 4 - (2 ^ 10) * z",
+        "(x - y) * (x + y) - z * z * 3",
+        "-(x * 3 + 7) / 5 + y ^ 2"
+    };
+
+    int32_t * columns[26] = { 0 };
+    int32_t * results = xmalloc(ROW_COUNT * sizeof(int32_t));
+    memset(results, 0, ROW_COUNT * sizeof(int32_t));
+    for (char variable = 'x'; variable <= 'z'; variable++)
+    {
+        int32_t * column = xmalloc(ROW_COUNT * sizeof(int32_t));
+        for (int32_t i = 0; i < ROW_COUNT; i++)
+        {
+            column[i] = rand() % 20001 - 10000;
+        }
+        columns[variable - 'a'] = column;
+    }
+
+    printf("batch (%d rows):\n", ROW_COUNT);
+    for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++)
+    {
+        compile(parse_source(sources[i]));
+
+        // Warms up the caches, the timed run then measures steady state.
+        vm_execute_batch(code, constants, columns, results, ROW_COUNT);
+        double start = get_time_seconds();
+        vm_execute_batch(code, constants, columns, results, ROW_COUNT);
+        double batch_seconds = get_time_seconds() - start;
+
+        int32_t mismatches = 0;
+        start = get_time_seconds();
+        for (int32_t row = 0; row < ROW_COUNT; row++)
+        {
+            for (char variable = 'x'; variable <= 'z'; variable++)
+            {
+                vm_variables[variable - 'a'] = columns[variable - 'a'][row];
+            }
+            vm_stack_top = vm_stack;
+            vm_execute(code, constants);
+            mismatches += vm_pop() != results[row];
+        }
+        double row_seconds = get_time_seconds() - start;
+        assert(mismatches == 0);
+
+        printf("  %-32s %7.2f ns/row %7.2f ns/row batched, %6.2fx\n", sources[i],
+            row_seconds * 1e9 / ROW_COUNT, batch_seconds * 1e9 / ROW_COUNT, row_seconds / batch_seconds);
+    }
+
+    for (char variable = 'x'; variable <= 'z'; variable++)
+    {
+        free(columns[variable - 'a']);
+    }
+    free(results);
+}
+
+// Compares the JIT with the interpreter: results for a few sets of variable
+// values in each compilation mode, then the time of an evaluation.
+void bench_jit(int32_t iterations)
+{
+    const char * sources[] =
+    {
+        "x + y * z",
+        "x * 8 + y / 4 - (2 ^ 10) * z",
+        "(x - y) * (x + y) - z * z * 3",
+        "-(x * 3 + 7) / 5 + y ^ 2 - -z",
+        "((x + 1) * (y - 2) + (z + 3) * (x - 4)) * ((y + 5) - (z - 6) * (x + 7))"
+    };
+    int32_t values[][3] =
+    {
+        { 0, 1, 0 },
+        { 7, -13, 100 },
+        { -100, 99, -7 },
+        { 123, -456, 31 }
+    };
+
+    printf("jit%s:\n", JIT_AVAILABLE ? "" : " (not available, interpreter fallback)");
+    for (size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++)
+    {
+        ast_node_t * ast_root = parse_source(sources[i]);
+
+        for (int32_t mode = 0; mode < 3; mode++)
+        {
+            compile_optimize = mode != 1;
+            compile_checked = mode == 2;
+            compile(ast_root);
+
+            jit_code_t jit;
+            jit_compile(code, constants, &jit);
+            for (size_t j = 0; j < sizeof(values) / sizeof(values[0]); j++)
+            {
+                vm_variables['x' - 'a'] = values[j][0];
+                vm_variables['y' - 'a'] = values[j][1];
+                vm_variables['z' - 'a'] = values[j][2];
+                int32_t result = jit_execute(&jit, code, constants);
+                vm_stack_top = vm_stack;
+                vm_execute(code, constants);
+                assert(result == vm_pop());
+            }
+            jit_free(&jit);
+        }
+        compile_optimize = true;
+        compile_checked = false;
+
+        compile(ast_root);
+        jit_code_t jit;
+        jit_compile(code, constants, &jit);
+        volatile int32_t sink;
+
+        double start = get_time_seconds();
+        for (int32_t j = 0; j < iterations; j++)
+        {
+            vm_stack_top = vm_stack;
+            vm_execute(code, constants);
+            sink = vm_pop();
+        }
+        double interpreter_seconds = get_time_seconds() - start;
+
+        start = get_time_seconds();
+        for (int32_t j = 0; j < iterations; j++)
+        {
+            sink = jit_execute(&jit, code, constants);
+        }
+        double jit_seconds = get_time_seconds() - start;
+        (void)sink;
+        jit_free(&jit);
+
+        printf("  %-72s %7.2f ns %7.2f ns jit, %6.2fx\n", sources[i],
+            interpreter_seconds * 1e9 / iterations, jit_seconds * 1e9 / iterations, interpreter_seconds / jit_seconds);
+    }
+}
+
+// The dispatch programs only contain literals, they run unoptimized or they
+// would be folded into a single literal.
+void bench(int32_t iterations)
+{
+    struct
+    {
+        const char * name;
+        void (*generate)();
+    } programs[] =
+    {
+        { "add_sub", generate_add_sub },
+        { "mul_div", generate_mul_div },
+        { "nested", generate_nested },
+        { "pow", generate_pow }
+    };
+
+    printf("%d iterations per program\n", iterations);
+    compile_optimize = false;
+    for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++)
+    {
+        programs[i].generate();
+        ast_node_t * ast_root = parse_source(bench_source);
+        bench_result_t results[2];
+
+        printf("%s:\n", programs[i].name);
+        for (int32_t fused = 0; fused < 2; fused++)
+        {
+            compile_peephole = fused;
+            compile(ast_root);
+            printf("  %s: %d ops, %d stack accesses, %d with a cached top\n",
+                fused ? "fused" : "unfused", code_length, count_stack_accesses(false), count_stack_accesses(true));
+
+            results[fused] = bench_run(vm_execute_switch, iterations);
+            print_bench_result("switch", results[fused], iterations);
+#if VM_HAS_THREADED_DISPATCH
+            bench_result_t threaded_result = bench_run(vm_execute_threaded, iterations);
+            print_bench_result("threaded", threaded_result, iterations);
+            assert(threaded_result.value == results[fused].value);
+            printf("    speedup    %8.2fx\n", results[fused].seconds / threaded_result.seconds);
+#endif
+            bench_result_t cached_result = bench_run(vm_execute_cached, iterations);
+            print_bench_result("cached", cached_result, iterations);
+            assert(cached_result.value == results[fused].value);
+        }
+        assert(results[0].value == results[1].value);
+    }
+    compile_peephole = true;
+    compile_optimize = true;
+
+    bench_optimizer(iterations);
+    bench_pow(iterations);
+    bench_batch();
+    bench_jit(iterations);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+// Usage: main [bench [iterations]]
+int main(int argc, char * argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        bench(argc > 2 ? atoi(argv[2]) : BENCH_DEFAULT_ITERATIONS);
+        return 0;
+    }
 
-    compile(ast_root);
-    vm_execute(code);
+    compile(parse_source("-50 + -(3 + 3)"));
+    vm_execute(code, constants);
     printf("%d\n", vm_pop());
 
     return 0;
@@ -1,77 +1,368 @@
 #include "ast.h"
 #include "common.h"
 
+#include <stdlib.h>
+#include <string.h>
+
+// Nodes start zeroed so the free functions below can walk trees the parser
+// gave up on half way.
+void * ast_alloc(uint64_t size)
+{
+    void * node = xmalloc(size);
+    memset(node, 0, size);
+    return node;
+}
+
 ast_decl_t * ast_new_decl(ast_decl_type_t type)
 {
-    ast_decl_t * decl = xmalloc(sizeof(ast_decl_t));
+    ast_decl_t * decl = ast_alloc(sizeof(ast_decl_t));
     decl->type = type;
+    decl->sym = NULL;
     return decl;
 }
 
 ast_typespec_t * ast_new_typespec(ast_typespec_type_t type)
 {
-    ast_typespec_t * typespec = xmalloc(sizeof(ast_typespec_t));
+    ast_typespec_t * typespec = ast_alloc(sizeof(ast_typespec_t));
     typespec->type = type;
+    typespec->resolved_type = NULL;
     return typespec;
 }
 
 ast_expr_t * ast_new_expr(ast_expr_type_t type)
 {
-    ast_expr_t * expr = xmalloc(sizeof(ast_expr_t));
+    ast_expr_t * expr = ast_alloc(sizeof(ast_expr_t));
     expr->type = type;
+    expr->resolved_type = NULL;
     return expr;
 }
 
 ast_cmpnd_field_t * ast_new_cmpnd_field(ast_cmpnd_field_type_t type)
 {
-    ast_cmpnd_field_t * field = xmalloc(sizeof(ast_cmpnd_field_t));
+    ast_cmpnd_field_t * field = ast_alloc(sizeof(ast_cmpnd_field_t));
     field->type = type;
     return field;
 }
 
 ast_aggregate_item_t * ast_new_aggregate_item(void)
 {
-    return xmalloc(sizeof(ast_aggregate_item_t));
+    return ast_alloc(sizeof(ast_aggregate_item_t));
 }
 
 ast_enum_item_t * ast_new_enum_item(void)
 {
-    return xmalloc(sizeof(ast_enum_item_t));
+    return ast_alloc(sizeof(ast_enum_item_t));
 }
 
 ast_param_t * ast_new_param(void)
 {
-    return xmalloc(sizeof(ast_param_t));
+    return ast_alloc(sizeof(ast_param_t));
 }
 
 ast_stmt_block_t * ast_new_stmt_block(void)
 {
-    return xmalloc(sizeof(ast_stmt_block_t));
+    return ast_alloc(sizeof(ast_stmt_block_t));
 }
 
 ast_stmt_t * ast_new_stmt(ast_stmt_type_t type)
 {
-    ast_stmt_t * stmt = xmalloc(sizeof(ast_stmt_t));
+    ast_stmt_t * stmt = ast_alloc(sizeof(ast_stmt_t));
     stmt->type = type;
     return stmt;
 }
 
 ast_simple_stmt_t * ast_new_simple_stmt(ast_simple_stmt_type_t type)
 {
-    ast_simple_stmt_t * stmt = xmalloc(sizeof(ast_simple_stmt_t));
+    ast_simple_stmt_t * stmt = ast_alloc(sizeof(ast_simple_stmt_t));
     stmt->type = type;
     return stmt;
 }
 
 ast_switch_item_t * ast_new_switch_item(void)
 {
-    return xmalloc(sizeof(ast_switch_item_t));
+    return ast_alloc(sizeof(ast_switch_item_t));
 }
 
 ast_switch_case_literal_t * ast_new_switch_case_literal(ast_switch_case_literal_type_t type)
 {
-    ast_switch_case_literal_t * lit = xmalloc(sizeof(ast_switch_case_literal_t));
+    ast_switch_case_literal_t * lit = ast_alloc(sizeof(ast_switch_case_literal_t));
     lit->type = type;
     return lit;
 }
 
+
+////////////////////////////////////////////////////////////////////////////////
+// Freeing
+////////////////////////////////////////////////////////////////////////////////
+
+// Names are interned and types belong to the resolver, neither is freed here.
+
+void ast_free_typespec(ast_typespec_t * typespec)
+{
+    if (!typespec)
+    {
+        return;
+    }
+
+    switch (typespec->type)
+    {
+    case AST_TYPESPEC_NAME:
+        break;
+    case AST_TYPESPEC_ARRAY:
+        ast_free_typespec(typespec->array.base);
+        ast_free_expr(typespec->array.size_expr);
+        break;
+    case AST_TYPESPEC_POINTER:
+        ast_free_typespec(typespec->pointer.base);
+        break;
+    case AST_TYPESPEC_FN:
+        for (int32_t i = 0; i < sb_len(typespec->fn.args); ++i)
+        {
+            ast_free_typespec(typespec->fn.args[i]);
+        }
+        sb_free(typespec->fn.args);
+        ast_free_typespec(typespec->fn.return_type);
+        break;
+    }
+    free(typespec);
+}
+
+void ast_free_expr(ast_expr_t * expr)
+{
+    if (!expr)
+    {
+        return;
+    }
+
+    switch (expr->type)
+    {
+    case AST_EXPR_TERNARY:
+        ast_free_expr(expr->ternary.condition);
+        ast_free_expr(expr->ternary.then_expr);
+        ast_free_expr(expr->ternary.else_expr);
+        break;
+    case AST_EXPR_BINARY_OP:
+        ast_free_expr(expr->binary.left);
+        ast_free_expr(expr->binary.right);
+        break;
+    case AST_EXPR_UNARY_OP:
+        ast_free_expr(expr->unary.expr);
+        break;
+    case AST_EXPR_CAST:
+        ast_free_typespec(expr->cast.type);
+        ast_free_expr(expr->cast.expr);
+        break;
+    case AST_EXPR_INVOKE:
+        ast_free_expr(expr->invoke.expr);
+        for (int32_t i = 0; i < sb_len(expr->invoke.args); ++i)
+        {
+            ast_free_expr(expr->invoke.args[i]);
+        }
+        sb_free(expr->invoke.args);
+        break;
+    case AST_EXPR_INDEX:
+        ast_free_expr(expr->index.expr);
+        ast_free_expr(expr->index.index_expr);
+        break;
+    case AST_EXPR_FIELD:
+        ast_free_expr(expr->field.expr);
+        break;
+    case AST_EXPR_COMPOUND:
+        ast_free_typespec(expr->compound.type);
+        for (int32_t i = 0; i < sb_len(expr->compound.args); ++i)
+        {
+            ast_cmpnd_field_t * field = expr->compound.args[i];
+            if (field->type == AST_CMPND_FIELD_INDEX)
+            {
+                ast_free_expr(field->index_expr);
+            }
+            ast_free_expr(field->expr);
+            free(field);
+        }
+        sb_free(expr->compound.args);
+        break;
+    case AST_EXPR_STRING:
+        sb_free(expr->string_value.str);
+        break;
+    case AST_EXPR_NAME:
+    case AST_EXPR_INTEGER:
+    case AST_EXPR_FLOAT:
+        break;
+    }
+    free(expr);
+}
+
+void ast_free_simple_stmt(ast_simple_stmt_t * stmt)
+{
+    if (!stmt)
+    {
+        return;
+    }
+
+    switch (stmt->type)
+    {
+    case AST_SIMPLE_STMT_VAR_DECL:
+        ast_free_decl(stmt->var_decl);
+        break;
+    case AST_SIMPLE_STMT_CONST_DECL:
+        ast_free_decl(stmt->const_decl);
+        break;
+    case AST_SIMPLE_STMT_ASSIGN:
+        ast_free_expr(stmt->assign.left);
+        ast_free_expr(stmt->assign.right);
+        break;
+    case AST_SIMPLE_STMT_DECREMENT:
+    case AST_SIMPLE_STMT_INCREMENT:
+    case AST_SIMPLE_STMT_EXPR:
+        ast_free_expr(stmt->expr);
+        break;
+    }
+    free(stmt);
+}
+
+void ast_free_simple_stmt_list(sb_t(ast_simple_stmt_t *) stmts)
+{
+    for (int32_t i = 0; i < sb_len(stmts); ++i)
+    {
+        ast_free_simple_stmt(stmts[i]);
+    }
+    sb_free(stmts);
+}
+
+void ast_free_stmt(ast_stmt_t * stmt)
+{
+    if (!stmt)
+    {
+        return;
+    }
+
+    switch (stmt->type)
+    {
+    case AST_STMT_IF:
+        for (int32_t i = 0; i < sb_len(stmt->if_stmt.conditions); ++i)
+        {
+            ast_free_expr(stmt->if_stmt.conditions[i]);
+        }
+        for (int32_t i = 0; i < sb_len(stmt->if_stmt.stmt_blocks); ++i)
+        {
+            ast_free_stmt_block(stmt->if_stmt.stmt_blocks[i]);
+        }
+        sb_free(stmt->if_stmt.conditions);
+        sb_free(stmt->if_stmt.stmt_blocks);
+        ast_free_stmt_block(stmt->if_stmt.else_stmt_block);
+        break;
+    case AST_STMT_WHILE:
+        ast_free_expr(stmt->while_stmt.condition);
+        ast_free_stmt_block(stmt->while_stmt.stmt_block);
+        break;
+    case AST_STMT_FOR:
+        ast_free_simple_stmt_list(stmt->for_stmt.init_stmts);
+        ast_free_expr(stmt->for_stmt.condition);
+        ast_free_simple_stmt_list(stmt->for_stmt.incr_stmts);
+        ast_free_stmt_block(stmt->for_stmt.stmt_block);
+        break;
+    case AST_STMT_SWITCH:
+        ast_free_expr(stmt->switch_stmt.expr);
+        for (int32_t i = 0; i < sb_len(stmt->switch_stmt.items); ++i)
+        {
+            ast_switch_item_t * item = stmt->switch_stmt.items[i];
+            for (int32_t j = 0; j < sb_len(item->values); ++j)
+            {
+                free(item->values[j]);
+            }
+            sb_free(item->values);
+            ast_free_stmt_block(item->stmt_block);
+            free(item);
+        }
+        sb_free(stmt->switch_stmt.items);
+        break;
+    case AST_STMT_RETURN:
+        ast_free_expr(stmt->return_stmt);
+        break;
+    case AST_STMT_CONTINUE:
+    case AST_STMT_BREAK:
+        break;
+    case AST_STMT_BLOCK:
+        ast_free_stmt_block(stmt->stmt_block);
+        break;
+    case AST_STMT_SIMPLE:
+        ast_free_simple_stmt(stmt->simple_stmt);
+        break;
+    }
+    free(stmt);
+}
+
+void ast_free_stmt_block(ast_stmt_block_t * block)
+{
+    if (!block)
+    {
+        return;
+    }
+
+    for (int32_t i = 0; i < sb_len(block->stmts); ++i)
+    {
+        ast_free_stmt(block->stmts[i]);
+    }
+    sb_free(block->stmts);
+    free(block);
+}
+
+void ast_free_decl(ast_decl_t * decl)
+{
+    if (!decl)
+    {
+        return;
+    }
+
+    switch (decl->type)
+    {
+    case AST_DECL_ENUM:
+        ast_free_typespec(decl->enum_decl.base_type);
+        for (int32_t i = 0; i < sb_len(decl->enum_decl.items); ++i)
+        {
+            ast_free_expr(decl->enum_decl.items[i]->expr);
+            free(decl->enum_decl.items[i]);
+        }
+        sb_free(decl->enum_decl.items);
+        break;
+    case AST_DECL_UNION:
+    case AST_DECL_STRUCT:
+        for (int32_t i = 0; i < sb_len(decl->aggregate_decl.items); ++i)
+        {
+            ast_free_typespec(decl->aggregate_decl.items[i]->type);
+            free(decl->aggregate_decl.items[i]);
+        }
+        sb_free(decl->aggregate_decl.items);
+        break;
+    case AST_DECL_VAR:
+    case AST_DECL_CONST:
+        ast_free_typespec(decl->var_decl.type);
+        ast_free_expr(decl->var_decl.expr);
+        break;
+    case AST_DECL_TYPE:
+        ast_free_typespec(decl->type_decl.type);
+        break;
+    case AST_DECL_FN:
+        for (int32_t i = 0; i < sb_len(decl->fn_decl.params); ++i)
+        {
+            ast_free_typespec(decl->fn_decl.params[i]->type);
+            free(decl->fn_decl.params[i]);
+        }
+        sb_free(decl->fn_decl.params);
+        ast_free_typespec(decl->fn_decl.return_type);
+        ast_free_stmt_block(decl->fn_decl.stmt_block);
+        break;
+    case AST_DECL_IMPORT:
+        break;
+    }
+    free(decl);
+}
+
+void ast_free_decls(sb_t(ast_decl_t *) decls)
+{
+    for (int32_t i = 0; i < sb_len(decls); ++i)
+    {
+        ast_free_decl(decls[i]);
+    }
+    sb_free(decls);
+}
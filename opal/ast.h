@@ -2,8 +2,10 @@
 
 #include "lex.h"
 
-typedef struct ast_expr_t;
-typedef struct ast_stmt_block_t;
+struct ast_expr_t;
+struct ast_stmt_block_t;
+struct type_t;
+struct sym_t;
 
 typedef enum ast_typespec_type_t
 {
@@ -16,6 +18,7 @@ typedef enum ast_typespec_type_t
 typedef struct ast_typespec_t
 {
     ast_typespec_type_t type;
+    struct type_t * resolved_type;
     union
     {
         const char * name;
@@ -53,6 +56,8 @@ typedef struct ast_cmpnd_field_t
         struct ast_expr_t * index_expr;
         const char * field_name;
     };
+    // Value of index_expr, set by the resolver.
+    int64_t index;
 } ast_cmpnd_field_t;
 
 typedef enum ast_expr_type_t
@@ -74,6 +79,7 @@ typedef enum ast_expr_type_t
 typedef struct ast_expr_t
 {
     ast_expr_type_t type;
+    struct type_t * resolved_type;
     union
     {
         struct
@@ -85,8 +91,8 @@ typedef struct ast_expr_t
         struct
         {
             token_type_t op;
-            struct st_expr_t * left;
-            struct st_expr_t * right;
+            struct ast_expr_t * left;
+            struct ast_expr_t * right;
         } binary;
         struct
         {
@@ -127,7 +133,11 @@ typedef struct ast_expr_t
             uint64_t length;
         } string_value;
         int64_t int_value;
-        double float_value;
+        struct
+        {
+            double value;
+            bool is_f32;
+        } float_value;
     };
 } ast_expr_t;
 
@@ -185,6 +195,8 @@ typedef struct ast_switch_case_literal_t
         const char * name;
         uint64_t integer;
     };
+    // Value of the label, set by the resolver.
+    int64_t value;
 } ast_switch_case_literal_t;
 
 typedef struct ast_switch_item_t
@@ -246,7 +258,8 @@ typedef enum ast_decl_type_t
     AST_DECL_VAR,
     AST_DECL_CONST,
     AST_DECL_TYPE,
-    AST_DECL_FN
+    AST_DECL_FN,
+    AST_DECL_IMPORT
 } ast_decl_type_t;
 
 typedef struct ast_enum_item_t
@@ -267,10 +280,13 @@ typedef struct ast_param_t
     ast_typespec_t * type;
 } ast_param_t;
 
+// An import declaration has no payload, its name is the interned dotted
+// module path.
 typedef struct ast_decl_t
 {
     ast_decl_type_t type;
     const char *name;
+    struct sym_t * sym;
     union
     {
         struct
@@ -316,3 +332,10 @@ ast_simple_stmt_t * ast_new_simple_stmt(ast_simple_stmt_type_t type);
 ast_switch_item_t * ast_new_switch_item(void);
 ast_switch_case_literal_t * ast_new_switch_case_literal(ast_switch_case_literal_type_t type);
 
+// Frees a node and everything it owns. Declarations that were added to the
+// resolver are still referenced by their symbols and must not be freed.
+void ast_free_typespec(ast_typespec_t * typespec);
+void ast_free_expr(ast_expr_t * expr);
+void ast_free_stmt_block(ast_stmt_block_t * block);
+void ast_free_decl(ast_decl_t * decl);
+void ast_free_decls(sb_t(ast_decl_t *) decls);
@@ -0,0 +1,582 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <string.h>
+
+#include "common.h"
+#include "lex.h"
+#include "parse.h"
+#include "print.h"
+#include "iface.h"
+
+// Every corpus is lexed, parsed and interned separately so a regression can
+// be pinned to one of them. Parsing is timed both with lexing inline and
+// with the lexer on its own thread, and against decoding the same
+// declarations from a module interface held in memory. Results are written as a single JSON object on
+// stdout so runs can be archived and compared over time.
+
+typedef struct bench_phase_t
+{
+    uint64_t ns;
+    uint64_t bytes;
+    uint64_t tokens;
+} bench_phase_t;
+
+typedef struct bench_corpus_t
+{
+    const char * name;
+    void (*generate)(buf_t * out, uint64_t index);
+} bench_corpus_t;
+
+enum
+{
+    BENCH_NESTING_DEPTH = 48,
+    BENCH_EXPR_TERMS = 512,
+    BENCH_STRING_LENGTH = 4096,
+    BENCH_NUMBERS_PER_TABLE = 64
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Corpora
+////////////////////////////////////////////////////////////////////////////////
+
+// Exercises every declaration, statement and expression form the parser
+// knows, so a corpus made of copies of it covers the whole grammar.
+const char * bench_snippet =
+    "enum color : u8 { red, green = 4, blue, }\n"
+    "struct vec { x: i32; y: i32; next: vec*; }\n"
+    "union word { i: u32; b: u8[4]; }\n"
+    "type callback = fn(vec*, i32): b8;\n"
+    "const LIMIT : i32 = 16 * 4 + (3 << 2);\n"
+    "var origin : vec = vec{ .x = 0, .y = -1 };\n"
+    "var table : i32[4] = { 1, 2, [3] = 0x7f };\n"
+    "var message : u8* = \"hello, \\\"bench\\\"\\n\";\n"
+    "fn walk(v: vec*, limit: i32, f: callback): i32 {\n"
+    "    var total : i32 = 0;\n"
+    "    for (var i : i32 = 0; i < limit && v; i++, total += 1) {\n"
+    "        if (f(v, i)) { continue; } else if (!v.next) { break; } else { v = v.next; }\n"
+    "        total += v.x * (v.y - 1) / 3 % 7 ^ ~i | i & 0xff;\n"
+    "    }\n"
+    "    while (total > LIMIT) { total -= cast(i32, table[total % 4]); }\n"
+    "    switch (total) {\n"
+    "        0, 'a' -> { return -1; }\n"
+    "        1 -> { total = total ? total : (:vec){ 1, 2 }.x; }\n"
+    "        otherwise -> { total--; }\n"
+    "    }\n"
+    "    { const half : i32 = total >> 1; return half <= 0 || half >= LIMIT ? 0 : *&half; }\n"
+    "}\n";
+
+void bench_generate_mixed(buf_t * out, uint64_t index)
+{
+    (void)index;
+    buf_write(out, bench_snippet, strlen(bench_snippet));
+}
+
+// Blocks and parentheses nested BENCH_NESTING_DEPTH deep.
+void bench_generate_nesting(buf_t * out, uint64_t index)
+{
+    buf_printf(out, "fn nest_%llu(a: i32): i32 {\n", (unsigned long long)index);
+    for (int32_t i = 0; i < BENCH_NESTING_DEPTH; ++i)
+    {
+        buf_printf(out, "%*sif (a > %d) {\n", (i + 1) * 4, "", i);
+    }
+    buf_printf(out, "%*sreturn ", (BENCH_NESTING_DEPTH + 1) * 4, "");
+    for (int32_t i = 0; i < BENCH_NESTING_DEPTH; ++i)
+    {
+        buf_write(out, "(", 1);
+    }
+    buf_write(out, "a", 1);
+    for (int32_t i = 0; i < BENCH_NESTING_DEPTH; ++i)
+    {
+        buf_printf(out, " + %d)", i);
+    }
+    buf_write(out, ";\n", 2);
+    for (int32_t i = BENCH_NESTING_DEPTH - 1; i >= 0; --i)
+    {
+        buf_printf(out, "%*s}\n", (i + 1) * 4, "");
+    }
+    buf_printf(out, "    return 0;\n}\n");
+}
+
+// One constant per chunk whose initializer is a flat BENCH_EXPR_TERMS term
+// expression mixing every binary precedence level.
+void bench_generate_exprs(buf_t * out, uint64_t index)
+{
+    static const char * ops[] = { "+", "*", "-", "<<", "|", "&&", "/", "==", "^", "||", "%", "<" };
+    buf_printf(out, "const expr_%llu : i64 = x", (unsigned long long)index);
+    for (int32_t i = 1; i < BENCH_EXPR_TERMS; ++i)
+    {
+        buf_printf(out, " %s %s", ops[i % (sizeof(ops) / sizeof(ops[0]))], (i & 1) ? "y" : "123");
+    }
+    buf_write(out, ";\n", 2);
+}
+
+// Many small declarations, each introducing new identifiers.
+void bench_generate_decls(buf_t * out, uint64_t index)
+{
+    unsigned long long n = index;
+    switch (index % 5)
+    {
+    case 0: buf_printf(out, "var v_%llu : i32 = %llu;\n", n, n); break;
+    case 1: buf_printf(out, "const c_%llu : u8* = v_%llu;\n", n, n - 1); break;
+    case 2: buf_printf(out, "struct s_%llu { a_%llu: i32; b_%llu: s_%llu*; }\n", n, n, n, n); break;
+    case 3: buf_printf(out, "enum e_%llu : u8 { x_%llu, y_%llu = 2, }\n", n, n, n); break;
+    case 4: buf_printf(out, "fn f_%llu(p_%llu: i32): i32 { return p_%llu; }\n", n, n, n); break;
+    }
+}
+
+// Large string literals with escapes sprinkled in.
+void bench_generate_strings(buf_t * out, uint64_t index)
+{
+    buf_printf(out, "var str_%llu : u8* = \"", (unsigned long long)index);
+    for (int32_t i = 0; i < BENCH_STRING_LENGTH; ++i)
+    {
+        if (i % 64 == 63)
+        {
+            buf_write(out, "\\n", 2);
+        }
+        else
+        {
+            char c = 'a' + (char)((index + i) % 26);
+            buf_write(out, &c, 1);
+        }
+    }
+    buf_write(out, "\";\n", 3);
+}
+
+// Constant tables of decimal, hex and binary literals of every length.
+void bench_generate_numbers(buf_t * out, uint64_t index)
+{
+    uint64_t value = index * 0x9e3779b97f4a7c15ull + 1;
+    buf_printf(out, "var table_%llu : u64[%d] = {", (unsigned long long)index, BENCH_NUMBERS_PER_TABLE);
+    for (int32_t i = 0; i < BENCH_NUMBERS_PER_TABLE; ++i)
+    {
+        uint64_t n = value >> (value % 61);
+        value = value * 6364136223846793005ull + 1442695040888963407ull;
+        const char * separator = i ? ", " : " ";
+        switch (i % 4)
+        {
+        case 0: case 1: buf_printf(out, "%s%llu", separator, (unsigned long long)n); break;
+        case 2: buf_printf(out, "%s0x%llx", separator, (unsigned long long)n); break;
+        case 3:
+            buf_printf(out, "%s0b", separator);
+            for (int32_t bit = 15; bit >= 0; --bit)
+            {
+                buf_write(out, (n >> bit) & 1 ? "1" : "0", 1);
+            }
+            break;
+        }
+    }
+    buf_write(out, " };\n", 4);
+}
+
+// Float tables, with short decimals, full precision doubles and exponents.
+void bench_generate_floats(buf_t * out, uint64_t index)
+{
+    uint64_t value = index * 0x9e3779b97f4a7c15ull + 1;
+    buf_printf(out, "var floats_%llu : f64[%d] = {", (unsigned long long)index, BENCH_NUMBERS_PER_TABLE);
+    for (int32_t i = 0; i < BENCH_NUMBERS_PER_TABLE; ++i)
+    {
+        double n = (double)(value >> 11) / (double)(1ull << 53);
+        value = value * 6364136223846793005ull + 1442695040888963407ull;
+        const char * separator = i ? ", " : " ";
+        switch (i % 4)
+        {
+        case 0: buf_printf(out, "%s%.2f", separator, n * 100); break;
+        case 1: buf_printf(out, "%s%.17g", separator, n); break;
+        case 2: buf_printf(out, "%s%.6e", separator, n * 1e30); break;
+        case 3: buf_printf(out, "%s%.8gf32", separator, n * 1000 + 1); break;
+        }
+    }
+    buf_write(out, " };\n", 4);
+}
+
+// Generated code style: a license header, doc comments on every
+// declaration and commented out code in nested block comments.
+void bench_generate_comments(buf_t * out, uint64_t index)
+{
+    unsigned long long n = index;
+    buf_printf(out,
+        "/*\n"
+        " * Copyright (c) the authors of generated module %llu. All rights reserved.\n"
+        " * Permission is hereby granted, free of charge, to any person obtaining a copy\n"
+        " * of this software, to deal in the software without restriction, subject to\n"
+        " * the conditions above. THE SOFTWARE IS PROVIDED \"AS IS\", WITHOUT WARRANTY.\n"
+        " */\n"
+        "\n"
+        "// Returns the value of field %llu, scaled by the factor it was generated with.\n"
+        "// The factor is one of the constants of the table above and never zero.\n"
+        "fn get_%llu(x: i32): i32 {\n"
+        "    /* Disabled while the table is regenerated:\n"
+        "       /* return x * 2; */ return x * 3;\n"
+        "    */\n"
+        "    return x * %llu; // scaled\n"
+        "}\n",
+        n, n, n, n);
+}
+
+bench_corpus_t bench_corpora[] =
+{
+    { "mixed", bench_generate_mixed },
+    { "nesting", bench_generate_nesting },
+    { "exprs", bench_generate_exprs },
+    { "strings", bench_generate_strings },
+    { "numbers", bench_generate_numbers },
+    { "floats", bench_generate_floats },
+    { "comments", bench_generate_comments },
+    // Last, as its identifiers stay in the intern table for the corpora after it.
+    { "decls", bench_generate_decls },
+};
+
+char * bench_make_corpus(bench_corpus_t * corpus, uint64_t size, uint64_t * chunks)
+{
+    buf_t buf = { 0 };
+    *chunks = 0;
+    while (buf.length < size)
+    {
+        corpus->generate(&buf, (*chunks)++);
+    }
+    return buf_string(&buf);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Phases
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct bench_reader_t
+{
+    const char * input;
+    uint64_t left;
+} bench_reader_t;
+
+// Copies out of the corpus as a pipe would, so streaming is measured
+// without the cost of the system calls.
+uint64_t bench_read(void * context, char * buffer, uint64_t size)
+{
+    bench_reader_t * reader = context;
+    uint64_t count = size < reader->left ? size : reader->left;
+    memcpy(buffer, reader->input, count);
+    reader->input += count;
+    reader->left -= count;
+    return count;
+}
+
+bench_phase_t bench_lex(const char * source, bool stream, sb_t(const char *) * identifiers)
+{
+    bench_phase_t phase = { 0 };
+    lexer_t lexer;
+    bench_reader_t reader = { source, strlen(source) };
+
+    uint64_t start = time_ns();
+    if (stream)
+    {
+        init_lexer_stream(&lexer, bench_read, &reader);
+    }
+    else
+    {
+        init_lexer(&lexer, source);
+    }
+    while (lexer.token.type != TOKEN_TYPE_EOF)
+    {
+        if (lexer.token.type == TOKEN_TYPE_STRING)
+        {
+            sb_free(lexer.token.string.str);
+        }
+        else if (identifiers && lexer.token.type == TOKEN_TYPE_IDENTIFIER)
+        {
+            sb_push(*identifiers, lexer.token.identifier);
+        }
+        phase.tokens++;
+        next_token(&lexer);
+    }
+    phase.ns = time_ns() - start;
+    phase.bytes = strlen(source);
+    return phase;
+}
+
+sb_t(ast_decl_t *) bench_parse(const char * source, bool pipelined, bench_phase_t * phase)
+{
+    uint64_t start = time_ns();
+    if (pipelined)
+    {
+        init_parser_pipelined(source);
+    }
+    else
+    {
+        init_parser(source);
+    }
+    sb_t(ast_decl_t *) decls = parse_document();
+    phase->ns = time_ns() - start;
+    phase->bytes = strlen(source);
+    return decls;
+}
+
+// Looks up every identifier of the corpus again in token order. The lexer
+// already interned them, so this measures the hit path of the table as the
+// parser and resolver see it.
+bench_phase_t bench_intern(sb_t(const char *) identifiers)
+{
+    bench_phase_t phase = { 0 };
+    sb_t(uint64_t) lengths = NULL;
+    for (int32_t i = 0; i < sb_len(identifiers); ++i)
+    {
+        sb_push(lengths, strlen(identifiers[i]));
+        phase.bytes += lengths[i];
+    }
+
+    uint64_t start = time_ns();
+    for (int32_t i = 0; i < sb_len(identifiers); ++i)
+    {
+        const char * str = intern_string_range(identifiers[i], identifiers[i] + lengths[i] - 1);
+        if (str != identifiers[i])
+        {
+            printf("Interning '%s' returned a different string\n", identifiers[i]);
+            exit(1);
+        }
+    }
+    phase.ns = time_ns() - start;
+    phase.tokens = sb_len(identifiers);
+
+    sb_free(lengths);
+    return phase;
+}
+
+// Pipelining and interface files must not change what is parsed.
+void bench_check_same_ast(sb_t(ast_decl_t *) expected_decls, sb_t(ast_decl_t *) decls, const char * what)
+{
+    buf_t buf = { 0 };
+    print_decls(&buf, expected_decls);
+    char * expected = buf_string(&buf);
+    print_decls(&buf, decls);
+    char * actual = buf_string(&buf);
+    if (strcmp(expected, actual) != 0)
+    {
+        printf("%s differs from the sequential parse\n", what);
+        exit(1);
+    }
+    free(expected);
+    free(actual);
+}
+
+// Bytes are those of the source, so the throughput compares with parsing.
+sb_t(ast_decl_t *) bench_iface_load(sb_t(ast_decl_t *) decls, const char * source, bench_phase_t * phase)
+{
+    buf_t buf = { 0 };
+    iface_write(&buf, 0, decls);
+    uint64_t size = buf.length;
+    char * data = buf_string(&buf);
+
+    sb_t(ast_decl_t *) loaded = NULL;
+    uint64_t start = time_ns();
+    if (!iface_read(data, size, 0, &loaded))
+    {
+        printf("Cannot read back the module interface\n");
+        exit(1);
+    }
+    phase->ns = time_ns() - start;
+    phase->bytes = strlen(source);
+
+    free(data);
+    return loaded;
+}
+
+// The mixed corpus is the snippet repeated, so its dump has to be the
+// snippet's dump repeated as well.
+bench_phase_t bench_dump(sb_t(ast_decl_t *) decls, uint64_t chunks)
+{
+    bench_phase_t phase = { 0 };
+
+    init_parser(bench_snippet);
+    sb_t(ast_decl_t *) snippet_decls = parse_document();
+    buf_t buf = { 0 };
+    print_decls(&buf, snippet_decls);
+    uint64_t expected_length = buf.length;
+    char * expected = buf_string(&buf);
+    sb_free(snippet_decls);
+
+    uint64_t start = time_ns();
+    print_decls(&buf, decls);
+    phase.bytes = buf.length;
+    char * dump = buf_string(&buf);
+    phase.ns = time_ns() - start;
+
+    if (phase.bytes != expected_length * chunks)
+    {
+        printf("AST dump has %llu bytes, expected %llu\n",
+            (unsigned long long)phase.bytes, (unsigned long long)(expected_length * chunks));
+        exit(1);
+    }
+    for (uint64_t i = 0; i < chunks; ++i)
+    {
+        if (memcmp(dump + i * expected_length, expected, expected_length) != 0)
+        {
+            printf("AST dump of copy %llu differs from the snippet\n", (unsigned long long)i);
+            exit(1);
+        }
+    }
+
+    free(dump);
+    free(expected);
+    return phase;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Driver
+////////////////////////////////////////////////////////////////////////////////
+
+void bench_keep_best(bench_phase_t * best, bench_phase_t phase)
+{
+    if (best->ns == 0 || phase.ns < best->ns)
+    {
+        *best = phase;
+    }
+}
+
+void bench_print_phase(const char * name, bench_phase_t phase, bool last)
+{
+    double seconds = phase.ns / 1e9;
+    printf("      \"%s\": { \"ns\": %llu, \"bytes\": %llu, \"tokens\": %llu, "
+        "\"mb_per_s\": %.2f, \"tokens_per_s\": %.0f }%s\n",
+        name, (unsigned long long)phase.ns, (unsigned long long)phase.bytes,
+        (unsigned long long)phase.tokens,
+        seconds > 0 ? phase.bytes / (1024.0 * 1024.0) / seconds : 0.0,
+        seconds > 0 ? phase.tokens / seconds : 0.0,
+        last ? "" : ",");
+}
+
+int bench_usage(void)
+{
+    printf("Usage: opal_bench [--size <KB>] [--runs <n>] [--corpus <name>]\n");
+    printf("Corpora:");
+    for (uint64_t i = 0; i < sizeof(bench_corpora) / sizeof(bench_corpora[0]); ++i)
+    {
+        printf(" %s", bench_corpora[i].name);
+    }
+    printf("\n");
+    return 1;
+}
+
+int main(int argc, char * argv[])
+{
+    uint64_t size_kb = 512;
+    int32_t runs = 3;
+    const char * only = NULL;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (i + 1 == argc)
+        {
+            return bench_usage();
+        }
+        if (strcmp(argv[i], "--size") == 0)
+        {
+            size_kb = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--runs") == 0)
+        {
+            runs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--corpus") == 0)
+        {
+            only = argv[++i];
+        }
+        else
+        {
+            return bench_usage();
+        }
+    }
+    if (size_kb == 0 || runs <= 0)
+    {
+        return bench_usage();
+    }
+
+    printf("{\n  \"size_kb\": %llu,\n  \"runs\": %d,\n  \"cpus\": %d,\n  \"corpora\": [",
+        (unsigned long long)size_kb, runs, cpu_count());
+
+    bool first = true;
+    bool found = false;
+    for (uint64_t c = 0; c < sizeof(bench_corpora) / sizeof(bench_corpora[0]); ++c)
+    {
+        bench_corpus_t * corpus = &bench_corpora[c];
+        if (only && strcmp(only, corpus->name) != 0)
+        {
+            continue;
+        }
+        found = true;
+
+        uint64_t chunks = 0;
+        char * source = bench_make_corpus(corpus, size_kb * 1024, &chunks);
+        bool dump = corpus->generate == bench_generate_mixed;
+
+        bench_phase_t lex = { 0 };
+        bench_phase_t lex_stream = { 0 };
+        bench_phase_t parse = { 0 };
+        bench_phase_t pipelined = { 0 };
+        bench_phase_t iface = { 0 };
+        bench_phase_t intern = { 0 };
+        bench_phase_t print = { 0 };
+        for (int32_t run = 0; run < runs; ++run)
+        {
+            sb_t(const char *) identifiers = NULL;
+            bench_keep_best(&lex, bench_lex(source, false, &identifiers));
+            bench_keep_best(&lex_stream, bench_lex(source, true, NULL));
+            bench_keep_best(&intern, bench_intern(identifiers));
+            sb_free(identifiers);
+
+            bench_phase_t phase = { 0 };
+            sb_t(ast_decl_t *) decls = bench_parse(source, false, &phase);
+            phase.tokens = lex.tokens;
+            bench_keep_best(&parse, phase);
+
+            sb_t(ast_decl_t *) pipelined_decls = bench_parse(source, true, &phase);
+            phase.tokens = lex.tokens;
+            bench_keep_best(&pipelined, phase);
+            if (run == 0)
+            {
+                bench_check_same_ast(decls, pipelined_decls, "Pipelined parse");
+            }
+            ast_free_decls(pipelined_decls);
+
+            sb_t(ast_decl_t *) iface_decls = bench_iface_load(decls, source, &phase);
+            phase.tokens = lex.tokens;
+            bench_keep_best(&iface, phase);
+            if (run == 0)
+            {
+                bench_check_same_ast(decls, iface_decls, "Interface load");
+            }
+            ast_free_decls(iface_decls);
+
+            if (dump)
+            {
+                bench_keep_best(&print, bench_dump(decls, chunks));
+            }
+            ast_free_decls(decls);
+        }
+
+        printf("%s\n    {\n      \"name\": \"%s\",\n      \"chunks\": %llu,\n",
+            first ? "" : ",", corpus->name, (unsigned long long)chunks);
+        bench_print_phase("lex", lex, false);
+        bench_print_phase("lex_stream", lex_stream, false);
+        bench_print_phase("parse", parse, false);
+        bench_print_phase("parse_pipelined", pipelined, false);
+        bench_print_phase("iface_load", iface, false);
+        bench_print_phase("intern", intern, !dump);
+        if (dump)
+        {
+            bench_print_phase("dump", print, true);
+        }
+        printf("    }");
+        first = false;
+
+        free(source);
+    }
+    printf("\n  ]\n}\n");
+
+    if (!found)
+    {
+        return bench_usage();
+    }
+    return 0;
+}
@@ -0,0 +1,1492 @@
+#include "bytecode.h"
+#include "resolve.h"
+#include "common.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+void bytecode_error(const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    printf("Bytecode error: ");
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+    exit(1); // @Todo Good error handling
+}
+
+enum
+{
+    BC_MAX_REGISTERS = 256,
+    BC_MAX_LOCALS = 256,
+    BC_MAX_LOOP_DEPTH = 64
+};
+
+// Scalar locals live in registers. Aggregates and scalars whose address is
+// taken live in the frame memory, their register then holds their address.
+typedef struct bc_local_t
+{
+    const char * name;
+    type_t * type;
+    int32_t reg;
+    bool is_memory;
+} bc_local_t;
+
+typedef struct bc_loop_t
+{
+    sb_t(int32_t) break_jumps;
+    sb_t(int32_t) continue_jumps;
+} bc_loop_t;
+
+vm_module_t * bc_module = NULL;
+
+bc_local_t bc_locals[BC_MAX_LOCALS];
+int32_t bc_num_locals = 0;
+int32_t bc_num_regs = 0;
+int32_t bc_max_regs = 0;
+int32_t bc_frame_size = 0;
+int32_t bc_last_target = 0;
+sb_t(const char *) bc_address_taken = NULL;
+
+bc_loop_t bc_loops[BC_MAX_LOOP_DEPTH];
+int32_t bc_loop_depth = 0;
+type_t * bc_return_type = NULL;
+
+////////////////////////////////////////////////////////////////////////////////
+// Emission
+////////////////////////////////////////////////////////////////////////////////
+
+int32_t bc_emit(vm_instr_t instr)
+{
+    sb_push(bc_module->code, instr);
+    return sb_len(bc_module->code) - 1;
+}
+
+int32_t bc_here(void)
+{
+    return sb_len(bc_module->code);
+}
+
+void bc_patch_to(int32_t jump, int32_t target)
+{
+    vm_instr_t * instr = &bc_module->code[jump];
+    int32_t offset = target - (jump + 1);
+
+    if (VM_GET_OP(*instr) == VM_OP_JMP)
+    {
+        *instr = VM_SAX(VM_OP_JMP, offset);
+    }
+    else
+    {
+        if (offset < INT16_MIN || offset > INT16_MAX)
+        {
+            bytecode_error("Conditional jump out of range");
+        }
+        *instr = VM_ABX(VM_GET_OP(*instr), VM_GET_A(*instr), (uint16_t)offset);
+    }
+
+    if (target > bc_last_target)
+    {
+        bc_last_target = target;
+    }
+}
+
+void bc_patch_here(int32_t jump)
+{
+    bc_patch_to(jump, bc_here());
+}
+
+void bc_patch_list_here(sb_t(int32_t) jumps)
+{
+    for (int32_t * it = jumps; it != sb_end(jumps); ++it)
+    {
+        bc_patch_here(*it);
+    }
+}
+
+int32_t bc_alloc_reg(void)
+{
+    if (bc_num_regs >= BC_MAX_REGISTERS)
+    {
+        bytecode_error("Too many registers needed");
+    }
+
+    int32_t reg = bc_num_regs++;
+    if (bc_num_regs > bc_max_regs)
+    {
+        bc_max_regs = bc_num_regs;
+    }
+    return reg;
+}
+
+int32_t bc_alloc_frame(type_t * type)
+{
+    bc_frame_size = (int32_t)align_up(bc_frame_size, type->align);
+    int32_t offset = bc_frame_size;
+    bc_frame_size += (int32_t)type->size;
+    return offset;
+}
+
+int32_t bc_add_constant(int64_t value)
+{
+    for (int32_t i = 0; i < sb_len(bc_module->constants); ++i)
+    {
+        if (bc_module->constants[i] == value)
+        {
+            return i;
+        }
+    }
+
+    if (sb_len(bc_module->constants) > UINT16_MAX)
+    {
+        bytecode_error("Too many constants");
+    }
+
+    sb_push(bc_module->constants, value);
+    return sb_len(bc_module->constants) - 1;
+}
+
+void bc_emit_load_int(int32_t reg, int64_t value)
+{
+    if (value >= INT16_MIN && value <= INT16_MAX)
+    {
+        bc_emit(VM_ABX(VM_OP_LOADI, reg, (uint16_t)value));
+    }
+    else
+    {
+        bc_emit(VM_ABX(VM_OP_LOADK, reg, bc_add_constant(value)));
+    }
+}
+
+void bc_emit_frame_address(int32_t reg, int32_t offset)
+{
+    if (offset > UINT16_MAX)
+    {
+        bytecode_error("Frame too large");
+    }
+    bc_emit(VM_ABX(VM_OP_FRAME, reg, offset));
+}
+
+void bc_emit_add_offset(int32_t dest, int32_t reg, int64_t offset)
+{
+    if (offset >= INT8_MIN && offset <= INT8_MAX)
+    {
+        bc_emit(VM_ABC(VM_OP_ADDI, dest, reg, (uint8_t)offset));
+    }
+    else
+    {
+        int32_t tmp = bc_alloc_reg();
+        bc_emit_load_int(tmp, offset);
+        bc_emit(VM_ABC(VM_OP_ADD, dest, reg, tmp));
+        bc_num_regs--;
+    }
+}
+
+bool bc_writes_a(vm_opcode_t op)
+{
+    return op >= VM_OP_MOV && op <= VM_OP_FRAME
+        && !(op >= VM_OP_STORE8 && op <= VM_OP_ZERO);
+}
+
+// Moves a value into dest, retargeting the instruction that produced it
+// when possible instead of emitting a MOV.
+void bc_emit_move(int32_t dest, int32_t src, bool src_is_temp)
+{
+    if (dest == src)
+    {
+        return;
+    }
+
+    int32_t last = bc_here() - 1;
+    if (src_is_temp && last >= 0 && bc_last_target <= last)
+    {
+        vm_instr_t instr = bc_module->code[last];
+        if (bc_writes_a(VM_GET_OP(instr)) && (int32_t)VM_GET_A(instr) == src)
+        {
+            bc_module->code[last] = (instr & ~(vm_instr_t)0xff00) | ((vm_instr_t)dest << 8);
+            return;
+        }
+    }
+
+    bc_emit(VM_ABC(VM_OP_MOV, dest, src, 0));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Types
+////////////////////////////////////////////////////////////////////////////////
+
+bool is_aggregate_type(type_t * type)
+{
+    return type->kind == TYPE_STRUCT
+        || type->kind == TYPE_UNION
+        || type->kind == TYPE_ARRAY;
+}
+
+type_t * bc_base_type(type_t * type)
+{
+    return type->kind == TYPE_ENUM ? type->enum_type.base : type;
+}
+
+void bc_check_supported(type_t * type)
+{
+    if (is_float_type(bc_base_type(type)))
+    {
+        bytecode_error("Floating point values are not supported by the bytecode backend");
+    }
+}
+
+vm_opcode_t bc_load_op(type_t * type)
+{
+    type = bc_base_type(type);
+    bc_check_supported(type);
+
+    switch (type->kind)
+    {
+    case TYPE_B8: case TYPE_U8: return VM_OP_LOADU8;
+    case TYPE_I8: return VM_OP_LOADS8;
+    case TYPE_I16: return VM_OP_LOADS16;
+    case TYPE_U16: return VM_OP_LOADU16;
+    case TYPE_I32: return VM_OP_LOADS32;
+    case TYPE_B32: case TYPE_U32: return VM_OP_LOADU32;
+    default: return VM_OP_LOAD64;
+    }
+}
+
+vm_opcode_t bc_store_op(type_t * type)
+{
+    switch (type->size)
+    {
+    case 1: return VM_OP_STORE8;
+    case 2: return VM_OP_STORE16;
+    case 4: return VM_OP_STORE32;
+    default: return VM_OP_STORE64;
+    }
+}
+
+// Registers are 64 bits wide. Values of narrower types are normalized when
+// they are stored or converted, and after operations that may wrap.
+void bc_emit_normalize(int32_t reg, type_t * type)
+{
+    type = bc_base_type(type);
+    vm_opcode_t op = VM_OP_NOP;
+
+    switch (type->kind)
+    {
+    case TYPE_B8: case TYPE_B32: op = VM_OP_BOOL; break;
+    case TYPE_I8: op = VM_OP_SEXT8; break;
+    case TYPE_I16: op = VM_OP_SEXT16; break;
+    case TYPE_I32: op = VM_OP_SEXT32; break;
+    case TYPE_U8: op = VM_OP_ZEXT8; break;
+    case TYPE_U16: op = VM_OP_ZEXT16; break;
+    case TYPE_U32: op = VM_OP_ZEXT32; break;
+    default: return;
+    }
+
+    bc_emit(VM_ABC(op, reg, reg, 0));
+}
+
+bool bc_needs_conversion(type_t * dest, type_t * src)
+{
+    dest = bc_base_type(dest);
+    src = bc_base_type(src);
+
+    if (!is_integer_type(dest) || dest == src)
+    {
+        return false;
+    }
+    if (dest->kind == TYPE_B8 || dest->kind == TYPE_B32)
+    {
+        return src->kind != TYPE_B8 && src->kind != TYPE_B32;
+    }
+    if (!is_integer_type(src))
+    {
+        return dest->size < 8;
+    }
+    return dest->size < src->size || (dest->size < 8 && is_signed_type(dest) != is_signed_type(src));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Locals
+////////////////////////////////////////////////////////////////////////////////
+
+bc_local_t * bc_find_local(const char * name)
+{
+    for (int32_t i = bc_num_locals - 1; i >= 0; --i)
+    {
+        if (bc_locals[i].name == name)
+        {
+            return &bc_locals[i];
+        }
+    }
+    return NULL;
+}
+
+bool bc_is_address_taken(const char * name)
+{
+    for (const char ** it = bc_address_taken; it != sb_end(bc_address_taken); ++it)
+    {
+        if (*it == name)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bc_local_t * bc_push_local(const char * name, type_t * type)
+{
+    if (bc_num_locals >= BC_MAX_LOCALS)
+    {
+        bytecode_error("Too many locals");
+    }
+
+    bc_check_supported(type);
+    bc_local_t * local = &bc_locals[bc_num_locals++];
+    local->name = name;
+    local->type = type;
+    local->reg = bc_alloc_reg();
+    local->is_memory = is_aggregate_type(type) || bc_is_address_taken(name);
+    return local;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Expressions
+////////////////////////////////////////////////////////////////////////////////
+
+// Where a value can be read from or written to: either directly a register
+// or the memory pointed to by a register.
+typedef struct bc_lvalue_t
+{
+    int32_t reg;
+    bool is_memory;
+    type_t * type;
+} bc_lvalue_t;
+
+int32_t bc_compile_expr(ast_expr_t * expr);
+void bc_compile_expr_into(ast_expr_t * expr, int32_t dest, type_t * dest_type);
+
+int32_t bc_global_address(sym_t * sym);
+
+bc_lvalue_t bc_compile_lvalue(ast_expr_t * expr)
+{
+    bc_lvalue_t lvalue = { .type = expr->resolved_type };
+
+    switch (expr->type)
+    {
+    case AST_EXPR_NAME:
+        {
+            bc_local_t * local = bc_find_local(expr->name);
+            if (local)
+            {
+                lvalue.reg = local->reg;
+                lvalue.is_memory = local->is_memory;
+                return lvalue;
+            }
+
+            sym_t * sym = get_global_sym(expr->name);
+            assert(sym && sym->kind == SYM_VAR);
+            lvalue.reg = bc_alloc_reg();
+            bc_emit_load_int(lvalue.reg, bc_global_address(sym));
+            lvalue.is_memory = true;
+        }
+        break;
+    case AST_EXPR_INDEX:
+        {
+            // The address goes below the operands, whose temps are only
+            // released once it has been computed.
+            type_t * base_type = expr->index.expr->resolved_type;
+            lvalue.reg = bc_alloc_reg();
+            lvalue.is_memory = true;
+            int32_t base = bc_compile_expr(expr->index.expr);
+            int32_t index = bc_compile_expr(expr->index.index_expr);
+
+            type_t * elem_type = base_type->kind == TYPE_ARRAY ? base_type->array.base : base_type->pointer.base;
+            int32_t offset = index;
+            if (elem_type->size != 1)
+            {
+                offset = bc_alloc_reg();
+                bc_emit_load_int(offset, elem_type->size);
+                bc_emit(VM_ABC(VM_OP_MUL, offset, index, offset));
+            }
+            bc_emit(VM_ABC(VM_OP_ADD, lvalue.reg, base, offset));
+            bc_num_regs = lvalue.reg + 1;
+        }
+        break;
+    case AST_EXPR_FIELD:
+        {
+            type_t * type = expr->field.expr->resolved_type;
+            if (type->kind == TYPE_POINTER)
+            {
+                type = type->pointer.base;
+            }
+
+            int32_t index = find_field_index(type, expr->field.name);
+            int64_t offset = type->aggregate.fields[index].offset;
+            lvalue.reg = bc_alloc_reg();
+            lvalue.is_memory = true;
+            int32_t base = bc_compile_expr(expr->field.expr);
+
+            if (offset == 0)
+            {
+                bc_emit_move(lvalue.reg, base, base > lvalue.reg);
+            }
+            else
+            {
+                bc_emit_add_offset(lvalue.reg, base, offset);
+            }
+            bc_num_regs = lvalue.reg + 1;
+        }
+        break;
+    case AST_EXPR_UNARY_OP:
+        assert(expr->unary.op == TOKEN_TYPE_MULT);
+        lvalue.reg = bc_compile_expr(expr->unary.expr);
+        lvalue.is_memory = true;
+        break;
+    default:
+        bytecode_error("Expression is not an lvalue");
+        break;
+    }
+
+    return lvalue;
+}
+
+// Aggregates are represented by their address, so reading one from memory
+// is free and only scalars need a load.
+int32_t bc_read_lvalue(bc_lvalue_t lvalue)
+{
+    if (!lvalue.is_memory || is_aggregate_type(lvalue.type))
+    {
+        return lvalue.reg;
+    }
+
+    int32_t reg = bc_alloc_reg();
+    bc_emit(VM_ABC(bc_load_op(lvalue.type), reg, lvalue.reg, 0));
+    return reg;
+}
+
+void bc_emit_aggregate_copy(int32_t dest, int32_t src, type_t * type)
+{
+    int32_t size = bc_alloc_reg();
+    bc_emit_load_int(size, type->size);
+    bc_emit(VM_ABC(VM_OP_COPY, dest, src, size));
+    bc_num_regs--;
+}
+
+void bc_write_lvalue(bc_lvalue_t lvalue, int32_t value)
+{
+    if (is_aggregate_type(lvalue.type))
+    {
+        bc_emit_aggregate_copy(lvalue.reg, value, lvalue.type);
+    }
+    else if (lvalue.is_memory)
+    {
+        bc_emit(VM_ABC(bc_store_op(lvalue.type), lvalue.reg, value, 0));
+    }
+    else
+    {
+        bc_emit_move(lvalue.reg, value, false);
+    }
+}
+
+vm_opcode_t bc_binary_opcode(token_type_t op, bool is_signed)
+{
+    switch (op)
+    {
+    case TOKEN_TYPE_PLUS: return VM_OP_ADD;
+    case TOKEN_TYPE_MINUS: return VM_OP_SUB;
+    case TOKEN_TYPE_MULT: return VM_OP_MUL;
+    case TOKEN_TYPE_DIV: return is_signed ? VM_OP_DIV : VM_OP_DIVU;
+    case TOKEN_TYPE_MOD: return is_signed ? VM_OP_MOD : VM_OP_MODU;
+    case TOKEN_TYPE_AND: return VM_OP_AND;
+    case TOKEN_TYPE_OR: return VM_OP_OR;
+    case TOKEN_TYPE_XOR: return VM_OP_XOR;
+    case TOKEN_TYPE_SHL: return VM_OP_SHL;
+    case TOKEN_TYPE_SHR: return is_signed ? VM_OP_SHR : VM_OP_SHRU;
+    case TOKEN_TYPE_EQ: return VM_OP_EQ;
+    case TOKEN_TYPE_NE: return VM_OP_NE;
+    case TOKEN_TYPE_LT: case TOKEN_TYPE_GT: return is_signed ? VM_OP_LT : VM_OP_LTU;
+    case TOKEN_TYPE_LE: case TOKEN_TYPE_GE: return is_signed ? VM_OP_LE : VM_OP_LEU;
+    default: assert(0); return VM_OP_NOP;
+    }
+}
+
+bool bc_may_wrap(token_type_t op)
+{
+    return op == TOKEN_TYPE_PLUS
+        || op == TOKEN_TYPE_MINUS
+        || op == TOKEN_TYPE_MULT
+        || op == TOKEN_TYPE_SHL;
+}
+
+// Scales the integer operand of pointer arithmetic by the pointee size.
+int32_t bc_scale_index(int32_t index, type_t * pointer_type)
+{
+    int64_t size = pointer_type->pointer.base->size;
+    if (size == 1)
+    {
+        return index;
+    }
+
+    int32_t reg = bc_alloc_reg();
+    bc_emit_load_int(reg, size);
+    bc_emit(VM_ABC(VM_OP_MUL, reg, index, reg));
+    return reg;
+}
+
+int32_t bc_compile_logic(ast_expr_t * expr)
+{
+    bool is_and = expr->binary.op == TOKEN_TYPE_LOGIC_AND;
+    int32_t dest = bc_alloc_reg();
+
+    bc_compile_expr_into(expr->binary.left, dest, type_b8);
+    int32_t jump = bc_emit(VM_ABX(is_and ? VM_OP_JMPF : VM_OP_JMPT, dest, 0));
+    bc_compile_expr_into(expr->binary.right, dest, type_b8);
+    bc_patch_here(jump);
+    return dest;
+}
+
+int32_t bc_compile_binary(ast_expr_t * expr)
+{
+    token_type_t op = expr->binary.op;
+    if (op == TOKEN_TYPE_LOGIC_AND || op == TOKEN_TYPE_LOGIC_OR)
+    {
+        return bc_compile_logic(expr);
+    }
+
+    type_t * left_type = expr->binary.left->resolved_type;
+    type_t * right_type = expr->binary.right->resolved_type;
+    type_t * type = expr->resolved_type;
+    int32_t saved_regs = bc_num_regs;
+    int32_t left = bc_compile_expr(expr->binary.left);
+    int32_t right = bc_compile_expr(expr->binary.right);
+
+    if (op == TOKEN_TYPE_PLUS || op == TOKEN_TYPE_MINUS)
+    {
+        if (left_type->kind == TYPE_POINTER && is_integer_type(right_type))
+        {
+            right = bc_scale_index(right, left_type);
+        }
+        else if (right_type->kind == TYPE_POINTER && is_integer_type(left_type))
+        {
+            left = bc_scale_index(left, right_type);
+        }
+    }
+
+    type_t * operand_type = is_arithmetic_type(left_type) && is_arithmetic_type(right_type)
+        ? unify_arithmetic_types(left_type, right_type)
+        : type_u64;
+    bool is_signed = is_signed_type(operand_type);
+
+    if (op == TOKEN_TYPE_SHL || op == TOKEN_TYPE_SHR)
+    {
+        is_signed = is_signed_type(left_type);
+    }
+    else if (op == TOKEN_TYPE_GT || op == TOKEN_TYPE_GE)
+    {
+        int32_t tmp = left;
+        left = right;
+        right = tmp;
+    }
+
+    bc_num_regs = saved_regs;
+    int32_t dest = bc_alloc_reg();
+    bc_emit(VM_ABC(bc_binary_opcode(op, is_signed), dest, left, right));
+
+    if (op == TOKEN_TYPE_MINUS && left_type->kind == TYPE_POINTER && right_type->kind == TYPE_POINTER)
+    {
+        int64_t size = left_type->pointer.base->size;
+        if (size != 1)
+        {
+            int32_t tmp = bc_alloc_reg();
+            bc_emit_load_int(tmp, size);
+            bc_emit(VM_ABC(VM_OP_DIV, dest, dest, tmp));
+            bc_num_regs--;
+        }
+    }
+    else if (bc_may_wrap(op) && is_integer_type(type) && bc_base_type(type)->size < 8)
+    {
+        bc_emit_normalize(dest, type);
+    }
+
+    return dest;
+}
+
+int32_t bc_compile_unary(ast_expr_t * expr)
+{
+    token_type_t op = expr->unary.op;
+    if (op == TOKEN_TYPE_MULT)
+    {
+        return bc_read_lvalue(bc_compile_lvalue(expr));
+    }
+    else if (op == TOKEN_TYPE_AND)
+    {
+        bc_lvalue_t lvalue = bc_compile_lvalue(expr->unary.expr);
+        assert(lvalue.is_memory);
+        return lvalue.reg;
+    }
+
+    int32_t saved_regs = bc_num_regs;
+    int32_t operand = bc_compile_expr(expr->unary.expr);
+    bc_num_regs = saved_regs;
+    int32_t dest = bc_alloc_reg();
+
+    switch (op)
+    {
+    case TOKEN_TYPE_PLUS:
+        bc_emit_move(dest, operand, operand >= saved_regs);
+        break;
+    case TOKEN_TYPE_MINUS:
+        bc_emit(VM_ABC(VM_OP_NEG, dest, operand, 0));
+        break;
+    case TOKEN_TYPE_NOT:
+        bc_emit(VM_ABC(VM_OP_NOT, dest, operand, 0));
+        break;
+    case TOKEN_TYPE_LOGIC_NOT:
+        bc_emit(VM_ABC(VM_OP_LNOT, dest, operand, 0));
+        break;
+    default:
+        assert(0);
+        break;
+    }
+
+    type_t * type = expr->resolved_type;
+    bool may_wrap = op == TOKEN_TYPE_MINUS || (op == TOKEN_TYPE_NOT && !is_signed_type(type));
+    if (may_wrap && is_integer_type(type) && bc_base_type(type)->size < 8)
+    {
+        bc_emit_normalize(dest, type);
+    }
+    return dest;
+}
+
+int32_t bc_compile_ternary(ast_expr_t * expr)
+{
+    int32_t dest = bc_alloc_reg();
+    int32_t saved_regs = bc_num_regs;
+    int32_t condition = bc_compile_expr(expr->ternary.condition);
+    bc_num_regs = saved_regs;
+
+    int32_t else_jump = bc_emit(VM_ABX(VM_OP_JMPF, condition, 0));
+    bc_compile_expr_into(expr->ternary.then_expr, dest, expr->resolved_type);
+    int32_t end_jump = bc_emit(VM_SAX(VM_OP_JMP, 0));
+    bc_patch_here(else_jump);
+    bc_compile_expr_into(expr->ternary.else_expr, dest, expr->resolved_type);
+    bc_patch_here(end_jump);
+    return dest;
+}
+
+int32_t bc_compile_invoke(ast_expr_t * expr)
+{
+    ast_expr_t * callee = expr->invoke.expr;
+    if (callee->type != AST_EXPR_NAME || bc_find_local(callee->name))
+    {
+        bytecode_error("Only direct calls are supported by the bytecode backend");
+    }
+
+    int32_t fn_index = find_vm_fn(bc_module, callee->name);
+    assert(fn_index >= 0);
+
+    type_t * fn_type = callee->resolved_type;
+    if (is_aggregate_type(fn_type->fn.return_type))
+    {
+        bytecode_error("Returning aggregates is not supported by the bytecode backend");
+    }
+
+    // Arguments go in consecutive registers, which become the first
+    // registers of the callee.
+    int32_t base = bc_num_regs;
+    for (int32_t i = 0; i < expr->invoke.num_args; ++i)
+    {
+        int32_t arg = bc_alloc_reg();
+        type_t * param_type = fn_type->fn.params[i];
+        bc_compile_expr_into(expr->invoke.args[i], arg, param_type);
+
+        if (is_aggregate_type(param_type))
+        {
+            int32_t copy = bc_alloc_reg();
+            bc_emit_frame_address(copy, bc_alloc_frame(param_type));
+            bc_emit_aggregate_copy(copy, arg, param_type);
+            bc_emit(VM_ABC(VM_OP_MOV, arg, copy, 0));
+        }
+        bc_num_regs = arg + 1;
+    }
+
+    if (expr->invoke.num_args == 0)
+    {
+        bc_alloc_reg();
+    }
+
+    bc_emit(VM_ABX(VM_OP_CALL, base, fn_index));
+    bc_num_regs = base + 1;
+    return base;
+}
+
+int32_t bc_add_data(const void * bytes, int64_t size, int64_t align)
+{
+    while (sb_len(bc_module->data) % align != 0)
+    {
+        sb_push(bc_module->data, 0);
+    }
+
+    int32_t address = VM_MEMORY_GUARD_SIZE + sb_len(bc_module->data);
+    for (int64_t i = 0; i < size; ++i)
+    {
+        sb_push(bc_module->data, bytes ? ((const uint8_t *)bytes)[i] : 0);
+    }
+    return address;
+}
+
+int32_t bc_compile_compound(ast_expr_t * expr)
+{
+    type_t * type = expr->resolved_type;
+    int32_t dest = bc_alloc_reg();
+    bc_emit_frame_address(dest, bc_alloc_frame(type));
+
+    int32_t size = bc_alloc_reg();
+    bc_emit_load_int(size, type->size);
+    bc_emit(VM_ABC(VM_OP_ZERO, dest, size, 0));
+    bc_num_regs--;
+
+    int64_t index = 0;
+    for (int32_t i = 0; i < expr->compound.num_args; ++i)
+    {
+        ast_cmpnd_field_t * field = expr->compound.args[i];
+        type_t * field_type = NULL;
+        int64_t offset = 0;
+
+        if (type->kind == TYPE_ARRAY)
+        {
+            if (field->type == AST_CMPND_FIELD_INDEX)
+            {
+                index = field->index;
+            }
+            field_type = type->array.base;
+            offset = index * field_type->size;
+        }
+        else
+        {
+            if (field->type == AST_CMPND_FIELD_FIELD)
+            {
+                index = find_field_index(type, field->field_name);
+            }
+            field_type = type->aggregate.fields[index].type;
+            offset = type->aggregate.fields[index].offset;
+        }
+        index++;
+
+        int32_t saved_regs = bc_num_regs;
+        bc_lvalue_t lvalue = { .reg = bc_alloc_reg(), .is_memory = true, .type = field_type };
+        bc_emit_add_offset(lvalue.reg, dest, offset);
+        int32_t value = bc_alloc_reg();
+        bc_compile_expr_into(field->expr, value, field_type);
+        bc_write_lvalue(lvalue, value);
+        bc_num_regs = saved_regs;
+    }
+
+    return dest;
+}
+
+int32_t bc_compile_name(ast_expr_t * expr)
+{
+    bc_local_t * local = bc_find_local(expr->name);
+    if (!local)
+    {
+        sym_t * sym = get_global_sym(expr->name);
+        assert(sym);
+
+        if (sym->kind == SYM_CONST || sym->kind == SYM_ENUM_CONST)
+        {
+            if (!is_integer_type(sym->type))
+            {
+                bytecode_error("Only integer constants are supported by the bytecode backend");
+            }
+            int32_t reg = bc_alloc_reg();
+            bc_emit_load_int(reg, sym->const_value);
+            return reg;
+        }
+        else if (sym->kind == SYM_FN)
+        {
+            bytecode_error("Function values are not supported by the bytecode backend");
+        }
+    }
+
+    return bc_read_lvalue(bc_compile_lvalue(expr));
+}
+
+// Returns the register holding the value of the expression, which may be
+// the register of a local.
+int32_t bc_compile_expr(ast_expr_t * expr)
+{
+    bc_check_supported(expr->resolved_type);
+
+    switch (expr->type)
+    {
+    case AST_EXPR_INTEGER:
+        {
+            int32_t reg = bc_alloc_reg();
+            bc_emit_load_int(reg, expr->int_value);
+            return reg;
+        }
+    case AST_EXPR_STRING:
+        {
+            int32_t reg = bc_alloc_reg();
+            bc_emit_load_int(reg, bc_add_data(expr->string_value.str, expr->string_value.length + 1, 1));
+            return reg;
+        }
+    case AST_EXPR_NAME:
+        return bc_compile_name(expr);
+    case AST_EXPR_BINARY_OP:
+        return bc_compile_binary(expr);
+    case AST_EXPR_UNARY_OP:
+        return bc_compile_unary(expr);
+    case AST_EXPR_TERNARY:
+        return bc_compile_ternary(expr);
+    case AST_EXPR_CAST:
+        {
+            int32_t saved_regs = bc_num_regs;
+            int32_t operand = bc_compile_expr(expr->cast.expr);
+            bc_num_regs = saved_regs;
+            int32_t dest = bc_alloc_reg();
+            bc_emit_move(dest, operand, operand >= saved_regs);
+            if (bc_needs_conversion(expr->resolved_type, expr->cast.expr->resolved_type))
+            {
+                bc_emit_normalize(dest, expr->resolved_type);
+            }
+            return dest;
+        }
+    case AST_EXPR_INVOKE:
+        return bc_compile_invoke(expr);
+    case AST_EXPR_INDEX:
+    case AST_EXPR_FIELD:
+        return bc_read_lvalue(bc_compile_lvalue(expr));
+    case AST_EXPR_COMPOUND:
+        return bc_compile_compound(expr);
+    case AST_EXPR_FLOAT:
+        bc_check_supported(type_f64);
+        break;
+    }
+
+    return 0;
+}
+
+void bc_compile_expr_into(ast_expr_t * expr, int32_t dest, type_t * dest_type)
+{
+    int32_t saved_regs = bc_num_regs;
+    int32_t value = bc_compile_expr(expr);
+    bc_emit_move(dest, value, value >= saved_regs);
+    if (bc_needs_conversion(dest_type, expr->resolved_type))
+    {
+        bc_emit_normalize(dest, dest_type);
+    }
+    bc_num_regs = saved_regs;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Statements
+////////////////////////////////////////////////////////////////////////////////
+
+void bc_compile_local_decl(ast_decl_t * decl)
+{
+    type_t * type = decl->var_decl.type->resolved_type;
+    bc_local_t * local = bc_push_local(decl->name, type);
+    bc_lvalue_t lvalue = { .reg = local->reg, .is_memory = local->is_memory, .type = type };
+
+    if (local->is_memory)
+    {
+        bc_emit_frame_address(local->reg, bc_alloc_frame(type));
+    }
+
+    if (decl->var_decl.expr)
+    {
+        int32_t saved_regs = bc_num_regs;
+        int32_t value = lvalue.is_memory ? bc_alloc_reg() : local->reg;
+        bc_compile_expr_into(decl->var_decl.expr, value, type);
+        bc_write_lvalue(lvalue, value);
+        bc_num_regs = saved_regs;
+    }
+    else if (local->is_memory)
+    {
+        int32_t size = bc_alloc_reg();
+        bc_emit_load_int(size, type->size);
+        bc_emit(VM_ABC(VM_OP_ZERO, local->reg, size, 0));
+        bc_num_regs--;
+    }
+    else
+    {
+        bc_emit_load_int(local->reg, 0);
+    }
+}
+
+vm_opcode_t bc_assign_opcode(token_type_t op, type_t * type)
+{
+    bool is_signed = is_signed_type(type);
+    switch (op)
+    {
+    case TOKEN_TYPE_ASSIGN_ADD: return VM_OP_ADD;
+    case TOKEN_TYPE_ASSIGN_SUB: return VM_OP_SUB;
+    case TOKEN_TYPE_ASSIGN_MULT: return VM_OP_MUL;
+    case TOKEN_TYPE_ASSIGN_DIV: return is_signed ? VM_OP_DIV : VM_OP_DIVU;
+    case TOKEN_TYPE_ASSIGN_MOD: return is_signed ? VM_OP_MOD : VM_OP_MODU;
+    case TOKEN_TYPE_ASSIGN_AND: return VM_OP_AND;
+    case TOKEN_TYPE_ASSIGN_OR: return VM_OP_OR;
+    case TOKEN_TYPE_ASSIGN_XOR: return VM_OP_XOR;
+    case TOKEN_TYPE_ASSIGN_SHL: return VM_OP_SHL;
+    case TOKEN_TYPE_ASSIGN_SHR: return is_signed ? VM_OP_SHR : VM_OP_SHRU;
+    default: bytecode_error("Unsupported assignment operator"); return VM_OP_NOP;
+    }
+}
+
+void bc_compile_assign(ast_simple_stmt_t * stmt)
+{
+    bc_lvalue_t lvalue = bc_compile_lvalue(stmt->assign.left);
+    type_t * type = lvalue.type;
+
+    if (stmt->assign.op == TOKEN_TYPE_ASSIGN)
+    {
+        int32_t value = lvalue.is_memory ? bc_alloc_reg() : lvalue.reg;
+        bc_compile_expr_into(stmt->assign.right, value, type);
+        bc_write_lvalue(lvalue, value);
+        return;
+    }
+
+    int32_t current = bc_read_lvalue(lvalue);
+    int32_t saved_regs = bc_num_regs;
+    int32_t operand = bc_compile_expr(stmt->assign.right);
+
+    if (type->kind == TYPE_POINTER)
+    {
+        operand = bc_scale_index(operand, type);
+    }
+
+    bc_num_regs = saved_regs;
+    int32_t result = lvalue.is_memory ? bc_alloc_reg() : lvalue.reg;
+    bc_emit(VM_ABC(bc_assign_opcode(stmt->assign.op, type), result, current, operand));
+    bc_emit_normalize(result, type);
+    if (lvalue.is_memory)
+    {
+        bc_write_lvalue(lvalue, result);
+    }
+}
+
+void bc_compile_simple_stmt(ast_simple_stmt_t * stmt)
+{
+    int32_t saved_regs = bc_num_regs;
+
+    switch (stmt->type)
+    {
+    case AST_SIMPLE_STMT_VAR_DECL:
+        bc_compile_local_decl(stmt->var_decl);
+        saved_regs = bc_num_regs;
+        break;
+    case AST_SIMPLE_STMT_CONST_DECL:
+        bc_compile_local_decl(stmt->const_decl);
+        saved_regs = bc_num_regs;
+        break;
+    case AST_SIMPLE_STMT_ASSIGN:
+        bc_compile_assign(stmt);
+        break;
+    case AST_SIMPLE_STMT_INCREMENT:
+    case AST_SIMPLE_STMT_DECREMENT:
+        {
+            bc_lvalue_t lvalue = bc_compile_lvalue(stmt->expr);
+            int32_t current = bc_read_lvalue(lvalue);
+            int32_t result = lvalue.is_memory ? bc_alloc_reg() : lvalue.reg;
+            int64_t step = lvalue.type->kind == TYPE_POINTER ? lvalue.type->pointer.base->size : 1;
+            bc_emit_add_offset(result, current, stmt->type == AST_SIMPLE_STMT_INCREMENT ? step : -step);
+            bc_emit_normalize(result, lvalue.type);
+            if (lvalue.is_memory)
+            {
+                bc_write_lvalue(lvalue, result);
+            }
+        }
+        break;
+    case AST_SIMPLE_STMT_EXPR:
+        bc_compile_expr(stmt->expr);
+        break;
+    }
+
+    bc_num_regs = saved_regs;
+}
+
+void bc_compile_stmt_block(ast_stmt_block_t * block);
+
+int32_t bc_compile_condition_jump(ast_expr_t * condition)
+{
+    int32_t saved_regs = bc_num_regs;
+    int32_t reg = bc_compile_expr(condition);
+    bc_num_regs = saved_regs;
+    return bc_emit(VM_ABX(VM_OP_JMPF, reg, 0));
+}
+
+void bc_push_loop(void)
+{
+    if (bc_loop_depth >= BC_MAX_LOOP_DEPTH)
+    {
+        bytecode_error("Loops nested too deeply");
+    }
+    bc_loops[bc_loop_depth++] = (bc_loop_t){ NULL, NULL };
+}
+
+void bc_pop_loop(int32_t continue_target)
+{
+    bc_loop_t * loop = &bc_loops[--bc_loop_depth];
+    for (int32_t * it = loop->continue_jumps; it != sb_end(loop->continue_jumps); ++it)
+    {
+        bc_patch_to(*it, continue_target);
+    }
+    bc_patch_list_here(loop->break_jumps);
+    sb_free(loop->continue_jumps);
+    sb_free(loop->break_jumps);
+}
+
+void bc_compile_switch(ast_stmt_t * stmt)
+{
+    int32_t saved_regs = bc_num_regs;
+    int32_t value = bc_alloc_reg();
+    bc_compile_expr_into(stmt->switch_stmt.expr, value, stmt->switch_stmt.expr->resolved_type);
+    int32_t tmp = bc_alloc_reg();
+
+    sb_t(int32_t) case_jumps = NULL;
+    int32_t otherwise_index = -1;
+
+    for (int32_t i = 0; i < stmt->switch_stmt.num_items; ++i)
+    {
+        ast_switch_item_t * item = stmt->switch_stmt.items[i];
+        if (item->num_values == 0)
+        {
+            otherwise_index = i;
+        }
+
+        for (int32_t j = 0; j < item->num_values; ++j)
+        {
+            bc_emit_load_int(tmp, item->values[j]->value);
+            bc_emit(VM_ABC(VM_OP_EQ, tmp, value, tmp));
+            sb_push(case_jumps, bc_emit(VM_ABX(VM_OP_JMPT, tmp, 0)));
+        }
+    }
+
+    bc_num_regs = saved_regs;
+    int32_t default_jump = bc_emit(VM_SAX(VM_OP_JMP, 0));
+    sb_t(int32_t) end_jumps = NULL;
+    int32_t case_jump_index = 0;
+
+    for (int32_t i = 0; i < stmt->switch_stmt.num_items; ++i)
+    {
+        ast_switch_item_t * item = stmt->switch_stmt.items[i];
+        for (int32_t j = 0; j < item->num_values; ++j)
+        {
+            bc_patch_here(case_jumps[case_jump_index++]);
+        }
+        if (i == otherwise_index)
+        {
+            bc_patch_here(default_jump);
+        }
+
+        bc_compile_stmt_block(item->stmt_block);
+        sb_push(end_jumps, bc_emit(VM_SAX(VM_OP_JMP, 0)));
+    }
+
+    if (otherwise_index < 0)
+    {
+        bc_patch_here(default_jump);
+    }
+    bc_patch_list_here(end_jumps);
+    sb_free(case_jumps);
+    sb_free(end_jumps);
+}
+
+void bc_compile_stmt(ast_stmt_t * stmt)
+{
+    switch (stmt->type)
+    {
+    case AST_STMT_IF:
+        {
+            sb_t(int32_t) end_jumps = NULL;
+            for (int32_t i = 0; i < stmt->if_stmt.num_conditions; ++i)
+            {
+                int32_t next_jump = bc_compile_condition_jump(stmt->if_stmt.conditions[i]);
+                bc_compile_stmt_block(stmt->if_stmt.stmt_blocks[i]);
+                if (i + 1 < stmt->if_stmt.num_conditions || stmt->if_stmt.else_stmt_block)
+                {
+                    sb_push(end_jumps, bc_emit(VM_SAX(VM_OP_JMP, 0)));
+                }
+                bc_patch_here(next_jump);
+            }
+            if (stmt->if_stmt.else_stmt_block)
+            {
+                bc_compile_stmt_block(stmt->if_stmt.else_stmt_block);
+            }
+            bc_patch_list_here(end_jumps);
+            sb_free(end_jumps);
+        }
+        break;
+    case AST_STMT_WHILE:
+        {
+            int32_t start = bc_here();
+            int32_t exit_jump = bc_compile_condition_jump(stmt->while_stmt.condition);
+            bc_push_loop();
+            bc_compile_stmt_block(stmt->while_stmt.stmt_block);
+            int32_t back_jump = bc_emit(VM_SAX(VM_OP_JMP, 0));
+            bc_patch_to(back_jump, start);
+            bc_patch_here(exit_jump);
+            bc_pop_loop(start);
+        }
+        break;
+    case AST_STMT_FOR:
+        {
+            int32_t saved_locals = bc_num_locals;
+            int32_t saved_regs = bc_num_regs;
+            for (int32_t i = 0; i < stmt->for_stmt.num_init_stmts; ++i)
+            {
+                bc_compile_simple_stmt(stmt->for_stmt.init_stmts[i]);
+            }
+
+            int32_t start = bc_here();
+            int32_t exit_jump = bc_compile_condition_jump(stmt->for_stmt.condition);
+            bc_push_loop();
+            bc_compile_stmt_block(stmt->for_stmt.stmt_block);
+
+            int32_t continue_target = bc_here();
+            for (int32_t i = 0; i < stmt->for_stmt.num_incr_stmts; ++i)
+            {
+                bc_compile_simple_stmt(stmt->for_stmt.incr_stmts[i]);
+            }
+            int32_t back_jump = bc_emit(VM_SAX(VM_OP_JMP, 0));
+            bc_patch_to(back_jump, start);
+            bc_patch_here(exit_jump);
+            bc_pop_loop(continue_target);
+
+            bc_num_locals = saved_locals;
+            bc_num_regs = saved_regs;
+        }
+        break;
+    case AST_STMT_SWITCH:
+        bc_compile_switch(stmt);
+        break;
+    case AST_STMT_RETURN:
+        if (stmt->return_stmt)
+        {
+            int32_t saved_regs = bc_num_regs;
+            int32_t value = bc_alloc_reg();
+            bc_compile_expr_into(stmt->return_stmt, value, bc_return_type);
+            bc_emit(VM_ABC(VM_OP_RET, value, 0, 0));
+            bc_num_regs = saved_regs;
+        }
+        else
+        {
+            bc_emit(VM_ABC(VM_OP_RET0, 0, 0, 0));
+        }
+        break;
+    case AST_STMT_CONTINUE:
+        sb_push(bc_loops[bc_loop_depth - 1].continue_jumps, bc_emit(VM_SAX(VM_OP_JMP, 0)));
+        break;
+    case AST_STMT_BREAK:
+        sb_push(bc_loops[bc_loop_depth - 1].break_jumps, bc_emit(VM_SAX(VM_OP_JMP, 0)));
+        break;
+    case AST_STMT_BLOCK:
+        bc_compile_stmt_block(stmt->stmt_block);
+        break;
+    case AST_STMT_SIMPLE:
+        bc_compile_simple_stmt(stmt->simple_stmt);
+        break;
+    }
+}
+
+void bc_compile_stmt_block(ast_stmt_block_t * block)
+{
+    int32_t saved_locals = bc_num_locals;
+    int32_t saved_regs = bc_num_regs;
+
+    for (int32_t i = 0; i < block->num_stmts; ++i)
+    {
+        bc_compile_stmt(block->stmts[i]);
+    }
+
+    bc_num_locals = saved_locals;
+    bc_num_regs = saved_regs;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Declarations
+////////////////////////////////////////////////////////////////////////////////
+
+void bc_collect_address_taken_expr(ast_expr_t * expr);
+
+void bc_collect_address_taken_exprs(sb_t(ast_expr_t *) exprs, int32_t count)
+{
+    for (int32_t i = 0; i < count; ++i)
+    {
+        bc_collect_address_taken_expr(exprs[i]);
+    }
+}
+
+void bc_collect_address_taken_expr(ast_expr_t * expr)
+{
+    if (!expr)
+    {
+        return;
+    }
+
+    switch (expr->type)
+    {
+    case AST_EXPR_TERNARY:
+        bc_collect_address_taken_expr(expr->ternary.condition);
+        bc_collect_address_taken_expr(expr->ternary.then_expr);
+        bc_collect_address_taken_expr(expr->ternary.else_expr);
+        break;
+    case AST_EXPR_BINARY_OP:
+        bc_collect_address_taken_expr(expr->binary.left);
+        bc_collect_address_taken_expr(expr->binary.right);
+        break;
+    case AST_EXPR_UNARY_OP:
+        if (expr->unary.op == TOKEN_TYPE_AND && expr->unary.expr->type == AST_EXPR_NAME)
+        {
+            sb_push(bc_address_taken, expr->unary.expr->name);
+        }
+        bc_collect_address_taken_expr(expr->unary.expr);
+        break;
+    case AST_EXPR_CAST:
+        bc_collect_address_taken_expr(expr->cast.expr);
+        break;
+    case AST_EXPR_INVOKE:
+        bc_collect_address_taken_expr(expr->invoke.expr);
+        bc_collect_address_taken_exprs(expr->invoke.args, expr->invoke.num_args);
+        break;
+    case AST_EXPR_INDEX:
+        bc_collect_address_taken_expr(expr->index.expr);
+        bc_collect_address_taken_expr(expr->index.index_expr);
+        break;
+    case AST_EXPR_FIELD:
+        bc_collect_address_taken_expr(expr->field.expr);
+        break;
+    case AST_EXPR_COMPOUND:
+        for (int32_t i = 0; i < expr->compound.num_args; ++i)
+        {
+            bc_collect_address_taken_expr(expr->compound.args[i]->expr);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void bc_collect_address_taken_simple_stmt(ast_simple_stmt_t * stmt)
+{
+    switch (stmt->type)
+    {
+    case AST_SIMPLE_STMT_VAR_DECL:
+    case AST_SIMPLE_STMT_CONST_DECL:
+        bc_collect_address_taken_expr(stmt->var_decl->var_decl.expr);
+        break;
+    case AST_SIMPLE_STMT_ASSIGN:
+        bc_collect_address_taken_expr(stmt->assign.left);
+        bc_collect_address_taken_expr(stmt->assign.right);
+        break;
+    default:
+        bc_collect_address_taken_expr(stmt->expr);
+        break;
+    }
+}
+
+void bc_collect_address_taken_block(ast_stmt_block_t * block)
+{
+    for (int32_t i = 0; i < block->num_stmts; ++i)
+    {
+        ast_stmt_t * stmt = block->stmts[i];
+        switch (stmt->type)
+        {
+        case AST_STMT_IF:
+            bc_collect_address_taken_exprs(stmt->if_stmt.conditions, stmt->if_stmt.num_conditions);
+            for (int32_t j = 0; j < stmt->if_stmt.num_conditions; ++j)
+            {
+                bc_collect_address_taken_block(stmt->if_stmt.stmt_blocks[j]);
+            }
+            if (stmt->if_stmt.else_stmt_block)
+            {
+                bc_collect_address_taken_block(stmt->if_stmt.else_stmt_block);
+            }
+            break;
+        case AST_STMT_WHILE:
+            bc_collect_address_taken_expr(stmt->while_stmt.condition);
+            bc_collect_address_taken_block(stmt->while_stmt.stmt_block);
+            break;
+        case AST_STMT_FOR:
+            for (int32_t j = 0; j < stmt->for_stmt.num_init_stmts; ++j)
+            {
+                bc_collect_address_taken_simple_stmt(stmt->for_stmt.init_stmts[j]);
+            }
+            bc_collect_address_taken_expr(stmt->for_stmt.condition);
+            for (int32_t j = 0; j < stmt->for_stmt.num_incr_stmts; ++j)
+            {
+                bc_collect_address_taken_simple_stmt(stmt->for_stmt.incr_stmts[j]);
+            }
+            bc_collect_address_taken_block(stmt->for_stmt.stmt_block);
+            break;
+        case AST_STMT_SWITCH:
+            bc_collect_address_taken_expr(stmt->switch_stmt.expr);
+            for (int32_t j = 0; j < stmt->switch_stmt.num_items; ++j)
+            {
+                bc_collect_address_taken_block(stmt->switch_stmt.items[j]->stmt_block);
+            }
+            break;
+        case AST_STMT_RETURN:
+            bc_collect_address_taken_expr(stmt->return_stmt);
+            break;
+        case AST_STMT_BLOCK:
+            bc_collect_address_taken_block(stmt->stmt_block);
+            break;
+        case AST_STMT_SIMPLE:
+            bc_collect_address_taken_simple_stmt(stmt->simple_stmt);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void bc_begin_fn(void)
+{
+    bc_num_locals = 0;
+    bc_num_regs = 0;
+    bc_max_regs = 0;
+    bc_frame_size = 0;
+    bc_loop_depth = 0;
+    bc_last_target = bc_here();
+    sb_free(bc_address_taken);
+}
+
+void bc_end_fn(vm_fn_t * fn)
+{
+    bc_emit(VM_ABC(VM_OP_RET0, 0, 0, 0));
+    fn->num_registers = bc_max_regs > fn->num_params ? bc_max_regs : fn->num_params;
+    fn->frame_size = bc_frame_size;
+}
+
+void bc_compile_fn(ast_decl_t * decl, vm_fn_t * fn)
+{
+    type_t * type = decl->sym->type;
+    bc_begin_fn();
+    fn->code_start = bc_here();
+    bc_collect_address_taken_block(decl->fn_decl.stmt_block);
+
+    for (int32_t i = 0; i < decl->fn_decl.num_params; ++i)
+    {
+        type_t * param_type = type->fn.params[i];
+        bc_check_supported(param_type);
+        bc_local_t * local = &bc_locals[bc_num_locals++];
+        local->name = decl->fn_decl.params[i]->name;
+        local->type = param_type;
+        local->reg = bc_alloc_reg();
+        local->is_memory = is_aggregate_type(param_type);
+    }
+
+    // Parameters whose address is taken are moved to the frame memory.
+    for (int32_t i = 0; i < decl->fn_decl.num_params; ++i)
+    {
+        bc_local_t * local = &bc_locals[i];
+        if (!local->is_memory && bc_is_address_taken(local->name))
+        {
+            int32_t address = bc_alloc_reg();
+            bc_emit_frame_address(address, bc_alloc_frame(local->type));
+            bc_emit(VM_ABC(bc_store_op(local->type), address, local->reg, 0));
+            local->reg = address;
+            local->is_memory = true;
+        }
+    }
+
+    bc_return_type = type->fn.return_type;
+    bc_compile_stmt_block(decl->fn_decl.stmt_block);
+    bc_return_type = NULL;
+    bc_end_fn(fn);
+}
+
+map_t bc_global_addresses;
+
+int32_t bc_global_address(sym_t * sym)
+{
+    intptr_t address = (intptr_t)map_get(&bc_global_addresses, sym);
+    if (!address)
+    {
+        address = bc_add_data(NULL, sym->type->size, sym->type->align);
+        map_put(&bc_global_addresses, sym, (void *)address);
+    }
+    return (int32_t)address;
+}
+
+void bc_compile_init_fn(sb_t(ast_decl_t *) decls, vm_fn_t * fn)
+{
+    bc_begin_fn();
+    fn->code_start = bc_here();
+    bc_return_type = type_void;
+
+    for (ast_decl_t ** it = decls; it != sb_end(decls); ++it)
+    {
+        ast_decl_t * decl = *it;
+        if (decl->type != AST_DECL_VAR)
+        {
+            continue;
+        }
+
+        check_sym(decl->sym);
+        bc_check_supported(decl->sym->type);
+        int32_t address = bc_global_address(decl->sym);
+
+        if (decl->var_decl.expr)
+        {
+            bc_lvalue_t lvalue = { .reg = bc_alloc_reg(), .is_memory = true, .type = decl->sym->type };
+            bc_emit_load_int(lvalue.reg, address);
+            int32_t value = bc_alloc_reg();
+            bc_compile_expr_into(decl->var_decl.expr, value, lvalue.type);
+            bc_write_lvalue(lvalue, value);
+            bc_num_regs = 0;
+        }
+    }
+
+    bc_return_type = NULL;
+    bc_end_fn(fn);
+}
+
+int32_t find_vm_fn(vm_module_t * module, const char * name)
+{
+    return (int32_t)(intptr_t)map_get(&module->fn_indices, name) - 1;
+}
+
+// Declarations are resolved on demand, every function is compiled along
+// with a synthetic function running the global initializers.
+vm_module_t * compile_bytecode(sb_t(ast_decl_t *) decls)
+{
+    vm_module_t * module = xmalloc(sizeof(vm_module_t));
+    memset(module, 0, sizeof(vm_module_t));
+    bc_module = module;
+    map_free(&bc_global_addresses);
+
+    for (ast_decl_t ** it = decls; it != sb_end(decls); ++it)
+    {
+        ast_decl_t * decl = *it;
+        if (decl->type == AST_DECL_FN)
+        {
+            check_sym(decl->sym);
+            vm_fn_t fn = { .name = decl->name, .num_params = decl->fn_decl.num_params };
+            sb_push(module->fns, fn);
+            map_put(&module->fn_indices, decl->name, (void *)(intptr_t)sb_len(module->fns));
+        }
+    }
+
+    module->init_fn = sb_len(module->fns);
+    sb_push(module->fns, (vm_fn_t){ .name = "$init" });
+    bc_compile_init_fn(decls, &module->fns[module->init_fn]);
+
+    int32_t fn_index = 0;
+    for (ast_decl_t ** it = decls; it != sb_end(decls); ++it)
+    {
+        if ((*it)->type == AST_DECL_FN)
+        {
+            bc_compile_fn(*it, &module->fns[fn_index++]);
+        }
+    }
+
+    bc_module = NULL;
+    return module;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <stdint.h>
+#include "common.h"
+#include "ast.h"
+
+// Instructions are 32 bits wide: an 8 bits opcode followed by either three
+// 8 bits operands (A, B, C), an 8 bits operand and a 16 bits operand (A, Bx
+// or sBx) or a single signed 24 bits operand (sAx).
+typedef uint32_t vm_instr_t;
+
+#define VM_GET_OP(i) ((i) & 0xff)
+#define VM_GET_A(i) (((i) >> 8) & 0xff)
+#define VM_GET_B(i) (((i) >> 16) & 0xff)
+#define VM_GET_C(i) (((i) >> 24) & 0xff)
+#define VM_GET_SC(i) ((int32_t)(i) >> 24)
+#define VM_GET_BX(i) ((i) >> 16)
+#define VM_GET_SBX(i) ((int32_t)(i) >> 16)
+#define VM_GET_SAX(i) ((int32_t)(i) >> 8)
+
+#define VM_ABC(op, a, b, c) ((vm_instr_t)(op) | ((vm_instr_t)(a) << 8) | ((vm_instr_t)(b) << 16) | ((vm_instr_t)(c) << 24))
+#define VM_ABX(op, a, bx) ((vm_instr_t)(op) | ((vm_instr_t)(a) << 8) | ((vm_instr_t)(bx) << 16))
+#define VM_SAX(op, sax) ((vm_instr_t)(op) | ((vm_instr_t)(sax) << 8))
+
+typedef enum vm_opcode_t
+{
+    VM_OP_NOP,
+    VM_OP_MOV,      // A = B
+    VM_OP_LOADI,    // A = sBx
+    VM_OP_LOADK,    // A = K[Bx]
+
+    VM_OP_ADD,      // A = B op C
+    VM_OP_SUB,
+    VM_OP_MUL,
+    VM_OP_DIV,
+    VM_OP_DIVU,
+    VM_OP_MOD,
+    VM_OP_MODU,
+    VM_OP_AND,
+    VM_OP_OR,
+    VM_OP_XOR,
+    VM_OP_SHL,
+    VM_OP_SHR,
+    VM_OP_SHRU,
+    VM_OP_EQ,
+    VM_OP_NE,
+    VM_OP_LT,
+    VM_OP_LE,
+    VM_OP_LTU,
+    VM_OP_LEU,
+    VM_OP_ADDI,     // A = B + sC
+
+    VM_OP_NEG,      // A = op B
+    VM_OP_NOT,
+    VM_OP_LNOT,
+    VM_OP_BOOL,
+    VM_OP_SEXT8,
+    VM_OP_SEXT16,
+    VM_OP_SEXT32,
+    VM_OP_ZEXT8,
+    VM_OP_ZEXT16,
+    VM_OP_ZEXT32,
+
+    VM_OP_LOADS8,   // A = mem[B]
+    VM_OP_LOADS16,
+    VM_OP_LOADS32,
+    VM_OP_LOADU8,
+    VM_OP_LOADU16,
+    VM_OP_LOADU32,
+    VM_OP_LOAD64,
+    VM_OP_STORE8,   // mem[A] = B
+    VM_OP_STORE16,
+    VM_OP_STORE32,
+    VM_OP_STORE64,
+    VM_OP_COPY,     // mem[A .. A + C] = mem[B .. B + C], C being a register
+    VM_OP_ZERO,     // mem[A .. A + B] = 0, B being a register
+    VM_OP_FRAME,    // A = address of the frame memory + Bx
+
+    VM_OP_JMP,      // ip += sAx
+    VM_OP_JMPF,     // if (!A) ip += sBx
+    VM_OP_JMPT,     // if (A) ip += sBx
+    VM_OP_CALL,     // A = F[Bx](A, A + 1, ...)
+    VM_OP_RET,      // return A
+    VM_OP_RET0,     // return
+
+    VM_OP_COUNT_
+} vm_opcode_t;
+
+typedef struct vm_fn_t
+{
+    const char * name;
+    int32_t code_start;
+    int32_t num_params;
+    int32_t num_registers;
+    int32_t frame_size;
+} vm_fn_t;
+
+// Pointers are offsets in the VM memory, which starts with a guard area so
+// that 0 is never a valid address, followed by the data segment.
+enum
+{
+    VM_MEMORY_GUARD_SIZE = 16
+};
+
+typedef struct vm_module_t
+{
+    sb_t(vm_instr_t) code;
+    sb_t(int64_t) constants;
+    sb_t(vm_fn_t) fns;
+    sb_t(uint8_t) data;
+    int32_t init_fn;
+    map_t fn_indices;
+} vm_module_t;
+
+vm_module_t * compile_bytecode(sb_t(ast_decl_t *) decls);
+int32_t find_vm_fn(vm_module_t * module, const char * name);
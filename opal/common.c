@@ -2,12 +2,51 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
 #include <assert.h>
+#include <errno.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#endif
 
 #include "common.h"
 
+THREAD_LOCAL stats_t stats;
+
+void stats_add(stats_t * to, const stats_t * from)
+{
+    to->read_ns += from->read_ns;
+    to->lex_ns += from->lex_ns;
+    to->parse_ns += from->parse_ns;
+    to->resolve_ns += from->resolve_ns;
+    to->output_ns += from->output_ns;
+    to->xmalloc_calls += from->xmalloc_calls;
+    to->xmalloc_bytes += from->xmalloc_bytes;
+    to->xrealloc_calls += from->xrealloc_calls;
+    to->xrealloc_bytes += from->xrealloc_bytes;
+    to->sb_grows += from->sb_grows;
+    to->intern_hits += from->intern_hits;
+    to->intern_misses += from->intern_misses;
+    to->module_cache_hits += from->module_cache_hits;
+    to->module_cache_misses += from->module_cache_misses;
+}
+
 void * xmalloc(uint64_t size)
 {
+    stats.xmalloc_calls++;
+    stats.xmalloc_bytes += size;
     void * ptr = malloc(size);
     assert(ptr);
     return ptr;
@@ -15,6 +54,8 @@ void * xmalloc(uint64_t size)
 
 void * xrealloc(void * ptr, uint64_t size)
 {
+    stats.xrealloc_calls++;
+    stats.xrealloc_bytes += size;
     ptr = realloc(ptr, size);
     assert(ptr);
     return ptr;
@@ -22,6 +63,7 @@ void * xrealloc(void * ptr, uint64_t size)
 
 void * _sb_grow_impl(void * b, int32_t increment, uint64_t value_size)
 {
+    stats.sb_grows++;
     int32_t old_size = (b) ? _sb_raw_cap(b) : 0;
     int32_t min_needed = old_size + increment;
     int32_t new_size = old_size * 2 + 1;
@@ -58,33 +100,227 @@ void test_dyn_buf(void)
     assert(sb_len(array) == 0);
 }
 
-typedef struct intern_string_t
+uint64_t hash_ptr(const void * ptr)
+{
+    uint64_t x = (uint64_t)(uintptr_t)ptr;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    return x;
+}
+
+// Open addressing with linear probing, keys are never removed.
+// NULL is not a valid key.
+void * map_get(map_t * map, const void * key)
+{
+    if (map->length == 0)
+    {
+        return NULL;
+    }
+
+    uint64_t i = hash_ptr(key) & (map->capacity - 1);
+    while (map->keys[i])
+    {
+        if (map->keys[i] == key)
+        {
+            return map->values[i];
+        }
+        i = (i + 1) & (map->capacity - 1);
+    }
+
+    return NULL;
+}
+
+void map_grow(map_t * map, uint64_t new_capacity);
+
+void map_put(map_t * map, const void * key, void * value)
+{
+    assert(key);
+
+    if (2 * map->length >= map->capacity)
+    {
+        map_grow(map, map->capacity ? map->capacity * 2 : 16);
+    }
+
+    uint64_t i = hash_ptr(key) & (map->capacity - 1);
+    while (map->keys[i])
+    {
+        if (map->keys[i] == key)
+        {
+            map->values[i] = value;
+            return;
+        }
+        i = (i + 1) & (map->capacity - 1);
+    }
+
+    map->keys[i] = key;
+    map->values[i] = value;
+    map->length++;
+}
+
+void map_grow(map_t * map, uint64_t new_capacity)
+{
+    map_t new_map =
+    {
+        .keys = xmalloc(new_capacity * sizeof(void *)),
+        .values = xmalloc(new_capacity * sizeof(void *)),
+        .length = 0,
+        .capacity = new_capacity,
+    };
+    memset(new_map.keys, 0, new_capacity * sizeof(void *));
+
+    for (uint64_t i = 0; i < map->capacity; ++i)
+    {
+        if (map->keys[i])
+        {
+            map_put(&new_map, map->keys[i], map->values[i]);
+        }
+    }
+
+    map_free(map);
+    *map = new_map;
+}
+
+void map_free(map_t * map)
+{
+    free((void *)map->keys);
+    free(map->values);
+    *map = (map_t){ 0 };
+}
+
+void test_map(void)
+{
+    map_t map = { 0 };
+    assert(map_get(&map, (void *)1) == NULL);
+
+    for (uintptr_t i = 1; i < 1024; ++i)
+    {
+        map_put(&map, (void *)i, (void *)(i * 3));
+    }
+    assert(map.length == 1023);
+
+    for (uintptr_t i = 1; i < 1024; ++i)
+    {
+        assert(map_get(&map, (void *)i) == (void *)(i * 3));
+    }
+    assert(map_get(&map, (void *)2048) == NULL);
+
+    map_put(&map, (void *)12, (void *)7);
+    assert(map_get(&map, (void *)12) == (void *)7);
+    assert(map.length == 1023);
+
+    map_free(&map);
+    assert(map.length == 0);
+}
+
+void spin_lock(spin_lock_t * lock)
+{
+    while (atomic_flag_test_and_set_explicit(&lock->flag, memory_order_acquire))
+    {
+        thread_yield();
+    }
+}
+
+void spin_unlock(spin_lock_t * lock)
+{
+    atomic_flag_clear_explicit(&lock->flag, memory_order_release);
+}
+
+enum
 {
+    INTERN_STRIPES = 16
+};
+
+typedef struct intern_entry_t
+{
+    uint64_t hash;
     uint64_t length;
     const char * str;
-} intern_string_t; 
+} intern_entry_t;
+
+// Strings are spread over independently locked open addressing tables by
+// the top bits of their hash, so threads lexing different modules rarely
+// wait on each other.
+typedef struct intern_table_t
+{
+    spin_lock_t lock;
+    intern_entry_t * entries;
+    uint64_t length;
+    uint64_t capacity;
+} intern_table_t;
+
+intern_table_t intern_tables[INTERN_STRIPES];
+
+uint64_t hash_range(const char * first, uint64_t length)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (uint64_t i = 0; i < length; ++i)
+    {
+        hash ^= (unsigned char)first[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
 
-sb_t(intern_string_t) intern_string_list = NULL;
+void intern_table_grow(intern_table_t * table)
+{
+    uint64_t capacity = table->capacity ? table->capacity * 2 : 256;
+    intern_entry_t * entries = xmalloc(capacity * sizeof(intern_entry_t));
+    memset(entries, 0, capacity * sizeof(intern_entry_t));
+
+    for (uint64_t i = 0; i < table->capacity; ++i)
+    {
+        intern_entry_t * entry = &table->entries[i];
+        if (entry->str)
+        {
+            uint64_t j = entry->hash & (capacity - 1);
+            while (entries[j].str)
+            {
+                j = (j + 1) & (capacity - 1);
+            }
+            entries[j] = *entry;
+        }
+    }
+
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
+}
 
 // @Todo Use some kind of memory arena
 const char * intern_string_range(const char * first, const char * last)
 {
     uint64_t length = last - first + 1;
+    uint64_t hash = hash_range(first, length);
+    intern_table_t * table = &intern_tables[hash >> 60];
 
-    for (intern_string_t * it = intern_string_list;
-            it != sb_end(intern_string_list);
-            ++it)
+    spin_lock(&table->lock);
+    if ((table->length + 1) * 2 > table->capacity)
     {
-        if (it->length == length && strncmp(it->str, first, length) == 0)
+        intern_table_grow(table);
+    }
+
+    uint64_t i = hash & (table->capacity - 1);
+    while (table->entries[i].str)
+    {
+        intern_entry_t * entry = &table->entries[i];
+        if (entry->hash == hash && entry->length == length && memcmp(entry->str, first, length) == 0)
         {
-            return it->str;
+            spin_unlock(&table->lock);
+            stats.intern_hits++;
+            return entry->str;
         }
+        i = (i + 1) & (table->capacity - 1);
     }
 
     char * new_str = xmalloc(length + 1);
     memcpy(new_str, first, length);
     new_str[length] = '\0';
-    sb_push(intern_string_list, (intern_string_t){ length, new_str });
+    table->entries[i] = (intern_entry_t){ hash, length, new_str };
+    table->length++;
+    spin_unlock(&table->lock);
+
+    stats.intern_misses++;
     return new_str;
 }
 
@@ -93,6 +329,453 @@ const char * intern_string(const char * str)
     return intern_string_range(str, str + strlen(str) - 1);
 }
 
+// Returns the NUL terminated content of the file, or NULL if it cannot be
+// read. The result must be released with free.
+char * read_file(const char * path)
+{
+    FILE * file = fopen(path, "rb");
+    if (!file)
+    {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (length < 0)
+    {
+        fclose(file);
+        return NULL;
+    }
+
+    char * content = xmalloc(length + 1);
+    if (fread(content, 1, length, file) != (size_t)length)
+    {
+        fclose(file);
+        free(content);
+        return NULL;
+    }
+
+    content[length] = '\0';
+    fclose(file);
+    return content;
+}
+
+const void * mmap_file(const char * path, uint64_t * size)
+{
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return NULL;
+    }
+
+    LARGE_INTEGER length;
+    void * data = NULL;
+    if (GetFileSizeEx(file, &length) && length.QuadPart > 0)
+    {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping)
+        {
+            data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+    }
+    CloseHandle(file);
+    *size = data ? (uint64_t)length.QuadPart : 0;
+    return data;
+#else
+    int file = open(path, O_RDONLY);
+    if (file < 0)
+    {
+        return NULL;
+    }
+
+    struct stat info;
+    void * data = NULL;
+    if (fstat(file, &info) == 0 && info.st_size > 0)
+    {
+        data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (data == MAP_FAILED)
+        {
+            data = NULL;
+        }
+    }
+    close(file);
+    *size = data ? (uint64_t)info.st_size : 0;
+    return data;
+#endif
+}
+
+void munmap_file(const void * data, uint64_t size)
+{
+#if defined(_WIN32)
+    (void)size;
+    UnmapViewOfFile(data);
+#else
+    munmap((void *)data, size);
+#endif
+}
+
+bool replace_file(const char * from, const char * to)
+{
+#if defined(_WIN32)
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(from, to) == 0;
+#endif
+}
+
+// Succeeds if the directory already exists.
+bool make_dir(const char * path)
+{
+#if defined(_WIN32)
+    return CreateDirectoryA(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+    struct stat info;
+    return mkdir(path, 0777) == 0 || (stat(path, &info) == 0 && S_ISDIR(info.st_mode));
+#endif
+}
+
+int32_t process_id(void)
+{
+#if defined(_WIN32)
+    return (int32_t)GetCurrentProcessId();
+#else
+    return (int32_t)getpid();
+#endif
+}
+
+uint64_t time_ns(void)
+{
+#if defined(_WIN32)
+    static LARGE_INTEGER frequency;
+    if (frequency.QuadPart == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+    }
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000ull
+        + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000ull / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+typedef struct thread_start_t
+{
+    thread_fn_t fn;
+    void * arg;
+} thread_start_t;
+
+#if defined(_WIN32)
+DWORD WINAPI thread_entry(LPVOID param)
+#else
+void * thread_entry(void * param)
+#endif
+{
+    thread_start_t start = *(thread_start_t *)param;
+    free(param);
+    start.fn(start.arg);
+    return 0;
+}
+
+thread_t thread_start(thread_fn_t fn, void * arg)
+{
+    thread_start_t * start = xmalloc(sizeof(thread_start_t));
+    start->fn = fn;
+    start->arg = arg;
+
+    thread_t thread = { 0 };
+#if defined(_WIN32)
+    thread.handle = CreateThread(NULL, 0, thread_entry, start, 0, NULL);
+    assert(thread.handle);
+#else
+    pthread_t * handle = xmalloc(sizeof(pthread_t));
+    int result = pthread_create(handle, NULL, thread_entry, start);
+    assert(result == 0);
+    (void)result;
+    thread.handle = handle;
+#endif
+    return thread;
+}
+
+void thread_join(thread_t thread)
+{
+#if defined(_WIN32)
+    WaitForSingleObject(thread.handle, INFINITE);
+    CloseHandle(thread.handle);
+#else
+    pthread_join(*(pthread_t *)thread.handle, NULL);
+    free(thread.handle);
+#endif
+}
+
+void thread_yield(void)
+{
+#if defined(_WIN32)
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+int32_t cpu_count(void)
+{
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int32_t)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int32_t)count : 1;
+#endif
+}
+
+buf_block_t * buf_reserve(buf_t * buf, uint64_t size)
+{
+    buf_block_t * block = sb_len(buf->blocks) ? &buf->blocks[sb_len(buf->blocks) - 1] : NULL;
+    if (block && block->capacity - block->length >= size)
+    {
+        return block;
+    }
+
+    uint64_t capacity = size > BUF_BLOCK_SIZE ? size : BUF_BLOCK_SIZE;
+    sb_push(buf->blocks, (buf_block_t){ xmalloc(capacity), 0, capacity });
+    return &buf->blocks[sb_len(buf->blocks) - 1];
+}
+
+void buf_maybe_flush(buf_t * buf)
+{
+    if (buf->file && buf->length >= BUF_FLUSH_SIZE)
+    {
+        buf_flush(buf);
+    }
+}
+
+void buf_write(buf_t * buf, const void * data, uint64_t size)
+{
+    const char * bytes = data;
+    while (size > 0)
+    {
+        buf_block_t * block = buf_reserve(buf, 1);
+        uint64_t chunk = block->capacity - block->length;
+        chunk = chunk < size ? chunk : size;
+
+        memcpy(block->data + block->length, bytes, chunk);
+        block->length += chunk;
+        buf->length += chunk;
+        bytes += chunk;
+        size -= chunk;
+    }
+    buf_maybe_flush(buf);
+}
+
+// Formats straight into the last block, the text is only formatted a second
+// time when it does not fit in what is left of it.
+void buf_vprintf(buf_t * buf, const char * format, va_list args)
+{
+    buf_block_t * block = buf_reserve(buf, 1);
+    uint64_t available = block->capacity - block->length;
+
+    va_list copy;
+    va_copy(copy, args);
+    int32_t length = vsnprintf(block->data + block->length, available, format, copy);
+    va_end(copy);
+    assert(length >= 0);
+
+    if ((uint64_t)length >= available)
+    {
+        // vsnprintf needs room for the terminator, which is then overwritten
+        // by the next append.
+        block = buf_reserve(buf, (uint64_t)length + 1);
+        va_copy(copy, args);
+        vsnprintf(block->data + block->length, (uint64_t)length + 1, format, copy);
+        va_end(copy);
+    }
+
+    block->length += length;
+    buf->length += length;
+    buf_maybe_flush(buf);
+}
+
+void buf_printf(buf_t * buf, const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    buf_vprintf(buf, format, args);
+    va_end(args);
+}
+
+void buf_reset(buf_t * buf)
+{
+    // The last block is kept to be filled again.
+    int32_t num_blocks = sb_len(buf->blocks);
+    for (int32_t i = 0; i + 1 < num_blocks; ++i)
+    {
+        free(buf->blocks[i].data);
+    }
+
+    if (num_blocks)
+    {
+        buf->blocks[0] = buf->blocks[num_blocks - 1];
+        buf->blocks[0].length = 0;
+        _sb_raw_len(buf->blocks) = 1;
+    }
+    buf->length = 0;
+}
+
+// Writes the pending blocks to the file, a no-op for in-memory buffers.
+void buf_flush(buf_t * buf)
+{
+    if (!buf->file || buf->length == 0)
+    {
+        return;
+    }
+
+#if defined(_WIN32)
+    for (buf_block_t * it = buf->blocks; it != sb_end(buf->blocks); ++it)
+    {
+        if (fwrite(it->data, 1, it->length, buf->file) != it->length)
+        {
+            fprintf(stderr, "Cannot write the output: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+    fflush(buf->file);
+#else
+    // Whatever went through stdio must come out first.
+    fflush(buf->file);
+    int fd = fileno(buf->file);
+
+    enum { MAX_IOVECS = 64 };
+    struct iovec iovecs[MAX_IOVECS];
+    buf_block_t * block = buf->blocks;
+    uint64_t offset = 0;
+
+    while (block != sb_end(buf->blocks))
+    {
+        int num_iovecs = 0;
+        for (buf_block_t * it = block; it != sb_end(buf->blocks) && num_iovecs < MAX_IOVECS; ++it)
+        {
+            uint64_t skip = it == block ? offset : 0;
+            iovecs[num_iovecs].iov_base = it->data + skip;
+            iovecs[num_iovecs].iov_len = it->length - skip;
+            num_iovecs++;
+        }
+
+        ssize_t written = writev(fd, iovecs, num_iovecs);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written < 0)
+        {
+            fprintf(stderr, "Cannot write the output: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        // Partial writes resume from the first block not entirely written.
+        while (block != sb_end(buf->blocks) && written >= (ssize_t)(block->length - offset))
+        {
+            written -= block->length - offset;
+            offset = 0;
+            block++;
+        }
+        offset += written;
+    }
+#endif
+
+    buf_reset(buf);
+}
+
+// Returns the whole content as a NUL terminated string to release with
+// free, the buffer is left empty.
+char * buf_string(buf_t * buf)
+{
+    char * str = xmalloc(buf->length + 1);
+    char * it = str;
+    for (buf_block_t * block = buf->blocks; block != sb_end(buf->blocks); ++block)
+    {
+        memcpy(it, block->data, block->length);
+        it += block->length;
+    }
+    *it = '\0';
+
+    buf_reset(buf);
+    return str;
+}
+
+void buf_free(buf_t * buf)
+{
+    buf_flush(buf);
+    for (buf_block_t * it = buf->blocks; it != sb_end(buf->blocks); ++it)
+    {
+        free(it->data);
+    }
+    sb_free(buf->blocks);
+    buf->length = 0;
+}
+
+void test_buf(void)
+{
+    buf_t buf = { 0 };
+    buf_printf(&buf, "%s %d", "answer", 42);
+    buf_write(&buf, "!", 1);
+    char * str = buf_string(&buf);
+    assert(strcmp(str, "answer 42!") == 0);
+    free(str);
+
+    // Appends spanning several blocks, one of them larger than a block.
+    char * large = xmalloc(BUF_BLOCK_SIZE * 2);
+    memset(large, 'x', BUF_BLOCK_SIZE * 2 - 1);
+    large[BUF_BLOCK_SIZE * 2 - 1] = '\0';
+    for (int32_t i = 0; i < 10000; ++i)
+    {
+        buf_printf(&buf, "%05d", i);
+    }
+    buf_printf(&buf, "%s", large);
+    buf_write(&buf, large, BUF_BLOCK_SIZE + 3);
+    assert(buf.length == 50000 + BUF_BLOCK_SIZE * 3 + 2);
+    assert(sb_len(buf.blocks) > 2);
+
+    str = buf_string(&buf);
+    assert(strncmp(str, "000000000100002", 15) == 0);
+    assert(strncmp(str + 49995, "09999xx", 7) == 0);
+    assert(strlen(str) == 50000 + BUF_BLOCK_SIZE * 3 + 2);
+    free(str);
+
+    // Going through a file gives the same bytes back.
+    FILE * file = tmpfile();
+    assert(file);
+    buf.file = file;
+    fputs("head ", file);
+    for (int32_t i = 0; i < BUF_FLUSH_SIZE / 4; ++i)
+    {
+        buf_write(&buf, "abcd", 4);
+    }
+    assert(buf.length == 0);
+    buf_printf(&buf, " tail");
+    buf_flush(&buf);
+
+    long length = ftell(file);
+    assert(length == 5 + BUF_FLUSH_SIZE + 5);
+    char * content = xmalloc(length);
+    fseek(file, 0, SEEK_SET);
+    assert(fread(content, 1, length, file) == (size_t)length);
+    assert(strncmp(content, "head abcdabcd", 13) == 0);
+    assert(strncmp(content + length - 9, "abcd tail", 9) == 0);
+    free(content);
+    fclose(file);
+
+    buf.file = NULL;
+    buf_free(&buf);
+    free(large);
+}
+
 void test_intern_string(void)
 {
     char a[] = "my first string";
@@ -103,11 +786,28 @@ void test_intern_string(void)
     assert(intern_string(intern_string(a)) == intern_string(a));
     assert(intern_string(a) != intern_string(b));
     assert(intern_string(a) != intern_string(c));
+
+    // Enough strings to make every stripe grow a few times.
+    const char * strs[10000];
+    for (int32_t i = 0; i < 10000; ++i)
+    {
+        char str[32];
+        snprintf(str, sizeof(str), "interned_%d", i);
+        strs[i] = intern_string(str);
+    }
+    for (int32_t i = 0; i < 10000; ++i)
+    {
+        char str[32];
+        snprintf(str, sizeof(str), "interned_%d", i);
+        assert(intern_string(str) == strs[i]);
+    }
 }
 
 void test_common(void)
 {
     test_dyn_buf();
+    test_map();
     test_intern_string();
+    test_buf();
 }
 
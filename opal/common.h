@@ -1,6 +1,44 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+// Allocation and interning counters are always kept, they cost an add each.
+// Timers around individual tokens are only taken when timing is set. Every
+// thread counts into its own copy, helper threads hand theirs back to be
+// merged with stats_add when they are joined.
+typedef struct stats_t
+{
+    bool timing;
+    uint64_t read_ns;
+    uint64_t lex_ns;
+    uint64_t parse_ns;
+    uint64_t resolve_ns;
+    uint64_t output_ns;
+
+    uint64_t xmalloc_calls;
+    uint64_t xmalloc_bytes;
+    uint64_t xrealloc_calls;
+    uint64_t xrealloc_bytes;
+    uint64_t sb_grows;
+    uint64_t intern_hits;
+    uint64_t intern_misses;
+    uint64_t module_cache_hits;
+    uint64_t module_cache_misses;
+} stats_t;
+
+extern THREAD_LOCAL stats_t stats;
+
+void stats_add(stats_t * to, const stats_t * from);
 
 void * xmalloc(uint64_t size);
 void * xrealloc(void * ptr, uint64_t size);
@@ -20,8 +58,93 @@ void * _sb_grow_impl(void * b, int32_t increment, uint64_t value_size);
 #define sb_push(b, ...) (_sb_maybe_grow(b, 1), (b)[_sb_raw_len(b)++] = (__VA_ARGS__))
 #define sb_free(b) ((b) ? free(_sb_raw(b)), (b) = NULL : 0)
 
+typedef struct map_t
+{
+    const void ** keys;
+    void ** values;
+    uint64_t length;
+    uint64_t capacity;
+} map_t;
+
+void * map_get(map_t * map, const void * key);
+void map_put(map_t * map, const void * key, void * value);
+void map_free(map_t * map);
+
+// Interning is safe to call from any thread.
 const char * intern_string(const char * str);
 const char * intern_string_range(const char * first, const char * last);
 
+// FNV-1a, also used to tell whether a source file changed.
+uint64_t hash_range(const char * first, uint64_t length);
+
+char * read_file(const char * path);
+
+// Maps the whole file read-only. Returns NULL if it cannot be mapped, which
+// includes empty files.
+const void * mmap_file(const char * path, uint64_t * size);
+void munmap_file(const void * data, uint64_t size);
+
+// Renames from to to, replacing to if it exists.
+bool replace_file(const char * from, const char * to);
+bool make_dir(const char * path);
+int32_t process_id(void);
+
+// Monotonic clock in nanoseconds, only meaningful as a difference.
+uint64_t time_ns(void);
+
+typedef struct thread_t
+{
+    void * handle;
+} thread_t;
+
+typedef void (*thread_fn_t)(void * arg);
+
+thread_t thread_start(thread_fn_t fn, void * arg);
+void thread_join(thread_t thread);
+void thread_yield(void);
+int32_t cpu_count(void);
+
+// For short critical sections only, waiting threads yield in a loop.
+typedef struct spin_lock_t
+{
+    atomic_flag flag;
+} spin_lock_t;
+
+#define SPIN_LOCK_INIT { ATOMIC_FLAG_INIT }
+
+void spin_lock(spin_lock_t * lock);
+void spin_unlock(spin_lock_t * lock);
+
+// Output is appended to a list of blocks instead of one growing array so
+// nothing is ever copied twice. A buffer attached to a file hands all its
+// blocks to a single writev once BUF_FLUSH_SIZE bytes are pending, a buffer
+// without a file keeps everything in memory until buf_string.
+enum
+{
+    BUF_BLOCK_SIZE = 64 * 1024,
+    BUF_FLUSH_SIZE = 1024 * 1024
+};
+
+typedef struct buf_block_t
+{
+    char * data;
+    uint64_t length;
+    uint64_t capacity;
+} buf_block_t;
+
+typedef struct buf_t
+{
+    sb_t(buf_block_t) blocks;
+    uint64_t length;
+    FILE * file;
+} buf_t;
+
+void buf_write(buf_t * buf, const void * data, uint64_t size);
+void buf_vprintf(buf_t * buf, const char * format, va_list args);
+void buf_printf(buf_t * buf, const char * format, ...);
+void buf_flush(buf_t * buf);
+char * buf_string(buf_t * buf);
+void buf_free(buf_t * buf);
+
 void test_common(void);
 
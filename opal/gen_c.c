@@ -0,0 +1,1381 @@
+#include "gen_c.h"
+#include "resolve.h"
+#include "parse.h"
+#include "common.h"
+#include "trace.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+void gen_c_error(const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    printf("C generation error: ");
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+    exit(1); // @Todo Good error handling
+}
+
+enum
+{
+    GEN_MAX_LOOP_DEPTH = 64
+};
+
+// C ends a switch on break while Opal breaks out of the enclosing loop, so a
+// break nested in a switch jumps to a label placed after the loop instead.
+typedef struct gen_loop_t
+{
+    int32_t label;
+    int32_t switch_depth;
+    bool needs_break_label;
+} gen_loop_t;
+
+buf_t * gen_out = NULL;
+int32_t gen_indent = 0;
+
+map_t gen_reserved_names;
+map_t gen_defined_types;
+sb_t(const char *) gen_locals = NULL;
+sb_t(ast_decl_t *) gen_deferred_inits = NULL;
+
+gen_loop_t gen_loops[GEN_MAX_LOOP_DEPTH];
+int32_t gen_loop_depth = 0;
+int32_t gen_switch_depth = 0;
+int32_t gen_label_count = 0;
+type_t * gen_return_type = NULL;
+
+////////////////////////////////////////////////////////////////////////////////
+// Output
+////////////////////////////////////////////////////////////////////////////////
+
+void gen_printf(const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    buf_vprintf(gen_out, format, args);
+    va_end(args);
+}
+
+void gen_newline(void)
+{
+    gen_printf("\n%*s", gen_indent * 4, "");
+}
+
+char * gen_strf(const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int32_t length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    char * str = xmalloc(length + 1);
+    va_start(args, format);
+    vsnprintf(str, length + 1, format, args);
+    va_end(args);
+    return str;
+}
+
+// Appends to a NUL terminated stretchy buffer.
+void gen_append(sb_t(char) * str, const char * suffix)
+{
+    if (*str)
+    {
+        _sb_raw_len(*str)--;
+    }
+    for (const char * c = suffix; *c; ++c)
+    {
+        sb_push(*str, *c);
+    }
+    sb_push(*str, '\0');
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Names
+////////////////////////////////////////////////////////////////////////////////
+
+// Opal identifiers that would collide with C keywords, with the names the
+// prelude relies on or with the generated entry points get a '_' suffix.
+const char * gen_reserved[] =
+{
+    "auto", "break", "case", "char", "const", "continue", "default", "do",
+    "double", "else", "enum", "extern", "float", "for", "goto", "if",
+    "inline", "int", "long", "register", "restrict", "return", "short",
+    "signed", "sizeof", "static", "struct", "switch", "typedef", "union",
+    "unsigned", "void", "volatile", "while", "_Bool", "_Complex", "_Imaginary",
+    "int8_t", "int16_t", "int32_t", "int64_t", "uint8_t", "uint16_t",
+    "uint32_t", "uint64_t", "INT64_C", "UINT64_C",
+    "main", "opal_init", "opal_copy"
+};
+
+void gen_init_reserved_names(void)
+{
+    map_free(&gen_reserved_names);
+    for (int32_t i = 0; i < (int32_t)(sizeof(gen_reserved) / sizeof(gen_reserved[0])); ++i)
+    {
+        char * mangled = gen_strf("%s_", gen_reserved[i]);
+        map_put(&gen_reserved_names, intern_string(gen_reserved[i]), (void *)intern_string(mangled));
+        free(mangled);
+    }
+}
+
+// name must be interned.
+const char * gen_name(const char * name)
+{
+    const char * mangled = map_get(&gen_reserved_names, name);
+    return mangled ? mangled : name;
+}
+
+bool gen_is_local(const char * name)
+{
+    for (const char ** it = gen_locals; it != sb_end(gen_locals); ++it)
+    {
+        if (*it == name)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void gen_push_local(const char * name)
+{
+    sb_push(gen_locals, name);
+}
+
+void gen_pop_locals(int32_t count)
+{
+    if (gen_locals)
+    {
+        _sb_raw_len(gen_locals) = count;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Types
+////////////////////////////////////////////////////////////////////////////////
+
+bool gen_is_bool_type(type_t * type)
+{
+    return type->kind == TYPE_B8 || type->kind == TYPE_B32;
+}
+
+const char * gen_type_name(type_t * type)
+{
+    switch (type->kind)
+    {
+    case TYPE_VOID: return "void";
+    case TYPE_B8: return "uint8_t";
+    case TYPE_B32: return "uint32_t";
+    case TYPE_I8: return "int8_t";
+    case TYPE_I16: return "int16_t";
+    case TYPE_I32: return "int32_t";
+    case TYPE_I64: return "int64_t";
+    case TYPE_U8: return "uint8_t";
+    case TYPE_U16: return "uint16_t";
+    case TYPE_U32: return "uint32_t";
+    case TYPE_U64: return "uint64_t";
+    case TYPE_F32: return "float";
+    case TYPE_F64: return "double";
+    case TYPE_ENUM:
+    case TYPE_STRUCT:
+    case TYPE_UNION:
+        return gen_name(type->sym->name);
+    default:
+        assert(0);
+        return NULL;
+    }
+}
+
+char * gen_paren_declarator(const char * declarator)
+{
+    return gen_strf(*declarator == '*' ? "(%s)" : "%s", declarator);
+}
+
+// Builds the C declaration of declarator with the given type from the
+// inside out. Opal function values are C function pointers.
+char * gen_type_decl(type_t * type, const char * declarator)
+{
+    switch (type->kind)
+    {
+    case TYPE_POINTER:
+        {
+            char * inner = gen_strf("*%s", declarator);
+            char * result = gen_type_decl(type->pointer.base, inner);
+            free(inner);
+            return result;
+        }
+    case TYPE_ARRAY:
+        {
+            char * paren = gen_paren_declarator(declarator);
+            char * inner = gen_strf("%s[%lld]", paren, (long long)type->array.length);
+            char * result = gen_type_decl(type->array.base, inner);
+            free(paren);
+            free(inner);
+            return result;
+        }
+    case TYPE_FN:
+        {
+            sb_t(char) params = NULL;
+            for (int32_t i = 0; i < type->fn.num_params; ++i)
+            {
+                char * param = gen_type_decl(type->fn.params[i], "");
+                gen_append(&params, i > 0 ? ", " : "");
+                gen_append(&params, param);
+                free(param);
+            }
+
+            char * inner = gen_strf("(*%s)(%s)", declarator, params ? params : "void");
+            char * result = gen_type_decl(type->fn.return_type, inner);
+            sb_free(params);
+            free(inner);
+            return result;
+        }
+    default:
+        return gen_strf(*declarator ? "%s %s" : "%s", gen_type_name(type), declarator);
+    }
+}
+
+void gen_type(type_t * type, const char * declarator)
+{
+    char * decl = gen_type_decl(type, declarator);
+    gen_printf("%s", decl);
+    free(decl);
+}
+
+void gen_aggregate(type_t * type);
+
+void gen_aggregate_dependency(type_t * type)
+{
+    while (type->kind == TYPE_ARRAY)
+    {
+        type = type->array.base;
+    }
+    if (type->kind == TYPE_STRUCT || type->kind == TYPE_UNION)
+    {
+        gen_aggregate(type);
+    }
+}
+
+// Aggregates embedded by value must be defined first, pointers only need
+// the forward declarations.
+void gen_aggregate(type_t * type)
+{
+    if (map_get(&gen_defined_types, type))
+    {
+        return;
+    }
+    map_put(&gen_defined_types, type, type);
+
+    for (int32_t i = 0; i < type->aggregate.num_fields; ++i)
+    {
+        gen_aggregate_dependency(type->aggregate.fields[i].type);
+    }
+
+    gen_printf("%s %s", type->kind == TYPE_STRUCT ? "struct" : "union", gen_name(type->sym->name));
+    gen_newline();
+    gen_printf("{");
+    gen_indent++;
+    for (int32_t i = 0; i < type->aggregate.num_fields; ++i)
+    {
+        type_field_t * field = &type->aggregate.fields[i];
+        gen_newline();
+        gen_type(field->type, gen_name(field->name));
+        gen_printf(";");
+    }
+    if (type->aggregate.num_fields == 0)
+    {
+        gen_newline();
+        gen_printf("char unused;");
+    }
+    gen_indent--;
+    gen_newline();
+    gen_printf("};");
+    gen_newline();
+    gen_newline();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Expressions
+////////////////////////////////////////////////////////////////////////////////
+
+void gen_expr(ast_expr_t * expr);
+void gen_expr_top(ast_expr_t * expr);
+void gen_initializer(ast_expr_t * expr, type_t * type);
+
+void gen_int_literal(type_t * type, int64_t value)
+{
+    switch (type->kind)
+    {
+    case TYPE_ENUM:
+        gen_printf("((%s)", gen_name(type->sym->name));
+        gen_int_literal(type->enum_type.base, value);
+        gen_printf(")");
+        break;
+    case TYPE_U64:
+        gen_printf("UINT64_C(%llu)", (unsigned long long)value);
+        break;
+    case TYPE_U32:
+        gen_printf("%lluu", (unsigned long long)(uint32_t)value);
+        break;
+    case TYPE_I64:
+        if (value == INT64_MIN)
+        {
+            gen_printf("(-INT64_C(9223372036854775807) - 1)");
+        }
+        else
+        {
+            gen_printf(value < 0 ? "(-INT64_C(%lld))" : "INT64_C(%lld)", (long long)(value < 0 ? -value : value));
+        }
+        break;
+    default:
+        if (value == INT32_MIN)
+        {
+            gen_printf("(-2147483647 - 1)");
+        }
+        else
+        {
+            gen_printf(value < 0 ? "(%lld)" : "%lld", (long long)value);
+        }
+        break;
+    }
+}
+
+void gen_float_literal(double value, bool is_f32)
+{
+    char str[64];
+    snprintf(str, sizeof(str), "%.17g", value);
+    gen_printf(strpbrk(str, ".en") ? "%s%s" : "%s.0%s", str, is_f32 ? "f" : "");
+}
+
+void gen_string_literal(const char * str, uint64_t length)
+{
+    gen_printf("((uint8_t *)\"");
+    for (uint64_t i = 0; i < length; ++i)
+    {
+        unsigned char c = (unsigned char)str[i];
+        if (c == '"' || c == '\\')
+        {
+            gen_printf("\\%c", c);
+        }
+        else if (c == '\n')
+        {
+            gen_printf("\\n");
+        }
+        else if (c >= 0x20 && c < 0x7f && c != '?')
+        {
+            gen_printf("%c", c);
+        }
+        else
+        {
+            // Octal escapes are at most three digits long, unlike hexadecimal
+            // ones which would swallow the following characters.
+            gen_printf("\\%03o", c);
+        }
+    }
+    gen_printf("\")");
+}
+
+// Converts to the destination type where C and Opal disagree: booleans are
+// normalized to 0 or 1 and the integer constant 0 becomes a null pointer.
+void gen_expr_as(ast_expr_t * expr, type_t * type)
+{
+    type_t * src = expr->resolved_type;
+    if (gen_is_bool_type(type) && !gen_is_bool_type(src))
+    {
+        gen_printf("!!(");
+        gen_expr(expr);
+        gen_printf(")");
+    }
+    else if (type->kind == TYPE_POINTER && is_integer_type(src))
+    {
+        gen_printf("0");
+    }
+    else
+    {
+        gen_expr_top(expr);
+    }
+}
+
+// Operand of a postfix operator: unary expressions are the only ones
+// emitted without their own parentheses.
+void gen_postfix_operand(ast_expr_t * expr)
+{
+    if (expr->type == AST_EXPR_UNARY_OP)
+    {
+        gen_printf("(");
+        gen_expr(expr);
+        gen_printf(")");
+    }
+    else
+    {
+        gen_expr(expr);
+    }
+}
+
+// Opal operators are spelled as in C, except for ~= which C does not have.
+const char * gen_op_string(token_type_t op)
+{
+    const char * str = token_op_string(op);
+    if (!str || op == TOKEN_TYPE_ASSIGN_NOT)
+    {
+        gen_c_error("Unsupported operator %d", op);
+    }
+    return str;
+}
+
+// Opal keeps the operand type for shifts and unary operators where C
+// promotes narrow operands to int, the result is truncated back.
+bool gen_needs_truncation(type_t * type)
+{
+    return is_integer_type(type) && !gen_is_bool_type(type) && type->size < 4;
+}
+
+void gen_expr_name(ast_expr_t * expr)
+{
+    if (!gen_is_local(expr->name))
+    {
+        sym_t * sym = get_global_sym(expr->name);
+        assert(sym);
+
+        if ((sym->kind == SYM_CONST || sym->kind == SYM_ENUM_CONST) && is_integer_type(sym->type))
+        {
+            gen_int_literal(sym->type, sym->const_value);
+            return;
+        }
+        else if (sym->kind == SYM_CONST)
+        {
+            gen_printf("(");
+            gen_expr_as(sym->decl->const_decl.expr, sym->type);
+            gen_printf(")");
+            return;
+        }
+    }
+
+    gen_printf("%s", gen_name(expr->name));
+}
+
+void gen_expr_unary(ast_expr_t * expr)
+{
+    token_type_t op = expr->unary.op;
+    ast_expr_t * operand = expr->unary.expr;
+    bool truncate = op != TOKEN_TYPE_LOGIC_NOT && op != TOKEN_TYPE_MULT && op != TOKEN_TYPE_AND
+        && gen_needs_truncation(expr->resolved_type);
+
+    if (truncate)
+    {
+        gen_printf("((%s)(", gen_type_name(expr->resolved_type));
+    }
+
+    switch (op)
+    {
+    case TOKEN_TYPE_PLUS: gen_printf("+"); break;
+    case TOKEN_TYPE_MINUS: gen_printf("-"); break;
+    case TOKEN_TYPE_MULT: gen_printf("*"); break;
+    case TOKEN_TYPE_AND: gen_printf("&"); break;
+    default: gen_printf("%s", gen_op_string(op)); break;
+    }
+
+    // Avoids pasting two operators into "--" or "++".
+    if (operand->type == AST_EXPR_UNARY_OP)
+    {
+        gen_printf("(");
+        gen_expr(operand);
+        gen_printf(")");
+    }
+    else
+    {
+        gen_expr(operand);
+    }
+
+    if (truncate)
+    {
+        gen_printf("))");
+    }
+}
+
+// Binary expressions are parenthesized unless they are the whole expression
+// of a statement or an argument.
+void gen_expr_binary(ast_expr_t * expr, bool is_top)
+{
+    token_type_t op = expr->binary.op;
+    type_t * left_type = expr->binary.left->resolved_type;
+    type_t * right_type = expr->binary.right->resolved_type;
+    bool truncate = (op == TOKEN_TYPE_SHL || op == TOKEN_TYPE_SHR) && gen_needs_truncation(expr->resolved_type);
+    bool pointer_diff = op == TOKEN_TYPE_MINUS && left_type->kind == TYPE_POINTER && right_type->kind == TYPE_POINTER;
+
+    bool convert = truncate || pointer_diff;
+
+    if (convert)
+    {
+        gen_printf(is_top ? "(%s)(" : "((%s)(", gen_type_name(expr->resolved_type));
+    }
+    else if (!is_top)
+    {
+        gen_printf("(");
+    }
+
+    gen_expr(expr->binary.left);
+    gen_printf(" %s ", gen_op_string(op));
+    gen_expr(expr->binary.right);
+
+    if (convert)
+    {
+        gen_printf(is_top ? ")" : "))");
+    }
+    else if (!is_top)
+    {
+        gen_printf(")");
+    }
+}
+
+void gen_compound_fields(ast_expr_t * expr, type_t * type)
+{
+    if (expr->compound.num_args == 0)
+    {
+        gen_printf("{ 0 }");
+        return;
+    }
+
+    gen_printf("{ ");
+    int32_t index = 0;
+    for (int32_t i = 0; i < expr->compound.num_args; ++i)
+    {
+        ast_cmpnd_field_t * field = expr->compound.args[i];
+        type_t * field_type = NULL;
+
+        if (i > 0)
+        {
+            gen_printf(", ");
+        }
+
+        if (type->kind == TYPE_ARRAY)
+        {
+            field_type = type->array.base;
+            if (field->type == AST_CMPND_FIELD_INDEX)
+            {
+                gen_printf("[");
+                gen_expr(field->index_expr);
+                gen_printf("] = ");
+            }
+        }
+        else
+        {
+            if (field->type == AST_CMPND_FIELD_FIELD)
+            {
+                index = find_field_index(type, field->field_name);
+                gen_printf(".%s = ", gen_name(field->field_name));
+            }
+            field_type = type->aggregate.fields[index].type;
+        }
+        index++;
+
+        gen_initializer(field->expr, field_type);
+    }
+    gen_printf(" }");
+}
+
+// Initializers of declarations use plain brace lists, which are constant
+// expressions unlike compound literals and are the only way to initialize
+// an array in C.
+void gen_initializer(ast_expr_t * expr, type_t * type)
+{
+    if (expr->type == AST_EXPR_COMPOUND)
+    {
+        gen_compound_fields(expr, expr->resolved_type);
+        return;
+    }
+    else if (expr->type == AST_EXPR_NAME && !gen_is_local(expr->name))
+    {
+        sym_t * sym = get_global_sym(expr->name);
+        if (sym->kind == SYM_CONST && !is_integer_type(sym->type))
+        {
+            gen_initializer(sym->decl->const_decl.expr, sym->type);
+            return;
+        }
+    }
+    gen_expr_as(expr, type);
+}
+
+void gen_expr(ast_expr_t * expr)
+{
+    switch (expr->type)
+    {
+    case AST_EXPR_INTEGER:
+        gen_int_literal(expr->resolved_type, expr->int_value);
+        break;
+    case AST_EXPR_FLOAT:
+        gen_float_literal(expr->float_value.value, expr->float_value.is_f32);
+        break;
+    case AST_EXPR_STRING:
+        gen_string_literal(expr->string_value.str, expr->string_value.length);
+        break;
+    case AST_EXPR_NAME:
+        gen_expr_name(expr);
+        break;
+    case AST_EXPR_UNARY_OP:
+        gen_expr_unary(expr);
+        break;
+    case AST_EXPR_BINARY_OP:
+        gen_expr_binary(expr, false);
+        break;
+    case AST_EXPR_TERNARY:
+        gen_printf("(");
+        gen_expr(expr->ternary.condition);
+        gen_printf(" ? ");
+        gen_expr_as(expr->ternary.then_expr, expr->resolved_type);
+        gen_printf(" : ");
+        gen_expr_as(expr->ternary.else_expr, expr->resolved_type);
+        gen_printf(")");
+        break;
+    case AST_EXPR_CAST:
+        gen_printf("((");
+        gen_type(expr->resolved_type, "");
+        gen_printf(")");
+        if (gen_is_bool_type(expr->resolved_type) && !gen_is_bool_type(expr->cast.expr->resolved_type))
+        {
+            gen_printf("!!(");
+            gen_expr_top(expr->cast.expr);
+            gen_printf(")");
+        }
+        else
+        {
+            gen_expr(expr->cast.expr);
+        }
+        gen_printf(")");
+        break;
+    case AST_EXPR_INVOKE:
+        {
+            type_t * fn_type = expr->invoke.expr->resolved_type;
+            gen_postfix_operand(expr->invoke.expr);
+            gen_printf("(");
+            for (int32_t i = 0; i < expr->invoke.num_args; ++i)
+            {
+                gen_printf("%s", i > 0 ? ", " : "");
+                gen_expr_as(expr->invoke.args[i], fn_type->fn.params[i]);
+            }
+            gen_printf(")");
+        }
+        break;
+    case AST_EXPR_INDEX:
+        gen_postfix_operand(expr->index.expr);
+        gen_printf("[");
+        gen_expr_top(expr->index.index_expr);
+        gen_printf("]");
+        break;
+    case AST_EXPR_FIELD:
+        gen_postfix_operand(expr->field.expr);
+        gen_printf("%s", expr->field.expr->resolved_type->kind == TYPE_POINTER ? "->" : ".");
+        gen_printf("%s", gen_name(expr->field.name));
+        break;
+    case AST_EXPR_COMPOUND:
+        gen_printf("(");
+        gen_type(expr->resolved_type, "");
+        gen_printf(")");
+        gen_compound_fields(expr, expr->resolved_type);
+        break;
+    }
+}
+
+void gen_expr_top(ast_expr_t * expr)
+{
+    if (expr->type == AST_EXPR_BINARY_OP)
+    {
+        gen_expr_binary(expr, true);
+    }
+    else
+    {
+        gen_expr(expr);
+    }
+}
+
+// Whether the expression can initialize a global in C, which only accepts
+// constant expressions and addresses of globals.
+bool gen_is_static_expr(ast_expr_t * expr)
+{
+    switch (expr->type)
+    {
+    case AST_EXPR_INTEGER:
+    case AST_EXPR_FLOAT:
+    case AST_EXPR_STRING:
+        return true;
+    case AST_EXPR_NAME:
+        {
+            sym_t * sym = get_global_sym(expr->name);
+            if (sym->kind == SYM_CONST && !is_integer_type(sym->type))
+            {
+                return gen_is_static_expr(sym->decl->const_decl.expr);
+            }
+            return sym->kind != SYM_VAR;
+        }
+    case AST_EXPR_UNARY_OP:
+        if (expr->unary.op == TOKEN_TYPE_AND)
+        {
+            return expr->unary.expr->type == AST_EXPR_NAME;
+        }
+        return expr->unary.op != TOKEN_TYPE_MULT && gen_is_static_expr(expr->unary.expr);
+    case AST_EXPR_BINARY_OP:
+        return gen_is_static_expr(expr->binary.left) && gen_is_static_expr(expr->binary.right);
+    case AST_EXPR_TERNARY:
+        return is_arithmetic_type(expr->resolved_type)
+            && gen_is_static_expr(expr->ternary.condition)
+            && gen_is_static_expr(expr->ternary.then_expr)
+            && gen_is_static_expr(expr->ternary.else_expr);
+    case AST_EXPR_CAST:
+        return gen_is_static_expr(expr->cast.expr);
+    case AST_EXPR_COMPOUND:
+        for (int32_t i = 0; i < expr->compound.num_args; ++i)
+        {
+            if (!gen_is_static_expr(expr->compound.args[i]->expr))
+            {
+                return false;
+            }
+        }
+        return true;
+    case AST_EXPR_INVOKE:
+    case AST_EXPR_INDEX:
+    case AST_EXPR_FIELD:
+        return false;
+    }
+    return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Statements
+////////////////////////////////////////////////////////////////////////////////
+
+void gen_stmt_block(ast_stmt_block_t * block);
+
+// Arrays cannot be assigned in C, they are copied with opal_copy instead.
+void gen_array_copy(const char * dest, ast_expr_t * dest_expr, ast_expr_t * src)
+{
+    gen_printf("opal_copy(");
+    if (dest)
+    {
+        gen_printf("%s", dest);
+    }
+    else
+    {
+        gen_expr(dest_expr);
+    }
+    gen_printf(", ");
+    gen_expr_top(src);
+    gen_printf(", %lld)", (long long)src->resolved_type->size);
+}
+
+void gen_local_decl(ast_decl_t * decl)
+{
+    type_t * type = decl->var_decl.type->resolved_type;
+    ast_expr_t * init = decl->var_decl.expr;
+    const char * name = gen_name(decl->name);
+
+    gen_type(type, name);
+    if (type->kind == TYPE_ARRAY && init && init->type != AST_EXPR_COMPOUND)
+    {
+        gen_printf("; ");
+        gen_array_copy(name, NULL, init);
+    }
+    else if (init)
+    {
+        gen_printf(" = ");
+        gen_initializer(init, type);
+    }
+    else
+    {
+        gen_printf("%s", type->kind == TYPE_ARRAY || type->kind == TYPE_STRUCT || type->kind == TYPE_UNION ? " = { 0 }" : " = 0");
+    }
+
+    gen_push_local(decl->name);
+}
+
+// Emitted without the trailing semicolon so it can be used in the header of
+// a for loop.
+void gen_simple_stmt(ast_simple_stmt_t * stmt)
+{
+    switch (stmt->type)
+    {
+    case AST_SIMPLE_STMT_VAR_DECL:
+        gen_local_decl(stmt->var_decl);
+        break;
+    case AST_SIMPLE_STMT_CONST_DECL:
+        gen_local_decl(stmt->const_decl);
+        break;
+    case AST_SIMPLE_STMT_ASSIGN:
+        {
+            type_t * type = stmt->assign.left->resolved_type;
+            if (stmt->assign.op == TOKEN_TYPE_ASSIGN_NOT)
+            {
+                gen_c_error("Unsupported assignment operator");
+            }
+
+            if (type->kind == TYPE_ARRAY)
+            {
+                gen_array_copy(NULL, stmt->assign.left, stmt->assign.right);
+            }
+            else
+            {
+                gen_expr(stmt->assign.left);
+                gen_printf(" %s ", gen_op_string(stmt->assign.op));
+                if (stmt->assign.op == TOKEN_TYPE_ASSIGN)
+                {
+                    gen_expr_as(stmt->assign.right, type);
+                }
+                else
+                {
+                    gen_expr_top(stmt->assign.right);
+                }
+            }
+        }
+        break;
+    case AST_SIMPLE_STMT_INCREMENT:
+        gen_postfix_operand(stmt->expr);
+        gen_printf("++");
+        break;
+    case AST_SIMPLE_STMT_DECREMENT:
+        gen_postfix_operand(stmt->expr);
+        gen_printf("--");
+        break;
+    case AST_SIMPLE_STMT_EXPR:
+        gen_expr_top(stmt->expr);
+        break;
+    }
+}
+
+void gen_push_loop(void)
+{
+    if (gen_loop_depth >= GEN_MAX_LOOP_DEPTH)
+    {
+        gen_c_error("Loops nested too deeply");
+    }
+    gen_loops[gen_loop_depth++] = (gen_loop_t){ .label = gen_label_count++, .switch_depth = gen_switch_depth };
+}
+
+void gen_pop_loop(void)
+{
+    gen_loop_t * loop = &gen_loops[--gen_loop_depth];
+    if (loop->needs_break_label)
+    {
+        gen_newline();
+        gen_printf("opal_break_%d:;", loop->label);
+    }
+}
+
+void gen_for_stmt(ast_stmt_t * stmt)
+{
+    int32_t saved_locals = sb_len(gen_locals);
+    bool inline_init = stmt->for_stmt.num_init_stmts <= 1;
+
+    if (stmt->for_stmt.num_init_stmts == 1)
+    {
+        ast_simple_stmt_t * init = stmt->for_stmt.init_stmts[0];
+        if (init->type == AST_SIMPLE_STMT_VAR_DECL || init->type == AST_SIMPLE_STMT_CONST_DECL)
+        {
+            type_t * type = init->var_decl->var_decl.type->resolved_type;
+            ast_expr_t * expr = init->var_decl->var_decl.expr;
+            inline_init = type->kind != TYPE_ARRAY || !expr || expr->type == AST_EXPR_COMPOUND;
+        }
+    }
+
+    if (!inline_init)
+    {
+        gen_printf("{");
+        gen_indent++;
+        for (int32_t i = 0; i < stmt->for_stmt.num_init_stmts; ++i)
+        {
+            gen_newline();
+            gen_simple_stmt(stmt->for_stmt.init_stmts[i]);
+            gen_printf(";");
+        }
+        gen_newline();
+    }
+
+    gen_printf("for (");
+    if (inline_init && stmt->for_stmt.num_init_stmts == 1)
+    {
+        gen_simple_stmt(stmt->for_stmt.init_stmts[0]);
+    }
+    gen_printf(";");
+    if (stmt->for_stmt.condition)
+    {
+        gen_printf(" ");
+        gen_expr_top(stmt->for_stmt.condition);
+    }
+    gen_printf(";");
+    for (int32_t i = 0; i < stmt->for_stmt.num_incr_stmts; ++i)
+    {
+        ast_simple_stmt_t * incr = stmt->for_stmt.incr_stmts[i];
+        if (incr->type == AST_SIMPLE_STMT_VAR_DECL || incr->type == AST_SIMPLE_STMT_CONST_DECL)
+        {
+            gen_c_error("Declarations are not supported in the increment of a for loop");
+        }
+        gen_printf("%s", i > 0 ? ", " : " ");
+        gen_simple_stmt(incr);
+    }
+    gen_printf(")");
+
+    gen_push_loop();
+    gen_newline();
+    gen_stmt_block(stmt->for_stmt.stmt_block);
+    gen_pop_loop();
+
+    if (!inline_init)
+    {
+        gen_indent--;
+        gen_newline();
+        gen_printf("}");
+    }
+    gen_pop_locals(saved_locals);
+}
+
+void gen_case_value(ast_switch_case_literal_t * lit)
+{
+    if (lit->type == AST_CASE_LITERAL_INTEGER)
+    {
+        gen_int_literal(type_of_int_literal((int64_t)lit->integer), (int64_t)lit->integer);
+        return;
+    }
+
+    if (gen_is_local(lit->name))
+    {
+        gen_c_error("Local constant '%s' used as a case value is not supported by the C backend", lit->name);
+    }
+    sym_t * sym = get_global_sym(lit->name);
+    gen_int_literal(sym->type, sym->const_value);
+}
+
+void gen_switch_stmt(ast_stmt_t * stmt)
+{
+    gen_printf("switch (");
+    gen_expr_top(stmt->switch_stmt.expr);
+    gen_printf(")");
+    gen_newline();
+    gen_printf("{");
+    gen_switch_depth++;
+
+    for (int32_t i = 0; i < stmt->switch_stmt.num_items; ++i)
+    {
+        ast_switch_item_t * item = stmt->switch_stmt.items[i];
+        for (int32_t j = 0; j < item->num_values; ++j)
+        {
+            gen_newline();
+            gen_printf("case ");
+            gen_case_value(item->values[j]);
+            gen_printf(":");
+        }
+        if (item->num_values == 0)
+        {
+            gen_newline();
+            gen_printf("default:");
+        }
+
+        gen_indent++;
+        gen_newline();
+        gen_stmt_block(item->stmt_block);
+        gen_newline();
+        gen_printf("break;");
+        gen_indent--;
+    }
+
+    gen_switch_depth--;
+    gen_newline();
+    gen_printf("}");
+}
+
+void gen_stmt(ast_stmt_t * stmt)
+{
+    switch (stmt->type)
+    {
+    case AST_STMT_IF:
+        for (int32_t i = 0; i < stmt->if_stmt.num_conditions; ++i)
+        {
+            gen_printf("%s", i > 0 ? "else if (" : "if (");
+            gen_expr_top(stmt->if_stmt.conditions[i]);
+            gen_printf(")");
+            gen_newline();
+            gen_stmt_block(stmt->if_stmt.stmt_blocks[i]);
+            if (i + 1 < stmt->if_stmt.num_conditions || stmt->if_stmt.else_stmt_block)
+            {
+                gen_newline();
+            }
+        }
+        if (stmt->if_stmt.else_stmt_block)
+        {
+            gen_printf("else");
+            gen_newline();
+            gen_stmt_block(stmt->if_stmt.else_stmt_block);
+        }
+        break;
+    case AST_STMT_WHILE:
+        gen_printf("while (");
+        gen_expr_top(stmt->while_stmt.condition);
+        gen_printf(")");
+        gen_push_loop();
+        gen_newline();
+        gen_stmt_block(stmt->while_stmt.stmt_block);
+        gen_pop_loop();
+        break;
+    case AST_STMT_FOR:
+        gen_for_stmt(stmt);
+        break;
+    case AST_STMT_SWITCH:
+        gen_switch_stmt(stmt);
+        break;
+    case AST_STMT_RETURN:
+        if (stmt->return_stmt)
+        {
+            gen_printf("return ");
+            gen_expr_as(stmt->return_stmt, gen_return_type);
+            gen_printf(";");
+        }
+        else
+        {
+            gen_printf("return;");
+        }
+        break;
+    case AST_STMT_CONTINUE:
+        gen_printf("continue;");
+        break;
+    case AST_STMT_BREAK:
+        {
+            gen_loop_t * loop = &gen_loops[gen_loop_depth - 1];
+            if (gen_switch_depth > loop->switch_depth)
+            {
+                loop->needs_break_label = true;
+                gen_printf("goto opal_break_%d;", loop->label);
+            }
+            else
+            {
+                gen_printf("break;");
+            }
+        }
+        break;
+    case AST_STMT_BLOCK:
+        gen_stmt_block(stmt->stmt_block);
+        break;
+    case AST_STMT_SIMPLE:
+        gen_simple_stmt(stmt->simple_stmt);
+        gen_printf(";");
+        break;
+    }
+}
+
+void gen_stmt_block(ast_stmt_block_t * block)
+{
+    int32_t saved_locals = sb_len(gen_locals);
+    gen_printf("{");
+    gen_indent++;
+    for (int32_t i = 0; i < block->num_stmts; ++i)
+    {
+        gen_newline();
+        gen_stmt(block->stmts[i]);
+    }
+    gen_indent--;
+    gen_newline();
+    gen_printf("}");
+    gen_pop_locals(saved_locals);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Declarations
+////////////////////////////////////////////////////////////////////////////////
+
+void gen_fn_header(ast_decl_t * decl)
+{
+    type_t * type = decl->sym->type;
+    sb_t(char) params = NULL;
+
+    if (type->fn.return_type->kind == TYPE_ARRAY)
+    {
+        gen_c_error("Function '%s' returns an array, which C does not support", decl->name);
+    }
+
+    for (int32_t i = 0; i < decl->fn_decl.num_params; ++i)
+    {
+        type_t * param_type = type->fn.params[i];
+        if (param_type->kind == TYPE_ARRAY)
+        {
+            gen_c_error("Parameter '%s' of '%s' is an array, which C does not pass by value",
+                decl->fn_decl.params[i]->name, decl->name);
+        }
+
+        char * param = gen_type_decl(param_type, gen_name(decl->fn_decl.params[i]->name));
+        gen_append(&params, i > 0 ? ", " : "");
+        gen_append(&params, param);
+        free(param);
+    }
+
+    char * declarator = gen_strf("%s(%s)", gen_name(decl->name), params ? params : "void");
+    gen_type(type->fn.return_type, declarator);
+    free(declarator);
+    sb_free(params);
+}
+
+void gen_fn(ast_decl_t * decl)
+{
+    trace_begin("gen_fn");
+    gen_fn_header(decl);
+    gen_newline();
+
+    for (int32_t i = 0; i < decl->fn_decl.num_params; ++i)
+    {
+        gen_push_local(decl->fn_decl.params[i]->name);
+    }
+
+    gen_return_type = decl->sym->type->fn.return_type;
+    gen_loop_depth = 0;
+    gen_switch_depth = 0;
+    gen_stmt_block(decl->fn_decl.stmt_block);
+    gen_return_type = NULL;
+    gen_pop_locals(0);
+
+    gen_newline();
+    gen_newline();
+    trace_end(decl->name);
+}
+
+void gen_global_var(ast_decl_t * decl)
+{
+    ast_expr_t * init = decl->var_decl.expr;
+    gen_type(decl->sym->type, gen_name(decl->name));
+
+    if (init && gen_is_static_expr(init))
+    {
+        gen_printf(" = ");
+        gen_initializer(init, decl->sym->type);
+    }
+    else if (init)
+    {
+        sb_push(gen_deferred_inits, decl);
+    }
+
+    gen_printf(";");
+    gen_newline();
+}
+
+void gen_init_fn(void)
+{
+    gen_printf("void opal_init(void)");
+    gen_newline();
+    gen_printf("{");
+    gen_indent++;
+
+    for (ast_decl_t ** it = gen_deferred_inits; it != sb_end(gen_deferred_inits); ++it)
+    {
+        ast_decl_t * decl = *it;
+        type_t * type = decl->sym->type;
+        gen_newline();
+
+        if (type->kind == TYPE_ARRAY)
+        {
+            gen_array_copy(gen_name(decl->name), NULL, decl->var_decl.expr);
+        }
+        else
+        {
+            gen_printf("%s = ", gen_name(decl->name));
+            if (decl->var_decl.expr->type == AST_EXPR_COMPOUND)
+            {
+                gen_expr(decl->var_decl.expr);
+            }
+            else
+            {
+                gen_expr_as(decl->var_decl.expr, type);
+            }
+        }
+        gen_printf(";");
+    }
+
+    gen_indent--;
+    gen_newline();
+    gen_printf("}");
+    gen_newline();
+    gen_newline();
+}
+
+void gen_main_fn(ast_decl_t * decl)
+{
+    type_t * type = decl->sym->type;
+    if (type->fn.num_params != 0 || (type->fn.return_type != type_void && !is_integer_type(type->fn.return_type)))
+    {
+        gen_c_error("'main' must take no parameters and return an integer or nothing");
+    }
+
+    gen_printf("int main(void)");
+    gen_newline();
+    gen_printf("{");
+    gen_indent++;
+    if (gen_deferred_inits)
+    {
+        gen_newline();
+        gen_printf("opal_init();");
+    }
+    gen_newline();
+    if (type->fn.return_type == type_void)
+    {
+        gen_printf("%s();", gen_name(decl->name));
+        gen_newline();
+        gen_printf("return 0;");
+    }
+    else
+    {
+        gen_printf("return (int)%s();", gen_name(decl->name));
+    }
+    gen_indent--;
+    gen_newline();
+    gen_printf("}");
+    gen_newline();
+}
+
+const char * gen_prelude =
+    "// Generated by opal, do not edit.\n"
+    "#include <stdint.h>\n"
+    "\n"
+    "static inline void opal_copy(void * dest, const void * src, uint64_t size)\n"
+    "{\n"
+    "    for (uint64_t i = 0; i < size; ++i)\n"
+    "    {\n"
+    "        ((uint8_t *)dest)[i] = ((const uint8_t *)src)[i];\n"
+    "    }\n"
+    "}\n"
+    "\n";
+
+// Everything is checked first. The output then follows the order C needs:
+// type names, aggregate definitions, prototypes, globals and function bodies.
+void gen_c_code(sb_t(ast_decl_t *) decls, buf_t * out)
+{
+    gen_out = out;
+    gen_indent = 0;
+    gen_label_count = 0;
+    gen_locals = NULL;
+    gen_deferred_inits = NULL;
+    map_free(&gen_defined_types);
+    gen_init_reserved_names();
+
+    ast_decl_t * main_decl = NULL;
+    for (ast_decl_t ** it = decls; it != sb_end(decls); ++it)
+    {
+        check_sym((*it)->sym);
+        if ((*it)->type == AST_DECL_FN && (*it)->name == intern_string("main"))
+        {
+            main_decl = *it;
+        }
+    }
+
+    gen_printf("%s", gen_prelude);
+
+    for (ast_decl_t ** it = decls; it != sb_end(decls); ++it)
+    {
+        ast_decl_t * decl = *it;
+        if (decl->type == AST_DECL_ENUM)
+        {
+            gen_printf("typedef %s %s;", gen_type_name(decl->sym->type->enum_type.base), gen_name(decl->name));
+            gen_newline();
+        }
+        else if (decl->type == AST_DECL_STRUCT || decl->type == AST_DECL_UNION)
+        {
+            const char * keyword = decl->type == AST_DECL_STRUCT ? "struct" : "union";
+            gen_printf("typedef %s %s %s;", keyword, gen_name(decl->name), gen_name(decl->name));
+            gen_newline();
+        }
+    }
+    gen_newline();
+
+    for (ast_decl_t ** it = decls; it != sb_end(decls); ++it)
+    {
+        if ((*it)->type == AST_DECL_STRUCT || (*it)->type == AST_DECL_UNION)
+        {
+            gen_aggregate((*it)->sym->type);
+        }
+    }
+
+    for (ast_decl_t ** it = decls; it != sb_end(decls); ++it)
+    {
+        if ((*it)->type == AST_DECL_FN)
+        {
+            gen_fn_header(*it);
+            gen_printf(";");
+            gen_newline();
+        }
+    }
+    gen_newline();
+
+    for (ast_decl_t ** it = decls; it != sb_end(decls); ++it)
+    {
+        if ((*it)->type == AST_DECL_VAR)
+        {
+            gen_global_var(*it);
+        }
+    }
+    gen_newline();
+
+    if (gen_deferred_inits)
+    {
+        gen_init_fn();
+    }
+
+    for (ast_decl_t ** it = decls; it != sb_end(decls); ++it)
+    {
+        if ((*it)->type == AST_DECL_FN)
+        {
+            gen_fn(*it);
+        }
+    }
+
+    if (main_decl)
+    {
+        gen_main_fn(main_decl);
+    }
+
+    sb_free(gen_locals);
+    sb_free(gen_deferred_inits);
+    gen_out = NULL;
+}
+
+void test_gen_c(void)
+{
+    init_resolver();
+    init_parser(
+        "enum color : u8 { RED, GREEN, BLUE }"
+        "struct node { next: node*; inner: pair; }"
+        "struct pair { a: i32; b: i32[2]; }"
+        "var head: node;"
+        "var total: i32 = 3;"
+        "var tail: node* = &head;"
+        "var count: i32 = twice(2);"
+        "fn twice(x: i32): i32 { return x * 2; }"
+        "fn int(x: u8): u8 { return x << 2; }"
+        "fn find(c: color): i32 {"
+        "   for (var i: i32 = 0; i < 10; i++) { switch (i) { 3 -> { break; } otherwise -> {} } }"
+        "   while (true) { if (c == BLUE) { continue; } break; }"
+        "   return -(-total);"
+        "}"
+        "fn main(): i32 { return find(GREEN); }"
+    );
+    sb_t(ast_decl_t *) decls = parse_document();
+    resolve_add_decls(decls);
+    buf_t buf = { 0 };
+    gen_c_code(decls, &buf);
+    char * code = buf_string(&buf);
+
+    assert(strstr(code, "typedef uint8_t color;"));
+    assert(strstr(code, "typedef struct node node;"));
+    assert(strstr(code, "struct pair\n{\n    int32_t a;\n    int32_t b[2];\n};"));
+    assert(strstr(code, "struct pair") < strstr(code, "struct node\n"));
+    assert(strstr(code, "int32_t total = 3;"));
+    assert(strstr(code, "node *tail = &head;"));
+    assert(strstr(code, "count = twice(2);"));
+    assert(strstr(code, "uint8_t int_(uint8_t x)"));
+    assert(strstr(code, "return (uint8_t)(x << 2);"));
+    assert(strstr(code, "goto opal_break_0;"));
+    assert(strstr(code, "opal_break_0:;"));
+    assert(strstr(code, "if (c == ((color)2))"));
+    assert(strstr(code, "-(-total)"));
+    assert(strstr(code, "find(((color)1))"));
+    assert(strstr(code, "opal_init();"));
+    assert(strstr(code, "return (int)main_();"));
+    free(code);
+    buf_free(&buf);
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "common.h"
+#include "ast.h"
+
+// Emits a self-contained C99 translation unit for the given declarations.
+// Global initializers that are not constant expressions in C are run by a
+// generated opal_init function; when the program declares a main function
+// a C main calling opal_init first is generated as well.
+void gen_c_code(sb_t(ast_decl_t *) decls, buf_t * out);
+void test_gen_c(void);
@@ -0,0 +1,1048 @@
+#include "iface.h"
+#include "parse.h"
+#include "print.h"
+#include "common.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+enum
+{
+    // Bump whenever the encoding or the AST changes.
+    IFACE_VERSION = 3
+};
+
+// The header is followed by the string table, a length prefixed entry per
+// distinct name, and then the declarations as a preorder stream of 32-bit
+// tags, counts and string indices. Each name is interned once per load
+// however often the module uses it. Nothing is aligned, all values are read
+// with memcpy in the byte order of the machine that wrote them; a file from
+// another byte order fails the version check. payload_hash covers everything
+// after the header, so a damaged file is a cache miss and not a wrong AST.
+typedef struct iface_header_t
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t num_token_types;
+    uint32_t num_strings;
+    uint64_t source_hash;
+    uint64_t payload_hash;
+    uint64_t strings_size;
+    uint64_t nodes_size;
+} iface_header_t;
+
+typedef struct iface_writer_t
+{
+    buf_t nodes;
+    map_t string_indices;
+    sb_t(const char *) strings;
+} iface_writer_t;
+
+typedef struct iface_reader_t
+{
+    const char * data;
+    uint64_t size;
+    uint64_t pos;
+    const char ** strings;
+    uint32_t num_strings;
+    bool error;
+} iface_reader_t;
+
+////////////////////////////////////////////////////////////////////////////////
+// Writing
+////////////////////////////////////////////////////////////////////////////////
+
+void iface_put_u32(iface_writer_t * w, uint32_t value)
+{
+    buf_write(&w->nodes, &value, sizeof(value));
+}
+
+void iface_put_i64(iface_writer_t * w, int64_t value)
+{
+    buf_write(&w->nodes, &value, sizeof(value));
+}
+
+void iface_put_f64(iface_writer_t * w, double value)
+{
+    buf_write(&w->nodes, &value, sizeof(value));
+}
+
+// Names are interned, so the pointer identifies the string. Index 0 is NULL.
+void iface_put_string(iface_writer_t * w, const char * str)
+{
+    if (!str)
+    {
+        iface_put_u32(w, 0);
+        return;
+    }
+
+    uintptr_t index = (uintptr_t)map_get(&w->string_indices, str);
+    if (!index)
+    {
+        sb_push(w->strings, str);
+        index = sb_len(w->strings);
+        map_put(&w->string_indices, str, (void *)index);
+    }
+    iface_put_u32(w, (uint32_t)index);
+}
+
+void iface_put_expr(iface_writer_t * w, ast_expr_t * expr);
+void iface_put_stmt_block(iface_writer_t * w, ast_stmt_block_t * block);
+void iface_put_decl(iface_writer_t * w, ast_decl_t * decl);
+
+// Nodes start with their type + 1 as tag, a 0 tag stands for NULL.
+void iface_put_typespec(iface_writer_t * w, ast_typespec_t * typespec)
+{
+    if (!typespec)
+    {
+        iface_put_u32(w, 0);
+        return;
+    }
+
+    iface_put_u32(w, typespec->type + 1);
+    switch (typespec->type)
+    {
+    case AST_TYPESPEC_NAME:
+        iface_put_string(w, typespec->name);
+        break;
+    case AST_TYPESPEC_ARRAY:
+        iface_put_typespec(w, typespec->array.base);
+        iface_put_expr(w, typespec->array.size_expr);
+        break;
+    case AST_TYPESPEC_POINTER:
+        iface_put_typespec(w, typespec->pointer.base);
+        break;
+    case AST_TYPESPEC_FN:
+        iface_put_u32(w, typespec->fn.num_args);
+        for (int32_t i = 0; i < typespec->fn.num_args; ++i)
+        {
+            iface_put_typespec(w, typespec->fn.args[i]);
+        }
+        iface_put_typespec(w, typespec->fn.return_type);
+        break;
+    }
+}
+
+void iface_put_expr(iface_writer_t * w, ast_expr_t * expr)
+{
+    if (!expr)
+    {
+        iface_put_u32(w, 0);
+        return;
+    }
+
+    iface_put_u32(w, expr->type + 1);
+    switch (expr->type)
+    {
+    case AST_EXPR_TERNARY:
+        iface_put_expr(w, expr->ternary.condition);
+        iface_put_expr(w, expr->ternary.then_expr);
+        iface_put_expr(w, expr->ternary.else_expr);
+        break;
+    case AST_EXPR_BINARY_OP:
+        iface_put_u32(w, expr->binary.op);
+        iface_put_expr(w, expr->binary.left);
+        iface_put_expr(w, expr->binary.right);
+        break;
+    case AST_EXPR_UNARY_OP:
+        iface_put_u32(w, expr->unary.op);
+        iface_put_expr(w, expr->unary.expr);
+        break;
+    case AST_EXPR_CAST:
+        iface_put_typespec(w, expr->cast.type);
+        iface_put_expr(w, expr->cast.expr);
+        break;
+    case AST_EXPR_INVOKE:
+        iface_put_expr(w, expr->invoke.expr);
+        iface_put_u32(w, expr->invoke.num_args);
+        for (int32_t i = 0; i < expr->invoke.num_args; ++i)
+        {
+            iface_put_expr(w, expr->invoke.args[i]);
+        }
+        break;
+    case AST_EXPR_INDEX:
+        iface_put_expr(w, expr->index.expr);
+        iface_put_expr(w, expr->index.index_expr);
+        break;
+    case AST_EXPR_FIELD:
+        iface_put_expr(w, expr->field.expr);
+        iface_put_string(w, expr->field.name);
+        break;
+    case AST_EXPR_COMPOUND:
+        iface_put_typespec(w, expr->compound.type);
+        iface_put_u32(w, expr->compound.num_args);
+        for (int32_t i = 0; i < expr->compound.num_args; ++i)
+        {
+            ast_cmpnd_field_t * field = expr->compound.args[i];
+            iface_put_u32(w, field->type);
+            iface_put_expr(w, field->expr);
+            if (field->type == AST_CMPND_FIELD_FIELD)
+            {
+                iface_put_string(w, field->field_name);
+            }
+            else if (field->type == AST_CMPND_FIELD_INDEX)
+            {
+                iface_put_expr(w, field->index_expr);
+            }
+        }
+        break;
+    case AST_EXPR_NAME:
+        iface_put_string(w, expr->name);
+        break;
+    case AST_EXPR_STRING:
+        iface_put_i64(w, expr->string_value.length);
+        buf_write(&w->nodes, expr->string_value.str, expr->string_value.length);
+        break;
+    case AST_EXPR_INTEGER:
+        iface_put_i64(w, expr->int_value);
+        break;
+    case AST_EXPR_FLOAT:
+        iface_put_f64(w, expr->float_value.value);
+        iface_put_u32(w, expr->float_value.is_f32);
+        break;
+    }
+}
+
+void iface_put_simple_stmt(iface_writer_t * w, ast_simple_stmt_t * stmt)
+{
+    if (!stmt)
+    {
+        iface_put_u32(w, 0);
+        return;
+    }
+
+    iface_put_u32(w, stmt->type + 1);
+    switch (stmt->type)
+    {
+    case AST_SIMPLE_STMT_VAR_DECL:
+        iface_put_decl(w, stmt->var_decl);
+        break;
+    case AST_SIMPLE_STMT_CONST_DECL:
+        iface_put_decl(w, stmt->const_decl);
+        break;
+    case AST_SIMPLE_STMT_ASSIGN:
+        iface_put_u32(w, stmt->assign.op);
+        iface_put_expr(w, stmt->assign.left);
+        iface_put_expr(w, stmt->assign.right);
+        break;
+    case AST_SIMPLE_STMT_DECREMENT:
+    case AST_SIMPLE_STMT_INCREMENT:
+    case AST_SIMPLE_STMT_EXPR:
+        iface_put_expr(w, stmt->expr);
+        break;
+    }
+}
+
+void iface_put_simple_stmt_list(iface_writer_t * w, sb_t(ast_simple_stmt_t *) stmts, int32_t num_stmts)
+{
+    iface_put_u32(w, num_stmts);
+    for (int32_t i = 0; i < num_stmts; ++i)
+    {
+        iface_put_simple_stmt(w, stmts[i]);
+    }
+}
+
+void iface_put_stmt(iface_writer_t * w, ast_stmt_t * stmt)
+{
+    iface_put_u32(w, stmt->type + 1);
+    switch (stmt->type)
+    {
+    case AST_STMT_IF:
+        iface_put_u32(w, stmt->if_stmt.num_conditions);
+        for (int32_t i = 0; i < stmt->if_stmt.num_conditions; ++i)
+        {
+            iface_put_expr(w, stmt->if_stmt.conditions[i]);
+            iface_put_stmt_block(w, stmt->if_stmt.stmt_blocks[i]);
+        }
+        iface_put_stmt_block(w, stmt->if_stmt.else_stmt_block);
+        break;
+    case AST_STMT_WHILE:
+        iface_put_expr(w, stmt->while_stmt.condition);
+        iface_put_stmt_block(w, stmt->while_stmt.stmt_block);
+        break;
+    case AST_STMT_FOR:
+        iface_put_simple_stmt_list(w, stmt->for_stmt.init_stmts, stmt->for_stmt.num_init_stmts);
+        iface_put_expr(w, stmt->for_stmt.condition);
+        iface_put_simple_stmt_list(w, stmt->for_stmt.incr_stmts, stmt->for_stmt.num_incr_stmts);
+        iface_put_stmt_block(w, stmt->for_stmt.stmt_block);
+        break;
+    case AST_STMT_SWITCH:
+        iface_put_expr(w, stmt->switch_stmt.expr);
+        iface_put_u32(w, stmt->switch_stmt.num_items);
+        for (int32_t i = 0; i < stmt->switch_stmt.num_items; ++i)
+        {
+            ast_switch_item_t * item = stmt->switch_stmt.items[i];
+            iface_put_u32(w, item->num_values);
+            for (int32_t j = 0; j < item->num_values; ++j)
+            {
+                ast_switch_case_literal_t * value = item->values[j];
+                iface_put_u32(w, value->type);
+                if (value->type == AST_CASE_LITERAL_NAME)
+                {
+                    iface_put_string(w, value->name);
+                }
+                else
+                {
+                    iface_put_i64(w, (int64_t)value->integer);
+                }
+            }
+            iface_put_stmt_block(w, item->stmt_block);
+        }
+        break;
+    case AST_STMT_RETURN:
+        iface_put_expr(w, stmt->return_stmt);
+        break;
+    case AST_STMT_CONTINUE:
+    case AST_STMT_BREAK:
+        break;
+    case AST_STMT_BLOCK:
+        iface_put_stmt_block(w, stmt->stmt_block);
+        break;
+    case AST_STMT_SIMPLE:
+        iface_put_simple_stmt(w, stmt->simple_stmt);
+        break;
+    }
+}
+
+void iface_put_stmt_block(iface_writer_t * w, ast_stmt_block_t * block)
+{
+    if (!block)
+    {
+        iface_put_u32(w, 0);
+        return;
+    }
+
+    iface_put_u32(w, 1);
+    iface_put_u32(w, block->num_stmts);
+    for (int32_t i = 0; i < block->num_stmts; ++i)
+    {
+        iface_put_stmt(w, block->stmts[i]);
+    }
+}
+
+void iface_put_decl(iface_writer_t * w, ast_decl_t * decl)
+{
+    iface_put_u32(w, decl->type + 1);
+    iface_put_string(w, decl->name);
+    switch (decl->type)
+    {
+    case AST_DECL_ENUM:
+        iface_put_typespec(w, decl->enum_decl.base_type);
+        iface_put_u32(w, decl->enum_decl.num_items);
+        for (int32_t i = 0; i < decl->enum_decl.num_items; ++i)
+        {
+            iface_put_string(w, decl->enum_decl.items[i]->name);
+            iface_put_expr(w, decl->enum_decl.items[i]->expr);
+        }
+        break;
+    case AST_DECL_UNION:
+    case AST_DECL_STRUCT:
+        iface_put_u32(w, decl->aggregate_decl.num_items);
+        for (int32_t i = 0; i < decl->aggregate_decl.num_items; ++i)
+        {
+            iface_put_string(w, decl->aggregate_decl.items[i]->name);
+            iface_put_typespec(w, decl->aggregate_decl.items[i]->type);
+        }
+        break;
+    case AST_DECL_VAR:
+    case AST_DECL_CONST:
+        iface_put_typespec(w, decl->var_decl.type);
+        iface_put_expr(w, decl->var_decl.expr);
+        break;
+    case AST_DECL_TYPE:
+        iface_put_typespec(w, decl->type_decl.type);
+        break;
+    case AST_DECL_FN:
+        iface_put_u32(w, decl->fn_decl.num_params);
+        for (int32_t i = 0; i < decl->fn_decl.num_params; ++i)
+        {
+            iface_put_string(w, decl->fn_decl.params[i]->name);
+            iface_put_typespec(w, decl->fn_decl.params[i]->type);
+        }
+        iface_put_typespec(w, decl->fn_decl.return_type);
+        iface_put_stmt_block(w, decl->fn_decl.stmt_block);
+        break;
+    case AST_DECL_IMPORT:
+        break;
+    }
+}
+
+void iface_write(buf_t * out, uint64_t source_hash, sb_t(ast_decl_t *) decls)
+{
+    iface_writer_t w = { 0 };
+    iface_put_u32(&w, sb_len(decls));
+    for (int32_t i = 0; i < sb_len(decls); ++i)
+    {
+        iface_put_decl(&w, decls[i]);
+    }
+
+    iface_header_t header = { .magic = { 'O', 'P', 'L', 'I' } };
+    header.version = IFACE_VERSION;
+    header.num_token_types = TOKEN_TYPE_KW_END_;
+    header.num_strings = sb_len(w.strings);
+    header.source_hash = source_hash;
+    header.nodes_size = w.nodes.length;
+    for (int32_t i = 0; i < sb_len(w.strings); ++i)
+    {
+        header.strings_size += sizeof(uint32_t) + strlen(w.strings[i]);
+    }
+
+    buf_t payload = { 0 };
+    for (int32_t i = 0; i < sb_len(w.strings); ++i)
+    {
+        uint32_t length = (uint32_t)strlen(w.strings[i]);
+        buf_write(&payload, &length, sizeof(length));
+        buf_write(&payload, w.strings[i], length);
+    }
+    for (buf_block_t * it = w.nodes.blocks; it != sb_end(w.nodes.blocks); ++it)
+    {
+        buf_write(&payload, it->data, it->length);
+    }
+    uint64_t payload_size = payload.length;
+    char * payload_data = buf_string(&payload);
+    header.payload_hash = hash_range(payload_data, payload_size);
+
+    buf_write(out, &header, sizeof(header));
+    buf_write(out, payload_data, payload_size);
+
+    free(payload_data);
+    buf_free(&payload);
+    buf_free(&w.nodes);
+    map_free(&w.string_indices);
+    sb_free(w.strings);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Reading
+////////////////////////////////////////////////////////////////////////////////
+
+// Once the data turns out to be truncated or corrupt every further read
+// returns 0, which reads as NULL nodes and empty lists, so decoding winds
+// down quickly and leaves a tree that ast_free_decls can release. Nodes are
+// linked into their parent before their children are read for the same
+// reason.
+void iface_get_bytes(iface_reader_t * r, void * out, uint64_t size)
+{
+    if (r->error || r->size - r->pos < size)
+    {
+        r->error = true;
+        memset(out, 0, size);
+        return;
+    }
+    memcpy(out, r->data + r->pos, size);
+    r->pos += size;
+}
+
+uint32_t iface_get_u32(iface_reader_t * r)
+{
+    uint32_t value;
+    iface_get_bytes(r, &value, sizeof(value));
+    return value;
+}
+
+int64_t iface_get_i64(iface_reader_t * r)
+{
+    int64_t value;
+    iface_get_bytes(r, &value, sizeof(value));
+    return value;
+}
+
+double iface_get_f64(iface_reader_t * r)
+{
+    double value;
+    iface_get_bytes(r, &value, sizeof(value));
+    return value;
+}
+
+uint32_t iface_get_tag(iface_reader_t * r, uint32_t max)
+{
+    uint32_t tag = iface_get_u32(r);
+    if (tag > max)
+    {
+        r->error = true;
+        return 0;
+    }
+    return tag;
+}
+
+// Every list element takes at least four bytes, which bounds the count.
+int32_t iface_get_count(iface_reader_t * r)
+{
+    uint32_t count = iface_get_u32(r);
+    if (count > (r->size - r->pos) / 4)
+    {
+        r->error = true;
+        return 0;
+    }
+    return (int32_t)count;
+}
+
+token_type_t iface_get_op(iface_reader_t * r)
+{
+    uint32_t op = iface_get_u32(r);
+    if (op >= TOKEN_TYPE_KW_START_)
+    {
+        r->error = true;
+        return TOKEN_TYPE_EOF;
+    }
+    return (token_type_t)op;
+}
+
+const char * iface_get_string(iface_reader_t * r)
+{
+    uint32_t index = iface_get_u32(r);
+    if (index > r->num_strings)
+    {
+        r->error = true;
+        return NULL;
+    }
+    return index ? r->strings[index - 1] : NULL;
+}
+
+const char * iface_get_name(iface_reader_t * r)
+{
+    const char * name = iface_get_string(r);
+    if (!name)
+    {
+        r->error = true;
+    }
+    return name;
+}
+
+ast_expr_t * iface_get_expr(iface_reader_t * r);
+ast_stmt_block_t * iface_get_stmt_block(iface_reader_t * r);
+ast_decl_t * iface_get_decl(iface_reader_t * r);
+
+ast_typespec_t * iface_get_typespec(iface_reader_t * r)
+{
+    uint32_t tag = iface_get_tag(r, AST_TYPESPEC_FN + 1);
+    if (!tag)
+    {
+        return NULL;
+    }
+
+    ast_typespec_t * typespec = ast_new_typespec(tag - 1);
+    switch (typespec->type)
+    {
+    case AST_TYPESPEC_NAME:
+        typespec->name = iface_get_name(r);
+        break;
+    case AST_TYPESPEC_ARRAY:
+        typespec->array.base = iface_get_typespec(r);
+        typespec->array.size_expr = iface_get_expr(r);
+        break;
+    case AST_TYPESPEC_POINTER:
+        typespec->pointer.base = iface_get_typespec(r);
+        break;
+    case AST_TYPESPEC_FN:
+    {
+        int32_t num_args = iface_get_count(r);
+        for (int32_t i = 0; i < num_args; ++i)
+        {
+            sb_push(typespec->fn.args, iface_get_typespec(r));
+            typespec->fn.num_args++;
+        }
+        typespec->fn.return_type = iface_get_typespec(r);
+        break;
+    }
+    }
+    return typespec;
+}
+
+ast_expr_t * iface_get_expr(iface_reader_t * r)
+{
+    uint32_t tag = iface_get_tag(r, AST_EXPR_FLOAT + 1);
+    if (!tag)
+    {
+        return NULL;
+    }
+
+    ast_expr_t * expr = ast_new_expr(tag - 1);
+    switch (expr->type)
+    {
+    case AST_EXPR_TERNARY:
+        expr->ternary.condition = iface_get_expr(r);
+        expr->ternary.then_expr = iface_get_expr(r);
+        expr->ternary.else_expr = iface_get_expr(r);
+        break;
+    case AST_EXPR_BINARY_OP:
+        expr->binary.op = iface_get_op(r);
+        expr->binary.left = iface_get_expr(r);
+        expr->binary.right = iface_get_expr(r);
+        break;
+    case AST_EXPR_UNARY_OP:
+        expr->unary.op = iface_get_op(r);
+        expr->unary.expr = iface_get_expr(r);
+        break;
+    case AST_EXPR_CAST:
+        expr->cast.type = iface_get_typespec(r);
+        expr->cast.expr = iface_get_expr(r);
+        break;
+    case AST_EXPR_INVOKE:
+    {
+        expr->invoke.expr = iface_get_expr(r);
+        int32_t num_args = iface_get_count(r);
+        for (int32_t i = 0; i < num_args; ++i)
+        {
+            sb_push(expr->invoke.args, iface_get_expr(r));
+            expr->invoke.num_args++;
+        }
+        break;
+    }
+    case AST_EXPR_INDEX:
+        expr->index.expr = iface_get_expr(r);
+        expr->index.index_expr = iface_get_expr(r);
+        break;
+    case AST_EXPR_FIELD:
+        expr->field.expr = iface_get_expr(r);
+        expr->field.name = iface_get_name(r);
+        break;
+    case AST_EXPR_COMPOUND:
+    {
+        expr->compound.type = iface_get_typespec(r);
+        int32_t num_args = iface_get_count(r);
+        for (int32_t i = 0; i < num_args; ++i)
+        {
+            ast_cmpnd_field_t * field = ast_new_cmpnd_field(iface_get_tag(r, AST_CMPND_FIELD_INDEX));
+            sb_push(expr->compound.args, field);
+            expr->compound.num_args++;
+
+            field->expr = iface_get_expr(r);
+            if (field->type == AST_CMPND_FIELD_FIELD)
+            {
+                field->field_name = iface_get_name(r);
+            }
+            else if (field->type == AST_CMPND_FIELD_INDEX)
+            {
+                field->index_expr = iface_get_expr(r);
+            }
+        }
+        break;
+    }
+    case AST_EXPR_NAME:
+        expr->name = iface_get_name(r);
+        break;
+    case AST_EXPR_STRING:
+    {
+        uint64_t length = (uint64_t)iface_get_i64(r);
+        if (length > r->size - r->pos)
+        {
+            r->error = true;
+            length = 0;
+        }
+        sb_t(char) str = NULL;
+        _sb_maybe_grow(str, (int32_t)length + 1);
+        iface_get_bytes(r, str, length);
+        str[length] = '\0';
+        _sb_raw_len(str) = (int32_t)length + 1;
+        expr->string_value.str = str;
+        expr->string_value.length = length;
+        break;
+    }
+    case AST_EXPR_INTEGER:
+        expr->int_value = iface_get_i64(r);
+        break;
+    case AST_EXPR_FLOAT:
+        expr->float_value.value = iface_get_f64(r);
+        expr->float_value.is_f32 = iface_get_u32(r) != 0;
+        break;
+    }
+    return expr;
+}
+
+ast_simple_stmt_t * iface_get_simple_stmt(iface_reader_t * r)
+{
+    uint32_t tag = iface_get_tag(r, AST_SIMPLE_STMT_EXPR + 1);
+    if (!tag)
+    {
+        return NULL;
+    }
+
+    ast_simple_stmt_t * stmt = ast_new_simple_stmt(tag - 1);
+    switch (stmt->type)
+    {
+    case AST_SIMPLE_STMT_VAR_DECL:
+        stmt->var_decl = iface_get_decl(r);
+        break;
+    case AST_SIMPLE_STMT_CONST_DECL:
+        stmt->const_decl = iface_get_decl(r);
+        break;
+    case AST_SIMPLE_STMT_ASSIGN:
+        stmt->assign.op = iface_get_op(r);
+        stmt->assign.left = iface_get_expr(r);
+        stmt->assign.right = iface_get_expr(r);
+        break;
+    case AST_SIMPLE_STMT_DECREMENT:
+    case AST_SIMPLE_STMT_INCREMENT:
+    case AST_SIMPLE_STMT_EXPR:
+        stmt->expr = iface_get_expr(r);
+        break;
+    }
+    return stmt;
+}
+
+int32_t iface_get_simple_stmt_list(iface_reader_t * r, sb_t(ast_simple_stmt_t *) * stmts)
+{
+    int32_t num_stmts = iface_get_count(r);
+    for (int32_t i = 0; i < num_stmts; ++i)
+    {
+        sb_push(*stmts, iface_get_simple_stmt(r));
+    }
+    return num_stmts;
+}
+
+ast_stmt_t * iface_get_stmt(iface_reader_t * r)
+{
+    uint32_t tag = iface_get_tag(r, AST_STMT_SIMPLE + 1);
+    if (!tag)
+    {
+        r->error = true;
+        return NULL;
+    }
+
+    ast_stmt_t * stmt = ast_new_stmt(tag - 1);
+    switch (stmt->type)
+    {
+    case AST_STMT_IF:
+    {
+        int32_t num_conditions = iface_get_count(r);
+        for (int32_t i = 0; i < num_conditions; ++i)
+        {
+            sb_push(stmt->if_stmt.conditions, iface_get_expr(r));
+            sb_push(stmt->if_stmt.stmt_blocks, iface_get_stmt_block(r));
+            stmt->if_stmt.num_conditions++;
+        }
+        stmt->if_stmt.else_stmt_block = iface_get_stmt_block(r);
+        break;
+    }
+    case AST_STMT_WHILE:
+        stmt->while_stmt.condition = iface_get_expr(r);
+        stmt->while_stmt.stmt_block = iface_get_stmt_block(r);
+        break;
+    case AST_STMT_FOR:
+        stmt->for_stmt.num_init_stmts = iface_get_simple_stmt_list(r, &stmt->for_stmt.init_stmts);
+        stmt->for_stmt.condition = iface_get_expr(r);
+        stmt->for_stmt.num_incr_stmts = iface_get_simple_stmt_list(r, &stmt->for_stmt.incr_stmts);
+        stmt->for_stmt.stmt_block = iface_get_stmt_block(r);
+        break;
+    case AST_STMT_SWITCH:
+    {
+        stmt->switch_stmt.expr = iface_get_expr(r);
+        int32_t num_items = iface_get_count(r);
+        for (int32_t i = 0; i < num_items; ++i)
+        {
+            ast_switch_item_t * item = ast_new_switch_item();
+            sb_push(stmt->switch_stmt.items, item);
+            stmt->switch_stmt.num_items++;
+
+            int32_t num_values = iface_get_count(r);
+            for (int32_t j = 0; j < num_values; ++j)
+            {
+                ast_switch_case_literal_t * value =
+                    ast_new_switch_case_literal(iface_get_tag(r, AST_CASE_LITERAL_INTEGER));
+                sb_push(item->values, value);
+                item->num_values++;
+
+                if (value->type == AST_CASE_LITERAL_NAME)
+                {
+                    value->name = iface_get_name(r);
+                }
+                else
+                {
+                    value->integer = (uint64_t)iface_get_i64(r);
+                }
+            }
+            item->stmt_block = iface_get_stmt_block(r);
+        }
+        break;
+    }
+    case AST_STMT_RETURN:
+        stmt->return_stmt = iface_get_expr(r);
+        break;
+    case AST_STMT_CONTINUE:
+    case AST_STMT_BREAK:
+        break;
+    case AST_STMT_BLOCK:
+        stmt->stmt_block = iface_get_stmt_block(r);
+        break;
+    case AST_STMT_SIMPLE:
+        stmt->simple_stmt = iface_get_simple_stmt(r);
+        break;
+    }
+    return stmt;
+}
+
+ast_stmt_block_t * iface_get_stmt_block(iface_reader_t * r)
+{
+    if (!iface_get_tag(r, 1))
+    {
+        return NULL;
+    }
+
+    ast_stmt_block_t * block = ast_new_stmt_block();
+    int32_t num_stmts = iface_get_count(r);
+    for (int32_t i = 0; i < num_stmts && !r->error; ++i)
+    {
+        sb_push(block->stmts, iface_get_stmt(r));
+        block->num_stmts++;
+    }
+    return block;
+}
+
+ast_decl_t * iface_get_decl(iface_reader_t * r)
+{
+    uint32_t tag = iface_get_tag(r, AST_DECL_IMPORT + 1);
+    if (!tag)
+    {
+        r->error = true;
+        return NULL;
+    }
+
+    ast_decl_t * decl = ast_new_decl(tag - 1);
+    decl->name = iface_get_name(r);
+    switch (decl->type)
+    {
+    case AST_DECL_ENUM:
+    {
+        decl->enum_decl.base_type = iface_get_typespec(r);
+        int32_t num_items = iface_get_count(r);
+        for (int32_t i = 0; i < num_items; ++i)
+        {
+            ast_enum_item_t * item = ast_new_enum_item();
+            sb_push(decl->enum_decl.items, item);
+            decl->enum_decl.num_items++;
+            item->name = iface_get_name(r);
+            item->expr = iface_get_expr(r);
+        }
+        break;
+    }
+    case AST_DECL_UNION:
+    case AST_DECL_STRUCT:
+    {
+        int32_t num_items = iface_get_count(r);
+        for (int32_t i = 0; i < num_items; ++i)
+        {
+            ast_aggregate_item_t * item = ast_new_aggregate_item();
+            sb_push(decl->aggregate_decl.items, item);
+            decl->aggregate_decl.num_items++;
+            item->name = iface_get_name(r);
+            item->type = iface_get_typespec(r);
+        }
+        break;
+    }
+    case AST_DECL_VAR:
+    case AST_DECL_CONST:
+        decl->var_decl.type = iface_get_typespec(r);
+        decl->var_decl.expr = iface_get_expr(r);
+        break;
+    case AST_DECL_TYPE:
+        decl->type_decl.type = iface_get_typespec(r);
+        break;
+    case AST_DECL_FN:
+    {
+        int32_t num_params = iface_get_count(r);
+        for (int32_t i = 0; i < num_params; ++i)
+        {
+            ast_param_t * param = ast_new_param();
+            sb_push(decl->fn_decl.params, param);
+            decl->fn_decl.num_params++;
+            param->name = iface_get_name(r);
+            param->type = iface_get_typespec(r);
+        }
+        decl->fn_decl.return_type = iface_get_typespec(r);
+        decl->fn_decl.stmt_block = iface_get_stmt_block(r);
+        break;
+    }
+    case AST_DECL_IMPORT:
+        break;
+    }
+    return decl;
+}
+
+bool iface_read(const void * data, uint64_t size, uint64_t source_hash, sb_t(ast_decl_t *) * decls)
+{
+    iface_header_t header;
+    if (size < sizeof(header))
+    {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, "OPLI", sizeof(header.magic)) != 0
+            || header.version != IFACE_VERSION
+            || header.num_token_types != TOKEN_TYPE_KW_END_
+            || header.source_hash != source_hash
+            || header.strings_size > size - sizeof(header)
+            || header.nodes_size != size - sizeof(header) - header.strings_size
+            || header.num_strings > header.strings_size / sizeof(uint32_t)
+            || header.payload_hash != hash_range((const char *)data + sizeof(header), size - sizeof(header)))
+    {
+        return false;
+    }
+
+    iface_reader_t r = { .data = (const char *)data + sizeof(header), .size = header.strings_size };
+    r.strings = xmalloc((header.num_strings + 1) * sizeof(const char *));
+    for (uint32_t i = 0; i < header.num_strings && !r.error; ++i)
+    {
+        uint64_t length = iface_get_u32(&r);
+        if (length > r.size - r.pos)
+        {
+            r.error = true;
+            break;
+        }
+        r.strings[i] = intern_string_range(r.data + r.pos, r.data + r.pos + length - 1);
+        r.pos += length;
+    }
+
+    sb_t(ast_decl_t *) result = NULL;
+    if (!r.error && r.pos == r.size)
+    {
+        r.num_strings = header.num_strings;
+        r.data += r.size;
+        r.size = header.nodes_size;
+        r.pos = 0;
+
+        int32_t num_decls = iface_get_count(&r);
+        for (int32_t i = 0; i < num_decls && !r.error; ++i)
+        {
+            sb_push(result, iface_get_decl(&r));
+        }
+    }
+    free(r.strings);
+
+    if (r.error || r.pos != r.size)
+    {
+        ast_free_decls(result);
+        return false;
+    }
+    *decls = result;
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Files
+////////////////////////////////////////////////////////////////////////////////
+
+// Written to a temporary file first and renamed over the old one, so a
+// compiler running at the same time never maps a half written file.
+bool iface_save(const char * path, uint64_t source_hash, sb_t(ast_decl_t *) decls)
+{
+    char tmp_path[1024];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, process_id()) >= (int)sizeof(tmp_path))
+    {
+        return false;
+    }
+
+    FILE * file = fopen(tmp_path, "wb");
+    if (!file)
+    {
+        return false;
+    }
+
+    buf_t buf = { .file = file };
+    iface_write(&buf, source_hash, decls);
+    buf_free(&buf);
+    bool ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || !replace_file(tmp_path, path))
+    {
+        remove(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+bool iface_load(const char * path, uint64_t source_hash, sb_t(ast_decl_t *) * decls)
+{
+    uint64_t size = 0;
+    const void * data = mmap_file(path, &size);
+    if (!data)
+    {
+        return false;
+    }
+
+    bool ok = iface_read(data, size, source_hash, decls);
+    munmap_file(data, size);
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Tests
+////////////////////////////////////////////////////////////////////////////////
+
+void test_iface(void)
+{
+    const char * source =
+        "import base.io;"
+        "enum e : u8 { a, b = 2 } struct s { x: i32; y: s*[4]; } union u { i: i32; }"
+        "type t = fn(i32, u8*): b8; var v : i32[2] = { [1] = 5, 6 }; const c : u8* = \"a\\tb\";"
+        "fn f(p: s*): i32 {"
+        "    for (var i : i32 = 0, i = 1; i < 4; i++) { if (i) { continue; } else if (!i) { break; } }"
+        "    while (p) { p = cast(s*, p.y[0]); }"
+        "    switch (p.x) { 1, a -> { return -1; } otherwise -> {} }"
+        "    { return p ? (:s){ .x = 1 }.x : f(&p[0]); }"
+        "}"
+        "fn g() { const k : i32 = 3; var r : f32 = 0.1f32 * 2.5e-3; g(); return; }";
+
+    init_parser(source);
+    sb_t(ast_decl_t *) decls = parse_document();
+    buf_t buf = { 0 };
+    iface_write(&buf, 42, decls);
+    uint64_t size = buf.length;
+    char * data = buf_string(&buf);
+
+    sb_t(ast_decl_t *) loaded = NULL;
+    assert(iface_read(data, size, 42, &loaded));
+    assert(sb_len(loaded) == sb_len(decls));
+    assert(loaded[0]->name == intern_string("base.io"));
+    assert(loaded[6]->var_decl.expr->string_value.length == 3);
+    assert(loaded[6]->var_decl.expr->string_value.str[3] == '\0');
+
+    print_decls(&buf, decls);
+    char * expected = buf_string(&buf);
+    print_decls(&buf, loaded);
+    char * actual = buf_string(&buf);
+    assert(strcmp(expected, actual) == 0);
+    free(expected);
+    free(actual);
+    ast_free_decls(loaded);
+
+    // A different source, truncation or a damaged byte anywhere in the
+    // strings or nodes must be rejected without crashing or leaking.
+    loaded = NULL;
+    assert(!iface_read(data, size, 43, &loaded));
+    for (uint64_t i = 0; i < size; ++i)
+    {
+        assert(!iface_read(data, i, 42, &loaded));
+    }
+    for (uint64_t i = sizeof(iface_header_t); i < size; ++i)
+    {
+        data[i] ^= 0x01;
+        assert(!iface_read(data, size, 42, &loaded));
+        data[i] ^= 0x01;
+    }
+    assert(iface_read(data, size, 42, &loaded));
+    ast_free_decls(loaded);
+
+    // On disk a damaged interface is a miss.
+    const char * path = "test_iface.opali";
+    assert(iface_save(path, 42, decls));
+    FILE * file = fopen(path, "r+b");
+    assert(file);
+    fseek(file, (long)(size - 1), SEEK_SET);
+    char last = (char)fgetc(file);
+    fseek(file, (long)(size - 1), SEEK_SET);
+    fputc(last ^ 0x01, file);
+    fclose(file);
+    loaded = NULL;
+    assert(!iface_load(path, 42, &loaded));
+    assert(loaded == NULL);
+    remove(path);
+
+    free(data);
+    buf_free(&buf);
+    ast_free_decls(decls);
+}
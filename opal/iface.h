@@ -0,0 +1,19 @@
+#pragma once
+
+#include "common.h"
+#include "ast.h"
+
+// Module interface files hold the parsed declarations of one module in a
+// binary form that is decoded straight out of a read-only mapping of the
+// file, so an unchanged module is loaded without being lexed or parsed. A
+// file records the hash of the source it was made from and is ignored once
+// that source changes, or when it was written by a different version of
+// the compiler.
+void iface_write(buf_t * out, uint64_t source_hash, sb_t(ast_decl_t *) decls);
+bool iface_read(const void * data, uint64_t size, uint64_t source_hash, sb_t(ast_decl_t *) * decls);
+
+// Both return false instead of failing, a missing or stale interface only
+// means the module has to be parsed again.
+bool iface_save(const char * path, uint64_t source_hash, sb_t(ast_decl_t *) decls);
+bool iface_load(const char * path, uint64_t source_hash, sb_t(ast_decl_t *) * decls);
+void test_iface(void);
@@ -1,9 +1,28 @@
 #include "lex.h"
 
+#include "trace.h"
+
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
 #include <assert.h>
+#include <float.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define LEX_SSE2
+#include <emmintrin.h>
+#endif
 
 int64_t digit_values[256] =
 {
@@ -36,55 +55,842 @@ char escaped_character_chars[256] =
     ['\''] = '\''
 };
 
-char escaped_string_chars[256] =
-{
-    ['0'] = '\0',
-    ['n'] = '\n',
-    ['t'] = '\t',
-    ['r'] = '\r',
-    ['b'] = '\b',
-    ['\\'] = '\\',
-    ['"'] = '"'
-};
+char escaped_string_chars[256] =
+{
+    ['0'] = '\0',
+    ['n'] = '\n',
+    ['t'] = '\t',
+    ['r'] = '\r',
+    ['b'] = '\b',
+    ['\\'] = '\\',
+    ['"'] = '"'
+};
+
+void init_float_powers(void);
+
+bool keywords_initilized = false;
+const char * keywords[TOKEN_TYPE_KW_END_ - TOKEN_TYPE_KW_START_ - 1];
+
+#define REGISTER_KEYWORD(NAME, name) keywords[TOKEN_TYPE_KW_##NAME - TOKEN_TYPE_KW_START_ - 1] = intern_string(name);
+void init_keywords(void)
+{
+    if (keywords_initilized)
+    {
+        return;
+    }
+
+    REGISTER_KEYWORD(VAR, "var");
+    REGISTER_KEYWORD(CONST, "const");
+    REGISTER_KEYWORD(IF, "if");
+    REGISTER_KEYWORD(ELSE, "else");
+    REGISTER_KEYWORD(WHILE, "while");
+    REGISTER_KEYWORD(FOR, "for");
+    REGISTER_KEYWORD(SWITCH, "switch");
+    REGISTER_KEYWORD(OTHERWISE, "otherwise");
+    REGISTER_KEYWORD(RETURN, "return");
+    REGISTER_KEYWORD(FN, "fn");
+    REGISTER_KEYWORD(STRUCT, "struct");
+    REGISTER_KEYWORD(UNION, "union");
+    REGISTER_KEYWORD(ENUM, "enum");
+    REGISTER_KEYWORD(TYPE, "type");
+    REGISTER_KEYWORD(CONTINUE, "continue");
+    REGISTER_KEYWORD(BREAK, "break");
+    REGISTER_KEYWORD(CAST, "cast");
+    REGISTER_KEYWORD(IMPORT, "import");
+    init_float_powers();
+    keywords_initilized = true;
+}
+#undef REGISTER_KEYWORD
+
+////////////////////////////////////////////////////////////////////////////////
+// Streamed input
+////////////////////////////////////////////////////////////////////////////////
+
+enum
+{
+    LEXER_CHUNK_SIZE = 64 * 1024,
+    // No scanner looks further than this past the end of its token.
+    LEXER_LOOKAHEAD = 16
+};
+
+typedef struct lexer_reader_t
+{
+    lexer_read_fn_t read;
+    void * context;
+    char * buffer;
+    uint64_t capacity;
+    bool eof;
+} lexer_reader_t;
+
+// Moves the bytes from keep on to the front of the buffer and reads more
+// behind them. Only a token longer than half the buffer keeps that much, the
+// buffer is doubled for it. Reading stops once LEXER_LOOKAHEAD new bytes have
+// arrived, so input from a slow producer is lexed as it is written instead of
+// a chunk at a time. Returns whether anything was read.
+bool lexer_refill(lexer_t * l, const char * keep)
+{
+    lexer_reader_t * reader = l->reader;
+    if (!reader || reader->eof)
+    {
+        return false;
+    }
+
+    uint64_t kept = l->end - keep;
+    uint64_t offset = l->stream - keep;
+    if (kept > reader->capacity / 2)
+    {
+        char * buffer = xmalloc(reader->capacity * 2);
+        memcpy(buffer, keep, kept);
+        free(reader->buffer);
+        reader->buffer = buffer;
+        reader->capacity *= 2;
+    }
+    else
+    {
+        memmove(reader->buffer, keep, kept);
+    }
+
+    uint64_t length = kept;
+    while (length < reader->capacity - 1)
+    {
+        uint64_t count = reader->read(reader->context, reader->buffer + length, reader->capacity - 1 - length);
+        if (count == 0)
+        {
+            reader->eof = true;
+            break;
+        }
+        length += count;
+        if (length - kept >= LEXER_LOOKAHEAD)
+        {
+            break;
+        }
+    }
+
+    reader->buffer[length] = '\0';
+    l->stream = reader->buffer + offset;
+    l->end = reader->buffer + length;
+    return length > kept;
+}
+
+// Whether the stream stopped at the end of a chunk that more input follows,
+// where a scanner has to hand back what it has instead of failing.
+bool lexer_chunk_ended(lexer_t * l)
+{
+    return l->reader && !l->reader->eof && l->stream == l->end;
+}
+
+// fread waits until it has all of size, read returns what a pipe has.
+uint64_t lexer_read_file(void * file, char * buffer, uint64_t size)
+{
+#if defined(_WIN32)
+    return fread(buffer, 1, size, file);
+#else
+    while (true)
+    {
+        ssize_t count = read(fileno(file), buffer, size);
+        if (count >= 0)
+        {
+            return (uint64_t)count;
+        }
+        if (errno != EINTR)
+        {
+            fprintf(stderr, "Cannot read the input: %s\n", strerror(errno));
+            exit(1);
+        }
+    }
+#endif
+}
+
+// Integer literals are read eight bytes at a time in a plain uint64_t. The
+// bytes are loaded so the first character is the lowest byte on any
+// machine, so the masks below never depend on the byte order.
+static inline uint64_t lex_load_u64(const char * p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint32_t lex_count_trailing_zeros(uint64_t v)
+{
+    assert(v != 0);
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, v);
+    return (uint32_t)index;
+#else
+    return (uint32_t)__builtin_ctzll(v);
+#endif
+}
+
+#define LEX_SWAR_BYTES(b) (0x0101010101010101ull * (uint8_t)(b))
+
+// Replaces every byte of v by its digit value and returns how many of the
+// leading bytes are digits of the base. A byte that is not has the high bit
+// of its lane set in the invalid mask; the additions never carry out of a
+// lane as the high bit is cleared first.
+static inline uint32_t lex_swar_digits(uint64_t * v, int base)
+{
+    const uint64_t high = LEX_SWAR_BYTES(0x80);
+    const uint64_t low = LEX_SWAR_BYTES(0x7f);
+    uint64_t invalid;
+
+    if (base == 16)
+    {
+        // 'a'-'f' and 'A'-'F' only differ in 0x20 and are the only bytes
+        // with 0x40 set that map to 1-6 once both bits are dropped.
+        uint64_t digits = *v ^ LEX_SWAR_BYTES('0');
+        uint64_t letters = (*v | LEX_SWAR_BYTES(0x20)) ^ LEX_SWAR_BYTES(0x60);
+        uint64_t is_digit = ~(((digits & low) + LEX_SWAR_BYTES(0x80 - 10)) | digits);
+        uint64_t is_letter = ((letters & low) + LEX_SWAR_BYTES(0x80 - 1)) &
+                ~(((letters & low) + LEX_SWAR_BYTES(0x80 - 7)) | letters);
+        invalid = ~(is_digit | is_letter) & high;
+        *v = (*v & LEX_SWAR_BYTES(0x0f)) + ((*v >> 6) & LEX_SWAR_BYTES(0x01)) * 9;
+    }
+    else
+    {
+        *v ^= LEX_SWAR_BYTES('0');
+        invalid = (((*v & low) + LEX_SWAR_BYTES(0x80 - base)) | *v) & high;
+    }
+
+    return invalid ? lex_count_trailing_zeros(invalid) / 8 : 8;
+}
+
+// Folds eight digit values, the first byte being the most significant
+// digit, into one number in three multiplies instead of eight.
+static inline uint64_t lex_swar_combine(uint64_t v, uint64_t base)
+{
+    v = (v & 0x00ff00ff00ff00ffull) * base + ((v >> 8) & 0x00ff00ff00ff00ffull);
+    v = (v & 0x0000ffff0000ffffull) * (base * base) + ((v >> 16) & 0x0000ffff0000ffffull);
+    return (v & 0x00000000ffffffffull) * (base * base * base * base) + (v >> 32);
+}
+
+// Reads the leading run of plain digits eight at a time, for as many chunks
+// as are sure to fit in 64 bits. Whatever follows, a '_', a digit too many
+// or an invalid one, is left to the digit loop of scan_integer.
+void scan_integer_swar(lexer_t * l, int base)
+{
+    uint32_t max_chunks = base == 2 ? 8 : 2;
+
+    for (uint32_t chunk = 0; chunk < max_chunks && l->end - l->stream >= 8; ++chunk)
+    {
+        uint64_t v = lex_load_u64(l->stream);
+        uint32_t count = lex_swar_digits(&v, base);
+        if (count == 0)
+        {
+            break;
+        }
+
+        // Shifting out the bytes after the digits pads the front with zeros.
+        v <<= 8 * (8 - count);
+        uint64_t scale = 1;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            scale *= base;
+        }
+        l->token.integer = l->token.integer * scale + lex_swar_combine(v, base);
+        l->stream += count;
+        if (count < 8)
+        {
+            break;
+        }
+    }
+}
+
+// Float literals are decimal, with a fraction, an exponent or both, and an
+// optional f32 or f64 suffix for their type. They are rounded correctly to
+// that type without strtod: exact small values take the Clinger fast path,
+// everything else Eisel-Lemire on the first 19 significant digits. Only a
+// longer literal whose cut off digits could change the rounding is settled
+// by comparing all of its digits with the halfway point, in big integers.
+
+enum
+{
+    LEX_MIN_POWER_OF_FIVE = -342,
+    LEX_MAX_POWER_OF_FIVE = 308,
+    LEX_FLOAT_MANTISSA_DIGITS = 19,
+    // Halfway points between doubles have at most 767 significant digits,
+    // the ones after these can only break a tie.
+    LEX_FLOAT_MAX_DIGITS = 800,
+    LEX_BIGNUM_LIMBS = 112,
+};
+
+typedef struct lex_float_format_t
+{
+    int32_t mantissa_bits;
+    int32_t min_exponent;
+    int32_t infinite_power;
+    int32_t min_power_of_ten;
+    int32_t max_power_of_ten;
+    int32_t min_round_to_even;
+    int32_t max_round_to_even;
+    int32_t max_exact_power_of_ten;
+} lex_float_format_t;
+
+const lex_float_format_t lex_f64_format = { 52, -1023, 0x7ff, -342, 308, -4, 23, 22 };
+const lex_float_format_t lex_f32_format = { 23, -127, 0xff, -65, 38, -17, 10, 10 };
+
+const double lex_exact_powers_of_ten[] =
+{
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+const uint64_t lex_integer_powers_of_ten[] =
+{
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+};
+
+// The 128 most significant bits of 5^q, high word first, for every power
+// Eisel-Lemire meets. Negative powers hold 2^b / 5^-q, rounded up while it
+// fits in 128 bits. Filled by init_float_powers.
+uint64_t lex_powers_of_five[2 * (LEX_MAX_POWER_OF_FIVE - LEX_MIN_POWER_OF_FIVE + 1)];
+
+// A binary float before it is packed, the mantissa without its implicit bit
+// and the biased exponent.
+typedef struct lex_float_bits_t
+{
+    uint64_t mantissa;
+    int32_t power2;
+} lex_float_bits_t;
+
+typedef struct lex_bignum_t
+{
+    uint32_t limbs[LEX_BIGNUM_LIMBS];
+    uint32_t count;
+} lex_bignum_t;
+
+void lex_bignum_set(lex_bignum_t * b, uint64_t value)
+{
+    b->count = 0;
+    while (value)
+    {
+        b->limbs[b->count++] = (uint32_t)value;
+        value >>= 32;
+    }
+}
+
+void lex_bignum_trim(lex_bignum_t * b)
+{
+    while (b->count && !b->limbs[b->count - 1])
+    {
+        b->count--;
+    }
+}
+
+void lex_bignum_mul_add(lex_bignum_t * b, uint32_t mul, uint32_t add)
+{
+    uint64_t carry = add;
+    for (uint32_t i = 0; i < b->count; ++i)
+    {
+        carry += (uint64_t)b->limbs[i] * mul;
+        b->limbs[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    if (carry)
+    {
+        assert(b->count < LEX_BIGNUM_LIMBS);
+        b->limbs[b->count++] = (uint32_t)carry;
+    }
+}
+
+void lex_bignum_mul_pow5(lex_bignum_t * b, int64_t power)
+{
+    // 5^13 is the largest power of five that fits in a limb.
+    for (; power >= 13; power -= 13)
+    {
+        lex_bignum_mul_add(b, 1220703125, 0);
+    }
+    uint32_t mul = 1;
+    while (power-- > 0)
+    {
+        mul *= 5;
+    }
+    lex_bignum_mul_add(b, mul, 0);
+}
+
+void lex_bignum_div_small(lex_bignum_t * b, uint32_t div)
+{
+    uint64_t rem = 0;
+    for (uint32_t i = b->count; i-- > 0;)
+    {
+        rem = (rem << 32) | b->limbs[i];
+        b->limbs[i] = (uint32_t)(rem / div);
+        rem %= div;
+    }
+    lex_bignum_trim(b);
+}
+
+void lex_bignum_shl(lex_bignum_t * b, uint64_t bits)
+{
+    if (!b->count)
+    {
+        return;
+    }
+
+    uint32_t words = (uint32_t)(bits / 32);
+    uint32_t shift = bits % 32;
+    uint32_t count = b->count + words + 1;
+    assert(count <= LEX_BIGNUM_LIMBS);
+    for (uint32_t i = count; i-- > 0;)
+    {
+        uint64_t high = i >= words && i - words < b->count ? b->limbs[i - words] : 0;
+        uint64_t low = i >= words + 1 && i - words - 1 < b->count ? b->limbs[i - words - 1] : 0;
+        b->limbs[i] = (uint32_t)((((high << 32) | low) << shift) >> 32);
+    }
+    b->count = count;
+    lex_bignum_trim(b);
+}
+
+void lex_bignum_shr(lex_bignum_t * b, uint64_t bits)
+{
+    uint64_t words = bits / 32;
+    uint32_t shift = bits % 32;
+    for (uint32_t i = 0; i < b->count; ++i)
+    {
+        uint64_t low = i + words < b->count ? b->limbs[i + words] : 0;
+        uint64_t high = i + words + 1 < b->count ? b->limbs[i + words + 1] : 0;
+        b->limbs[i] = (uint32_t)((((high << 32) | low) >> shift));
+    }
+    lex_bignum_trim(b);
+}
+
+uint32_t lex_bignum_bit_length(const lex_bignum_t * b)
+{
+    if (!b->count)
+    {
+        return 0;
+    }
+
+    uint32_t bits = 32 * (b->count - 1);
+    for (uint32_t top = b->limbs[b->count - 1]; top; top >>= 1)
+    {
+        bits++;
+    }
+    return bits;
+}
+
+int32_t lex_bignum_compare(const lex_bignum_t * a, const lex_bignum_t * b)
+{
+    if (a->count != b->count)
+    {
+        return a->count < b->count ? -1 : 1;
+    }
+    for (uint32_t i = a->count; i-- > 0;)
+    {
+        if (a->limbs[i] != b->limbs[i])
+        {
+            return a->limbs[i] < b->limbs[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+// Writes the 128 bits below and including the most significant one.
+void lex_bignum_top_128(const lex_bignum_t * b, uint64_t * out)
+{
+    lex_bignum_t top = *b;
+    uint32_t length = lex_bignum_bit_length(b);
+    if (length > 128)
+    {
+        lex_bignum_shr(&top, length - 128);
+    }
+    else
+    {
+        lex_bignum_shl(&top, 128 - length);
+    }
+    out[0] = (uint64_t)top.limbs[3] << 32 | top.limbs[2];
+    out[1] = (uint64_t)top.limbs[1] << 32 | top.limbs[0];
+}
+
+// Computes the table of lex_powers_of_five exactly, from 5^k and
+// 2^N / 5^k held in big integers, which is cheaper to keep correct than
+// thirteen hundred constants.
+void init_float_powers(void)
+{
+    enum { RECIPROCAL_BITS = 1760 };
+
+    lex_bignum_t power;
+    lex_bignum_t reciprocal;
+    lex_bignum_set(&power, 1);
+    lex_bignum_set(&reciprocal, 1);
+    lex_bignum_shl(&reciprocal, RECIPROCAL_BITS);
+
+    for (int32_t k = 0; k <= -LEX_MIN_POWER_OF_FIVE; ++k)
+    {
+        if (k <= LEX_MAX_POWER_OF_FIVE)
+        {
+            lex_bignum_top_128(&power, &lex_powers_of_five[2 * (k - LEX_MIN_POWER_OF_FIVE)]);
+        }
+        if (k > 0)
+        {
+            // Enough bits of the quotient that the 128 kept are exact, plus
+            // one so small reciprocals are never underestimated.
+            uint32_t z = lex_bignum_bit_length(&power);
+            uint32_t bits = k <= 27 ? z + 127 : 2 * z + 128;
+            assert(bits <= RECIPROCAL_BITS);
+            lex_bignum_t quotient = reciprocal;
+            lex_bignum_shr(&quotient, RECIPROCAL_BITS - bits);
+            lex_bignum_mul_add(&quotient, 1, 1);
+            lex_bignum_top_128(&quotient, &lex_powers_of_five[2 * (-k - LEX_MIN_POWER_OF_FIVE)]);
+        }
+
+        lex_bignum_mul_add(&power, 5, 0);
+        lex_bignum_div_small(&reciprocal, 5);
+    }
+}
+
+static inline uint32_t lex_count_leading_zeros(uint64_t v)
+{
+    assert(v != 0);
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse64(&index, v);
+    return 63 - (uint32_t)index;
+#else
+    return (uint32_t)__builtin_clzll(v);
+#endif
+}
+
+static inline void lex_mul_64(uint64_t a, uint64_t b, uint64_t * high, uint64_t * low)
+{
+#if defined(_MSC_VER)
+    *high = __umulh(a, b);
+    *low = a * b;
+#else
+    unsigned __int128 product = (unsigned __int128)a * b;
+    *high = (uint64_t)(product >> 64);
+    *low = (uint64_t)product;
+#endif
+}
+
+// Rounds w * 10^q to the format, with w exact. Follows fast_float, whose
+// proof shows the truncated power of five is always precise enough.
+lex_float_bits_t lex_eisel_lemire(uint64_t w, int64_t q, const lex_float_format_t * f)
+{
+    lex_float_bits_t bits = { 0, 0 };
+    if (w == 0 || q < f->min_power_of_ten)
+    {
+        return bits;
+    }
+    if (q > f->max_power_of_ten)
+    {
+        bits.power2 = f->infinite_power;
+        return bits;
+    }
+
+    uint32_t lz = lex_count_leading_zeros(w);
+    w <<= lz;
+
+    // Only the bits rounding looks at have to be right, the second word of
+    // the power is needed when they could still carry.
+    const uint64_t * power = &lex_powers_of_five[2 * (q - LEX_MIN_POWER_OF_FIVE)];
+    uint64_t high;
+    uint64_t low;
+    lex_mul_64(w, power[0], &high, &low);
+    uint64_t precision_mask = UINT64_MAX >> (f->mantissa_bits + 3);
+    if ((high & precision_mask) == precision_mask)
+    {
+        uint64_t second_high;
+        uint64_t second_low;
+        lex_mul_64(w, power[1], &second_high, &second_low);
+        low += second_high;
+        if (second_high > low)
+        {
+            high++;
+        }
+    }
+
+    int32_t upper_bit = (int32_t)(high >> 63);
+    int32_t shift = upper_bit + 64 - f->mantissa_bits - 3;
+    bits.mantissa = high >> shift;
+    // floor(q * log2(10)) + 63, exact over the whole table.
+    bits.power2 = (int32_t)((((152170 + 65536) * q) >> 16) + 63) + upper_bit - (int32_t)lz - f->min_exponent;
+
+    if (bits.power2 <= 0)
+    {
+        // Subnormal, or zero once shifted all the way out.
+        if (-bits.power2 + 1 >= 64)
+        {
+            bits.mantissa = 0;
+            bits.power2 = 0;
+            return bits;
+        }
+        bits.mantissa >>= -bits.power2 + 1;
+        bits.mantissa += bits.mantissa & 1;
+        bits.mantissa >>= 1;
+        bits.power2 = bits.mantissa < (1ull << f->mantissa_bits) ? 0 : 1;
+        return bits;
+    }
+
+    // A product that is exactly halfway rounds to even, which only small
+    // powers can produce.
+    if (low <= 1 && q >= f->min_round_to_even && q <= f->max_round_to_even &&
+            (bits.mantissa & 3) == 1 && (bits.mantissa << shift) == high)
+    {
+        bits.mantissa &= ~1ull;
+    }
+
+    bits.mantissa += bits.mantissa & 1;
+    bits.mantissa >>= 1;
+    if (bits.mantissa >= (2ull << f->mantissa_bits))
+    {
+        bits.mantissa = 1ull << f->mantissa_bits;
+        bits.power2++;
+    }
+    bits.mantissa &= ~(1ull << f->mantissa_bits);
+    if (bits.power2 >= f->infinite_power)
+    {
+        bits.mantissa = 0;
+        bits.power2 = f->infinite_power;
+    }
+    return bits;
+}
+
+// Picks between below and above, the roundings of the literal cut to 19
+// digits and of the next 19 digit number, by comparing every digit of the
+// literal with the point halfway between them.
+lex_float_bits_t lex_float_slow_path(const char * digits, const char * digits_end, int64_t exponent,
+        lex_float_bits_t below, lex_float_bits_t above, const lex_float_format_t * f)
+{
+    lex_bignum_t value = { .count = 0 };
+    int64_t power10 = exponent;
+    uint32_t count = 0;
+    bool fraction = false;
+    bool inexact = false;
+    for (const char * p = digits; p < digits_end; ++p)
+    {
+        if (*p == '_')
+        {
+            continue;
+        }
+        if (*p == '.')
+        {
+            fraction = true;
+            continue;
+        }
+
+        uint32_t digit = *p - '0';
+        if (count < LEX_FLOAT_MAX_DIGITS)
+        {
+            if (count || digit)
+            {
+                lex_bignum_mul_add(&value, 10, digit);
+                count++;
+            }
+            power10 -= fraction;
+        }
+        else
+        {
+            inexact |= digit != 0;
+            power10 += !fraction;
+        }
+    }
+
+    uint64_t mantissa = below.mantissa;
+    int64_t power2 = 1 + f->min_exponent - f->mantissa_bits;
+    if (below.power2 != 0)
+    {
+        mantissa |= 1ull << f->mantissa_bits;
+        power2 = below.power2 + f->min_exponent - f->mantissa_bits;
+    }
+
+    // value * 5^power10 * 2^power10 against (2 * mantissa + 1) * 2^(power2 - 1).
+    lex_bignum_t halfway;
+    lex_bignum_set(&halfway, 2 * mantissa + 1);
+    if (power10 >= 0)
+    {
+        lex_bignum_mul_pow5(&value, power10);
+    }
+    else
+    {
+        lex_bignum_mul_pow5(&halfway, -power10);
+    }
+    int64_t shift = power10 - (power2 - 1);
+    if (shift >= 0)
+    {
+        lex_bignum_shl(&value, shift);
+    }
+    else
+    {
+        lex_bignum_shl(&halfway, -shift);
+    }
+
+    int32_t order = lex_bignum_compare(&value, &halfway);
+    if (order == 0 && inexact)
+    {
+        order = 1;
+    }
+    if (order == 0)
+    {
+        return (below.mantissa & 1) ? above : below;
+    }
+    return order > 0 ? above : below;
+}
+
+double lex_float_pack(lex_float_bits_t bits, const lex_float_format_t * f)
+{
+    uint64_t word = bits.mantissa | (uint64_t)bits.power2 << f->mantissa_bits;
+    if (f == &lex_f32_format)
+    {
+        uint32_t word32 = (uint32_t)word;
+        float value;
+        memcpy(&value, &word32, sizeof(value));
+        return value;
+    }
+
+    double value;
+    memcpy(&value, &word, sizeof(value));
+    return value;
+}
+
+// Whether the decimal literal at p has a fraction or an exponent.
+bool is_float_literal(const char * p)
+{
+    while (isdigit(*p) || *p == '_')
+    {
+        p++;
+    }
+    return (*p == '.' && isdigit(p[1])) || *p == 'e' || *p == 'E';
+}
+
+void scan_float(lexer_t * l)
+{
+    const char * start = l->stream;
+    uint64_t mantissa = 0;
+    int64_t power10 = 0;
+    uint32_t digits = 0;
+    bool truncated = false;
+    bool fraction = false;
+
+    while (true)
+    {
+        if (*l->stream == '_')
+        {
+            l->stream++;
+            continue;
+        }
+        if (*l->stream == '.' && !fraction && isdigit(l->stream[1]))
+        {
+            fraction = true;
+            l->stream++;
+            continue;
+        }
+        if (!isdigit(*l->stream))
+        {
+            break;
+        }
+
+        // Past the leading zeros, digits are taken eight at a time while the
+        // mantissa has room for them.
+        if (mantissa && digits + 8 <= LEX_FLOAT_MANTISSA_DIGITS && l->end - l->stream >= 8)
+        {
+            uint64_t v = lex_load_u64(l->stream);
+            uint32_t count = lex_swar_digits(&v, 10);
+            v <<= 8 * (8 - count);
+            mantissa = mantissa * lex_integer_powers_of_ten[count] + lex_swar_combine(v, 10);
+            digits += count;
+            power10 -= fraction ? count : 0;
+            l->stream += count;
+            continue;
+        }
+
+        uint32_t digit = *l->stream - '0';
+        if (digits < LEX_FLOAT_MANTISSA_DIGITS)
+        {
+            mantissa = mantissa * 10 + digit;
+            digits += mantissa != 0;
+            power10 -= fraction;
+        }
+        else
+        {
+            truncated |= digit != 0;
+            power10 += !fraction;
+        }
+        l->stream++;
+    }
+
+    const char * digits_end = l->stream;
+    int64_t exponent = 0;
+    if (*l->stream == 'e' || *l->stream == 'E')
+    {
+        l->stream++;
+        bool negative = *l->stream == '-';
+        if (*l->stream == '-' || *l->stream == '+')
+        {
+            l->stream++;
+        }
+        assert((isdigit(*l->stream) || lexer_chunk_ended(l)) && "Missing float exponent digits");
+
+        // Anything this large is out of range or zero for every mantissa.
+        while (isdigit(*l->stream))
+        {
+            if (exponent < 100000)
+            {
+                exponent = exponent * 10 + (*l->stream - '0');
+            }
+            l->stream++;
+        }
+        exponent = negative ? -exponent : exponent;
+    }
 
-bool keywords_initilized = false;
-const char * keywords[TOKEN_TYPE_KW_END_ - TOKEN_TYPE_KW_START_ - 1];
+    bool is_f32 = false;
+    if (l->stream[0] == 'f' &&
+            ((l->stream[1] == '3' && l->stream[2] == '2') || (l->stream[1] == '6' && l->stream[2] == '4')) &&
+            !isalnum(l->stream[3]) && l->stream[3] != '_')
+    {
+        is_f32 = l->stream[1] == '3';
+        l->stream += 3;
+    }
 
-#define REGISTER_KEYWORD(NAME, name) keywords[TOKEN_TYPE_KW_##NAME - TOKEN_TYPE_KW_START_ - 1] = intern_string(name);
-void init_keywords(void)
-{
-    if (keywords_initilized)
+    const lex_float_format_t * f = is_f32 ? &lex_f32_format : &lex_f64_format;
+    power10 += exponent;
+    l->token.type = TOKEN_TYPE_FLOAT;
+    l->token.float_value.is_f32 = is_f32;
+
+    // Both operands are exact, so one correctly rounded operation is too.
+    if (!truncated && FLT_EVAL_METHOD == 0 &&
+            power10 >= -f->max_exact_power_of_ten && power10 <= f->max_exact_power_of_ten &&
+            mantissa <= (2ull << f->mantissa_bits))
     {
+        if (is_f32)
+        {
+            float value = (float)mantissa;
+            float scale = (float)lex_exact_powers_of_ten[power10 < 0 ? -power10 : power10];
+            l->token.float_value.value = power10 < 0 ? value / scale : value * scale;
+        }
+        else
+        {
+            double value = (double)mantissa;
+            double scale = lex_exact_powers_of_ten[power10 < 0 ? -power10 : power10];
+            l->token.float_value.value = power10 < 0 ? value / scale : value * scale;
+        }
         return;
     }
 
-    REGISTER_KEYWORD(VAR, "var");
-    REGISTER_KEYWORD(CONST, "const");
-    REGISTER_KEYWORD(IF, "if");
-    REGISTER_KEYWORD(ELSE, "else");
-    REGISTER_KEYWORD(WHILE, "while");
-    REGISTER_KEYWORD(FOR, "for");
-    REGISTER_KEYWORD(SWITCH, "switch");
-    REGISTER_KEYWORD(OTHERWISE, "otherwise");
-    REGISTER_KEYWORD(RETURN, "return");
-    REGISTER_KEYWORD(FN, "fn");
-    REGISTER_KEYWORD(STRUCT, "struct");
-    REGISTER_KEYWORD(UNION, "union");
-    REGISTER_KEYWORD(ENUM, "enum");
-    REGISTER_KEYWORD(TYPE, "type");
-    REGISTER_KEYWORD(CONTINUE, "continue");
-    REGISTER_KEYWORD(BREAK, "break");
-    REGISTER_KEYWORD(CAST, "cast");
-    keywords_initilized = true;
+    lex_float_bits_t bits = lex_eisel_lemire(mantissa, power10, f);
+    if (truncated)
+    {
+        lex_float_bits_t above = lex_eisel_lemire(mantissa + 1, power10, f);
+        if (above.mantissa != bits.mantissa || above.power2 != bits.power2)
+        {
+            bits = lex_float_slow_path(start, digits_end, exponent, bits, above, f);
+        }
+    }
+    assert(bits.power2 != f->infinite_power && "Float literal out of range");
+    l->token.float_value.value = lex_float_pack(bits, f);
 }
-#undef REGISTER_KEYWORD
 
 void scan_integer(lexer_t * l)
 {
+    const char * start = l->stream;
     l->token.type = TOKEN_TYPE_INTEGER;
     l->token.integer = 0;
 
-    int base = 10;
+    uint64_t base = 10;
     if (*l->stream == '0')
     {
         base = 8;
@@ -102,17 +908,32 @@ void scan_integer(lexer_t * l)
         }
     }
 
-    while (digit_values[*l->stream] != 0 || *l->stream == '0' || *l->stream == '_')
+    scan_integer_swar(l, (int)base);
+    while (digit_values[(unsigned char)*l->stream] != 0 || *l->stream == '0' || *l->stream == '_')
     {
         if (*l->stream != '_')
         {
-            uint64_t digit_value = digit_values[*l->stream];
-            assert(digit_value < base && "Invalid integer digit");
-            assert(l->token.integer < (UINT64_MAX - digit_value) / base && "Integer overflow");
+            uint64_t digit_value = digit_values[(unsigned char)*l->stream];
+            if (digit_value >= base || l->token.integer > (UINT64_MAX - digit_value) / base)
+            {
+                break;
+            }
             l->token.integer = l->token.integer * base + digit_value;
         }
         l->stream++;
     }
+
+    // A decimal literal only turns out to be a float at its '.' or exponent,
+    // which can come after digits too many for an integer or not octal.
+    bool stopped = digit_values[(unsigned char)*l->stream] != 0 || *l->stream == '0';
+    if ((base == 10 || base == 8) && (stopped || *l->stream == '.') && is_float_literal(start))
+    {
+        l->stream = start;
+        scan_float(l);
+        return;
+    }
+    assert(!(stopped && (uint64_t)digit_values[(unsigned char)*l->stream] >= base) && "Invalid integer digit");
+    assert(!stopped && "Integer overflow");
 }
 
 void scan_identifier(lexer_t * l)
@@ -173,7 +994,11 @@ void scan_string(lexer_t * l)
         if (*l->stream == '\\')
         {
             l->stream++;
-            assert((escaped_string_chars[*l->stream] != 0 || l->stream == '\0') && "Invalid escaped character in string literal");
+            if (*l->stream == '\0')
+            {
+                break;
+            }
+            assert(escaped_string_chars[*l->stream] != 0 && "Invalid escaped character in string literal");
             sb_push(output_string, escaped_string_chars[*l->stream]);
         }
         else
@@ -185,8 +1010,9 @@ void scan_string(lexer_t * l)
         length++;
     }
 
-    assert(*l->stream == '"' && "End of stream reached inside a string literal");
-    l->stream++;
+    // A string cut off by the end of a chunk is scanned again by scan_token.
+    assert((*l->stream == '"' || lexer_chunk_ended(l)) && "End of stream reached inside a string literal");
+    l->stream += *l->stream == '"';
 
     sb_push(output_string, '\0');
     l->token.string.str = output_string;
@@ -254,15 +1080,115 @@ bool try_scan_operator_3(lexer_t * l, const char * chars, token_type_t token_typ
 }
 
 #define HANDLE_CHAR_TOKEN(c, t) case c: { l->token.type = t; l->stream++; break; }
-void next_token(lexer_t * l)
+// Everything up to the newline is skipped with memchr, which is vectorized
+// by every libc we build against.
+void skip_line_comment(lexer_t * l)
 {
-    assert(l);
+    while (true)
+    {
+        const char * newline = memchr(l->stream, '\n', l->end - l->stream);
+        l->stream = newline ? newline : l->end;
+        if (newline || !lexer_refill(l, l->end))
+        {
+            return;
+        }
+    }
+}
 
-    while (isspace(*l->stream))
+// Block comments nest, so only '/' and '*' matter inside one. They are
+// searched for sixteen bytes at a time where SSE2 is available.
+void skip_block_comment(lexer_t * l)
+{
+    const char * p = l->stream + 2;
+    uint32_t depth = 1;
+    while (depth)
     {
-        l->stream++;
+#if defined(LEX_SSE2)
+        const __m128i slash = _mm_set1_epi8('/');
+        const __m128i star = _mm_set1_epi8('*');
+        while (l->end - p >= 16)
+        {
+            __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_or_si128(
+                    _mm_cmpeq_epi8(chunk, slash), _mm_cmpeq_epi8(chunk, star)));
+            if (mask)
+            {
+                p += lex_count_trailing_zeros(mask);
+                break;
+            }
+            p += 16;
+        }
+#endif
+        while (p < l->end && *p != '/' && *p != '*')
+        {
+            p++;
+        }
+
+        // A "/*" or "*/" may be split between two chunks.
+        if (l->end - p < 2)
+        {
+            l->stream = p;
+            if (lexer_refill(l, p))
+            {
+                p = l->stream;
+                continue;
+            }
+        }
+        assert(p < l->end && "Unterminated block comment");
+        if (p >= l->end)
+        {
+            break;
+        }
+
+        if (p[0] == '/' && p[1] == '*')
+        {
+            depth++;
+            p += 2;
+        }
+        else if (p[0] == '*' && p[1] == '/')
+        {
+            depth--;
+            p += 2;
+        }
+        else
+        {
+            p++;
+        }
+    }
+    l->stream = p;
+}
+
+void skip_whitespace(lexer_t * l)
+{
+    while (true)
+    {
+        while (isspace(*l->stream))
+        {
+            l->stream++;
+        }
+
+        if (l->stream[0] == '/' && l->stream[1] == '/')
+        {
+            skip_line_comment(l);
+        }
+        else if (l->stream[0] == '/' && l->stream[1] == '*')
+        {
+            skip_block_comment(l);
+        }
+        else if (l->end - l->stream < 2 && lexer_refill(l, l->stream))
+        {
+            continue;
+        }
+        else
+        {
+            break;
+        }
     }
+}
 
+// Scans the token at the stream, which starts past any whitespace.
+void scan_one_token(lexer_t * l)
+{
     switch (*l->stream)
     {
     case '0': case '1': case '2': case '3': case '4':
@@ -381,7 +1307,10 @@ void next_token(lexer_t * l)
     HANDLE_CHAR_TOKEN('(', TOKEN_TYPE_PARENTHESIS_OPEN);
     HANDLE_CHAR_TOKEN(')', TOKEN_TYPE_PARENTHESIS_CLOSE);
     HANDLE_CHAR_TOKEN('.', TOKEN_TYPE_DOT);
-    HANDLE_CHAR_TOKEN('\0', TOKEN_TYPE_EOF);
+
+    case '\0':
+        l->token.type = TOKEN_TYPE_EOF;
+        break;
 
     default:
         {
@@ -393,6 +1322,252 @@ void next_token(lexer_t * l)
 }
 #undef HANDLE_CHAR_TOKEN
 
+void scan_token(lexer_t * l)
+{
+    assert(l);
+
+    skip_whitespace(l);
+    if (!l->reader)
+    {
+        scan_one_token(l);
+        return;
+    }
+
+    if (l->end - l->stream < LEXER_LOOKAHEAD)
+    {
+        lexer_refill(l, l->stream);
+    }
+
+    // A token that ends close to the end of the chunk may continue in the
+    // next one, it is scanned again once the rest has been read.
+    while (true)
+    {
+        const char * start = l->stream;
+        scan_one_token(l);
+        if (l->end - l->stream >= LEXER_LOOKAHEAD || l->reader->eof)
+        {
+            break;
+        }
+
+        if (l->token.type == TOKEN_TYPE_STRING)
+        {
+            sb_free(l->token.string.str);
+        }
+        l->stream = start;
+        lexer_refill(l, start);
+    }
+
+    if (l->token.type == TOKEN_TYPE_EOF)
+    {
+        free(l->reader->buffer);
+        free(l->reader);
+        l->reader = NULL;
+        l->stream = "";
+        l->end = l->stream;
+    }
+}
+
+// Source spelling of operator tokens, NULL for any other token.
+const char * token_op_string(token_type_t type)
+{
+    switch (type)
+    {
+    case TOKEN_TYPE_GT: return ">";
+    case TOKEN_TYPE_LT: return "<";
+    case TOKEN_TYPE_LE: return "<=";
+    case TOKEN_TYPE_GE: return ">=";
+    case TOKEN_TYPE_NE: return "!=";
+    case TOKEN_TYPE_EQ: return "==";
+    case TOKEN_TYPE_PLUS: return "+";
+    case TOKEN_TYPE_MINUS: return "-";
+    case TOKEN_TYPE_OR: return "|";
+    case TOKEN_TYPE_XOR: return "^";
+    case TOKEN_TYPE_AND: return "&";
+    case TOKEN_TYPE_MULT: return "*";
+    case TOKEN_TYPE_DIV: return "/";
+    case TOKEN_TYPE_MOD: return "%";
+    case TOKEN_TYPE_SHR: return ">>";
+    case TOKEN_TYPE_SHL: return "<<";
+    case TOKEN_TYPE_NOT: return "~";
+    case TOKEN_TYPE_LOGIC_NOT: return "!";
+    case TOKEN_TYPE_LOGIC_AND: return "&&";
+    case TOKEN_TYPE_LOGIC_OR: return "||";
+    case TOKEN_TYPE_INC: return "++";
+    case TOKEN_TYPE_DEC: return "--";
+    case TOKEN_TYPE_ASSIGN: return "=";
+    case TOKEN_TYPE_ASSIGN_ADD: return "+=";
+    case TOKEN_TYPE_ASSIGN_SUB: return "-=";
+    case TOKEN_TYPE_ASSIGN_MULT: return "*=";
+    case TOKEN_TYPE_ASSIGN_DIV: return "/=";
+    case TOKEN_TYPE_ASSIGN_MOD: return "%=";
+    case TOKEN_TYPE_ASSIGN_NOT: return "~=";
+    case TOKEN_TYPE_ASSIGN_AND: return "&=";
+    case TOKEN_TYPE_ASSIGN_OR: return "|=";
+    case TOKEN_TYPE_ASSIGN_XOR: return "^=";
+    case TOKEN_TYPE_ASSIGN_SHR: return ">>=";
+    case TOKEN_TYPE_ASSIGN_SHL: return "<<=";
+    default: return NULL;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Pipelined lexing
+////////////////////////////////////////////////////////////////////////////////
+
+enum
+{
+    LEXER_PIPE_SIZE = 4096,
+    LEXER_PIPE_BATCH = 64
+};
+
+// head is only written by the lexer thread and tail only by the parser. Both
+// sides publish their position every LEXER_PIPE_BATCH tokens and before
+// waiting on the other, and otherwise work from a cached copy of the other
+// side's position so the shared cache lines are touched rarely.
+typedef struct lexer_pipe_t
+{
+    token_t tokens[LEXER_PIPE_SIZE];
+    _Alignas(64) atomic_uint_fast64_t head;
+    _Alignas(64) atomic_uint_fast64_t tail;
+
+    _Alignas(64) uint64_t consumer_head;
+    uint64_t consumer_tail;
+
+    lexer_t lexer;
+    thread_t thread;
+    bool timing;
+    stats_t stats;
+} lexer_pipe_t;
+
+void lexer_pipe_produce(void * arg)
+{
+    lexer_pipe_t * pipe = arg;
+    stats.timing = pipe->timing;
+    trace_thread_name("lexer");
+    trace_begin("lex");
+
+    uint64_t head = 0;
+    uint64_t published = 0;
+    uint64_t tail = 0;
+    while (true)
+    {
+        while (head - tail == LEXER_PIPE_SIZE)
+        {
+            if (published != head)
+            {
+                atomic_store_explicit(&pipe->head, head, memory_order_release);
+                published = head;
+            }
+            tail = atomic_load_explicit(&pipe->tail, memory_order_acquire);
+            if (head - tail == LEXER_PIPE_SIZE)
+            {
+                thread_yield();
+            }
+        }
+
+        pipe->tokens[head % LEXER_PIPE_SIZE] = pipe->lexer.token;
+        head++;
+        if (pipe->lexer.token.type == TOKEN_TYPE_EOF)
+        {
+            break;
+        }
+        next_token(&pipe->lexer);
+
+        if (head - published >= LEXER_PIPE_BATCH)
+        {
+            atomic_store_explicit(&pipe->head, head, memory_order_release);
+            published = head;
+        }
+    }
+    atomic_store_explicit(&pipe->head, head, memory_order_release);
+
+    trace_end(NULL);
+    pipe->stats = stats;
+}
+
+void lexer_pipe_consume(lexer_t * l)
+{
+    lexer_pipe_t * pipe = l->pipe;
+    if (pipe->consumer_tail == pipe->consumer_head)
+    {
+        atomic_store_explicit(&pipe->tail, pipe->consumer_tail, memory_order_release);
+        while ((pipe->consumer_head = atomic_load_explicit(&pipe->head, memory_order_acquire)) == pipe->consumer_tail)
+        {
+            thread_yield();
+        }
+    }
+
+    l->token = pipe->tokens[pipe->consumer_tail % LEXER_PIPE_SIZE];
+    pipe->consumer_tail++;
+    if (pipe->consumer_tail % LEXER_PIPE_BATCH == 0)
+    {
+        atomic_store_explicit(&pipe->tail, pipe->consumer_tail, memory_order_release);
+    }
+
+    if (l->token.type == TOKEN_TYPE_EOF)
+    {
+        thread_join(pipe->thread);
+        stats_add(&stats, &pipe->stats);
+        l->stream = pipe->lexer.stream;
+        l->pipe = NULL;
+        free(pipe);
+    }
+}
+
+lexer_pipe_t * lexer_pipe_new(void)
+{
+    lexer_pipe_t * pipe = xmalloc(sizeof(lexer_pipe_t));
+    atomic_init(&pipe->head, 0);
+    atomic_init(&pipe->tail, 0);
+    pipe->consumer_head = 0;
+    pipe->consumer_tail = 0;
+    pipe->timing = stats.timing;
+    return pipe;
+}
+
+// The lexer of the pipe has scanned its first token, l only consumes them.
+void lexer_pipe_start(lexer_t * l, lexer_pipe_t * pipe)
+{
+    l->stream = pipe->lexer.stream;
+    l->end = pipe->lexer.end;
+    l->reader = NULL;
+    l->pipe = pipe;
+    pipe->thread = thread_start(lexer_pipe_produce, pipe);
+    lexer_pipe_consume(l);
+}
+
+void init_lexer_pipelined(lexer_t * l, const char * input)
+{
+    lexer_pipe_t * pipe = lexer_pipe_new();
+    init_lexer(&pipe->lexer, input);
+    lexer_pipe_start(l, pipe);
+}
+
+void init_lexer_stream_pipelined(lexer_t * l, lexer_read_fn_t read, void * context)
+{
+    lexer_pipe_t * pipe = lexer_pipe_new();
+    init_lexer_stream(&pipe->lexer, read, context);
+    lexer_pipe_start(l, pipe);
+}
+
+void next_token(lexer_t * l)
+{
+    if (l->pipe)
+    {
+        lexer_pipe_consume(l);
+    }
+    else if (stats.timing)
+    {
+        uint64_t start = time_ns();
+        scan_token(l);
+        stats.lex_ns += time_ns() - start;
+    }
+    else
+    {
+        scan_token(l);
+    }
+}
+
 void init_lexer(lexer_t * l, const char * input)
 {
     assert(l);
@@ -401,9 +1576,56 @@ void init_lexer(lexer_t * l, const char * input)
 
     init_keywords();
     l->stream = input;
+    l->end = input + strlen(input);
+    l->reader = NULL;
+    l->pipe = NULL;
+    next_token(l);
+}
+
+void init_lexer_stream(lexer_t * l, lexer_read_fn_t read, void * context)
+{
+    assert(l);
+    assert(read);
+
+    init_keywords();
+    lexer_reader_t * reader = xmalloc(sizeof(lexer_reader_t));
+    reader->read = read;
+    reader->context = context;
+    reader->capacity = LEXER_CHUNK_SIZE;
+    reader->buffer = xmalloc(reader->capacity);
+    reader->buffer[0] = '\0';
+    reader->eof = false;
+
+    l->stream = reader->buffer;
+    l->end = reader->buffer;
+    l->reader = reader;
+    l->pipe = NULL;
+    lexer_refill(l, l->stream);
     next_token(l);
 }
 
+typedef struct test_lexer_reader_t
+{
+    const char * input;
+    uint64_t left;
+    uint64_t calls;
+} test_lexer_reader_t;
+
+// Hands out 1 to 7 bytes per call like a pipe that is written slowly, and
+// now and then all that was asked for.
+uint64_t test_lexer_read(void * context, char * buffer, uint64_t size)
+{
+    test_lexer_reader_t * reader = context;
+    uint64_t count = reader->calls % 64 == 0 ? size : 1 + reader->calls % 7;
+    reader->calls++;
+    count = count < size ? count : size;
+    count = count < reader->left ? count : reader->left;
+    memcpy(buffer, reader->input, count);
+    reader->input += count;
+    reader->left -= count;
+    return count;
+}
+
 void test_lexer(void)
 {
     lexer_t lexer;
@@ -449,6 +1671,134 @@ void test_lexer(void)
         assert(lexer.token.type == 0);
     }
 
+    {
+        // Long enough for the eight byte path, up to the largest values.
+        init_lexer(&lexer, "18446744073709551615 0xFFFFffffFFFFffff "
+                "0b1111111111111111111111111111111111111111111111111111111111111111 "
+                "01777777777777777777777 12345678_90 0xdead_BEEFcafe 0b10101010101;");
+        uint64_t expected[] = { UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX, 1234567890, 0xdeadbeefcafe, 1365 };
+        for (uint64_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i)
+        {
+            assert(lexer.token.type == TOKEN_TYPE_INTEGER);
+            assert(lexer.token.integer == expected[i]);
+            next_token(&lexer);
+        }
+        assert(lexer.token.type == TOKEN_TYPE_SEMICOLON);
+    }
+
+    {
+        // Every digit count in every base, with the value ending right
+        // before the end of the input as well as before another token.
+        uint64_t value = 0x9e3779b97f4a7c15;
+        for (int32_t i = 0; i < 256; ++i)
+        {
+            uint64_t expected = value >> (i % 64);
+            char text[128];
+            switch (i % 4)
+            {
+            case 0: snprintf(text, sizeof(text), "%llu", (unsigned long long)expected); break;
+            case 1: snprintf(text, sizeof(text), "0x%llx", (unsigned long long)expected); break;
+            case 2: snprintf(text, sizeof(text), "0%llo", (unsigned long long)expected); break;
+            case 3:
+            {
+                int32_t length = 2;
+                strcpy(text, "0b");
+                for (int32_t bit = 63 - i % 64; bit >= 0; --bit)
+                {
+                    text[length++] = '0' + ((expected >> bit) & 1);
+                }
+                text[length] = '\0';
+                break;
+            }
+            }
+            if (i & 1)
+            {
+                strcat(text, ")");
+            }
+
+            init_lexer(&lexer, text);
+            assert(lexer.token.type == TOKEN_TYPE_INTEGER);
+            assert(lexer.token.integer == expected);
+            value = value * 6364136223846793005ull + 1442695040888963407ull;
+        }
+    }
+
+    {
+        init_lexer(&lexer, "1.5 0.1f32 2.5e-3 1e3f64 1_000.25 0.x 012.5 7e+2;");
+        double expected[] = { 1.5, (float)0.1, 2.5e-3, 1e3 };
+        for (uint64_t i = 0; i < sizeof(expected) / sizeof(expected[0]); ++i)
+        {
+            assert(lexer.token.type == TOKEN_TYPE_FLOAT);
+            assert(lexer.token.float_value.value == expected[i]);
+            assert(lexer.token.float_value.is_f32 == (i == 1));
+            next_token(&lexer);
+        }
+        assert(lexer.token.type == TOKEN_TYPE_FLOAT && lexer.token.float_value.value == 1000.25);
+
+        // A '.' without digits after it is not a fraction, and a leading
+        // zero only means octal for integers.
+        next_token(&lexer);
+        assert(lexer.token.type == TOKEN_TYPE_INTEGER && lexer.token.integer == 0);
+        next_token(&lexer);
+        assert(lexer.token.type == TOKEN_TYPE_DOT);
+        next_token(&lexer);
+        assert(lexer.token.type == TOKEN_TYPE_IDENTIFIER);
+        next_token(&lexer);
+        assert(lexer.token.type == TOKEN_TYPE_FLOAT && lexer.token.float_value.value == 12.5);
+        next_token(&lexer);
+        assert(lexer.token.type == TOKEN_TYPE_FLOAT && lexer.token.float_value.value == 700.0);
+        next_token(&lexer);
+        assert(lexer.token.type == TOKEN_TYPE_SEMICOLON);
+    }
+
+    {
+        // Past 19 digits, on both sides of and exactly at a halfway point,
+        // and the smallest subnormals.
+        const char * texts[] =
+        {
+            "9007199254740993.0",
+            "9007199254740993.000000000000000000000000000001",
+            "9007199254740992.999999999999999999999999999999",
+            "123456789012345678901234567890e-10",
+            "2.4703282292062327e-324",
+            "2.4703282292062328e-324",
+            "1.4e-45f32",
+        };
+        double expected[] =
+        {
+            9007199254740992.0,
+            9007199254740994.0,
+            9007199254740992.0,
+            12345678901234567890.1234567890,
+            0.0,
+            4.9406564584124654e-324,
+            1.4e-45f,
+        };
+        for (uint64_t i = 0; i < sizeof(texts) / sizeof(texts[0]); ++i)
+        {
+            init_lexer(&lexer, texts[i]);
+            assert(lexer.token.type == TOKEN_TYPE_FLOAT);
+            assert(lexer.token.float_value.value == expected[i]);
+        }
+    }
+
+    {
+        // Comments nest and may end the input, division is unaffected.
+        init_lexer(&lexer, "a // line /* not a block\n"
+                "/ b /* one /* two ** / */ still one * / */ /= c/**/d\t/*/ x */ "
+                "/* a block longer than sixteen bytes, with * and / inside */ e // end");
+        const char * names[] = { "a", NULL, "b", NULL, "c", "d", "e" };
+        token_type_t types[] = { TOKEN_TYPE_IDENTIFIER, TOKEN_TYPE_DIV, TOKEN_TYPE_IDENTIFIER,
+                TOKEN_TYPE_ASSIGN_DIV, TOKEN_TYPE_IDENTIFIER, TOKEN_TYPE_IDENTIFIER, TOKEN_TYPE_IDENTIFIER };
+        for (uint64_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i)
+        {
+            assert(lexer.token.type == types[i]);
+            assert(!names[i] || strcmp(lexer.token.identifier, names[i]) == 0);
+            next_token(&lexer);
+        }
+        assert(lexer.token.type == TOKEN_TYPE_EOF);
+    }
+
     {
         init_lexer(&lexer, " '@' '\\'' '\\\\' '\\n'");
         assert(lexer.token.type == TOKEN_TYPE_INTEGER);
@@ -533,4 +1883,72 @@ void test_lexer(void)
         next_token(&lexer);
         assert(lexer.token.type == TOKEN_TYPE_KW_CONST);
     }
+
+    {
+        // Every kind of token, each pass shifted by a byte so that across
+        // the chunks each of them is cut at every offset.
+        buf_t buf = { 0 };
+        for (int32_t i = 0; i < 12000; ++i)
+        {
+            buf_printf(&buf, "%.*s", i % 13, "             ");
+            buf_printf(&buf, "name_%d >>= 0x%x 1.25e-%df32 /* a /* b */ */ \"s\\\"%d\" // x\n", i, i, i % 30, i);
+            buf_printf(&buf, "'\\n' %d.%d 0b101 -> != 1e+%d\n", i, i, i % 300);
+        }
+
+        // A string longer than a chunk grows the buffer.
+        buf_write(&buf, "\"", 1);
+        for (int32_t i = 0; i < 20000; ++i)
+        {
+            buf_write(&buf, "0123456789", 10);
+        }
+        buf_write(&buf, "\" /* */ end", 11);
+        char * source = buf_string(&buf);
+        buf_free(&buf);
+
+        lexer_t expected;
+        init_lexer(&expected, source);
+        test_lexer_reader_t reader = { source, strlen(source), 0 };
+        init_lexer_stream(&lexer, test_lexer_read, &reader);
+
+        uint64_t count = 0;
+        while (true)
+        {
+            token_t a = expected.token;
+            token_t b = lexer.token;
+            assert(a.type == b.type);
+            switch (a.type)
+            {
+            case TOKEN_TYPE_INTEGER: assert(a.integer == b.integer); break;
+            case TOKEN_TYPE_FLOAT:
+                assert(a.float_value.value == b.float_value.value);
+                assert(a.float_value.is_f32 == b.float_value.is_f32);
+                break;
+            case TOKEN_TYPE_IDENTIFIER: assert(a.identifier == b.identifier); break;
+            case TOKEN_TYPE_STRING:
+                assert(a.string.length == b.string.length);
+                assert(strcmp(a.string.str, b.string.str) == 0);
+                sb_free(a.string.str);
+                sb_free(b.string.str);
+                break;
+            default: break;
+            }
+            if (a.type == TOKEN_TYPE_EOF)
+            {
+                break;
+            }
+            next_token(&expected);
+            next_token(&lexer);
+            count++;
+        }
+        assert(count == 12000 * 11 + 2);
+        assert(lexer.reader == NULL);
+        free(source);
+
+        // A comment can be the last thing in the input.
+        reader = (test_lexer_reader_t){ "a /* /* */ */", 13, 0 };
+        init_lexer_stream(&lexer, test_lexer_read, &reader);
+        assert(lexer.token.type == TOKEN_TYPE_IDENTIFIER);
+        next_token(&lexer);
+        assert(lexer.token.type == TOKEN_TYPE_EOF);
+    }
 }
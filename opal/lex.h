@@ -3,13 +3,13 @@
 #include <stdint.h>
 #include "common.h"
 
-// @Todo Floating point numbers
 typedef enum token_type_t
 {
     TOKEN_TYPE_EOF = 0,
 
     // Literals
     TOKEN_TYPE_INTEGER,
+    TOKEN_TYPE_FLOAT,
     TOKEN_TYPE_IDENTIFIER,
     TOKEN_TYPE_STRING,
 
@@ -95,6 +95,7 @@ typedef enum token_type_t
     TOKEN_TYPE_KW_TYPE,
     TOKEN_TYPE_KW_CONTINUE,
     TOKEN_TYPE_KW_BREAK,
+    TOKEN_TYPE_KW_IMPORT,
     TOKEN_TYPE_KW_END_,
 } token_type_t;
 
@@ -104,6 +105,11 @@ typedef struct token_t
     union
     {
         uint64_t integer;
+        struct
+        {
+            double value;
+            bool is_f32;
+        } float_value;
         const char * identifier;
         char character;
         struct
@@ -114,12 +120,38 @@ typedef struct token_t
     };
 } token_t;
 
+struct lexer_pipe_t;
+struct lexer_reader_t;
+
+// Fills buffer with up to size bytes of input, returning how many it wrote
+// and 0 only at the end of the input.
+typedef uint64_t (*lexer_read_fn_t)(void * context, char * buffer, uint64_t size);
+
 typedef struct lexer_t
 {
     const char * stream;
+    // Points at the terminating NUL, reads of several bytes stay before it.
+    const char * end;
     token_t token;
+    struct lexer_reader_t * reader;
+    struct lexer_pipe_t * pipe;
 } lexer_t;
 
 void next_token(lexer_t * l);
+void init_keywords(void);
 void init_lexer(lexer_t * l, const char * input);
+
+// Lexes the input on a separate thread which feeds the tokens to next_token
+// through a bounded single-producer/single-consumer ring. The thread is
+// joined, and its stats merged, once the end of the input has been read.
+void init_lexer_pipelined(lexer_t * l, const char * input);
+
+// Lexes input pulled from read in chunks of LEXER_CHUNK_SIZE bytes, so the
+// whole input is never held at once and lexing starts with the first chunk.
+// Only a token longer than a chunk makes the buffer grow. lexer_read_file is
+// a read function for a FILE *.
+void init_lexer_stream(lexer_t * l, lexer_read_fn_t read, void * context);
+void init_lexer_stream_pipelined(lexer_t * l, lexer_read_fn_t read, void * context);
+uint64_t lexer_read_file(void * file, char * buffer, uint64_t size);
+const char * token_op_string(token_type_t type);
 void test_lexer(void);
@@ -4,15 +4,282 @@
 #include <assert.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdbool.h>
 
 #include "common.h"
 #include "lex.h"
 #include "parse.h"
+#include "resolve.h"
+#include "vm.h"
+#include "gen_c.h"
+#include "print.h"
+#include "trace.h"
+#include "module.h"
+#include "iface.h"
+#include "server.h"
+
+void usage(void)
+{
+    printf("Usage: opal [<input.opal> [options]]\n");
+    printf("       opal --server <socket> <input.opal> [options]\n");
+    printf("       opal --server <socket> --stop\n");
+    printf("       opal --daemon <socket>\n");
+    printf("Without arguments the unit tests are run. With --server the compile runs in\n");
+    printf("the compile server listening on socket, which is started in the background if\n");
+    printf("needed and keeps the modules it parsed for the next compiles. --daemon runs\n");
+    printf("that server in the foreground. An input of - is read from stdin in chunks\n");
+    printf("while it is being written, imports are found relative to the working directory.\n");
+    printf("  -o <output>          write to a file instead of stdout\n");
+    printf("  -j <threads>         threads parsing imported modules, one per CPU by default\n");
+    printf("  --cache <dir>        keep parsed modules in dir and reuse them while their\n");
+    printf("                       source is unchanged\n");
+    printf("  --ast                dump the input file as S-expressions instead of C code,\n");
+    printf("                       imports are not followed\n");
+    printf("  --run                compile to bytecode and run main in the VM instead of\n");
+    printf("                       writing C code, exiting with what main returns\n");
+    printf("  --lex-thread         lex on a separate thread while parsing\n");
+    printf("  --stats              print phase times and allocation counters to stderr\n");
+    printf("  --trace <file.json>  record phases and declarations as Chrome trace JSON\n");
+    exit(1);
+}
+
+void print_stats(uint64_t total_ns)
+{
+    fprintf(stderr, "read:      %10.3f ms\n", stats.read_ns / 1e6);
+    fprintf(stderr, "lex:       %10.3f ms\n", stats.lex_ns / 1e6);
+    fprintf(stderr, "parse:     %10.3f ms (without lex)\n", stats.parse_ns / 1e6);
+    fprintf(stderr, "resolve:   %10.3f ms\n", stats.resolve_ns / 1e6);
+    fprintf(stderr, "output:    %10.3f ms\n", stats.output_ns / 1e6);
+    fprintf(stderr, "total:     %10.3f ms\n", total_ns / 1e6);
+    fprintf(stderr, "xmalloc:   %10llu calls %12llu bytes\n",
+        (unsigned long long)stats.xmalloc_calls, (unsigned long long)stats.xmalloc_bytes);
+    fprintf(stderr, "xrealloc:  %10llu calls %12llu bytes\n",
+        (unsigned long long)stats.xrealloc_calls, (unsigned long long)stats.xrealloc_bytes);
+    fprintf(stderr, "sb grows:  %10llu\n", (unsigned long long)stats.sb_grows);
+    fprintf(stderr, "intern:    %10llu hits  %12llu misses\n",
+        (unsigned long long)stats.intern_hits, (unsigned long long)stats.intern_misses);
+    fprintf(stderr, "cache:     %10llu hits  %12llu misses\n",
+        (unsigned long long)stats.module_cache_hits, (unsigned long long)stats.module_cache_misses);
+}
+
+// Declarations are dumped as soon as they are parsed and freed right away,
+// so --ast runs in memory bounded by the largest declaration.
+void dump_decl(ast_decl_t * decl, void * user_data)
+{
+    uint64_t start = time_ns();
+    print_decl(user_data, decl);
+    ast_free_decl(decl);
+    stats.output_ns += time_ns() - start;
+}
+
+// Compiles an Opal source file to C, written to stdout unless an output
+// path is given, or runs it in the VM with --run.
+int compile_file(int argc, char * argv[])
+{
+    const char * input_path = NULL;
+    const char * output_path = NULL;
+    bool dump_ast = false;
+    bool run = false;
+    const char * cache_dir = NULL;
+    bool lex_thread = false;
+    int32_t num_threads = cpu_count();
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--ast") == 0)
+        {
+            dump_ast = true;
+        }
+        else if (strcmp(argv[i], "--run") == 0)
+        {
+            run = true;
+        }
+        else if (strcmp(argv[i], "--lex-thread") == 0)
+        {
+            lex_thread = true;
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            stats.timing = true;
+        }
+        else if (strcmp(argv[i], "--trace") == 0)
+        {
+            if (++i == argc) { usage(); }
+            trace_init(argv[i]);
+        }
+        else if (strcmp(argv[i], "--cache") == 0)
+        {
+            if (++i == argc) { usage(); }
+            cache_dir = argv[i];
+        }
+        else if (strcmp(argv[i], "-j") == 0)
+        {
+            if (++i == argc || (num_threads = atoi(argv[i])) <= 0) { usage(); }
+        }
+        else if (strcmp(argv[i], "-o") == 0)
+        {
+            if (++i == argc) { usage(); }
+            output_path = argv[i];
+        }
+        else if (!input_path)
+        {
+            input_path = argv[i];
+        }
+        else
+        {
+            usage();
+        }
+    }
+
+    if (!input_path || (run && (dump_ast || output_path)))
+    {
+        usage();
+    }
+
+    trace_thread_name("main");
+    trace_begin("compile_file");
+    uint64_t start = time_ns();
+
+    FILE * output = output_path ? fopen(output_path, "wb") : stdout;
+    if (!output)
+    {
+        printf("Cannot write '%s'\n", output_path);
+        return 1;
+    }
+    buf_t buf = { .file = output };
+    init_resolver();
+
+    int exit_code = 0;
+    uint64_t phase_start = 0;
+    if (dump_ast && strcmp(input_path, "-") == 0)
+    {
+        // Reading is interleaved with lexing, so it counts as lexing.
+        phase_start = time_ns();
+        if (lex_thread)
+        {
+            init_parser_stream_pipelined(lexer_read_file, stdin);
+        }
+        else
+        {
+            init_parser_stream(lexer_read_file, stdin);
+        }
+        parse_document_stream(dump_decl, &buf);
+        stats.parse_ns = time_ns() - phase_start - (lex_thread ? 0 : stats.lex_ns) - stats.output_ns;
+    }
+    else if (dump_ast)
+    {
+        trace_begin("read_file");
+        char * source = read_file(input_path);
+        if (!source)
+        {
+            printf("Cannot read '%s'\n", input_path);
+            return 1;
+        }
+        trace_end(input_path);
+        stats.read_ns = time_ns() - start;
+
+        phase_start = time_ns();
+        if (lex_thread)
+        {
+            init_parser_pipelined(source);
+        }
+        else
+        {
+            init_parser(source);
+        }
+        parse_document_stream(dump_decl, &buf);
+        stats.parse_ns = time_ns() - phase_start - (lex_thread ? 0 : stats.lex_ns) - stats.output_ns;
+        free(source);
+    }
+    else
+    {
+        sb_t(ast_decl_t *) decls = load_modules(input_path, num_threads, lex_thread, cache_dir);
+
+        phase_start = time_ns();
+        trace_begin("resolve");
+        resolve_add_decls(decls);
+        for (ast_decl_t ** it = decls; it != sb_end(decls); ++it)
+        {
+            trace_begin("check_sym");
+            check_sym((*it)->sym);
+            trace_end((*it)->name);
+        }
+        trace_end(NULL);
+        stats.resolve_ns = time_ns() - phase_start;
+
+        phase_start = time_ns();
+        if (run)
+        {
+            trace_begin("run");
+            vm_module_t * module = compile_bytecode(decls);
+            exit_code = (int)vm_run(module, "main");
+            trace_end(NULL);
+        }
+        else
+        {
+            trace_begin("gen_c_code");
+            gen_c_code(decls, &buf);
+            trace_end(output_path);
+        }
+        stats.output_ns = time_ns() - phase_start;
+    }
+
+    phase_start = time_ns();
+    buf_free(&buf);
+    if (output != stdout)
+    {
+        fclose(output);
+    }
+    stats.output_ns += time_ns() - phase_start;
+    trace_end(NULL);
+
+    if (stats.timing)
+    {
+        print_stats(time_ns() - start);
+    }
+
+    return exit_code;
+}
 
 int main(int argc, char * argv[])
 {
+    if (argc > 1 && strcmp(argv[1], "--daemon") == 0)
+    {
+        if (argc != 3) { usage(); }
+        return server_run(argv[2], compile_file);
+    }
+    if (argc > 1 && strcmp(argv[1], "--server") == 0)
+    {
+        if (argc < 4) { usage(); }
+        const char * path = argv[2];
+        if (argc == 4 && strcmp(argv[3], "--stop") == 0)
+        {
+            return server_stop(path);
+        }
+        argv[2] = argv[0];
+        for (int i = 3; i < argc; ++i)
+        {
+            // The server cannot read the client's stdin, that compile stays here.
+            if (strcmp(argv[i], "-") == 0)
+            {
+                return compile_file(argc - 2, argv + 2);
+            }
+        }
+        return server_request(path, argc - 2, argv + 2, compile_file);
+    }
+    if (argc > 1)
+    {
+        return compile_file(argc, argv);
+    }
+
     test_common();
     test_lexer();
     test_parser();
+    test_resolve();
+    test_vm();
+    test_gen_c();
+    test_print();
+    test_trace();
+    test_iface();
     return 0;
 }
@@ -0,0 +1,386 @@
+#include "module.h"
+#include "parse.h"
+#include "iface.h"
+#include "trace.h"
+#include "common.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+enum
+{
+    MODULE_MAX_THREADS = 64
+};
+
+typedef enum module_mark_t
+{
+    MODULE_UNVISITED,
+    MODULE_VISITING,
+    MODULE_VISITED
+} module_mark_t;
+
+typedef struct module_worker_t
+{
+    thread_t thread;
+    int32_t id;
+    bool timing;
+    stats_t stats;
+} module_worker_t;
+
+// Everything below the lock is shared between the loader threads.
+spin_lock_t module_lock = SPIN_LOCK_INIT;
+map_t module_map;
+sb_t(module_t *) module_queue = NULL;
+int32_t module_queue_head = 0;
+int32_t module_pending = 0;
+
+module_hooks_t module_hooks = { 0 };
+
+const char * module_root = NULL;
+const char * module_cache_dir = NULL;
+bool module_pipelined = false;
+sb_t(module_t *) module_stack = NULL;
+
+void module_error(const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    printf("Module error: ");
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+    exit(1); // @Todo Good error handling
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Loading
+////////////////////////////////////////////////////////////////////////////////
+
+char * module_file_path(const char * name)
+{
+    uint64_t root_length = strlen(module_root);
+    uint64_t name_length = strlen(name);
+    char * path = xmalloc(root_length + name_length + sizeof("/.opal"));
+
+    memcpy(path, module_root, root_length);
+    path[root_length] = '/';
+    for (uint64_t i = 0; i < name_length; ++i)
+    {
+        path[root_length + 1 + i] = name[i] == '.' ? '/' : name[i];
+    }
+    memcpy(path + root_length + 1 + name_length, ".opal", sizeof(".opal"));
+    return path;
+}
+
+char * module_cache_path(const char * name)
+{
+    uint64_t dir_length = strlen(module_cache_dir);
+    uint64_t name_length = strlen(name);
+    char * path = xmalloc(dir_length + name_length + sizeof("/.opali"));
+
+    memcpy(path, module_cache_dir, dir_length);
+    path[dir_length] = '/';
+    memcpy(path + dir_length + 1, name, name_length);
+    memcpy(path + dir_length + 1 + name_length, ".opali", sizeof(".opali"));
+    return path;
+}
+
+// Returns the module with that name, queueing it to be parsed the first
+// time it is asked for.
+module_t * module_request(const char * name, const char * importer, char * file_path)
+{
+    spin_lock(&module_lock);
+    module_t * module = map_get(&module_map, name);
+    if (!module)
+    {
+        module = xmalloc(sizeof(module_t));
+        memset(module, 0, sizeof(module_t));
+        module->name = name;
+        module->importer = importer;
+        module->file_path = file_path ? file_path : module_file_path(name);
+
+        map_put(&module_map, name, module);
+        sb_push(module_queue, module);
+        module_pending++;
+    }
+    spin_unlock(&module_lock);
+    return module;
+}
+
+void module_parse(module_t * module)
+{
+    trace_begin("load_module");
+
+    // A root module on stdin is lexed while it is read and never cached,
+    // there is no source to hash before parsing it.
+    bool from_stdin = strcmp(module->file_path, "-") == 0;
+    uint64_t start = time_ns();
+    trace_begin("read_file");
+    char * source = from_stdin ? NULL : read_file(module->file_path);
+    trace_end(module->file_path);
+    if (!source && !from_stdin)
+    {
+        if (module->importer)
+        {
+            module_error("Cannot read module '%s' (%s) imported by '%s'",
+                module->name, module->file_path, module->importer);
+        }
+        module_error("Cannot read '%s'", module->file_path);
+    }
+    stats.read_ns += time_ns() - start;
+
+    // An unchanged module is taken from the process that loaded it before,
+    // or decoded from its interface file in the cache directory, instead of
+    // being parsed. Both still take reading and hashing the source to know
+    // that it is unchanged.
+    uint64_t lex_ns = stats.lex_ns;
+    start = time_ns();
+    bool use_cache = !from_stdin && (module_cache_dir || module_hooks.find || module_hooks.loaded);
+    uint64_t source_hash = use_cache ? hash_range(source, strlen(source)) : 0;
+    bool warm = module_hooks.find && module_hooks.find(module->file_path, source_hash, &module->decls);
+    bool cached = warm;
+    char * cache_path = NULL;
+    if (use_cache && module_cache_dir && !warm)
+    {
+        cache_path = module_cache_path(module->name);
+        trace_begin("load_interface");
+        cached = iface_load(cache_path, source_hash, &module->decls);
+        trace_end(cached ? "hit" : "miss");
+    }
+    if (use_cache)
+    {
+        if (cached)
+        {
+            stats.module_cache_hits++;
+        }
+        else
+        {
+            stats.module_cache_misses++;
+        }
+    }
+
+    if (!cached)
+    {
+        if (from_stdin && module_pipelined)
+        {
+            init_parser_stream_pipelined(lexer_read_file, stdin);
+        }
+        else if (from_stdin)
+        {
+            init_parser_stream(lexer_read_file, stdin);
+        }
+        else if (module_pipelined)
+        {
+            init_parser_pipelined(source);
+        }
+        else
+        {
+            init_parser(source);
+        }
+        module->decls = parse_document();
+    }
+
+    if (cache_path && !cached)
+    {
+        trace_begin("save_interface");
+        if (!iface_save(cache_path, source_hash, module->decls))
+        {
+            fprintf(stderr, "Cannot write module interface '%s'\n", cache_path);
+        }
+        trace_end(cache_path);
+    }
+    if (use_cache && module_hooks.loaded && !warm)
+    {
+        module_hooks.loaded(module->file_path, source_hash, module->decls);
+    }
+    stats.parse_ns += time_ns() - start - (module_pipelined ? 0 : stats.lex_ns - lex_ns);
+    free(cache_path);
+    free(source);
+
+    for (ast_decl_t ** it = module->decls; it != sb_end(module->decls); ++it)
+    {
+        if ((*it)->type == AST_DECL_IMPORT)
+        {
+            sb_push(module->imports, module_request((*it)->name, module->name, NULL));
+        }
+    }
+
+    trace_end(module->name);
+}
+
+void module_work(void * arg)
+{
+    module_worker_t * worker = arg;
+    if (worker->id > 0)
+    {
+        stats.timing = worker->timing;
+        char name[32];
+        snprintf(name, sizeof(name), "loader %d", worker->id);
+        trace_thread_name(intern_string(name));
+    }
+
+    while (true)
+    {
+        module_t * module = NULL;
+        bool done = false;
+
+        spin_lock(&module_lock);
+        if (module_queue_head < sb_len(module_queue))
+        {
+            module = module_queue[module_queue_head++];
+        }
+        else
+        {
+            done = module_pending == 0;
+        }
+        spin_unlock(&module_lock);
+
+        if (module)
+        {
+            module_parse(module);
+            spin_lock(&module_lock);
+            module_pending--;
+            spin_unlock(&module_lock);
+        }
+        else if (done)
+        {
+            break;
+        }
+        else
+        {
+            thread_yield();
+        }
+    }
+
+    if (worker->id > 0)
+    {
+        worker->stats = stats;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Ordering
+////////////////////////////////////////////////////////////////////////////////
+
+void module_cycle_error(module_t * module)
+{
+    char message[1024];
+    int32_t length = 0;
+    bool in_cycle = false;
+    for (int32_t i = 0; i < sb_len(module_stack); ++i)
+    {
+        in_cycle = in_cycle || module_stack[i] == module;
+        if (in_cycle && length < (int32_t)sizeof(message))
+        {
+            length += snprintf(message + length, sizeof(message) - length, "%s -> ", module_stack[i]->name);
+        }
+    }
+    if (length < (int32_t)sizeof(message))
+    {
+        snprintf(message + length, sizeof(message) - length, "%s", module->name);
+    }
+    module_error("Import cycle: %s", message);
+}
+
+// Depth first, so every module is appended after everything it imports.
+void module_append_decls(module_t * module, sb_t(ast_decl_t *) * decls)
+{
+    if (module->mark == MODULE_VISITED)
+    {
+        return;
+    }
+    if (module->mark == MODULE_VISITING)
+    {
+        module_cycle_error(module);
+    }
+
+    module->mark = MODULE_VISITING;
+    sb_push(module_stack, module);
+    for (int32_t i = 0; i < sb_len(module->imports); ++i)
+    {
+        module_append_decls(module->imports[i], decls);
+    }
+    _sb_raw_len(module_stack)--;
+    module->mark = MODULE_VISITED;
+
+    for (ast_decl_t ** it = module->decls; it != sb_end(module->decls); ++it)
+    {
+        if ((*it)->type != AST_DECL_IMPORT)
+        {
+            sb_push(*decls, *it);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Entry point
+////////////////////////////////////////////////////////////////////////////////
+
+sb_t(ast_decl_t *) load_modules(const char * path, int32_t num_threads, bool pipelined_lexer, const char * cache_dir)
+{
+    trace_begin("load_modules");
+
+    // The root module is named after its file, so importing it back is
+    // reported as a cycle.
+    const char * slash = strrchr(path, '/');
+#if defined(_WIN32)
+    const char * backslash = strrchr(path, '\\');
+    if (backslash && (!slash || backslash > slash))
+    {
+        slash = backslash;
+    }
+#endif
+    const char * base = slash ? slash + 1 : path;
+    const char * dot = strrchr(base, '.');
+    const char * name = intern_string_range(base, (dot && dot > base ? dot : base + strlen(base)) - 1);
+    module_root = slash ? intern_string_range(path, slash - 1) : ".";
+
+    char * file_path = xmalloc(strlen(path) + 1);
+    strcpy(file_path, path);
+
+    init_keywords();
+    module_pipelined = pipelined_lexer;
+    module_cache_dir = cache_dir;
+    if (cache_dir && !make_dir(cache_dir))
+    {
+        module_error("Cannot create the cache directory '%s'", cache_dir);
+    }
+    module_t * root = module_request(name, NULL, file_path);
+
+    if (num_threads < 1)
+    {
+        num_threads = 1;
+    }
+    if (num_threads > MODULE_MAX_THREADS)
+    {
+        num_threads = MODULE_MAX_THREADS;
+    }
+
+    module_worker_t workers[MODULE_MAX_THREADS];
+    for (int32_t i = 0; i < num_threads; ++i)
+    {
+        workers[i].id = i;
+        workers[i].timing = stats.timing;
+        memset(&workers[i].stats, 0, sizeof(stats_t));
+        if (i > 0)
+        {
+            workers[i].thread = thread_start(module_work, &workers[i]);
+        }
+    }
+    module_work(&workers[0]);
+    for (int32_t i = 1; i < num_threads; ++i)
+    {
+        thread_join(workers[i].thread);
+        stats_add(&stats, &workers[i].stats);
+    }
+
+    sb_t(ast_decl_t *) decls = NULL;
+    module_append_decls(root, &decls);
+
+    trace_end(NULL);
+    return decls;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "common.h"
+#include "ast.h"
+
+// `import a.b;` refers to the file a/b.opal relative to the directory of
+// the file the compilation started from. All modules share one global
+// namespace.
+typedef struct module_t
+{
+    const char * name;
+    const char * importer;
+    char * file_path;
+    sb_t(ast_decl_t *) decls;
+    sb_t(struct module_t *) imports;
+    int32_t mark;
+} module_t;
+
+// Lets a long running process hand out modules it loaded before and collect
+// the ones loaded now. find returns true with the declarations of the file
+// if it has them for that exact source. loaded is called for every module
+// that did not come from find. Both are called from the loader threads.
+typedef struct module_hooks_t
+{
+    bool (*find)(const char * file_path, uint64_t source_hash, sb_t(ast_decl_t *) * decls);
+    void (*loaded)(const char * file_path, uint64_t source_hash, sb_t(ast_decl_t *) decls);
+} module_hooks_t;
+
+extern module_hooks_t module_hooks;
+
+// Loads the module in path and everything it imports. Modules are parsed on
+// up to num_threads threads as soon as an import of them is seen, and each
+// one exactly once however many modules import it. An import cycle is a
+// compile error. Returns the declarations of all modules with every module
+// after the ones it imports, without the import declarations themselves.
+//
+// With a cache_dir, parsed modules are kept there as interface files named
+// after the module and reused for as long as the module source is unchanged.
+sb_t(ast_decl_t *) load_modules(const char * path, int32_t num_threads, bool pipelined_lexer,
+    const char * cache_dir);
@@ -1,5 +1,20 @@
+// fileno and writev are POSIX and realpath is XSI, they are not declared in
+// strict C modes without asking for them before the first include.
+#if !defined(_WIN32) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 700
+#endif
+
 #include "main.c"
 #include "common.c"
 #include "lex.c"
 #include "ast.c"
 #include "parse.c"
+#include "resolve.c"
+#include "bytecode.c"
+#include "vm.c"
+#include "gen_c.c"
+#include "print.c"
+#include "trace.c"
+#include "module.c"
+#include "iface.c"
+#include "server.c"
@@ -0,0 +1,19 @@
+// Same unity build as opal.c with the benchmark driver instead of main.c.
+#if !defined(_WIN32) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 700
+#endif
+
+#include "bench.c"
+#include "common.c"
+#include "lex.c"
+#include "ast.c"
+#include "parse.c"
+#include "resolve.c"
+#include "bytecode.c"
+#include "vm.c"
+#include "gen_c.c"
+#include "print.c"
+#include "trace.c"
+#include "module.c"
+#include "iface.c"
+#include "server.c"
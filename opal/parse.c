@@ -2,17 +2,22 @@
 #include "common.h"
 #include "lex.h"
 #include "ast.h"
+#include "trace.h"
+#include "print.h"
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
+#include <assert.h>
 
-lexer_t l;
+// Each thread parses its own input, see the module loader.
+THREAD_LOCAL lexer_t l;
 
-inline bool is_token(token_type_t type)
+static inline bool is_token(token_type_t type)
 {
     return l.token.type == type;
 }
 
-inline void expect_token(token_type_t type)
+static inline void expect_token(token_type_t type)
 {
     if (!is_token(type))
     {
@@ -21,25 +26,25 @@ inline void expect_token(token_type_t type)
     }
 }
 
-inline bool is_token_cmp_op(void)
+static inline bool is_token_cmp_op(void)
 {
     token_type_t type = l.token.type;
     return type > TOKEN_TYPE_CMP_START_ && type < TOKEN_TYPE_CMP_END_;
 }
 
-inline bool is_token_add_op(void)
+static inline bool is_token_add_op(void)
 {
     token_type_t type = l.token.type;
     return type > TOKEN_TYPE_ADD_START_ && type < TOKEN_TYPE_ADD_END_;
 }
 
-inline bool is_token_mult_op(void)
+static inline bool is_token_mult_op(void)
 {
     token_type_t type = l.token.type;
     return type > TOKEN_TYPE_MULT_START_ && type < TOKEN_TYPE_MULT_END_;
 }
 
-inline bool is_token_invoke_op(void)
+static inline bool is_token_invoke_op(void)
 {
     token_type_t op = l.token.type;
     return op == TOKEN_TYPE_PARENTHESIS_OPEN 
@@ -47,7 +52,7 @@ inline bool is_token_invoke_op(void)
         || op == TOKEN_TYPE_DOT;   
 }
 
-inline bool is_token_unary_op(void)
+static inline bool is_token_unary_op(void)
 {
     token_type_t op = l.token.type;
     return op == TOKEN_TYPE_PLUS
@@ -58,7 +63,7 @@ inline bool is_token_unary_op(void)
         || op == TOKEN_TYPE_MULT;
 }
 
-inline bool is_token_assign_op(void)
+static inline bool is_token_assign_op(void)
 {
     token_type_t type = l.token.type;
     return type > TOKEN_TYPE_ASSIGN_START_ && type < TOKEN_TYPE_ASSIGN_END_;
@@ -135,6 +140,14 @@ ast_expr_t * parse_expr_operand(void)
         next_token(&l);
         return expr;
     }
+    else if (is_token(TOKEN_TYPE_FLOAT))
+    {
+        ast_expr_t * expr = ast_new_expr(AST_EXPR_FLOAT);
+        expr->float_value.value = l.token.float_value.value;
+        expr->float_value.is_f32 = l.token.float_value.is_f32;
+        next_token(&l);
+        return expr;
+    }
     else if (is_token(TOKEN_TYPE_IDENTIFIER))
     {
         const char * identifier = l.token.identifier;
@@ -148,7 +161,7 @@ ast_expr_t * parse_expr_operand(void)
         }
         
         ast_expr_t * expr = ast_new_expr(AST_EXPR_NAME);
-        expr->name = l.token.identifier;
+        expr->name = identifier;
         return expr;
     }
     else if (is_token(TOKEN_TYPE_STRING))
@@ -192,11 +205,10 @@ ast_expr_t * parse_expr_operand(void)
         next_token(&l);
         return expr;
     }
-    else if (is_token(is_token(TOKEN_TYPE_BRACE_OPEN)))
+    else if (is_token(TOKEN_TYPE_BRACE_OPEN))
     {
         return parse_expr_compound(NULL);
     }
-    // @Todo handle floats
 
     printf("Invalid operand\n");
     return NULL;
@@ -704,8 +716,11 @@ ast_stmt_block_t * parse_stmt_block(void)
                 stmt->if_stmt.num_conditions = 0;
                 stmt->if_stmt.else_stmt_block = NULL;
 
+                // Only "else if" continues the chain, a following "if" is
+                // a statement of its own.
                 bool expect_else = false;
-                while (is_token(TOKEN_TYPE_KW_IF))
+                bool more_conditions = true;
+                while (more_conditions)
                 {
                     next_token(&l);
                     expect_token(TOKEN_TYPE_PARENTHESIS_OPEN);
@@ -716,14 +731,12 @@ ast_stmt_block_t * parse_stmt_block(void)
                     sb_push(stmt->if_stmt.stmt_blocks, parse_stmt_block());
                     stmt->if_stmt.num_conditions++;
 
+                    more_conditions = false;
                     if (is_token(TOKEN_TYPE_KW_ELSE))
                     {
                         next_token(&l);
-                        if (!is_token(TOKEN_TYPE_KW_IF))
-                        {
-                            expect_else = true;
-                            break;
-                        }
+                        more_conditions = is_token(TOKEN_TYPE_KW_IF);
+                        expect_else = !more_conditions;
                     }
                 }
 
@@ -925,6 +938,7 @@ ast_stmt_block_t * parse_stmt_block(void)
 
 ast_decl_t * parse_fn_decl(void)
 {
+    trace_begin("parse_fn_decl");
     ast_decl_t * decl = ast_new_decl(AST_DECL_FN);
     decl->fn_decl.params        = NULL;
     decl->fn_decl.num_params    = 0;
@@ -964,66 +978,202 @@ ast_decl_t * parse_fn_decl(void)
     }
 
     decl->fn_decl.stmt_block = parse_stmt_block();
+    trace_end(decl->name);
     return decl;
 }
 
-sb_t(ast_decl_t *) parse_document(void)
+ast_decl_t * parse_import_decl(void)
 {
-    sb_t(ast_decl_t *) top_level_nodes = NULL;
+    ast_decl_t * decl = ast_new_decl(AST_DECL_IMPORT);
+    char path[256];
+    int32_t length = 0;
 
-    bool has_token = true;
-    while (has_token)
+    while (true)
     {
-        switch (l.token.type)
+        expect_token(TOKEN_TYPE_IDENTIFIER);
+        int32_t part_length = (int32_t)strlen(l.token.identifier);
+        if (length + part_length + 2 > (int32_t)sizeof(path))
         {
-        case TOKEN_TYPE_KW_ENUM:
-            next_token(&l);
-            sb_push(top_level_nodes, parse_enum_decl());
-            break;
-        case TOKEN_TYPE_KW_STRUCT:
-            next_token(&l);
-            sb_push(top_level_nodes, parse_aggregate_decl(AST_DECL_STRUCT));
-            break;
-        case TOKEN_TYPE_KW_UNION:
-            next_token(&l);
-            sb_push(top_level_nodes, parse_aggregate_decl(AST_DECL_UNION));
-            break;
-        case TOKEN_TYPE_KW_VAR:
-            next_token(&l);
-            sb_push(top_level_nodes, parse_const_var_decl(AST_DECL_VAR));
-            expect_token(TOKEN_TYPE_SEMICOLON);
-            next_token(&l);
-            break;
-        case TOKEN_TYPE_KW_CONST:
-            next_token(&l);
-            sb_push(top_level_nodes, parse_const_var_decl(AST_DECL_CONST));
-            expect_token(TOKEN_TYPE_SEMICOLON);
-            next_token(&l);
-            break;
-        case TOKEN_TYPE_KW_TYPE:
-            next_token(&l);
-            sb_push(top_level_nodes, parse_type_decl());
-            expect_token(TOKEN_TYPE_SEMICOLON);
-            next_token(&l);
-            break;
-        case TOKEN_TYPE_KW_FN:
-            next_token(&l);
-            sb_push(top_level_nodes, parse_fn_decl());
-            break;
-        case TOKEN_TYPE_EOF:
-            next_token(&l);
-            has_token = false;
-            break;
-        default:
-            printf("Unexpected token\n"); // @Todo Good error handling
+            printf("Module path too long\n");
             exit(1);
-            break;
         }
+        memcpy(path + length, l.token.identifier, part_length);
+        length += part_length;
+        next_token(&l);
+
+        if (!is_token(TOKEN_TYPE_DOT)) { break; }
+        path[length++] = '.';
+        next_token(&l);
     }
 
+    decl->name = intern_string_range(path, path + length - 1);
+    return decl;
+}
+
+// Parses one top level declaration, NULL once the input is exhausted.
+ast_decl_t * parse_next_decl(void)
+{
+    ast_decl_t * decl = NULL;
+    switch (l.token.type)
+    {
+    case TOKEN_TYPE_KW_ENUM:
+        next_token(&l);
+        decl = parse_enum_decl();
+        break;
+    case TOKEN_TYPE_KW_STRUCT:
+        next_token(&l);
+        decl = parse_aggregate_decl(AST_DECL_STRUCT);
+        break;
+    case TOKEN_TYPE_KW_UNION:
+        next_token(&l);
+        decl = parse_aggregate_decl(AST_DECL_UNION);
+        break;
+    case TOKEN_TYPE_KW_VAR:
+        next_token(&l);
+        decl = parse_const_var_decl(AST_DECL_VAR);
+        expect_token(TOKEN_TYPE_SEMICOLON);
+        next_token(&l);
+        break;
+    case TOKEN_TYPE_KW_CONST:
+        next_token(&l);
+        decl = parse_const_var_decl(AST_DECL_CONST);
+        expect_token(TOKEN_TYPE_SEMICOLON);
+        next_token(&l);
+        break;
+    case TOKEN_TYPE_KW_TYPE:
+        next_token(&l);
+        decl = parse_type_decl();
+        expect_token(TOKEN_TYPE_SEMICOLON);
+        next_token(&l);
+        break;
+    case TOKEN_TYPE_KW_FN:
+        next_token(&l);
+        decl = parse_fn_decl();
+        break;
+    case TOKEN_TYPE_KW_IMPORT:
+        next_token(&l);
+        decl = parse_import_decl();
+        expect_token(TOKEN_TYPE_SEMICOLON);
+        next_token(&l);
+        break;
+    case TOKEN_TYPE_EOF:
+        break;
+    default:
+        printf("Unexpected token\n"); // @Todo Good error handling
+        exit(1);
+        break;
+    }
+    return decl;
+}
+
+sb_t(ast_decl_t *) parse_document(void)
+{
+    trace_begin("parse_document");
+    sb_t(ast_decl_t *) top_level_nodes = NULL;
+
+    ast_decl_t * decl = NULL;
+    while ((decl = parse_next_decl()) != NULL)
+    {
+        sb_push(top_level_nodes, decl);
+    }
+
+    trace_end(NULL);
     return top_level_nodes;
 }
 
+void parse_document_stream(parse_decl_callback_t callback, void * user_data)
+{
+    trace_begin("parse_document_stream");
+
+    ast_decl_t * decl = NULL;
+    while ((decl = parse_next_decl()) != NULL)
+    {
+        callback(decl, user_data);
+    }
+
+    trace_end(NULL);
+}
+
+void init_parser(const char * input)
+{
+    init_lexer(&l, input);
+}
+
+void init_parser_pipelined(const char * input)
+{
+    init_lexer_pipelined(&l, input);
+}
+
+void init_parser_stream(lexer_read_fn_t read, void * context)
+{
+    init_lexer_stream(&l, read, context);
+}
+
+void init_parser_stream_pipelined(lexer_read_fn_t read, void * context)
+{
+    init_lexer_stream_pipelined(&l, read, context);
+}
+
+void test_parse_stream_callback(ast_decl_t * decl, void * user_data)
+{
+    sb_t(const char *) * names = user_data;
+    sb_push(*names, decl->name);
+    ast_free_decl(decl);
+}
+
+void test_parse_stream(void)
+{
+    const char * source =
+        "enum e : u8 { a, b = 2 } struct s { x: i32; y: s*[4]; } union u { i: i32; }"
+        "type t = fn(i32, u8*): b8; var v : i32[2] = { [1] = 5, 6 }; const c : u8* = \"str\";"
+        "fn f(p: s*): i32 {"
+        "    for (var i : i32 = 0, i = 1; i < 4; i++) { if (i) { continue; } else { break; } }"
+        "    while (p) { p = cast(s*, p.y[0]); }"
+        "    switch (p.x) { 1, a -> { return -1; } otherwise -> {} }"
+        "    { return p ? (:s){ .x = 1 }.x : f(&p[0]); }"
+        "}";
+
+    sb_t(const char *) names = NULL;
+    init_parser(source);
+    parse_document_stream(test_parse_stream_callback, &names);
+    assert(sb_len(names) == 7);
+    assert(names[0] == intern_string("e"));
+    assert(names[6] == intern_string("f"));
+    assert(parse_next_decl() == NULL);
+    sb_free(names);
+
+    init_parser(source);
+    sb_t(ast_decl_t *) decls = parse_document();
+    assert(sb_len(decls) == 7);
+
+    // Enough copies to wrap the token ring a few times.
+    buf_t buf = { 0 };
+    for (int32_t i = 0; i < 200; ++i)
+    {
+        buf_write(&buf, source, strlen(source));
+    }
+    char * large_source = buf_string(&buf);
+    init_parser(large_source);
+    sb_t(ast_decl_t *) sequential = parse_document();
+    init_parser_pipelined(large_source);
+    sb_t(ast_decl_t *) pipelined = parse_document();
+    assert(l.pipe == NULL);
+    assert(sb_len(pipelined) == sb_len(decls) * 200);
+
+    print_decls(&buf, sequential);
+    char * expected = buf_string(&buf);
+    print_decls(&buf, pipelined);
+    char * actual = buf_string(&buf);
+    assert(strcmp(expected, actual) == 0);
+
+    free(expected);
+    free(actual);
+    free(large_source);
+    ast_free_decls(sequential);
+    ast_free_decls(pipelined);
+    ast_free_decls(decls);
+}
+
 void test_parser(void)
 {
     init_lexer(&l,
@@ -1054,5 +1204,7 @@ void test_parser(void)
         "}"
     );
     parse_document();
+
+    test_parse_stream();
 }
 
@@ -1,4 +1,16 @@
 #pragma once
 
-void test_parser(void);
+#include "ast.h"
+
+// Declarations are handed over one at a time as soon as they are complete,
+// the callback owns them and may free them with ast_free_decl.
+typedef void (*parse_decl_callback_t)(ast_decl_t * decl, void * user_data);
 
+void init_parser(const char * input);
+void init_parser_pipelined(const char * input);
+void init_parser_stream(lexer_read_fn_t read, void * context);
+void init_parser_stream_pipelined(lexer_read_fn_t read, void * context);
+ast_decl_t * parse_next_decl(void);
+sb_t(ast_decl_t *) parse_document(void);
+void parse_document_stream(parse_decl_callback_t callback, void * user_data);
+void test_parser(void);
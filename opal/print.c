@@ -0,0 +1,627 @@
+#include "print.h"
+#include "parse.h"
+#include "common.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+buf_t * print_out = NULL;
+int32_t print_indent = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+// Output
+////////////////////////////////////////////////////////////////////////////////
+
+void print_printf(const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    buf_vprintf(print_out, format, args);
+    va_end(args);
+}
+
+void print_str(const char * str)
+{
+    buf_write(print_out, str, strlen(str));
+}
+
+void print_newline(void)
+{
+    static const char spaces[] = "                                ";
+    print_str("\n");
+    for (int32_t n = print_indent * 4; n > 0; n -= 32)
+    {
+        int32_t chunk = n < 32 ? n : 32;
+        buf_write(print_out, spaces, chunk);
+    }
+}
+
+void print_op(token_type_t op)
+{
+    const char * str = token_op_string(op);
+    if (str)
+    {
+        print_str(str);
+    }
+    else
+    {
+        print_printf("<op %d>", op);
+    }
+}
+
+void print_string_literal(const char * str, uint64_t length)
+{
+    print_str("\"");
+    for (uint64_t i = 0; i < length; ++i)
+    {
+        unsigned char c = (unsigned char)str[i];
+        switch (c)
+        {
+        case '"': print_str("\\\""); break;
+        case '\\': print_str("\\\\"); break;
+        case '\n': print_str("\\n"); break;
+        case '\r': print_str("\\r"); break;
+        case '\t': print_str("\\t"); break;
+        default:
+            if (c < 0x20 || c >= 0x7f)
+            {
+                print_printf("\\x%02x", c);
+            }
+            else
+            {
+                buf_write(print_out, &str[i], 1);
+            }
+            break;
+        }
+    }
+    print_str("\"");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Typespecs and expressions
+////////////////////////////////////////////////////////////////////////////////
+
+void print_typespec_internal(ast_typespec_t * typespec);
+void print_expr_internal(ast_expr_t * expr);
+void print_stmt_block_internal(ast_stmt_block_t * block);
+
+void print_typespec_internal(ast_typespec_t * typespec)
+{
+    if (!typespec)
+    {
+        print_str("nil");
+        return;
+    }
+
+    switch (typespec->type)
+    {
+    case AST_TYPESPEC_NAME:
+        print_str(typespec->name);
+        break;
+    case AST_TYPESPEC_ARRAY:
+        print_str("(array ");
+        print_typespec_internal(typespec->array.base);
+        print_str(" ");
+        print_expr_internal(typespec->array.size_expr);
+        print_str(")");
+        break;
+    case AST_TYPESPEC_POINTER:
+        print_str("(ptr ");
+        print_typespec_internal(typespec->pointer.base);
+        print_str(")");
+        break;
+    case AST_TYPESPEC_FN:
+        print_str("(fn (");
+        for (int32_t i = 0; i < typespec->fn.num_args; ++i)
+        {
+            if (i > 0) { print_str(" "); }
+            print_typespec_internal(typespec->fn.args[i]);
+        }
+        print_str(")");
+        if (typespec->fn.return_type)
+        {
+            print_str(" ");
+            print_typespec_internal(typespec->fn.return_type);
+        }
+        print_str(")");
+        break;
+    default:
+        assert(0);
+        break;
+    }
+}
+
+void print_expr_internal(ast_expr_t * expr)
+{
+    if (!expr)
+    {
+        print_str("nil");
+        return;
+    }
+
+    switch (expr->type)
+    {
+    case AST_EXPR_TERNARY:
+        print_str("(? ");
+        print_expr_internal(expr->ternary.condition);
+        print_str(" ");
+        print_expr_internal(expr->ternary.then_expr);
+        print_str(" ");
+        print_expr_internal(expr->ternary.else_expr);
+        print_str(")");
+        break;
+    case AST_EXPR_BINARY_OP:
+        print_str("(");
+        print_op(expr->binary.op);
+        print_str(" ");
+        print_expr_internal(expr->binary.left);
+        print_str(" ");
+        print_expr_internal(expr->binary.right);
+        print_str(")");
+        break;
+    case AST_EXPR_UNARY_OP:
+        print_str("(");
+        print_op(expr->unary.op);
+        print_str(" ");
+        print_expr_internal(expr->unary.expr);
+        print_str(")");
+        break;
+    case AST_EXPR_CAST:
+        print_str("(cast ");
+        print_typespec_internal(expr->cast.type);
+        print_str(" ");
+        print_expr_internal(expr->cast.expr);
+        print_str(")");
+        break;
+    case AST_EXPR_INVOKE:
+        print_str("(call ");
+        print_expr_internal(expr->invoke.expr);
+        for (int32_t i = 0; i < expr->invoke.num_args; ++i)
+        {
+            print_str(" ");
+            print_expr_internal(expr->invoke.args[i]);
+        }
+        print_str(")");
+        break;
+    case AST_EXPR_INDEX:
+        print_str("(index ");
+        print_expr_internal(expr->index.expr);
+        print_str(" ");
+        print_expr_internal(expr->index.index_expr);
+        print_str(")");
+        break;
+    case AST_EXPR_FIELD:
+        print_str("(field ");
+        print_expr_internal(expr->field.expr);
+        print_printf(" %s)", expr->field.name);
+        break;
+    case AST_EXPR_COMPOUND:
+        print_str("(compound ");
+        print_typespec_internal(expr->compound.type);
+        for (int32_t i = 0; i < expr->compound.num_args; ++i)
+        {
+            ast_cmpnd_field_t * field = expr->compound.args[i];
+            print_str(" ");
+            switch (field->type)
+            {
+            case AST_CMPND_FIELD_EXPR:
+                print_expr_internal(field->expr);
+                break;
+            case AST_CMPND_FIELD_FIELD:
+                print_printf("(named %s ", field->field_name);
+                print_expr_internal(field->expr);
+                print_str(")");
+                break;
+            case AST_CMPND_FIELD_INDEX:
+                print_str("(indexed ");
+                print_expr_internal(field->index_expr);
+                print_str(" ");
+                print_expr_internal(field->expr);
+                print_str(")");
+                break;
+            default:
+                assert(0);
+                break;
+            }
+        }
+        print_str(")");
+        break;
+    case AST_EXPR_NAME:
+        print_str(expr->name);
+        break;
+    case AST_EXPR_STRING:
+        print_string_literal(expr->string_value.str, expr->string_value.length);
+        break;
+    case AST_EXPR_INTEGER:
+        print_printf("%llu", (unsigned long long)expr->int_value);
+        break;
+    case AST_EXPR_FLOAT:
+        print_printf("%.17g%s", expr->float_value.value, expr->float_value.is_f32 ? "f32" : "");
+        break;
+    default:
+        assert(0);
+        break;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Statements
+////////////////////////////////////////////////////////////////////////////////
+
+void print_decl_internal(ast_decl_t * decl);
+
+void print_simple_stmt(ast_simple_stmt_t * stmt)
+{
+    switch (stmt->type)
+    {
+    case AST_SIMPLE_STMT_VAR_DECL:
+        print_decl_internal(stmt->var_decl);
+        break;
+    case AST_SIMPLE_STMT_CONST_DECL:
+        print_decl_internal(stmt->const_decl);
+        break;
+    case AST_SIMPLE_STMT_ASSIGN:
+        print_str("(");
+        print_op(stmt->assign.op);
+        print_str(" ");
+        print_expr_internal(stmt->assign.left);
+        print_str(" ");
+        print_expr_internal(stmt->assign.right);
+        print_str(")");
+        break;
+    case AST_SIMPLE_STMT_INCREMENT:
+        print_str("(++ ");
+        print_expr_internal(stmt->expr);
+        print_str(")");
+        break;
+    case AST_SIMPLE_STMT_DECREMENT:
+        print_str("(-- ");
+        print_expr_internal(stmt->expr);
+        print_str(")");
+        break;
+    case AST_SIMPLE_STMT_EXPR:
+        print_expr_internal(stmt->expr);
+        break;
+    default:
+        assert(0);
+        break;
+    }
+}
+
+void print_simple_stmt_list(sb_t(ast_simple_stmt_t *) stmts, int32_t num_stmts)
+{
+    print_str("(");
+    for (int32_t i = 0; i < num_stmts; ++i)
+    {
+        if (i > 0) { print_str(" "); }
+        print_simple_stmt(stmts[i]);
+    }
+    print_str(")");
+}
+
+void print_stmt(ast_stmt_t * stmt)
+{
+    switch (stmt->type)
+    {
+    case AST_STMT_IF:
+        print_str("(if ");
+        print_expr_internal(stmt->if_stmt.conditions[0]);
+        print_str(" ");
+        print_stmt_block_internal(stmt->if_stmt.stmt_blocks[0]);
+        for (int32_t i = 1; i < stmt->if_stmt.num_conditions; ++i)
+        {
+            print_str(" (elseif ");
+            print_expr_internal(stmt->if_stmt.conditions[i]);
+            print_str(" ");
+            print_stmt_block_internal(stmt->if_stmt.stmt_blocks[i]);
+            print_str(")");
+        }
+        if (stmt->if_stmt.else_stmt_block)
+        {
+            print_str(" (else ");
+            print_stmt_block_internal(stmt->if_stmt.else_stmt_block);
+            print_str(")");
+        }
+        print_str(")");
+        break;
+    case AST_STMT_WHILE:
+        print_str("(while ");
+        print_expr_internal(stmt->while_stmt.condition);
+        print_str(" ");
+        print_stmt_block_internal(stmt->while_stmt.stmt_block);
+        print_str(")");
+        break;
+    case AST_STMT_FOR:
+        print_str("(for ");
+        print_simple_stmt_list(stmt->for_stmt.init_stmts, stmt->for_stmt.num_init_stmts);
+        print_str(" ");
+        print_expr_internal(stmt->for_stmt.condition);
+        print_str(" ");
+        print_simple_stmt_list(stmt->for_stmt.incr_stmts, stmt->for_stmt.num_incr_stmts);
+        print_str(" ");
+        print_stmt_block_internal(stmt->for_stmt.stmt_block);
+        print_str(")");
+        break;
+    case AST_STMT_SWITCH:
+        print_str("(switch ");
+        print_expr_internal(stmt->switch_stmt.expr);
+        print_indent++;
+        for (int32_t i = 0; i < stmt->switch_stmt.num_items; ++i)
+        {
+            ast_switch_item_t * item = stmt->switch_stmt.items[i];
+            print_newline();
+            if (item->num_values == 0)
+            {
+                print_str("(otherwise ");
+            }
+            else
+            {
+                print_str("(case (");
+                for (int32_t j = 0; j < item->num_values; ++j)
+                {
+                    ast_switch_case_literal_t * lit = item->values[j];
+                    if (j > 0) { print_str(" "); }
+                    if (lit->type == AST_CASE_LITERAL_NAME)
+                    {
+                        print_str(lit->name);
+                    }
+                    else
+                    {
+                        print_printf("%llu", (unsigned long long)lit->integer);
+                    }
+                }
+                print_str(") ");
+            }
+            print_stmt_block_internal(item->stmt_block);
+            print_str(")");
+        }
+        print_indent--;
+        print_str(")");
+        break;
+    case AST_STMT_RETURN:
+        if (stmt->return_stmt)
+        {
+            print_str("(return ");
+            print_expr_internal(stmt->return_stmt);
+            print_str(")");
+        }
+        else
+        {
+            print_str("(return)");
+        }
+        break;
+    case AST_STMT_CONTINUE:
+        print_str("(continue)");
+        break;
+    case AST_STMT_BREAK:
+        print_str("(break)");
+        break;
+    case AST_STMT_BLOCK:
+        print_stmt_block_internal(stmt->stmt_block);
+        break;
+    case AST_STMT_SIMPLE:
+        print_simple_stmt(stmt->simple_stmt);
+        break;
+    default:
+        assert(0);
+        break;
+    }
+}
+
+void print_stmt_block_internal(ast_stmt_block_t * block)
+{
+    print_str("(block");
+    print_indent++;
+    for (int32_t i = 0; i < block->num_stmts; ++i)
+    {
+        print_newline();
+        print_stmt(block->stmts[i]);
+    }
+    print_indent--;
+    print_str(")");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Declarations
+////////////////////////////////////////////////////////////////////////////////
+
+void print_decl_internal(ast_decl_t * decl)
+{
+    switch (decl->type)
+    {
+    case AST_DECL_ENUM:
+        print_printf("(enum %s ", decl->name);
+        print_typespec_internal(decl->enum_decl.base_type);
+        for (int32_t i = 0; i < decl->enum_decl.num_items; ++i)
+        {
+            ast_enum_item_t * item = decl->enum_decl.items[i];
+            print_printf(" (%s", item->name);
+            if (item->expr)
+            {
+                print_str(" ");
+                print_expr_internal(item->expr);
+            }
+            print_str(")");
+        }
+        print_str(")");
+        break;
+    case AST_DECL_UNION:
+    case AST_DECL_STRUCT:
+        print_printf("(%s %s", decl->type == AST_DECL_STRUCT ? "struct" : "union", decl->name);
+        for (int32_t i = 0; i < decl->aggregate_decl.num_items; ++i)
+        {
+            ast_aggregate_item_t * item = decl->aggregate_decl.items[i];
+            print_printf(" (%s ", item->name);
+            print_typespec_internal(item->type);
+            print_str(")");
+        }
+        print_str(")");
+        break;
+    case AST_DECL_VAR:
+    case AST_DECL_CONST:
+        print_printf("(%s %s ", decl->type == AST_DECL_VAR ? "var" : "const", decl->name);
+        print_typespec_internal(decl->var_decl.type);
+        if (decl->var_decl.expr)
+        {
+            print_str(" ");
+            print_expr_internal(decl->var_decl.expr);
+        }
+        print_str(")");
+        break;
+    case AST_DECL_IMPORT:
+        print_printf("(import %s)", decl->name);
+        break;
+    case AST_DECL_TYPE:
+        print_printf("(type %s ", decl->name);
+        print_typespec_internal(decl->type_decl.type);
+        print_str(")");
+        break;
+    case AST_DECL_FN:
+        print_printf("(fn %s (", decl->name);
+        for (int32_t i = 0; i < decl->fn_decl.num_params; ++i)
+        {
+            ast_param_t * param = decl->fn_decl.params[i];
+            if (i > 0) { print_str(" "); }
+            print_printf("(%s ", param->name);
+            print_typespec_internal(param->type);
+            print_str(")");
+        }
+        print_str(")");
+        if (decl->fn_decl.return_type)
+        {
+            print_str(" ");
+            print_typespec_internal(decl->fn_decl.return_type);
+        }
+        print_indent++;
+        print_newline();
+        print_stmt_block_internal(decl->fn_decl.stmt_block);
+        print_indent--;
+        print_str(")");
+        break;
+    default:
+        assert(0);
+        break;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Entry points
+////////////////////////////////////////////////////////////////////////////////
+
+void print_typespec(buf_t * out, ast_typespec_t * typespec)
+{
+    print_out = out;
+    print_typespec_internal(typespec);
+}
+
+void print_expr(buf_t * out, ast_expr_t * expr)
+{
+    print_out = out;
+    print_expr_internal(expr);
+}
+
+void print_stmt_block(buf_t * out, ast_stmt_block_t * block)
+{
+    print_out = out;
+    print_indent = 0;
+    print_stmt_block_internal(block);
+}
+
+void print_decl(buf_t * out, ast_decl_t * decl)
+{
+    print_out = out;
+    print_indent = 0;
+    print_decl_internal(decl);
+    print_str("\n");
+}
+
+void print_decls(buf_t * out, sb_t(ast_decl_t *) decls)
+{
+    for (int32_t i = 0; i < sb_len(decls); ++i)
+    {
+        print_decl(out, decls[i]);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Tests
+////////////////////////////////////////////////////////////////////////////////
+
+void test_print_source(const char * source, const char * expected)
+{
+    init_parser(source);
+    sb_t(ast_decl_t *) decls = parse_document();
+
+    buf_t buf = { 0 };
+    print_decls(&buf, decls);
+    char * str = buf_string(&buf);
+    if (strcmp(str, expected) != 0)
+    {
+        printf("AST dump mismatch, expected:\n%s\ngot:\n%s\n", expected, str);
+        assert(0);
+    }
+    free(str);
+    sb_free(decls);
+}
+
+void test_print(void)
+{
+    test_print_source(
+        "import base; import std.io.file;"
+        "type callback = fn(i32*, u8[4]): b8;"
+        "type thunk = fn();",
+        "(import base)\n"
+        "(import std.io.file)\n"
+        "(type callback (fn ((ptr i32) (array u8 4)) b8))\n"
+        "(type thunk (fn ()))\n");
+
+    test_print_source(
+        "enum color : u8 { red, green = 4, blue, }"
+        "struct vec { x: i32; y: i32; }"
+        "union word { i: u32; b: u8[4]; }"
+        "var v : vec = vec{ .x = 1, .y = -2 };"
+        "var table : i32[3] = { [2] = 7, 1 };"
+        "var cursor : u8*;"
+        "const greeting : u8* = \"hi\\t\\\"x\\\"\\n\";",
+        "(enum color u8 (red) (green 4) (blue))\n"
+        "(struct vec (x i32) (y i32))\n"
+        "(union word (i u32) (b (array u8 4)))\n"
+        "(var v vec (compound vec (named x 1) (named y (- 2))))\n"
+        "(var table (array i32 3) (compound nil (indexed 2 7) 1))\n"
+        "(var cursor (ptr u8))\n"
+        "(const greeting (ptr u8) \"hi\\t\\\"x\\\"\\n\")\n");
+
+    test_print_source(
+        "fn f(a: i32, p: vec*): i32 {"
+        "    var n : i32 = a ? p.x : cast(i32, 'A');"
+        "    n += *&n << 2;"
+        "    p.y++;"
+        "    for (var i : i32 = 0, n = 1; i < 10; i++, n -= 1) { continue; }"
+        "    while (!n) { break; }"
+        "    if (a) { g(n, (:vec){0}); } else if (n) {} else { return 0; }"
+        "    switch (n) { 1, red -> { return; } otherwise -> {} }"
+        "    { }"
+        "    return p[1].x;"
+        "}",
+        "(fn f ((a i32) (p (ptr vec))) i32\n"
+        "    (block\n"
+        "        (var n i32 (? a (field p x) (cast i32 65)))\n"
+        "        (+= n (<< (* (& n)) 2))\n"
+        "        (++ (field p y))\n"
+        "        (for ((var i i32 0) (= n 1)) (< i 10) ((++ i) (-= n 1)) (block\n"
+        "            (continue)))\n"
+        "        (while (! n) (block\n"
+        "            (break)))\n"
+        "        (if a (block\n"
+        "            (call g n (compound vec 0))) (elseif n (block)) (else (block\n"
+        "            (return 0))))\n"
+        "        (switch n\n"
+        "            (case (1 red) (block\n"
+        "                (return)))\n"
+        "            (otherwise (block)))\n"
+        "        (block)\n"
+        "        (return (field (index p 1) x))))\n");
+}
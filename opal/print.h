@@ -0,0 +1,14 @@
+#pragma once
+
+#include "common.h"
+#include "ast.h"
+
+// Writes the AST as S-expressions, one top level form per declaration.
+// The output only depends on the parsed tree, never on resolved types, so
+// it can be diffed between parser versions and used for golden tests.
+void print_typespec(buf_t * out, ast_typespec_t * typespec);
+void print_expr(buf_t * out, ast_expr_t * expr);
+void print_stmt_block(buf_t * out, ast_stmt_block_t * block);
+void print_decl(buf_t * out, ast_decl_t * decl);
+void print_decls(buf_t * out, sb_t(ast_decl_t *) decls);
+void test_print(void);
@@ -0,0 +1,1479 @@
+#include "resolve.h"
+#include "common.h"
+#include "parse.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+void resolve_error(const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    printf("Resolve error: ");
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+    exit(1); // @Todo Good error handling
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Types
+////////////////////////////////////////////////////////////////////////////////
+
+type_t type_void_val = { .kind = TYPE_VOID, .size = 0, .align = 1 };
+type_t type_b8_val = { .kind = TYPE_B8, .size = 1, .align = 1 };
+type_t type_b32_val = { .kind = TYPE_B32, .size = 4, .align = 4 };
+type_t type_i8_val = { .kind = TYPE_I8, .size = 1, .align = 1 };
+type_t type_i16_val = { .kind = TYPE_I16, .size = 2, .align = 2 };
+type_t type_i32_val = { .kind = TYPE_I32, .size = 4, .align = 4 };
+type_t type_i64_val = { .kind = TYPE_I64, .size = 8, .align = 8 };
+type_t type_u8_val = { .kind = TYPE_U8, .size = 1, .align = 1 };
+type_t type_u16_val = { .kind = TYPE_U16, .size = 2, .align = 2 };
+type_t type_u32_val = { .kind = TYPE_U32, .size = 4, .align = 4 };
+type_t type_u64_val = { .kind = TYPE_U64, .size = 8, .align = 8 };
+type_t type_f32_val = { .kind = TYPE_F32, .size = 4, .align = 4 };
+type_t type_f64_val = { .kind = TYPE_F64, .size = 8, .align = 8 };
+
+type_t * type_void = &type_void_val;
+type_t * type_b8 = &type_b8_val;
+type_t * type_b32 = &type_b32_val;
+type_t * type_i8 = &type_i8_val;
+type_t * type_i16 = &type_i16_val;
+type_t * type_i32 = &type_i32_val;
+type_t * type_i64 = &type_i64_val;
+type_t * type_u8 = &type_u8_val;
+type_t * type_u16 = &type_u16_val;
+type_t * type_u32 = &type_u32_val;
+type_t * type_u64 = &type_u64_val;
+type_t * type_f32 = &type_f32_val;
+type_t * type_f64 = &type_f64_val;
+
+enum
+{
+    POINTER_SIZE = 8
+};
+
+type_t * type_alloc(type_kind_t kind)
+{
+    type_t * type = xmalloc(sizeof(type_t));
+    memset(type, 0, sizeof(type_t));
+    type->kind = kind;
+    return type;
+}
+
+bool is_integer_type(type_t * type)
+{
+    return (type->kind >= TYPE_B8 && type->kind <= TYPE_U64)
+        || type->kind == TYPE_ENUM;
+}
+
+bool is_signed_type(type_t * type)
+{
+    if (type->kind == TYPE_ENUM)
+    {
+        type = type->enum_type.base;
+    }
+    return type->kind >= TYPE_I8 && type->kind <= TYPE_I64;
+}
+
+bool is_float_type(type_t * type)
+{
+    return type->kind == TYPE_F32 || type->kind == TYPE_F64;
+}
+
+bool is_arithmetic_type(type_t * type)
+{
+    return is_integer_type(type) || is_float_type(type);
+}
+
+bool is_scalar_type(type_t * type)
+{
+    return is_arithmetic_type(type)
+        || type->kind == TYPE_POINTER
+        || type->kind == TYPE_FN;
+}
+
+map_t cached_pointer_types;
+
+type_t * type_pointer(type_t * base)
+{
+    type_t * type = map_get(&cached_pointer_types, base);
+    if (!type)
+    {
+        type = type_alloc(TYPE_POINTER);
+        type->size = POINTER_SIZE;
+        type->align = POINTER_SIZE;
+        type->pointer.base = base;
+        map_put(&cached_pointer_types, base, type);
+    }
+    return type;
+}
+
+void complete_type(type_t * type);
+
+sb_t(type_t *) cached_array_types = NULL;
+
+type_t * type_array(type_t * base, int64_t length)
+{
+    for (type_t ** it = cached_array_types; it != sb_end(cached_array_types); ++it)
+    {
+        if ((*it)->array.base == base && (*it)->array.length == length)
+        {
+            return *it;
+        }
+    }
+
+    complete_type(base);
+    type_t * type = type_alloc(TYPE_ARRAY);
+    type->size = base->size * length;
+    type->align = base->align;
+    type->array.base = base;
+    type->array.length = length;
+    sb_push(cached_array_types, type);
+    return type;
+}
+
+sb_t(type_t *) cached_fn_types = NULL;
+
+type_t * type_fn(sb_t(type_t *) params, int32_t num_params, type_t * return_type)
+{
+    for (type_t ** it = cached_fn_types; it != sb_end(cached_fn_types); ++it)
+    {
+        type_t * type = *it;
+        if (type->fn.num_params == num_params
+                && type->fn.return_type == return_type
+                && (num_params == 0 || memcmp(type->fn.params, params, num_params * sizeof(type_t *)) == 0))
+        {
+            sb_free(params);
+            return type;
+        }
+    }
+
+    type_t * type = type_alloc(TYPE_FN);
+    type->size = POINTER_SIZE;
+    type->align = POINTER_SIZE;
+    type->fn.params = params;
+    type->fn.num_params = num_params;
+    type->fn.return_type = return_type;
+    sb_push(cached_fn_types, type);
+    return type;
+}
+
+type_t * type_incomplete(sym_t * sym)
+{
+    type_t * type = type_alloc(TYPE_INCOMPLETE);
+    type->sym = sym;
+    return type;
+}
+
+int64_t align_up(int64_t value, int64_t align)
+{
+    return (value + align - 1) / align * align;
+}
+
+type_t * resolve_typespec(ast_typespec_t * typespec);
+
+// Aggregates are created incomplete so they can refer to themselves through
+// pointers; their fields are only resolved when the layout is needed.
+void complete_type(type_t * type)
+{
+    if (type->kind == TYPE_COMPLETING)
+    {
+        resolve_error("Type '%s' contains itself", type->sym->name);
+    }
+
+    if (type->kind != TYPE_INCOMPLETE)
+    {
+        return;
+    }
+
+    type->kind = TYPE_COMPLETING;
+    ast_decl_t * decl = type->sym->decl;
+    sb_t(type_field_t) fields = NULL;
+
+    for (int32_t i = 0; i < decl->aggregate_decl.num_items; ++i)
+    {
+        ast_aggregate_item_t * item = decl->aggregate_decl.items[i];
+        for (int32_t j = 0; j < i; ++j)
+        {
+            if (fields[j].name == item->name)
+            {
+                resolve_error("Duplicate field '%s' in '%s'", item->name, decl->name);
+            }
+        }
+
+        type_t * field_type = resolve_typespec(item->type);
+        complete_type(field_type);
+        sb_push(fields, (type_field_t){ item->name, field_type, 0 });
+    }
+
+    bool is_union = decl->type == AST_DECL_UNION;
+    int64_t size = 0;
+    int64_t align = 1;
+
+    for (int32_t i = 0; i < sb_len(fields); ++i)
+    {
+        type_t * field_type = fields[i].type;
+        if (field_type->align > align)
+        {
+            align = field_type->align;
+        }
+
+        if (is_union)
+        {
+            fields[i].offset = 0;
+            size = field_type->size > size ? field_type->size : size;
+        }
+        else
+        {
+            fields[i].offset = align_up(size, field_type->align);
+            size = fields[i].offset + field_type->size;
+        }
+    }
+
+    type->kind = is_union ? TYPE_UNION : TYPE_STRUCT;
+    type->size = align_up(size, align);
+    type->align = align;
+    type->aggregate.fields = fields;
+    type->aggregate.num_fields = sb_len(fields);
+}
+
+int32_t find_field_index(type_t * type, const char * name)
+{
+    for (int32_t i = 0; i < type->aggregate.num_fields; ++i)
+    {
+        if (type->aggregate.fields[i].name == name)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+type_t * unify_arithmetic_types(type_t * left, type_t * right)
+{
+    if (left->kind == TYPE_ENUM) { left = left->enum_type.base; }
+    if (right->kind == TYPE_ENUM) { right = right->enum_type.base; }
+
+    if (left->kind == TYPE_F64 || right->kind == TYPE_F64) { return type_f64; }
+    if (left->kind == TYPE_F32 || right->kind == TYPE_F32) { return type_f32; }
+    if (left->size < 4) { left = type_i32; }
+    if (right->size < 4) { right = type_i32; }
+    if (left->size != right->size) { return left->size > right->size ? left : right; }
+    return is_signed_type(left) ? right : left;
+}
+
+int64_t convert_const(type_t * type, int64_t value)
+{
+    if (type->kind == TYPE_ENUM)
+    {
+        type = type->enum_type.base;
+    }
+
+    switch (type->kind)
+    {
+    case TYPE_B8: case TYPE_B32: return value != 0;
+    case TYPE_I8: return (int8_t)value;
+    case TYPE_I16: return (int16_t)value;
+    case TYPE_I32: return (int32_t)value;
+    case TYPE_U8: return (uint8_t)value;
+    case TYPE_U16: return (uint16_t)value;
+    case TYPE_U32: return (uint32_t)value;
+    default: return value;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Symbols
+////////////////////////////////////////////////////////////////////////////////
+
+sb_t(sym_t *) global_syms = NULL;
+map_t global_sym_map;
+
+enum
+{
+    MAX_LOCAL_SYMS = 1024
+};
+
+sym_t local_syms[MAX_LOCAL_SYMS];
+sym_t * local_syms_end = local_syms;
+sym_t * local_scope_start = local_syms;
+
+sym_t * add_global_sym(const char * name, sym_kind_t kind, ast_decl_t * decl)
+{
+    if (map_get(&global_sym_map, name))
+    {
+        resolve_error("'%s' is already declared", name);
+    }
+
+    sym_t * sym = xmalloc(sizeof(sym_t));
+    memset(sym, 0, sizeof(sym_t));
+    sym->name = name;
+    sym->kind = kind;
+    sym->state = SYM_UNRESOLVED;
+    sym->decl = decl;
+
+    sb_push(global_syms, sym);
+    map_put(&global_sym_map, name, sym);
+    return sym;
+}
+
+void add_builtin_type(const char * name, type_t * type)
+{
+    sym_t * sym = add_global_sym(intern_string(name), SYM_TYPE, NULL);
+    sym->state = SYM_RESOLVED;
+    sym->type = type;
+}
+
+void add_builtin_const(const char * name, type_t * type, int64_t value)
+{
+    sym_t * sym = add_global_sym(intern_string(name), SYM_CONST, NULL);
+    sym->state = SYM_RESOLVED;
+    sym->type = type;
+    sym->const_value = value;
+}
+
+void init_resolver(void)
+{
+    for (sym_t ** it = global_syms; it != sb_end(global_syms); ++it)
+    {
+        free(*it);
+    }
+    sb_free(global_syms);
+    map_free(&global_sym_map);
+    local_syms_end = local_syms;
+    local_scope_start = local_syms;
+
+    add_builtin_type("void", type_void);
+    add_builtin_type("b8", type_b8);
+    add_builtin_type("b32", type_b32);
+    add_builtin_type("i8", type_i8);
+    add_builtin_type("i16", type_i16);
+    add_builtin_type("i32", type_i32);
+    add_builtin_type("i64", type_i64);
+    add_builtin_type("u8", type_u8);
+    add_builtin_type("u16", type_u16);
+    add_builtin_type("u32", type_u32);
+    add_builtin_type("u64", type_u64);
+    add_builtin_type("f32", type_f32);
+    add_builtin_type("f64", type_f64);
+    add_builtin_const("true", type_b8, 1);
+    add_builtin_const("false", type_b8, 0);
+}
+
+// Only registers the declarations, nothing is resolved until it is
+// referenced or explicitly checked.
+void resolve_add_decls(sb_t(ast_decl_t *) decls)
+{
+    for (ast_decl_t ** it = decls; it != sb_end(decls); ++it)
+    {
+        ast_decl_t * decl = *it;
+        switch (decl->type)
+        {
+        case AST_DECL_ENUM:
+            decl->sym = add_global_sym(decl->name, SYM_TYPE, decl);
+            for (int32_t i = 0; i < decl->enum_decl.num_items; ++i)
+            {
+                sym_t * item = add_global_sym(decl->enum_decl.items[i]->name, SYM_ENUM_CONST, decl);
+                item->enum_item_index = i;
+            }
+            break;
+        case AST_DECL_UNION:
+        case AST_DECL_STRUCT:
+        case AST_DECL_TYPE:
+            decl->sym = add_global_sym(decl->name, SYM_TYPE, decl);
+            break;
+        case AST_DECL_VAR:
+            decl->sym = add_global_sym(decl->name, SYM_VAR, decl);
+            break;
+        case AST_DECL_CONST:
+            decl->sym = add_global_sym(decl->name, SYM_CONST, decl);
+            break;
+        case AST_DECL_FN:
+            decl->sym = add_global_sym(decl->name, SYM_FN, decl);
+            break;
+        case AST_DECL_IMPORT:
+            resolve_error("Import of '%s' was not loaded", decl->name);
+            break;
+        }
+    }
+}
+
+// name must be interned.
+sym_t * get_global_sym(const char * name)
+{
+    return map_get(&global_sym_map, name);
+}
+
+sym_t * resolve_name(const char * name)
+{
+    sym_t * sym = get_global_sym(name);
+    if (sym)
+    {
+        resolve_sym(sym);
+    }
+    return sym;
+}
+
+sym_t * push_local_sym(const char * name, sym_kind_t kind, type_t * type)
+{
+    if (local_syms_end == local_syms + MAX_LOCAL_SYMS)
+    {
+        resolve_error("Too many local symbols");
+    }
+
+    sym_t * sym = local_syms_end++;
+    memset(sym, 0, sizeof(sym_t));
+    sym->name = name;
+    sym->kind = kind;
+    sym->state = SYM_RESOLVED;
+    sym->type = type;
+    return sym;
+}
+
+sym_t * lookup_sym(const char * name)
+{
+    for (sym_t * it = local_syms_end; it != local_scope_start; --it)
+    {
+        if (it[-1].name == name)
+        {
+            return &it[-1];
+        }
+    }
+    return resolve_name(name);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Expressions
+////////////////////////////////////////////////////////////////////////////////
+
+typedef struct resolved_expr_t
+{
+    type_t * type;
+    bool is_lvalue;
+    bool is_const;
+    int64_t value;
+} resolved_expr_t;
+
+resolved_expr_t resolved_rvalue(type_t * type)
+{
+    return (resolved_expr_t){ .type = type };
+}
+
+resolved_expr_t resolved_lvalue(type_t * type)
+{
+    return (resolved_expr_t){ .type = type, .is_lvalue = true };
+}
+
+resolved_expr_t resolved_const(type_t * type, int64_t value)
+{
+    return (resolved_expr_t){ .type = type, .is_const = true, .value = value };
+}
+
+resolved_expr_t resolve_expr_expected(ast_expr_t * expr, type_t * expected);
+
+resolved_expr_t resolve_expr(ast_expr_t * expr)
+{
+    return resolve_expr_expected(expr, NULL);
+}
+
+bool is_convertible(type_t * dest, resolved_expr_t * src)
+{
+    type_t * type = src->type;
+    if (dest == type)
+    {
+        return true;
+    }
+    else if (is_arithmetic_type(dest) && is_arithmetic_type(type))
+    {
+        return true;
+    }
+    else if (dest->kind == TYPE_POINTER && type->kind == TYPE_ARRAY)
+    {
+        return dest->pointer.base == type->array.base;
+    }
+    else if (dest->kind == TYPE_POINTER && src->is_const && src->value == 0 && is_integer_type(type))
+    {
+        return true;
+    }
+    return false;
+}
+
+void check_convertible(type_t * dest, resolved_expr_t * src, const char * context)
+{
+    if (!is_convertible(dest, src))
+    {
+        resolve_error("Invalid type conversion in %s", context);
+    }
+}
+
+int64_t resolve_const_int_expr(ast_expr_t * expr)
+{
+    resolved_expr_t result = resolve_expr(expr);
+    if (!result.is_const || !is_integer_type(result.type))
+    {
+        resolve_error("Expected a constant integer expression");
+    }
+    return result.value;
+}
+
+type_t * type_of_int_literal(int64_t value)
+{
+    if ((uint64_t)value > INT64_MAX) { return type_u64; }
+    if (value > INT32_MAX) { return type_i64; }
+    return type_i32;
+}
+
+resolved_expr_t resolve_expr_name(ast_expr_t * expr)
+{
+    sym_t * sym = lookup_sym(expr->name);
+    if (!sym)
+    {
+        resolve_error("Undeclared name '%s'", expr->name);
+    }
+
+    switch (sym->kind)
+    {
+    case SYM_VAR: return resolved_lvalue(sym->type);
+    case SYM_CONST:
+    case SYM_ENUM_CONST:
+        if (is_integer_type(sym->type))
+        {
+            return resolved_const(sym->type, sym->const_value);
+        }
+        return resolved_rvalue(sym->type);
+    case SYM_FN: return resolved_rvalue(sym->type);
+    case SYM_TYPE: resolve_error("Type '%s' used as a value", expr->name);
+    }
+
+    return resolved_rvalue(type_void);
+}
+
+int64_t eval_unary_op(token_type_t op, int64_t value)
+{
+    switch (op)
+    {
+    case TOKEN_TYPE_PLUS: return value;
+    case TOKEN_TYPE_MINUS: return -value;
+    case TOKEN_TYPE_NOT: return ~value;
+    case TOKEN_TYPE_LOGIC_NOT: return !value;
+    default: assert(0); return 0;
+    }
+}
+
+resolved_expr_t resolve_expr_unary(ast_expr_t * expr)
+{
+    resolved_expr_t operand = resolve_expr(expr->unary.expr);
+    type_t * type = operand.type;
+
+    switch (expr->unary.op)
+    {
+    case TOKEN_TYPE_PLUS:
+    case TOKEN_TYPE_MINUS:
+        if (!is_arithmetic_type(type)) { resolve_error("Unary +/- expects an arithmetic operand"); }
+        break;
+    case TOKEN_TYPE_NOT:
+        if (!is_integer_type(type)) { resolve_error("Unary ~ expects an integer operand"); }
+        break;
+    case TOKEN_TYPE_LOGIC_NOT:
+        if (!is_scalar_type(type)) { resolve_error("Unary ! expects a scalar operand"); }
+        type = type_b8;
+        break;
+    case TOKEN_TYPE_AND:
+        if (!operand.is_lvalue) { resolve_error("Cannot take the address of a non-lvalue"); }
+        return resolved_rvalue(type_pointer(type));
+    case TOKEN_TYPE_MULT:
+        if (type->kind != TYPE_POINTER) { resolve_error("Cannot dereference a non-pointer"); }
+        return resolved_lvalue(type->pointer.base);
+    default:
+        assert(0);
+        break;
+    }
+
+    if (operand.is_const)
+    {
+        return resolved_const(type, convert_const(type, eval_unary_op(expr->unary.op, operand.value)));
+    }
+    return resolved_rvalue(type);
+}
+
+int64_t eval_binary_op(token_type_t op, int64_t left, int64_t right, bool is_signed)
+{
+    uint64_t uleft = left;
+    uint64_t uright = right;
+
+    switch (op)
+    {
+    case TOKEN_TYPE_PLUS: return uleft + uright;
+    case TOKEN_TYPE_MINUS: return uleft - uright;
+    case TOKEN_TYPE_MULT: return uleft * uright;
+    case TOKEN_TYPE_DIV: return is_signed ? left / right : (int64_t)(uleft / uright);
+    case TOKEN_TYPE_MOD: return is_signed ? left % right : (int64_t)(uleft % uright);
+    case TOKEN_TYPE_AND: return left & right;
+    case TOKEN_TYPE_OR: return left | right;
+    case TOKEN_TYPE_XOR: return left ^ right;
+    case TOKEN_TYPE_SHL: return uleft << uright;
+    case TOKEN_TYPE_SHR: return is_signed ? left >> right : (int64_t)(uleft >> uright);
+    case TOKEN_TYPE_EQ: return left == right;
+    case TOKEN_TYPE_NE: return left != right;
+    case TOKEN_TYPE_LT: return is_signed ? left < right : uleft < uright;
+    case TOKEN_TYPE_LE: return is_signed ? left <= right : uleft <= uright;
+    case TOKEN_TYPE_GT: return is_signed ? left > right : uleft > uright;
+    case TOKEN_TYPE_GE: return is_signed ? left >= right : uleft >= uright;
+    case TOKEN_TYPE_LOGIC_AND: return left && right;
+    case TOKEN_TYPE_LOGIC_OR: return left || right;
+    default: assert(0); return 0;
+    }
+}
+
+resolved_expr_t resolve_expr_binary(ast_expr_t * expr)
+{
+    token_type_t op = expr->binary.op;
+    resolved_expr_t left = resolve_expr(expr->binary.left);
+    resolved_expr_t right = resolve_expr(expr->binary.right);
+    type_t * operand_type = NULL;
+    type_t * type = NULL;
+
+    switch (op)
+    {
+    case TOKEN_TYPE_PLUS:
+    case TOKEN_TYPE_MINUS:
+        if (left.type->kind == TYPE_POINTER && is_integer_type(right.type))
+        {
+            return resolved_rvalue(left.type);
+        }
+        else if (op == TOKEN_TYPE_PLUS && is_integer_type(left.type) && right.type->kind == TYPE_POINTER)
+        {
+            return resolved_rvalue(right.type);
+        }
+        else if (op == TOKEN_TYPE_MINUS && left.type->kind == TYPE_POINTER && left.type == right.type)
+        {
+            return resolved_rvalue(type_i64);
+        }
+        // Fallthrough
+    case TOKEN_TYPE_MULT:
+    case TOKEN_TYPE_DIV:
+        if (!is_arithmetic_type(left.type) || !is_arithmetic_type(right.type))
+        {
+            resolve_error("Arithmetic operator expects arithmetic operands");
+        }
+        operand_type = type = unify_arithmetic_types(left.type, right.type);
+        break;
+    case TOKEN_TYPE_MOD:
+    case TOKEN_TYPE_AND:
+    case TOKEN_TYPE_OR:
+    case TOKEN_TYPE_XOR:
+        if (!is_integer_type(left.type) || !is_integer_type(right.type))
+        {
+            resolve_error("Bitwise operator expects integer operands");
+        }
+        operand_type = type = unify_arithmetic_types(left.type, right.type);
+        break;
+    case TOKEN_TYPE_SHL:
+    case TOKEN_TYPE_SHR:
+        if (!is_integer_type(left.type) || !is_integer_type(right.type))
+        {
+            resolve_error("Shift operator expects integer operands");
+        }
+        operand_type = type = left.type;
+        break;
+    case TOKEN_TYPE_EQ:
+    case TOKEN_TYPE_NE:
+    case TOKEN_TYPE_LT:
+    case TOKEN_TYPE_LE:
+    case TOKEN_TYPE_GT:
+    case TOKEN_TYPE_GE:
+        if (is_arithmetic_type(left.type) && is_arithmetic_type(right.type))
+        {
+            operand_type = unify_arithmetic_types(left.type, right.type);
+        }
+        else if (left.type != right.type || !is_scalar_type(left.type))
+        {
+            resolve_error("Comparison between incompatible types");
+        }
+        type = type_b8;
+        break;
+    case TOKEN_TYPE_LOGIC_AND:
+    case TOKEN_TYPE_LOGIC_OR:
+        if (!is_scalar_type(left.type) || !is_scalar_type(right.type))
+        {
+            resolve_error("Logical operator expects scalar operands");
+        }
+        type = type_b8;
+        break;
+    default:
+        assert(0);
+        break;
+    }
+
+    if (left.is_const && right.is_const && is_integer_type(left.type) && is_integer_type(right.type))
+    {
+        if ((op == TOKEN_TYPE_DIV || op == TOKEN_TYPE_MOD) && right.value == 0)
+        {
+            resolve_error("Division by zero in constant expression");
+        }
+
+        bool is_signed = operand_type ? is_signed_type(operand_type) : true;
+        int64_t value = eval_binary_op(op, left.value, right.value, is_signed);
+        return resolved_const(type, convert_const(type, value));
+    }
+
+    return resolved_rvalue(type);
+}
+
+resolved_expr_t resolve_expr_ternary(ast_expr_t * expr, type_t * expected)
+{
+    resolved_expr_t condition = resolve_expr(expr->ternary.condition);
+    if (!is_scalar_type(condition.type))
+    {
+        resolve_error("Ternary condition must be scalar");
+    }
+
+    resolved_expr_t then_expr = resolve_expr_expected(expr->ternary.then_expr, expected);
+    resolved_expr_t else_expr = resolve_expr_expected(expr->ternary.else_expr, expected);
+    type_t * type = NULL;
+
+    if (is_arithmetic_type(then_expr.type) && is_arithmetic_type(else_expr.type))
+    {
+        type = unify_arithmetic_types(then_expr.type, else_expr.type);
+    }
+    else if (then_expr.type == else_expr.type)
+    {
+        type = then_expr.type;
+    }
+    else
+    {
+        resolve_error("Ternary branches have incompatible types");
+    }
+
+    if (condition.is_const && then_expr.is_const && else_expr.is_const)
+    {
+        return resolved_const(type, condition.value ? then_expr.value : else_expr.value);
+    }
+    return resolved_rvalue(type);
+}
+
+resolved_expr_t resolve_expr_cast(ast_expr_t * expr)
+{
+    type_t * type = resolve_typespec(expr->cast.type);
+    resolved_expr_t operand = resolve_expr(expr->cast.expr);
+
+    if (!is_scalar_type(type) || !is_scalar_type(operand.type))
+    {
+        resolve_error("Invalid cast");
+    }
+
+    if (operand.is_const && is_integer_type(type))
+    {
+        return resolved_const(type, convert_const(type, operand.value));
+    }
+    return resolved_rvalue(type);
+}
+
+resolved_expr_t resolve_expr_invoke(ast_expr_t * expr)
+{
+    resolved_expr_t callee = resolve_expr(expr->invoke.expr);
+    type_t * type = callee.type;
+
+    if (type->kind != TYPE_FN)
+    {
+        resolve_error("Calling a non-function value");
+    }
+
+    if (expr->invoke.num_args != type->fn.num_params)
+    {
+        resolve_error("Expected %d arguments, got %d", type->fn.num_params, expr->invoke.num_args);
+    }
+
+    for (int32_t i = 0; i < expr->invoke.num_args; ++i)
+    {
+        type_t * param_type = type->fn.params[i];
+        resolved_expr_t arg = resolve_expr_expected(expr->invoke.args[i], param_type);
+        check_convertible(param_type, &arg, "function argument");
+    }
+
+    return resolved_rvalue(type->fn.return_type);
+}
+
+resolved_expr_t resolve_expr_index(ast_expr_t * expr)
+{
+    resolved_expr_t operand = resolve_expr(expr->index.expr);
+    resolved_expr_t index = resolve_expr(expr->index.index_expr);
+
+    if (!is_integer_type(index.type))
+    {
+        resolve_error("Index must be an integer");
+    }
+
+    if (operand.type->kind == TYPE_ARRAY)
+    {
+        return resolved_lvalue(operand.type->array.base);
+    }
+    else if (operand.type->kind == TYPE_POINTER)
+    {
+        return resolved_lvalue(operand.type->pointer.base);
+    }
+
+    resolve_error("Cannot index a value that is neither an array nor a pointer");
+    return resolved_rvalue(type_void);
+}
+
+resolved_expr_t resolve_expr_field(ast_expr_t * expr)
+{
+    resolved_expr_t operand = resolve_expr(expr->field.expr);
+    type_t * type = operand.type;
+
+    if (type->kind == TYPE_POINTER)
+    {
+        type = type->pointer.base;
+        operand.is_lvalue = true;
+    }
+
+    complete_type(type);
+    if (type->kind != TYPE_STRUCT && type->kind != TYPE_UNION)
+    {
+        resolve_error("Accessing field '%s' of a non-aggregate", expr->field.name);
+    }
+
+    int32_t index = find_field_index(type, expr->field.name);
+    if (index < 0)
+    {
+        resolve_error("No field named '%s'", expr->field.name);
+    }
+
+    type_t * field_type = type->aggregate.fields[index].type;
+    return operand.is_lvalue ? resolved_lvalue(field_type) : resolved_rvalue(field_type);
+}
+
+resolved_expr_t resolve_expr_compound(ast_expr_t * expr, type_t * expected)
+{
+    type_t * type = expected;
+    if (expr->compound.type)
+    {
+        type = resolve_typespec(expr->compound.type);
+    }
+
+    if (!type)
+    {
+        resolve_error("Compound literal without a type");
+    }
+
+    complete_type(type);
+
+    if (type->kind == TYPE_STRUCT || type->kind == TYPE_UNION)
+    {
+        int32_t index = 0;
+        for (int32_t i = 0; i < expr->compound.num_args; ++i)
+        {
+            ast_cmpnd_field_t * field = expr->compound.args[i];
+            if (field->type == AST_CMPND_FIELD_INDEX)
+            {
+                resolve_error("Index initializer in aggregate compound literal");
+            }
+            else if (field->type == AST_CMPND_FIELD_FIELD)
+            {
+                index = find_field_index(type, field->field_name);
+                if (index < 0)
+                {
+                    resolve_error("No field named '%s'", field->field_name);
+                }
+            }
+
+            if (index >= type->aggregate.num_fields)
+            {
+                resolve_error("Too many initializers in compound literal");
+            }
+
+            type_t * field_type = type->aggregate.fields[index].type;
+            resolved_expr_t init = resolve_expr_expected(field->expr, field_type);
+            check_convertible(field_type, &init, "compound literal");
+            index++;
+        }
+    }
+    else if (type->kind == TYPE_ARRAY)
+    {
+        int64_t index = 0;
+        for (int32_t i = 0; i < expr->compound.num_args; ++i)
+        {
+            ast_cmpnd_field_t * field = expr->compound.args[i];
+            if (field->type == AST_CMPND_FIELD_FIELD)
+            {
+                resolve_error("Field initializer in array compound literal");
+            }
+            else if (field->type == AST_CMPND_FIELD_INDEX)
+            {
+                index = resolve_const_int_expr(field->index_expr);
+                field->index = index;
+            }
+
+            if (index < 0 || index >= type->array.length)
+            {
+                resolve_error("Array compound literal index out of range");
+            }
+
+            type_t * base = type->array.base;
+            resolved_expr_t init = resolve_expr_expected(field->expr, base);
+            check_convertible(base, &init, "compound literal");
+            index++;
+        }
+    }
+    else
+    {
+        resolve_error("Compound literal of a non-aggregate type");
+    }
+
+    return resolved_rvalue(type);
+}
+
+resolved_expr_t resolve_expr_expected(ast_expr_t * expr, type_t * expected)
+{
+    resolved_expr_t result = { 0 };
+
+    switch (expr->type)
+    {
+    case AST_EXPR_INTEGER:
+        result = resolved_const(type_of_int_literal(expr->int_value), expr->int_value);
+        break;
+    case AST_EXPR_FLOAT:
+        result = resolved_rvalue(expr->float_value.is_f32 ? type_f32 : type_f64);
+        break;
+    case AST_EXPR_STRING:
+        result = resolved_rvalue(type_pointer(type_u8));
+        break;
+    case AST_EXPR_NAME:
+        result = resolve_expr_name(expr);
+        break;
+    case AST_EXPR_UNARY_OP:
+        result = resolve_expr_unary(expr);
+        break;
+    case AST_EXPR_BINARY_OP:
+        result = resolve_expr_binary(expr);
+        break;
+    case AST_EXPR_TERNARY:
+        result = resolve_expr_ternary(expr, expected);
+        break;
+    case AST_EXPR_CAST:
+        result = resolve_expr_cast(expr);
+        break;
+    case AST_EXPR_INVOKE:
+        result = resolve_expr_invoke(expr);
+        break;
+    case AST_EXPR_INDEX:
+        result = resolve_expr_index(expr);
+        break;
+    case AST_EXPR_FIELD:
+        result = resolve_expr_field(expr);
+        break;
+    case AST_EXPR_COMPOUND:
+        result = resolve_expr_compound(expr, expected);
+        break;
+    }
+
+    expr->resolved_type = result.type;
+    return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Declarations
+////////////////////////////////////////////////////////////////////////////////
+
+type_t * resolve_typespec_inner(ast_typespec_t * typespec)
+{
+    switch (typespec->type)
+    {
+    case AST_TYPESPEC_NAME:
+        {
+            sym_t * sym = resolve_name(typespec->name);
+            if (!sym)
+            {
+                resolve_error("Undeclared type '%s'", typespec->name);
+            }
+            if (sym->kind != SYM_TYPE)
+            {
+                resolve_error("'%s' is not a type", typespec->name);
+            }
+            return sym->type;
+        }
+    case AST_TYPESPEC_POINTER:
+        return type_pointer(resolve_typespec(typespec->pointer.base));
+    case AST_TYPESPEC_ARRAY:
+        {
+            type_t * base = resolve_typespec(typespec->array.base);
+            int64_t length = resolve_const_int_expr(typespec->array.size_expr);
+            if (length < 0)
+            {
+                resolve_error("Negative array size");
+            }
+            return type_array(base, length);
+        }
+    case AST_TYPESPEC_FN:
+        {
+            sb_t(type_t *) params = NULL;
+            for (int32_t i = 0; i < typespec->fn.num_args; ++i)
+            {
+                sb_push(params, resolve_typespec(typespec->fn.args[i]));
+            }
+            return type_fn(params, typespec->fn.num_args, resolve_typespec(typespec->fn.return_type));
+        }
+    }
+
+    return NULL;
+}
+
+type_t * resolve_typespec(ast_typespec_t * typespec)
+{
+    if (!typespec)
+    {
+        return type_void;
+    }
+
+    typespec->resolved_type = resolve_typespec_inner(typespec);
+    return typespec->resolved_type;
+}
+
+type_t * resolve_enum_type(ast_decl_t * decl)
+{
+    type_t * base = resolve_typespec(decl->enum_decl.base_type);
+    if (!is_integer_type(base) || base->kind == TYPE_ENUM)
+    {
+        resolve_error("Enum '%s' must have an integer base type", decl->name);
+    }
+
+    type_t * type = type_alloc(TYPE_ENUM);
+    type->sym = decl->sym;
+    type->size = base->size;
+    type->align = base->align;
+    type->enum_type.base = base;
+    return type;
+}
+
+void resolve_enum_const(sym_t * sym)
+{
+    ast_decl_t * decl = sym->decl;
+    resolve_sym(decl->sym);
+    sym->type = decl->sym->type;
+
+    int32_t index = sym->enum_item_index;
+    ast_enum_item_t * item = decl->enum_decl.items[index];
+
+    if (item->expr)
+    {
+        sym->const_value = resolve_const_int_expr(item->expr);
+    }
+    else if (index > 0)
+    {
+        sym_t * previous = resolve_name(decl->enum_decl.items[index - 1]->name);
+        sym->const_value = previous->const_value + 1;
+    }
+    else
+    {
+        sym->const_value = 0;
+    }
+
+    sym->const_value = convert_const(sym->type, sym->const_value);
+}
+
+void resolve_var_decl(sym_t * sym)
+{
+    ast_decl_t * decl = sym->decl;
+    sym->type = resolve_typespec(decl->var_decl.type);
+    complete_type(sym->type);
+
+    if (decl->var_decl.expr)
+    {
+        resolved_expr_t init = resolve_expr_expected(decl->var_decl.expr, sym->type);
+        check_convertible(sym->type, &init, "variable initializer");
+    }
+}
+
+void resolve_const_decl(sym_t * sym)
+{
+    ast_decl_t * decl = sym->decl;
+    sym->type = resolve_typespec(decl->const_decl.type);
+    complete_type(sym->type);
+
+    resolved_expr_t init = resolve_expr_expected(decl->const_decl.expr, sym->type);
+    check_convertible(sym->type, &init, "constant initializer");
+
+    if (is_integer_type(sym->type))
+    {
+        if (!init.is_const)
+        {
+            resolve_error("Initializer of '%s' is not constant", sym->name);
+        }
+        sym->const_value = convert_const(sym->type, init.value);
+    }
+}
+
+type_t * resolve_fn_type(ast_decl_t * decl)
+{
+    sb_t(type_t *) params = NULL;
+    for (int32_t i = 0; i < decl->fn_decl.num_params; ++i)
+    {
+        sb_push(params, resolve_typespec(decl->fn_decl.params[i]->type));
+    }
+    return type_fn(params, decl->fn_decl.num_params, resolve_typespec(decl->fn_decl.return_type));
+}
+
+void resolve_sym(sym_t * sym)
+{
+    if (sym->state == SYM_RESOLVED)
+    {
+        return;
+    }
+    else if (sym->state == SYM_RESOLVING)
+    {
+        resolve_error("Cyclic dependency on '%s'", sym->name);
+    }
+
+    // Globals never see the locals of the function that referenced them.
+    sym_t * saved_scope_start = local_scope_start;
+    local_scope_start = local_syms_end;
+    sym->state = SYM_RESOLVING;
+
+    ast_decl_t * decl = sym->decl;
+    switch (sym->kind)
+    {
+    case SYM_TYPE:
+        if (decl->type == AST_DECL_TYPE)
+        {
+            sym->type = resolve_typespec(decl->type_decl.type);
+        }
+        else if (decl->type == AST_DECL_ENUM)
+        {
+            sym->type = resolve_enum_type(decl);
+        }
+        else
+        {
+            sym->type = type_incomplete(sym);
+        }
+        break;
+    case SYM_VAR:
+        resolve_var_decl(sym);
+        break;
+    case SYM_CONST:
+        resolve_const_decl(sym);
+        break;
+    case SYM_ENUM_CONST:
+        resolve_enum_const(sym);
+        break;
+    case SYM_FN:
+        sym->type = resolve_fn_type(decl);
+        break;
+    }
+
+    sym->state = SYM_RESOLVED;
+    local_scope_start = saved_scope_start;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Statements
+////////////////////////////////////////////////////////////////////////////////
+
+type_t * current_return_type = NULL;
+int32_t current_loop_depth = 0;
+
+void check_condition(ast_expr_t * expr)
+{
+    resolved_expr_t condition = resolve_expr(expr);
+    if (!is_scalar_type(condition.type))
+    {
+        resolve_error("Condition must be a scalar expression");
+    }
+}
+
+void check_local_decl(ast_decl_t * decl, sym_kind_t kind)
+{
+    type_t * type = resolve_typespec(decl->var_decl.type);
+    complete_type(type);
+    int64_t value = 0;
+
+    if (decl->var_decl.expr)
+    {
+        resolved_expr_t init = resolve_expr_expected(decl->var_decl.expr, type);
+        check_convertible(type, &init, "variable initializer");
+        if (kind == SYM_CONST && is_integer_type(type))
+        {
+            if (!init.is_const)
+            {
+                resolve_error("Initializer of '%s' is not constant", decl->name);
+            }
+            value = convert_const(type, init.value);
+        }
+    }
+
+    sym_t * sym = push_local_sym(decl->name, kind, type);
+    sym->const_value = value;
+}
+
+void check_simple_stmt(ast_simple_stmt_t * stmt)
+{
+    switch (stmt->type)
+    {
+    case AST_SIMPLE_STMT_VAR_DECL:
+        check_local_decl(stmt->var_decl, SYM_VAR);
+        break;
+    case AST_SIMPLE_STMT_CONST_DECL:
+        check_local_decl(stmt->const_decl, SYM_CONST);
+        break;
+    case AST_SIMPLE_STMT_ASSIGN:
+        {
+            resolved_expr_t left = resolve_expr(stmt->assign.left);
+            if (!left.is_lvalue)
+            {
+                resolve_error("Cannot assign to a non-lvalue");
+            }
+
+            resolved_expr_t right = resolve_expr_expected(stmt->assign.right, left.type);
+            if (stmt->assign.op == TOKEN_TYPE_ASSIGN)
+            {
+                check_convertible(left.type, &right, "assignment");
+            }
+            else if ((stmt->assign.op == TOKEN_TYPE_ASSIGN_ADD || stmt->assign.op == TOKEN_TYPE_ASSIGN_SUB)
+                    && left.type->kind == TYPE_POINTER)
+            {
+                if (!is_integer_type(right.type))
+                {
+                    resolve_error("Pointer arithmetic expects an integer operand");
+                }
+            }
+            else if (!is_arithmetic_type(left.type) || !is_arithmetic_type(right.type))
+            {
+                resolve_error("Compound assignment expects arithmetic operands");
+            }
+        }
+        break;
+    case AST_SIMPLE_STMT_INCREMENT:
+    case AST_SIMPLE_STMT_DECREMENT:
+        {
+            resolved_expr_t operand = resolve_expr(stmt->expr);
+            if (!operand.is_lvalue || !is_scalar_type(operand.type))
+            {
+                resolve_error("Increment/decrement expects a scalar lvalue");
+            }
+        }
+        break;
+    case AST_SIMPLE_STMT_EXPR:
+        resolve_expr(stmt->expr);
+        break;
+    }
+}
+
+void check_stmt_block(ast_stmt_block_t * block);
+
+void check_switch_stmt(ast_stmt_t * stmt)
+{
+    resolved_expr_t expr = resolve_expr(stmt->switch_stmt.expr);
+    if (!is_integer_type(expr.type))
+    {
+        resolve_error("Switch expression must be an integer");
+    }
+
+    for (int32_t i = 0; i < stmt->switch_stmt.num_items; ++i)
+    {
+        ast_switch_item_t * item = stmt->switch_stmt.items[i];
+        for (int32_t j = 0; j < item->num_values; ++j)
+        {
+            ast_switch_case_literal_t * lit = item->values[j];
+            lit->value = (int64_t)lit->integer;
+            if (lit->type == AST_CASE_LITERAL_NAME)
+            {
+                sym_t * sym = lookup_sym(lit->name);
+                if (!sym || (sym->kind != SYM_CONST && sym->kind != SYM_ENUM_CONST) || !is_integer_type(sym->type))
+                {
+                    resolve_error("Case value '%s' is not an integer constant", lit->name);
+                }
+                lit->value = sym->const_value;
+            }
+        }
+        check_stmt_block(item->stmt_block);
+    }
+}
+
+void check_stmt(ast_stmt_t * stmt)
+{
+    switch (stmt->type)
+    {
+    case AST_STMT_IF:
+        for (int32_t i = 0; i < stmt->if_stmt.num_conditions; ++i)
+        {
+            check_condition(stmt->if_stmt.conditions[i]);
+            check_stmt_block(stmt->if_stmt.stmt_blocks[i]);
+        }
+        if (stmt->if_stmt.else_stmt_block)
+        {
+            check_stmt_block(stmt->if_stmt.else_stmt_block);
+        }
+        break;
+    case AST_STMT_WHILE:
+        check_condition(stmt->while_stmt.condition);
+        current_loop_depth++;
+        check_stmt_block(stmt->while_stmt.stmt_block);
+        current_loop_depth--;
+        break;
+    case AST_STMT_FOR:
+        {
+            sym_t * scope = local_syms_end;
+            for (int32_t i = 0; i < stmt->for_stmt.num_init_stmts; ++i)
+            {
+                check_simple_stmt(stmt->for_stmt.init_stmts[i]);
+            }
+            check_condition(stmt->for_stmt.condition);
+            for (int32_t i = 0; i < stmt->for_stmt.num_incr_stmts; ++i)
+            {
+                check_simple_stmt(stmt->for_stmt.incr_stmts[i]);
+            }
+            current_loop_depth++;
+            check_stmt_block(stmt->for_stmt.stmt_block);
+            current_loop_depth--;
+            local_syms_end = scope;
+        }
+        break;
+    case AST_STMT_SWITCH:
+        check_switch_stmt(stmt);
+        break;
+    case AST_STMT_RETURN:
+        if (stmt->return_stmt)
+        {
+            if (current_return_type == type_void)
+            {
+                resolve_error("Returning a value from a function without return type");
+            }
+            resolved_expr_t result = resolve_expr_expected(stmt->return_stmt, current_return_type);
+            check_convertible(current_return_type, &result, "return statement");
+        }
+        else if (current_return_type != type_void)
+        {
+            resolve_error("Missing return value");
+        }
+        break;
+    case AST_STMT_CONTINUE:
+    case AST_STMT_BREAK:
+        if (current_loop_depth == 0)
+        {
+            resolve_error("break/continue outside of a loop");
+        }
+        break;
+    case AST_STMT_BLOCK:
+        check_stmt_block(stmt->stmt_block);
+        break;
+    case AST_STMT_SIMPLE:
+        check_simple_stmt(stmt->simple_stmt);
+        break;
+    }
+}
+
+void check_stmt_block(ast_stmt_block_t * block)
+{
+    sym_t * scope = local_syms_end;
+    for (int32_t i = 0; i < block->num_stmts; ++i)
+    {
+        check_stmt(block->stmts[i]);
+    }
+    local_syms_end = scope;
+}
+
+void check_fn_body(sym_t * sym)
+{
+    ast_decl_t * decl = sym->decl;
+    type_t * type = sym->type;
+    sym_t * scope = local_syms_end;
+
+    for (int32_t i = 0; i < decl->fn_decl.num_params; ++i)
+    {
+        complete_type(type->fn.params[i]);
+        push_local_sym(decl->fn_decl.params[i]->name, SYM_VAR, type->fn.params[i]);
+    }
+
+    complete_type(type->fn.return_type);
+    current_return_type = type->fn.return_type;
+    current_loop_depth = 0;
+    check_stmt_block(decl->fn_decl.stmt_block);
+    current_return_type = NULL;
+    local_syms_end = scope;
+}
+
+// Resolves a single symbol along with whatever it references: aggregates
+// get their layout and functions get their body type-checked.
+void check_sym(sym_t * sym)
+{
+    resolve_sym(sym);
+
+    if (sym->is_checked)
+    {
+        return;
+    }
+    sym->is_checked = true;
+
+    if (sym->kind == SYM_TYPE)
+    {
+        complete_type(sym->type);
+    }
+    else if (sym->kind == SYM_FN)
+    {
+        check_fn_body(sym);
+    }
+}
+
+void resolve_all(void)
+{
+    for (int32_t i = 0; i < sb_len(global_syms); ++i)
+    {
+        check_sym(global_syms[i]);
+    }
+}
+
+void test_resolve(void)
+{
+    init_resolver();
+    init_parser(
+        "const a: i32 = b + 1;"
+        "const b: i32 = 41;"
+        "const unused: i32 = 3;"
+        "enum color : u8 { RED, GREEN = a, BLUE }"
+        "struct node { next: node*; value: i32; data: i8[b - 39]; }"
+        "union either { i: i64; f: f32; }"
+        "var counter: i32 = 0;"
+        "fn get(n: node*): i32 {"
+        "   var c: color = BLUE;"
+        "   for (var i: i32 = 0; i < a; i++) { counter += i; }"
+        "   switch (c) { RED, GREEN -> { return 0; } otherwise -> {} }"
+        "   return n.value + get(n.next) + n.data[1];"
+        "}"
+        "fn never_called(): either { return either{ .f = 42 }; }"
+    );
+    sb_t(ast_decl_t *) decls = parse_document();
+    resolve_add_decls(decls);
+
+    sym_t * get = get_global_sym(intern_string("get"));
+    assert(get->state == SYM_UNRESOLVED);
+    check_sym(get);
+    assert(get->state == SYM_RESOLVED);
+    assert(get->type->kind == TYPE_FN);
+    assert(get->type->fn.return_type == type_i32);
+
+    sym_t * a = get_global_sym(intern_string("a"));
+    assert(a->state == SYM_RESOLVED);
+    assert(a->const_value == 42);
+    assert(get_global_sym(intern_string("BLUE"))->const_value == 43);
+
+    sym_t * node = get_global_sym(intern_string("node"));
+    assert(node->state == SYM_RESOLVED);
+    assert(node->type->kind == TYPE_STRUCT);
+    assert(node->type->size == 16);
+    assert(node->type->aggregate.fields[2].type->kind == TYPE_ARRAY);
+    assert(node->type->aggregate.fields[2].type->array.length == 2);
+
+    assert(get_global_sym(intern_string("unused"))->state == SYM_UNRESOLVED);
+    assert(get_global_sym(intern_string("either"))->state == SYM_UNRESOLVED);
+    assert(get_global_sym(intern_string("never_called"))->state == SYM_UNRESOLVED);
+
+    resolve_all();
+    assert(get_global_sym(intern_string("unused"))->const_value == 3);
+    sym_t * either = get_global_sym(intern_string("either"));
+    assert(either->type->kind == TYPE_UNION);
+    assert(either->type->size == 8);
+    assert(get_global_sym(intern_string("never_called"))->is_checked);
+}
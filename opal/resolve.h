@@ -0,0 +1,135 @@
+#pragma once
+
+#include <stdbool.h>
+#include "ast.h"
+
+typedef enum type_kind_t
+{
+    TYPE_INCOMPLETE,
+    TYPE_COMPLETING,
+    TYPE_VOID,
+    TYPE_B8,
+    TYPE_B32,
+    TYPE_I8,
+    TYPE_I16,
+    TYPE_I32,
+    TYPE_I64,
+    TYPE_U8,
+    TYPE_U16,
+    TYPE_U32,
+    TYPE_U64,
+    TYPE_F32,
+    TYPE_F64,
+    TYPE_ENUM,
+    TYPE_POINTER,
+    TYPE_ARRAY,
+    TYPE_FN,
+    TYPE_STRUCT,
+    TYPE_UNION
+} type_kind_t;
+
+typedef struct type_field_t
+{
+    const char * name;
+    struct type_t * type;
+    int64_t offset;
+} type_field_t;
+
+typedef struct type_t
+{
+    type_kind_t kind;
+    int64_t size;
+    int64_t align;
+    struct sym_t * sym;
+    union
+    {
+        struct
+        {
+            struct type_t * base;
+        } pointer;
+        struct
+        {
+            struct type_t * base;
+            int64_t length;
+        } array;
+        struct
+        {
+            sb_t(struct type_t *) params;
+            int32_t num_params;
+            struct type_t * return_type;
+        } fn;
+        struct
+        {
+            sb_t(type_field_t) fields;
+            int32_t num_fields;
+        } aggregate;
+        struct
+        {
+            struct type_t * base;
+        } enum_type;
+    };
+} type_t;
+
+typedef enum sym_kind_t
+{
+    SYM_VAR,
+    SYM_CONST,
+    SYM_ENUM_CONST,
+    SYM_FN,
+    SYM_TYPE
+} sym_kind_t;
+
+// Global symbols are resolved on first reference. A symbol found in the
+// SYM_RESOLVING state while resolving means its declaration depends on itself.
+typedef enum sym_state_t
+{
+    SYM_UNRESOLVED,
+    SYM_RESOLVING,
+    SYM_RESOLVED
+} sym_state_t;
+
+typedef struct sym_t
+{
+    const char * name;
+    sym_kind_t kind;
+    sym_state_t state;
+    ast_decl_t * decl;
+    type_t * type;
+    int64_t const_value;
+    int32_t enum_item_index;
+    bool is_checked;
+} sym_t;
+
+extern type_t * type_void;
+extern type_t * type_b8;
+extern type_t * type_b32;
+extern type_t * type_i8;
+extern type_t * type_i16;
+extern type_t * type_i32;
+extern type_t * type_i64;
+extern type_t * type_u8;
+extern type_t * type_u16;
+extern type_t * type_u32;
+extern type_t * type_u64;
+extern type_t * type_f32;
+extern type_t * type_f64;
+
+type_t * type_pointer(type_t * base);
+type_t * type_array(type_t * base, int64_t length);
+bool is_integer_type(type_t * type);
+bool is_signed_type(type_t * type);
+bool is_float_type(type_t * type);
+bool is_arithmetic_type(type_t * type);
+type_t * unify_arithmetic_types(type_t * left, type_t * right);
+int32_t find_field_index(type_t * type, const char * name);
+int64_t align_up(int64_t value, int64_t align);
+
+void init_resolver(void);
+void resolve_add_decls(sb_t(ast_decl_t *) decls);
+sym_t * get_global_sym(const char * name);
+sym_t * resolve_name(const char * name);
+void resolve_sym(sym_t * sym);
+type_t * resolve_typespec(ast_typespec_t * typespec);
+void check_sym(sym_t * sym);
+void resolve_all(void);
+void test_resolve(void);
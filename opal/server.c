@@ -0,0 +1,766 @@
+#include "server.h"
+#include "module.h"
+#include "iface.h"
+#include "lex.h"
+#include "resolve.h"
+#include "common.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+
+enum
+{
+    SERVER_IDLE_TIMEOUT_MS = 10 * 60 * 1000,
+    SERVER_START_TIMEOUT_MS = 5000,
+    SERVER_MAX_REQUEST = 1024 * 1024,
+    SERVER_MAX_JOBS = 256
+};
+
+// Exit codes of a compile are never negative.
+enum
+{
+    SERVER_REPLY_STALE = -1
+};
+
+typedef enum server_request_type_t
+{
+    SERVER_REQUEST_COMPILE,
+    SERVER_REQUEST_STOP
+} server_request_type_t;
+
+// A request is this header followed by size bytes: the working directory
+// and the arguments, each NUL terminated. The client's stdout and stderr
+// travel along as SCM_RIGHTS ancillary data. The reply is the exit code of
+// the compile as an int32_t. A server built differently from the client
+// replies SERVER_REPLY_STALE to a compile and stops, the client then starts
+// one from its own executable.
+typedef struct server_header_t
+{
+    uint32_t type;
+    uint32_t size;
+    uint64_t version;
+} server_header_t;
+
+typedef struct server_module_t
+{
+    uint64_t source_hash;
+    sb_t(ast_decl_t *) decls;
+} server_module_t;
+
+#if defined(_WIN32)
+
+int server_unsupported(void)
+{
+    printf("The compile server is not available on this platform\n");
+    return 1;
+}
+
+int server_run(const char * path, server_compile_fn_t compile)
+{
+    (void)path;
+    (void)compile;
+    return server_unsupported();
+}
+
+int server_request(const char * path, int argc, char * argv[], server_compile_fn_t compile)
+{
+    (void)path;
+    (void)argc;
+    (void)argv;
+    (void)compile;
+    return server_unsupported();
+}
+
+int server_stop(const char * path)
+{
+    (void)path;
+    return server_unsupported();
+}
+
+#else
+
+// A compile in flight. The child writes the modules it loaded to the pipe
+// and the server collects them until the child exits and closes it.
+typedef struct server_job_t
+{
+    pid_t pid;
+    int connection;
+    int modules;
+    buf_t loaded;
+} server_job_t;
+
+// Keyed by interned absolute path. Children get a copy on write snapshot
+// and hand out its declarations without copying them, resolving them only
+// changes the child's copy.
+map_t server_modules;
+server_job_t server_jobs[SERVER_MAX_JOBS];
+int32_t server_num_jobs = 0;
+uint64_t server_build = 0;
+
+// Write end of the module pipe in a child.
+int server_module_pipe = -1;
+spin_lock_t server_pipe_lock = SPIN_LOCK_INIT;
+
+////////////////////////////////////////////////////////////////////////////////
+// Sockets
+////////////////////////////////////////////////////////////////////////////////
+
+bool server_write_all(int fd, const void * data, uint64_t size)
+{
+    const char * it = data;
+    while (size > 0)
+    {
+        ssize_t written = write(fd, it, size);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return false;
+        }
+        it += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool server_read_all(int fd, void * data, uint64_t size)
+{
+    char * it = data;
+    while (size > 0)
+    {
+        ssize_t length = read(fd, it, size);
+        if (length < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (length <= 0)
+        {
+            return false;
+        }
+        it += length;
+        size -= length;
+    }
+    return true;
+}
+
+bool server_address(const char * path, struct sockaddr_un * address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path))
+    {
+        fprintf(stderr, "Socket path '%s' is too long\n", path);
+        return false;
+    }
+    strcpy(address->sun_path, path);
+    return true;
+}
+
+int server_connect(const char * path)
+{
+    struct sockaddr_un address;
+    if (!server_address(path, &address))
+    {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// A socket left behind by a server that died is replaced, the socket of a
+// live server is not.
+int server_listen(const char * path)
+{
+    struct sockaddr_un address;
+    if (!server_address(path, &address))
+    {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    bool bound = bind(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+    if (!bound && errno == EADDRINUSE)
+    {
+        int existing = server_connect(path);
+        if (existing < 0)
+        {
+            unlink(path);
+            bound = bind(fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+        }
+        else
+        {
+            close(existing);
+        }
+    }
+
+    if (!bound || listen(fd, 64) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+typedef union server_control_t
+{
+    char data[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr align;
+} server_control_t;
+
+// IFACE_VERSION covers the interfaces the server keeps, the executable's
+// identity covers everything else that can change between builds. Where
+// /proc/self/exe does not exist only IFACE_VERSION is compared. Computed
+// once, a server whose executable is replaced keeps the version it started
+// with.
+uint64_t server_version(void)
+{
+    if (server_build == 0)
+    {
+        uint64_t identity[4] = { IFACE_VERSION, 0, 0, 0 };
+        struct stat info;
+        if (stat("/proc/self/exe", &info) == 0)
+        {
+            identity[1] = (uint64_t)info.st_mtime;
+            identity[2] = (uint64_t)info.st_size;
+            identity[3] = (uint64_t)info.st_ino;
+        }
+        server_build = hash_range((const char *)identity, sizeof(identity));
+    }
+    return server_build;
+}
+
+bool server_send(int connection, server_request_type_t type, const char * body, uint32_t size)
+{
+    server_header_t header = { type, size, server_version() };
+    struct iovec iov = { &header, sizeof(header) };
+    struct msghdr message = { 0 };
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+    server_control_t control;
+    if (type == SERVER_REQUEST_COMPILE)
+    {
+        int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+        memset(&control, 0, sizeof(control));
+        message.msg_control = control.data;
+        message.msg_controllen = sizeof(control.data);
+        struct cmsghdr * cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    }
+
+    ssize_t sent = sendmsg(connection, &message, 0);
+    return sent >= 0
+        && server_write_all(connection, (char *)&header + sent, sizeof(header) - sent)
+        && server_write_all(connection, body, size);
+}
+
+// The body is NUL terminated past its size. fds are left at -1 unless the
+// client sent two.
+bool server_receive(int connection, server_header_t * header, char ** body, int fds[2])
+{
+    struct iovec iov = { header, sizeof(*header) };
+    struct msghdr message = { 0 };
+    server_control_t control;
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data;
+    message.msg_controllen = sizeof(control.data);
+
+    ssize_t received = recvmsg(connection, &message, 0);
+    if (received <= 0)
+    {
+        return false;
+    }
+    for (struct cmsghdr * cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+                && cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int)))
+        {
+            memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+        }
+    }
+
+    if (!server_read_all(connection, (char *)header + received, sizeof(*header) - received)
+            || header->size > SERVER_MAX_REQUEST)
+    {
+        return false;
+    }
+    *body = xmalloc(header->size + 1);
+    (*body)[header->size] = '\0';
+    return server_read_all(connection, *body, header->size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Modules
+////////////////////////////////////////////////////////////////////////////////
+
+bool server_find_module(const char * file_path, uint64_t source_hash, sb_t(ast_decl_t *) * decls)
+{
+    char * path = realpath(file_path, NULL);
+    if (!path)
+    {
+        return false;
+    }
+    server_module_t * module = map_get(&server_modules, intern_string(path));
+    free(path);
+
+    if (!module || module->source_hash != source_hash)
+    {
+        return false;
+    }
+    *decls = module->decls;
+    return true;
+}
+
+// Each module goes to the server as its path length, path, source hash,
+// interface size and interface. A child that exits in the middle of one
+// leaves an incomplete message, which the server ignores.
+void server_module_loaded(const char * file_path, uint64_t source_hash, sb_t(ast_decl_t *) decls)
+{
+    char * path = realpath(file_path, NULL);
+    if (!path)
+    {
+        return;
+    }
+
+    buf_t iface = { 0 };
+    iface_write(&iface, source_hash, decls);
+    uint64_t iface_size = iface.length;
+    char * iface_data = buf_string(&iface);
+    buf_free(&iface);
+
+    buf_t message = { 0 };
+    uint32_t path_length = (uint32_t)strlen(path);
+    buf_write(&message, &path_length, sizeof(path_length));
+    buf_write(&message, path, path_length);
+    buf_write(&message, &source_hash, sizeof(source_hash));
+    buf_write(&message, &iface_size, sizeof(iface_size));
+    buf_write(&message, iface_data, iface_size);
+    uint64_t size = message.length;
+    char * data = buf_string(&message);
+    buf_free(&message);
+
+    spin_lock(&server_pipe_lock);
+    server_write_all(server_module_pipe, data, size);
+    spin_unlock(&server_pipe_lock);
+
+    free(data);
+    free(iface_data);
+    free(path);
+}
+
+void server_store_modules(const char * data, uint64_t size)
+{
+    uint64_t pos = 0;
+    while (size - pos >= sizeof(uint32_t))
+    {
+        uint32_t path_length;
+        memcpy(&path_length, data + pos, sizeof(path_length));
+        pos += sizeof(path_length);
+        if (path_length == 0 || size - pos < path_length + 2 * sizeof(uint64_t))
+        {
+            break;
+        }
+
+        const char * path = data + pos;
+        uint64_t source_hash;
+        uint64_t iface_size;
+        memcpy(&source_hash, data + pos + path_length, sizeof(source_hash));
+        memcpy(&iface_size, data + pos + path_length + sizeof(source_hash), sizeof(iface_size));
+        pos += path_length + 2 * sizeof(uint64_t);
+        if (size - pos < iface_size)
+        {
+            break;
+        }
+
+        sb_t(ast_decl_t *) decls = NULL;
+        if (iface_read(data + pos, iface_size, source_hash, &decls))
+        {
+            const char * key = intern_string_range(path, path + path_length - 1);
+            server_module_t * module = map_get(&server_modules, key);
+            if (!module)
+            {
+                module = xmalloc(sizeof(server_module_t));
+                memset(module, 0, sizeof(server_module_t));
+                map_put(&server_modules, key, module);
+            }
+            ast_free_decls(module->decls);
+            module->source_hash = source_hash;
+            module->decls = decls;
+        }
+        pos += iface_size;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Server
+////////////////////////////////////////////////////////////////////////////////
+
+void server_reply(int connection, int32_t exit_code)
+{
+    server_write_all(connection, &exit_code, sizeof(exit_code));
+    close(connection);
+}
+
+void server_compile_child(char * body, uint32_t size, int fds[2], int modules, server_compile_fn_t compile)
+{
+    dup2(fds[0], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    signal(SIGPIPE, SIG_DFL);
+
+    memset(&stats, 0, sizeof(stats));
+    server_module_pipe = modules;
+    module_hooks.find = server_find_module;
+    module_hooks.loaded = server_module_loaded;
+
+    const char * cwd = body;
+    sb_t(char *) args = NULL;
+    for (char * it = body + strlen(body) + 1; it < body + size; it += strlen(it) + 1)
+    {
+        sb_push(args, it);
+    }
+    sb_push(args, NULL);
+
+    if (chdir(cwd) != 0)
+    {
+        fprintf(stderr, "Cannot change to '%s'\n", cwd);
+        exit(1);
+    }
+    exit(compile(sb_len(args) - 1, args));
+}
+
+// Starts the compile in a child, the reply is sent once it exits. Returns
+// false if the request asks the server to stop or comes from a different
+// build. The socket is unlinked before the reply, so the client can start
+// the next server while this one finishes the compiles in flight.
+bool server_accept(const char * path, int listener, server_compile_fn_t compile)
+{
+    int connection = accept(listener, NULL, NULL);
+    if (connection < 0)
+    {
+        return true;
+    }
+
+    server_header_t header;
+    char * body = NULL;
+    int fds[2] = { -1, -1 };
+    bool stop = false;
+    if (!server_receive(connection, &header, &body, fds))
+    {
+        close(connection);
+    }
+    else if (header.type == SERVER_REQUEST_STOP)
+    {
+        unlink(path);
+        server_reply(connection, 0);
+        stop = true;
+    }
+    else if (header.version != server_version())
+    {
+        unlink(path);
+        server_reply(connection, SERVER_REPLY_STALE);
+        stop = true;
+    }
+    else if (header.type != SERVER_REQUEST_COMPILE || fds[0] < 0 || header.size == 0
+            || server_num_jobs == SERVER_MAX_JOBS)
+    {
+        server_reply(connection, 1);
+    }
+    else
+    {
+        int modules[2];
+        pid_t pid = -1;
+        fflush(NULL);
+        if (pipe(modules) == 0)
+        {
+            pid = fork();
+            if (pid == 0)
+            {
+                close(listener);
+                close(connection);
+                close(modules[0]);
+                for (int32_t i = 0; i < server_num_jobs; ++i)
+                {
+                    close(server_jobs[i].connection);
+                    close(server_jobs[i].modules);
+                }
+                server_compile_child(body, header.size, fds, modules[1], compile);
+            }
+            close(modules[1]);
+        }
+
+        if (pid < 0)
+        {
+            dprintf(fds[1], "The compile server cannot start a compile\n");
+            server_reply(connection, 1);
+        }
+        else
+        {
+            server_jobs[server_num_jobs++] = (server_job_t){ .pid = pid, .connection = connection, .modules = modules[0] };
+        }
+    }
+
+    if (fds[0] >= 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+    }
+    free(body);
+    return !stop;
+}
+
+// Returns false once the child has closed its end of the pipe, i.e. exited.
+bool server_collect(server_job_t * job)
+{
+    char chunk[64 * 1024];
+    ssize_t length = read(job->modules, chunk, sizeof(chunk));
+    if (length < 0 && errno == EINTR)
+    {
+        return true;
+    }
+    if (length > 0)
+    {
+        buf_write(&job->loaded, chunk, length);
+        return true;
+    }
+    close(job->modules);
+
+    int status = 0;
+    int32_t exit_code = 1;
+    while (waitpid(job->pid, &status, 0) < 0 && errno == EINTR)
+    {
+    }
+    if (WIFEXITED(status))
+    {
+        exit_code = WEXITSTATUS(status);
+    }
+    else if (WIFSIGNALED(status))
+    {
+        exit_code = 128 + WTERMSIG(status);
+    }
+    server_reply(job->connection, exit_code);
+
+    uint64_t size = job->loaded.length;
+    char * data = buf_string(&job->loaded);
+    buf_free(&job->loaded);
+    server_store_modules(data, size);
+    free(data);
+    return false;
+}
+
+// Compiles run in parallel, one child each. After a stop request no new
+// ones are accepted and the server exits once the running ones are done.
+int server_run(const char * path, server_compile_fn_t compile)
+{
+    int listener = server_listen(path);
+    if (listener < 0)
+    {
+        fprintf(stderr, "Cannot listen on '%s'\n", path);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    server_version();
+
+    // Interns the keywords and builtin names once for every child.
+    init_keywords();
+    init_resolver();
+
+    bool accepting = true;
+    while (accepting || server_num_jobs > 0)
+    {
+        struct pollfd fds[SERVER_MAX_JOBS + 1];
+        for (int32_t i = 0; i < server_num_jobs; ++i)
+        {
+            fds[i] = (struct pollfd){ .fd = server_jobs[i].modules, .events = POLLIN };
+        }
+        fds[server_num_jobs] = (struct pollfd){ .fd = accepting ? listener : -1, .events = POLLIN };
+
+        int ready = poll(fds, server_num_jobs + 1, server_num_jobs > 0 ? -1 : SERVER_IDLE_TIMEOUT_MS);
+        if (ready < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ready <= 0)
+        {
+            break;
+        }
+
+        int32_t num_jobs = server_num_jobs;
+        for (int32_t i = num_jobs - 1; i >= 0; --i)
+        {
+            if (fds[i].revents && !server_collect(&server_jobs[i]))
+            {
+                server_jobs[i] = server_jobs[--server_num_jobs];
+            }
+        }
+        if (fds[num_jobs].revents & POLLIN)
+        {
+            accepting = server_accept(path, listener, compile);
+        }
+    }
+
+    // After a stop the path may already belong to the next server.
+    close(listener);
+    if (accepting)
+    {
+        unlink(path);
+    }
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Client
+////////////////////////////////////////////////////////////////////////////////
+
+// The server is started in its own session with its standard streams on
+// /dev/null, so it outlives the client and does not keep its pipes open.
+int server_spawn(const char * path, server_compile_fn_t compile)
+{
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        return -1;
+    }
+    if (pid == 0)
+    {
+        setsid();
+        int null = open("/dev/null", O_RDWR);
+        if (null >= 0)
+        {
+            dup2(null, STDIN_FILENO);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+            if (null > STDERR_FILENO)
+            {
+                close(null);
+            }
+        }
+        exit(server_run(path, compile));
+    }
+
+    // A server that lost the race for the socket to one started by another
+    // client exits right away, the other one answers instead.
+    bool exited = false;
+    for (int32_t waited = 0; waited < SERVER_START_TIMEOUT_MS; waited += 10)
+    {
+        int connection = server_connect(path);
+        if (connection >= 0 || exited)
+        {
+            return connection;
+        }
+        exited = waitpid(pid, NULL, WNOHANG) == pid;
+
+        struct timespec delay = { 0, 10 * 1000 * 1000 };
+        nanosleep(&delay, NULL);
+    }
+    return -1;
+}
+
+int server_request(const char * path, int argc, char * argv[], server_compile_fn_t compile)
+{
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd)))
+    {
+        printf("Cannot get the working directory\n");
+        return 1;
+    }
+
+    buf_t body = { 0 };
+    buf_write(&body, cwd, strlen(cwd) + 1);
+    for (int i = 0; i < argc; ++i)
+    {
+        buf_write(&body, argv[i], strlen(argv[i]) + 1);
+    }
+    uint64_t size = body.length;
+    char * data = buf_string(&body);
+    buf_free(&body);
+
+    // A stale server has stopped by the time it replies, the retry goes to
+    // one started from this executable.
+    int32_t exit_code = SERVER_REPLY_STALE;
+    for (int32_t attempt = 0; attempt < 2 && exit_code == SERVER_REPLY_STALE; ++attempt)
+    {
+        int connection = server_connect(path);
+        if (connection < 0)
+        {
+            connection = server_spawn(path, compile);
+        }
+        if (connection < 0)
+        {
+            printf("Cannot reach or start a compile server at '%s'\n", path);
+            free(data);
+            return 1;
+        }
+
+        if (size > SERVER_MAX_REQUEST
+                || !server_send(connection, SERVER_REQUEST_COMPILE, data, (uint32_t)size)
+                || !server_read_all(connection, &exit_code, sizeof(exit_code)))
+        {
+            printf("Lost the connection to the compile server at '%s'\n", path);
+            exit_code = 1;
+        }
+        close(connection);
+    }
+    if (exit_code == SERVER_REPLY_STALE)
+    {
+        printf("The compile server at '%s' was built differently\n", path);
+        exit_code = 1;
+    }
+    free(data);
+    return exit_code;
+}
+
+// Nothing to do if no server is running.
+int server_stop(const char * path)
+{
+    int connection = server_connect(path);
+    if (connection < 0)
+    {
+        return 0;
+    }
+
+    int32_t exit_code = 1;
+    if (server_send(connection, SERVER_REQUEST_STOP, NULL, 0))
+    {
+        server_read_all(connection, &exit_code, sizeof(exit_code));
+    }
+    close(connection);
+    return exit_code;
+}
+
+#endif
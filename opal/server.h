@@ -0,0 +1,26 @@
+#pragma once
+
+#include "common.h"
+
+typedef int (*server_compile_fn_t)(int argc, char * argv[]);
+
+// A compile server keeps what survives between builds warm in one long
+// running process: the intern and keyword tables and every module it has
+// seen, keyed by file and source hash. Each request is compiled by a child
+// forked from the server with the client's stdout, stderr and working
+// directory, so a compile error cannot take the server down and requests
+// never see each other's resolver state. The modules a child had to parse
+// are sent back to the server for the requests after it.
+//
+// Needs Unix domain sockets and fork, elsewhere all three fail.
+
+// Serves requests on the socket at path until stopped, or until it has been
+// idle for SERVER_IDLE_TIMEOUT_MS.
+int server_run(const char * path, server_compile_fn_t compile);
+
+// Forwards a compile to the server at path, starting one in the background
+// if none answers or the one that does was built from a different
+// executable, and returns the exit code of the compile. argv[0] is the
+// program name as for main.
+int server_request(const char * path, int argc, char * argv[], server_compile_fn_t compile);
+int server_stop(const char * path);
@@ -0,0 +1,28 @@
+# Translates an Opal program to C, compiles it with the C compiler of the
+# build and runs it. The program reports success by returning 0 from main.
+
+file(MAKE_DIRECTORY ${WORK_DIR})
+get_filename_component(NAME ${SOURCE} NAME_WE)
+set(C_FILE ${WORK_DIR}/${NAME}.c)
+set(EXE_FILE ${WORK_DIR}/${NAME}${EXE_SUFFIX})
+
+execute_process(COMMAND ${OPAL} ${SOURCE} -o ${C_FILE} RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "opal failed to translate ${SOURCE}")
+endif()
+
+if(CC_ID STREQUAL "MSVC")
+    set(COMPILE_COMMAND ${CC} /nologo /O2 /W3 ${C_FILE} /Fe${EXE_FILE} /Fo${WORK_DIR}/)
+else()
+    set(COMPILE_COMMAND ${CC} -std=c99 -O2 -Wall -Werror ${C_FILE} -o ${EXE_FILE})
+endif()
+
+execute_process(COMMAND ${COMPILE_COMMAND} RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Failed to compile the generated ${C_FILE}")
+endif()
+
+execute_process(COMMAND ${EXE_FILE} RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${EXE_FILE} failed with ${result}")
+endif()
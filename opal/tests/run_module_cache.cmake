@@ -0,0 +1,29 @@
+# Translates an Opal program twice with a fresh module cache. The second run
+# has to take every module from the cache and produce the same C code.
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+
+foreach(run first second)
+    execute_process(COMMAND ${OPAL} ${SOURCE} --cache ${WORK_DIR}/cache --stats -o ${WORK_DIR}/${run}.c
+        RESULT_VARIABLE result ERROR_VARIABLE stats)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "opal failed to translate ${SOURCE}")
+    endif()
+    string(REGEX MATCH "cache: +([0-9]+) hits +([0-9]+) misses" match "${stats}")
+    set(${run}_hits ${CMAKE_MATCH_1})
+    set(${run}_misses ${CMAKE_MATCH_2})
+endforeach()
+
+if(NOT first_hits EQUAL 0 OR first_misses EQUAL 0)
+    message(FATAL_ERROR "The first run found ${first_hits} cached modules in an empty cache")
+endif()
+if(NOT second_hits EQUAL first_misses OR NOT second_misses EQUAL 0)
+    message(FATAL_ERROR "The second run missed ${second_misses} of ${first_misses} cached modules")
+endif()
+
+file(READ ${WORK_DIR}/first.c first)
+file(READ ${WORK_DIR}/second.c second)
+if(NOT first STREQUAL second)
+    message(FATAL_ERROR "Cached modules changed the generated code")
+endif()
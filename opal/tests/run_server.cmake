@@ -0,0 +1,63 @@
+# Compiles an Opal program twice through a compile server started by the
+# first request. The second compile has to take every module from the
+# server and produce the same C code, and compile errors have to reach the
+# client with their exit code. A server whose executable changed since it
+# started has to be replaced by a new one, which starts with an empty cache.
+
+file(REMOVE_RECURSE ${WORK_DIR})
+file(MAKE_DIRECTORY ${WORK_DIR})
+set(SOCKET ${WORK_DIR}/opal.sock)
+# A copy, so the test can touch the executable without touching the build.
+file(COPY ${OPAL} DESTINATION ${WORK_DIR})
+get_filename_component(OPAL_NAME ${OPAL} NAME)
+set(OPAL ${WORK_DIR}/${OPAL_NAME})
+get_filename_component(SOURCE_DIR ${SOURCE} DIRECTORY)
+get_filename_component(SOURCE_NAME ${SOURCE} NAME)
+
+foreach(run first second rebuilt)
+    if(run STREQUAL "rebuilt")
+        # mtime has a resolution of a second on some file systems.
+        execute_process(COMMAND ${CMAKE_COMMAND} -E sleep 1.1)
+        file(TOUCH ${OPAL})
+    endif()
+    # Relative paths are resolved in the client's working directory.
+    execute_process(COMMAND ${OPAL} --server ${SOCKET} ${SOURCE_NAME} --stats -o ${WORK_DIR}/${run}.c
+        WORKING_DIRECTORY ${SOURCE_DIR}
+        RESULT_VARIABLE result OUTPUT_VARIABLE output ERROR_VARIABLE stats)
+    if(NOT result EQUAL 0)
+        execute_process(COMMAND ${OPAL} --server ${SOCKET} --stop)
+        message(FATAL_ERROR "The server failed to translate ${SOURCE}: ${output}")
+    endif()
+    string(REGEX MATCH "cache: +([0-9]+) hits +([0-9]+) misses" match "${stats}")
+    set(${run}_hits ${CMAKE_MATCH_1})
+    set(${run}_misses ${CMAKE_MATCH_2})
+endforeach()
+
+execute_process(COMMAND ${OPAL} --server ${SOCKET} ${ERROR_SOURCE}
+    RESULT_VARIABLE error_result OUTPUT_VARIABLE error_output)
+execute_process(COMMAND ${OPAL} --server ${SOCKET} --stop RESULT_VARIABLE stop_result)
+
+if(NOT first_hits EQUAL 0 OR first_misses EQUAL 0)
+    message(FATAL_ERROR "The first compile found ${first_hits} modules in a new server")
+endif()
+if(NOT second_hits EQUAL first_misses OR NOT second_misses EQUAL 0)
+    message(FATAL_ERROR "The second compile missed ${second_misses} of ${first_misses} modules")
+endif()
+
+if(NOT rebuilt_hits EQUAL 0 OR NOT rebuilt_misses EQUAL first_misses)
+    message(FATAL_ERROR "The server from before the rebuild answered with ${rebuilt_hits} modules")
+endif()
+
+file(READ ${WORK_DIR}/first.c first)
+file(READ ${WORK_DIR}/second.c second)
+file(READ ${WORK_DIR}/rebuilt.c rebuilt)
+if(NOT first STREQUAL second OR NOT first STREQUAL rebuilt)
+    message(FATAL_ERROR "Modules from the server changed the generated code")
+endif()
+
+if(NOT error_result EQUAL 1 OR NOT error_output MATCHES "Import cycle")
+    message(FATAL_ERROR "Compile error was not forwarded, got ${error_result}: ${error_output}")
+endif()
+if(NOT stop_result EQUAL 0 OR EXISTS ${SOCKET})
+    message(FATAL_ERROR "The server did not stop")
+endif()
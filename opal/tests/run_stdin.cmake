@@ -0,0 +1,28 @@
+# Translates an Opal file and dumps its AST read from its path and streamed
+# from stdin, with and without the lexer thread. All of them have to be the
+# same.
+
+foreach(mode c ast)
+    if(mode STREQUAL "ast")
+        set(mode_option --ast)
+    else()
+        set(mode_option)
+    endif()
+
+    execute_process(COMMAND ${OPAL} ${SOURCE} ${mode_option}
+        RESULT_VARIABLE result OUTPUT_VARIABLE expected)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "opal failed to translate ${SOURCE}")
+    endif()
+
+    foreach(option "" --lex-thread)
+        execute_process(COMMAND ${OPAL} - ${mode_option} ${option} INPUT_FILE ${SOURCE}
+            RESULT_VARIABLE result OUTPUT_VARIABLE actual)
+        if(NOT result EQUAL 0)
+            message(FATAL_ERROR "opal failed to translate ${SOURCE} from stdin ${option}")
+        endif()
+        if(NOT actual STREQUAL expected)
+            message(FATAL_ERROR "The ${mode} output for ${SOURCE} differs when read from stdin ${option}")
+        endif()
+    endforeach()
+endforeach()
@@ -0,0 +1,278 @@
+#include "trace.h"
+#include "common.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+enum
+{
+    TRACE_RING_SIZE = 64 * 1024,
+    TRACE_MAX_DEPTH = 256
+};
+
+typedef struct trace_event_t
+{
+    const char * name;
+    const char * detail;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+} trace_event_t;
+
+// Only the owning thread writes a ring. Events are complete spans, written
+// when they end; once the ring is full the oldest ones are overwritten.
+// count is published with release semantics so the flushing thread sees
+// every event it covers.
+typedef struct trace_thread_t
+{
+    trace_event_t events[TRACE_RING_SIZE];
+    atomic_uint_fast64_t count;
+    const char * stack_names[TRACE_MAX_DEPTH];
+    uint64_t stack_starts[TRACE_MAX_DEPTH];
+    int32_t depth;
+    int32_t id;
+    const char * name;
+    struct trace_thread_t * next;
+} trace_thread_t;
+
+bool trace_enabled = false;
+const char * trace_path = NULL;
+uint64_t trace_start_ns = 0;
+_Atomic(trace_thread_t *) trace_threads = NULL;
+atomic_int trace_thread_count = 0;
+THREAD_LOCAL trace_thread_t * trace_current = NULL;
+
+////////////////////////////////////////////////////////////////////////////////
+// Recording
+////////////////////////////////////////////////////////////////////////////////
+
+// Threads register themselves on first use by pushing their ring onto a
+// lock-free list, rings are never freed.
+trace_thread_t * trace_get_thread(void)
+{
+    if (!trace_current)
+    {
+        trace_thread_t * thread = xmalloc(sizeof(trace_thread_t));
+        memset(thread, 0, sizeof(trace_thread_t));
+        atomic_init(&thread->count, 0);
+        thread->id = atomic_fetch_add(&trace_thread_count, 1) + 1;
+
+        thread->next = atomic_load(&trace_threads);
+        while (!atomic_compare_exchange_weak(&trace_threads, &thread->next, thread))
+        {
+        }
+        trace_current = thread;
+    }
+    return trace_current;
+}
+
+void trace_begin(const char * name)
+{
+    if (!trace_enabled)
+    {
+        return;
+    }
+
+    trace_thread_t * thread = trace_get_thread();
+    if (thread->depth < TRACE_MAX_DEPTH)
+    {
+        thread->stack_names[thread->depth] = name;
+        thread->stack_starts[thread->depth] = time_ns();
+    }
+    thread->depth++;
+}
+
+void trace_end(const char * detail)
+{
+    if (!trace_enabled)
+    {
+        return;
+    }
+
+    trace_thread_t * thread = trace_get_thread();
+    assert(thread->depth > 0);
+    thread->depth--;
+    if (thread->depth >= TRACE_MAX_DEPTH)
+    {
+        return;
+    }
+
+    uint64_t count = atomic_load_explicit(&thread->count, memory_order_relaxed);
+    trace_event_t * event = &thread->events[count % TRACE_RING_SIZE];
+    event->name = thread->stack_names[thread->depth];
+    event->detail = detail;
+    event->start_ns = thread->stack_starts[thread->depth];
+    event->duration_ns = time_ns() - event->start_ns;
+    atomic_store_explicit(&thread->count, count + 1, memory_order_release);
+}
+
+void trace_thread_name(const char * name)
+{
+    if (trace_enabled)
+    {
+        trace_get_thread()->name = name;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Output
+////////////////////////////////////////////////////////////////////////////////
+
+void trace_write_string(buf_t * out, const char * str)
+{
+    buf_write(out, "\"", 1);
+    for (const char * c = str; *c; ++c)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            buf_write(out, "\\", 1);
+            buf_write(out, c, 1);
+        }
+        else if ((unsigned char)*c < 0x20)
+        {
+            buf_printf(out, "\\u%04x", (unsigned char)*c);
+        }
+        else
+        {
+            buf_write(out, c, 1);
+        }
+    }
+    buf_write(out, "\"", 1);
+}
+
+void trace_write_event(buf_t * out, trace_thread_t * thread, const char * name, const char * detail,
+    uint64_t start_ns, uint64_t duration_ns)
+{
+    buf_printf(out, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"name\":",
+        thread->id, (start_ns - trace_start_ns) / 1e3, duration_ns / 1e3);
+    trace_write_string(out, name);
+    if (detail)
+    {
+        buf_printf(out, ",\"args\":{\"detail\":");
+        trace_write_string(out, detail);
+        buf_printf(out, "}");
+    }
+    buf_printf(out, "}");
+}
+
+// Spans still open on the calling thread, e.g. because a compile error
+// exits from inside the parser, are written as ending now.
+void trace_write(buf_t * out)
+{
+    uint64_t now = time_ns();
+    buf_printf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    buf_printf(out, "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"opal\"}}");
+
+    for (trace_thread_t * thread = atomic_load(&trace_threads); thread; thread = thread->next)
+    {
+        uint64_t count = atomic_load_explicit(&thread->count, memory_order_acquire);
+        uint64_t first = count > TRACE_RING_SIZE ? count - TRACE_RING_SIZE : 0;
+
+        buf_printf(out, ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":", thread->id);
+        if (thread->name)
+        {
+            trace_write_string(out, thread->name);
+        }
+        else
+        {
+            buf_printf(out, "\"thread %d\"", thread->id);
+        }
+        buf_printf(out, ",\"dropped_events\":%llu}}", (unsigned long long)first);
+
+        for (uint64_t i = first; i < count; ++i)
+        {
+            trace_event_t * event = &thread->events[i % TRACE_RING_SIZE];
+            trace_write_event(out, thread, event->name, event->detail, event->start_ns, event->duration_ns);
+        }
+
+        if (thread == trace_current)
+        {
+            int32_t depth = thread->depth < TRACE_MAX_DEPTH ? thread->depth : TRACE_MAX_DEPTH;
+            for (int32_t i = 0; i < depth; ++i)
+            {
+                trace_write_event(out, thread, thread->stack_names[i], "unfinished",
+                    thread->stack_starts[i], now - thread->stack_starts[i]);
+            }
+        }
+    }
+
+    buf_printf(out, "\n]}\n");
+}
+
+void trace_flush(void)
+{
+    if (!trace_enabled || !trace_path)
+    {
+        return;
+    }
+    trace_enabled = false;
+
+    FILE * file = fopen(trace_path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Cannot write trace '%s'\n", trace_path);
+        return;
+    }
+
+    buf_t buf = { .file = file };
+    trace_write(&buf);
+    buf_free(&buf);
+    fclose(file);
+}
+
+void trace_init(const char * path)
+{
+    trace_path = path;
+    trace_start_ns = time_ns();
+    trace_enabled = true;
+    atexit(trace_flush);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Tests
+////////////////////////////////////////////////////////////////////////////////
+
+void test_trace(void)
+{
+    trace_begin("disabled");
+    trace_end(NULL);
+    assert(trace_current == NULL);
+
+    trace_enabled = true;
+    trace_start_ns = time_ns();
+    trace_thread_name("main");
+    trace_begin("outer");
+    trace_begin("inner");
+    trace_end("a \"quoted\\\" detail");
+    trace_begin("open");
+
+    buf_t buf = { 0 };
+    trace_write(&buf);
+    char * json = buf_string(&buf);
+    assert(strstr(json, "\"name\":\"thread_name\",\"args\":{\"name\":\"main\""));
+    assert(strstr(json, "\"name\":\"inner\",\"args\":{\"detail\":\"a \\\"quoted\\\\\\\" detail\"}"));
+    assert(strstr(json, "\"name\":\"outer\",\"args\":{\"detail\":\"unfinished\"}"));
+    assert(strstr(json, "\"name\":\"open\",\"args\":{\"detail\":\"unfinished\"}"));
+    assert(strstr(json, "\"name\":\"disabled\"") == NULL);
+    free(json);
+
+    for (int32_t i = 0; i < TRACE_RING_SIZE + 10; ++i)
+    {
+        trace_begin("wrap");
+        trace_end(NULL);
+    }
+    trace_write(&buf);
+    json = buf_string(&buf);
+    assert(strstr(json, "\"dropped_events\":11}"));
+    assert(strstr(json, "\"name\":\"inner\"") == NULL);
+    free(json);
+
+    trace_end(NULL);
+    trace_end(NULL);
+    assert(trace_current->depth == 0);
+    atomic_store(&trace_current->count, 0);
+    trace_enabled = false;
+}
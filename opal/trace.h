@@ -0,0 +1,17 @@
+#pragma once
+
+#include "common.h"
+
+// Records spans into a ring buffer owned by the calling thread, so
+// recording never takes a lock. All rings are written out as Chrome trace
+// event JSON (loadable in chrome://tracing or Perfetto) when the process
+// exits. Nothing is recorded until trace_init is called.
+//
+// Span names and details are stored by pointer and must stay valid until
+// exit: use string literals or interned strings.
+void trace_init(const char * path);
+void trace_begin(const char * name);
+void trace_end(const char * detail);
+void trace_thread_name(const char * name);
+void trace_flush(void);
+void test_trace(void);
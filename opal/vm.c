@@ -0,0 +1,355 @@
+#include "vm.h"
+#include "bytecode.h"
+#include "resolve.h"
+#include "parse.h"
+#include "common.h"
+
+#include <stdarg.h>
+#include <string.h>
+#include <assert.h>
+
+void vm_error(const char * format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    printf("VM error: ");
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+    exit(1); // @Todo Good error handling
+}
+
+typedef struct vm_frame_t
+{
+    const vm_instr_t * return_ip;
+    int64_t * regs;
+    uint64_t frame_address;
+} vm_frame_t;
+
+int64_t vm_registers[VM_MAX_REGISTERS];
+vm_frame_t vm_frames[VM_MAX_FRAMES];
+uint8_t * vm_memory = NULL;
+uint64_t vm_stack_pointer = 0;
+
+void vm_reset(vm_module_t * module)
+{
+    if (!vm_memory)
+    {
+        vm_memory = xmalloc(VM_MEMORY_SIZE);
+    }
+
+    uint64_t data_size = sb_len(module->data);
+    if (VM_MEMORY_GUARD_SIZE + data_size > VM_MEMORY_SIZE)
+    {
+        vm_error("Data segment too large");
+    }
+
+    memset(vm_memory, 0, VM_MEMORY_SIZE);
+    if (data_size)
+    {
+        memcpy(vm_memory + VM_MEMORY_GUARD_SIZE, module->data, data_size);
+    }
+    vm_stack_pointer = align_up(VM_MEMORY_GUARD_SIZE + data_size, 16);
+}
+
+static inline uint8_t * vm_address(int64_t address, int64_t size)
+{
+    if (address < VM_MEMORY_GUARD_SIZE || address > VM_MEMORY_SIZE - size)
+    {
+        vm_error("Invalid memory access at %lld", (long long)address);
+    }
+    return vm_memory + address;
+}
+
+static inline uint64_t vm_push_frame_memory(int32_t size)
+{
+    uint64_t address = vm_stack_pointer;
+    vm_stack_pointer = align_up(vm_stack_pointer + size, 16);
+    if (vm_stack_pointer > VM_MEMORY_SIZE)
+    {
+        vm_error("Stack overflow");
+    }
+    return address;
+}
+
+#define LOAD_MEMORY(T) { T value; memcpy(&value, vm_address(RB, sizeof(T)), sizeof(T)); RA = value; }
+#define STORE_MEMORY(T) { T value = (T)RB; memcpy(vm_address(RA, sizeof(T)), &value, sizeof(T)); }
+
+int64_t vm_execute(vm_module_t * module, int32_t fn_index, int64_t * regs)
+{
+    const vm_instr_t * code = module->code;
+    const int64_t * constants = module->constants;
+    vm_fn_t * fn = &module->fns[fn_index];
+    const vm_instr_t * ip = code + fn->code_start;
+    uint64_t frame_address = vm_push_frame_memory(fn->frame_size);
+    int32_t depth = 0;
+
+#define RA regs[VM_GET_A(instr)]
+#define RB regs[VM_GET_B(instr)]
+#define RC regs[VM_GET_C(instr)]
+#define URB ((uint64_t)RB)
+#define URC ((uint64_t)RC)
+
+    for (;;)
+    {
+        vm_instr_t instr = *ip++;
+
+        switch (VM_GET_OP(instr))
+        {
+        case VM_OP_NOP: break;
+        case VM_OP_MOV: RA = RB; break;
+        case VM_OP_LOADI: RA = VM_GET_SBX(instr); break;
+        case VM_OP_LOADK: RA = constants[VM_GET_BX(instr)]; break;
+
+        case VM_OP_ADD: RA = (int64_t)(URB + URC); break;
+        case VM_OP_SUB: RA = (int64_t)(URB - URC); break;
+        case VM_OP_MUL: RA = (int64_t)(URB * URC); break;
+        case VM_OP_DIV:
+            if (RC == 0) { vm_error("Division by zero"); }
+            RA = RC == -1 ? (int64_t)(0 - URB) : RB / RC;
+            break;
+        case VM_OP_DIVU:
+            if (RC == 0) { vm_error("Division by zero"); }
+            RA = (int64_t)(URB / URC);
+            break;
+        case VM_OP_MOD:
+            if (RC == 0) { vm_error("Division by zero"); }
+            RA = RC == -1 ? 0 : RB % RC;
+            break;
+        case VM_OP_MODU:
+            if (RC == 0) { vm_error("Division by zero"); }
+            RA = (int64_t)(URB % URC);
+            break;
+        case VM_OP_AND: RA = RB & RC; break;
+        case VM_OP_OR: RA = RB | RC; break;
+        case VM_OP_XOR: RA = RB ^ RC; break;
+        case VM_OP_SHL: RA = (int64_t)(URB << (RC & 63)); break;
+        case VM_OP_SHR: RA = RB >> (RC & 63); break;
+        case VM_OP_SHRU: RA = (int64_t)(URB >> (RC & 63)); break;
+        case VM_OP_EQ: RA = RB == RC; break;
+        case VM_OP_NE: RA = RB != RC; break;
+        case VM_OP_LT: RA = RB < RC; break;
+        case VM_OP_LE: RA = RB <= RC; break;
+        case VM_OP_LTU: RA = URB < URC; break;
+        case VM_OP_LEU: RA = URB <= URC; break;
+        case VM_OP_ADDI: RA = (int64_t)(URB + (uint64_t)(int64_t)VM_GET_SC(instr)); break;
+
+        case VM_OP_NEG: RA = (int64_t)(0 - URB); break;
+        case VM_OP_NOT: RA = ~RB; break;
+        case VM_OP_LNOT: RA = !RB; break;
+        case VM_OP_BOOL: RA = RB != 0; break;
+        case VM_OP_SEXT8: RA = (int8_t)RB; break;
+        case VM_OP_SEXT16: RA = (int16_t)RB; break;
+        case VM_OP_SEXT32: RA = (int32_t)RB; break;
+        case VM_OP_ZEXT8: RA = (uint8_t)RB; break;
+        case VM_OP_ZEXT16: RA = (uint16_t)RB; break;
+        case VM_OP_ZEXT32: RA = (uint32_t)RB; break;
+
+        case VM_OP_LOADS8: LOAD_MEMORY(int8_t); break;
+        case VM_OP_LOADS16: LOAD_MEMORY(int16_t); break;
+        case VM_OP_LOADS32: LOAD_MEMORY(int32_t); break;
+        case VM_OP_LOADU8: LOAD_MEMORY(uint8_t); break;
+        case VM_OP_LOADU16: LOAD_MEMORY(uint16_t); break;
+        case VM_OP_LOADU32: LOAD_MEMORY(uint32_t); break;
+        case VM_OP_LOAD64: LOAD_MEMORY(int64_t); break;
+        case VM_OP_STORE8: STORE_MEMORY(uint8_t); break;
+        case VM_OP_STORE16: STORE_MEMORY(uint16_t); break;
+        case VM_OP_STORE32: STORE_MEMORY(uint32_t); break;
+        case VM_OP_STORE64: STORE_MEMORY(int64_t); break;
+        case VM_OP_COPY: memmove(vm_address(RA, RC), vm_address(RB, RC), RC); break;
+        case VM_OP_ZERO: memset(vm_address(RA, RB), 0, RB); break;
+        case VM_OP_FRAME: RA = frame_address + VM_GET_BX(instr); break;
+
+        case VM_OP_JMP: ip += VM_GET_SAX(instr); break;
+        case VM_OP_JMPF: if (!RA) { ip += VM_GET_SBX(instr); } break;
+        case VM_OP_JMPT: if (RA) { ip += VM_GET_SBX(instr); } break;
+
+        // The callee registers start at A, where the arguments are, so the
+        // return value ends up in the register A of the caller.
+        case VM_OP_CALL:
+            {
+                vm_fn_t * callee = &module->fns[VM_GET_BX(instr)];
+                if (depth + 1 >= VM_MAX_FRAMES
+                        || regs + VM_GET_A(instr) + callee->num_registers > vm_registers + VM_MAX_REGISTERS)
+                {
+                    vm_error("Call stack overflow");
+                }
+
+                vm_frames[depth++] = (vm_frame_t){ ip, regs, frame_address };
+                regs += VM_GET_A(instr);
+                frame_address = vm_push_frame_memory(callee->frame_size);
+                ip = code + callee->code_start;
+            }
+            break;
+        case VM_OP_RET:
+            regs[0] = RA;
+            // Fallthrough
+        case VM_OP_RET0:
+            vm_stack_pointer = frame_address;
+            if (depth == 0)
+            {
+                return regs[0];
+            }
+            {
+                vm_frame_t * frame = &vm_frames[--depth];
+                ip = frame->return_ip;
+                regs = frame->regs;
+                frame_address = frame->frame_address;
+            }
+            break;
+
+        default:
+            vm_error("Invalid opcode %d", VM_GET_OP(instr));
+            break;
+        }
+    }
+
+#undef RA
+#undef RB
+#undef RC
+#undef URB
+#undef URC
+}
+
+#undef LOAD_MEMORY
+#undef STORE_MEMORY
+
+int64_t vm_call(vm_module_t * module, int32_t fn_index, const int64_t * args, int32_t num_args)
+{
+    assert(fn_index >= 0 && fn_index < sb_len(module->fns));
+    assert(num_args == module->fns[fn_index].num_params);
+
+    for (int32_t i = 0; i < num_args; ++i)
+    {
+        vm_registers[i] = args[i];
+    }
+    return vm_execute(module, fn_index, vm_registers);
+}
+
+// Resets the memory, runs the global initializers then calls the given
+// function without arguments.
+int64_t vm_run(vm_module_t * module, const char * fn_name)
+{
+    int32_t fn_index = find_vm_fn(module, intern_string(fn_name));
+    if (fn_index < 0)
+    {
+        vm_error("No function named '%s'", fn_name);
+    }
+
+    vm_reset(module);
+    vm_call(module, module->init_fn, NULL, 0);
+    return vm_call(module, fn_index, NULL, 0);
+}
+
+void test_vm(void)
+{
+    init_resolver();
+    init_parser(
+        "struct point { x: i32; y: i32; }"
+        "struct holder { pad: i32; items: i16[4]; }"
+        "var digits: i32[3] = { 5, 6, 7 };"
+        "var held: holder;"
+        "var origin: point;"
+        "var scale: i32 = 3;"
+        "const LIMIT: i32 = 10;"
+        "fn fib(n: i32): i32 { if (n < 2) { return n; } return fib(n - 1) + fib(n - 2); }"
+        "fn test_fib(): i32 { return fib(20); }"
+        "fn test_for(): i64 {"
+        "   var total: i64 = 0;"
+        "   for (var i: i32 = 1; i <= 100; i++) { total += i; }"
+        "   return total;"
+        "}"
+        "fn test_while(): i32 {"
+        "   var i: i32 = 0; var n: i32 = 0;"
+        "   while (true) { i++; if (i > LIMIT) { break; } if (i % 2 == 0) { continue; } n += i; }"
+        "   return n;"
+        "}"
+        "fn classify(x: i32): i32 {"
+        "   switch (x) { 1, 2 -> { return 10; } 3 -> { return 30; } otherwise -> { return -1; } }"
+        "   return 0;"
+        "}"
+        "fn test_switch(): i32 { return classify(1) + classify(3) + classify(7); }"
+        "fn test_local_case(x: i32): i32 {"
+        "   const K: i32 = 3;"
+        "   switch (x) { K -> { return 1; } LIMIT -> { return 2; } otherwise -> { return 0; } }"
+        "   return -1;"
+        "}"
+        "fn test_index_temps(): i32 {"
+        "   var i: i32 = 1;"
+        "   held.items[2] = 9; held.items[i + 2] = 4;"
+        "   var h: holder; h.items[i] = 3; h.items[i * 3] = 8;"
+        "   return digits[0] * 100 + digits[1] * 10 + digits[i + 1]"
+        "       + held.items[2] * 1000 + held.items[i * 3] * 10000 + h.items[1] * 100000 + h.items[3] * 1000000;"
+        "}"
+        "fn test_overflow(): i32 {"
+        "   var a: i32 = 2147483647; a = a + 1;"
+        "   var b: i8 = 127; var c: i8 = b + 1;"
+        "   var d: i8 = -128; var e: i8 = -d;"
+        "   var f: i8 = 64; var g: i8 = f * 2;"
+        "   return (a < 0 ? 1 : 0) + (c == -128 ? 2 : 0) + (e == -128 ? 4 : 0) + (g < 0 ? 8 : 0);"
+        "}"
+        "fn test_const_index(): i32 {"
+        "   const N: i32 = 2;"
+        "   var a: i32[5] = { [N + 1] = 7, 8, [LIMIT - 10] = 1 };"
+        "   return a[0] * 100 + a[3] * 10 + a[4] + a[1] + a[2];"
+        "}"
+        "fn test_array(): i32 {"
+        "   var a: i32[8];"
+        "   for (var i: i32 = 0; i < 8; i++) { a[i] = i * i; }"
+        "   var p: i32* = &a[3];"
+        "   return *p + a[7] + *(p + 1);"
+        "}"
+        "fn test_struct(): i32 {"
+        "   var p: point = point{ 3, .y = 4 };"
+        "   var q: point* = &p;"
+        "   q.x = 10;"
+        "   origin.y = p.x * p.y;"
+        "   return origin.y * scale;"
+        "}"
+        "fn swap(a: i32*, b: i32*) { var t: i32 = *a; *a = *b; *b = t; }"
+        "fn test_swap(): i32 { var x: i32 = 1; var y: i32 = 2; swap(&x, &y); return x * 10 + y; }"
+        "fn length(s: u8*): i32 { var n: i32 = 0; while (s[n] != 0) { n++; } return n; }"
+        "fn test_string(): i32 { return length(\"hello\"); }"
+        "fn test_wrap(): i32 { var x: u8 = 250; x += 10; var y: i8 = cast(i8, 200); return x + y; }"
+        "fn test_sequential_ifs(c: i32): i32 {"
+        "   var r: i32 = 0;"
+        "   if (c > 0) { r += 1; }"
+        "   if (c > 0) { r += 10; } else if (c == 0) { r += 100; } else { r += 1000; }"
+        "   return r;"
+        "}"
+        "fn test_logic(): i32 { var a: i32 = 5; return (a > 3 && a < 10 ? 1 : 0) + (a == 2 || !(a != 5) ? 2 : 0); }"
+    );
+    sb_t(ast_decl_t *) decls = parse_document();
+    resolve_add_decls(decls);
+    vm_module_t * module = compile_bytecode(decls);
+
+    assert(vm_run(module, "test_fib") == 6765);
+    assert(vm_run(module, "test_for") == 5050);
+    assert(vm_run(module, "test_while") == 25);
+    assert(vm_run(module, "test_switch") == 39);
+    assert(vm_run(module, "test_array") == 9 + 49 + 16);
+    assert(vm_run(module, "test_struct") == 120);
+    assert(vm_run(module, "test_swap") == 21);
+    assert(vm_run(module, "test_string") == 5);
+    assert(vm_run(module, "test_wrap") == 4 - 56);
+    assert(vm_run(module, "test_logic") == 3);
+    assert(vm_run(module, "test_const_index") == 178);
+    assert(vm_run(module, "test_index_temps") == 8349567);
+    assert(vm_run(module, "test_overflow") == 15);
+
+    int64_t args[] = { 10 };
+    assert(vm_call(module, find_vm_fn(module, intern_string("fib")), args, 1) == 55);
+
+    // Case labels that name a local constant.
+    int32_t local_case = find_vm_fn(module, intern_string("test_local_case"));
+    int64_t values[] = { 3, 10, 5 };
+    assert(vm_call(module, local_case, &values[0], 1) == 1);
+    assert(vm_call(module, local_case, &values[1], 1) == 2);
+    assert(vm_call(module, local_case, &values[2], 1) == 0);
+
+    int32_t sequential_ifs = find_vm_fn(module, intern_string("test_sequential_ifs"));
+    int64_t conditions[] = { 1, 0, -1 };
+    assert(vm_call(module, sequential_ifs, &conditions[0], 1) == 11);
+    assert(vm_call(module, sequential_ifs, &conditions[1], 1) == 100);
+    assert(vm_call(module, sequential_ifs, &conditions[2], 1) == 1000);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+#include "bytecode.h"
+
+enum
+{
+    VM_MAX_REGISTERS = 64 * 1024,
+    VM_MAX_FRAMES = 4096,
+    VM_MEMORY_SIZE = 1 << 20
+};
+
+void vm_reset(vm_module_t * module);
+int64_t vm_call(vm_module_t * module, int32_t fn_index, const int64_t * args, int32_t num_args);
+int64_t vm_run(vm_module_t * module, const char * fn_name);
+void test_vm(void);
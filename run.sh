@@ -0,0 +1,8 @@
+#!/bin/sh
+# usage: run.sh file.opal  -> prints vm result and C result
+f=$1
+echo "vm: $(/tmp/h/harness $f 2>&1)"
+/tmp/b/opal $f -o /tmp/h/out.c 2>&1 | head -5
+cat >> /tmp/h/out.c <<'EOT'
+EOT
+gcc -w -o /tmp/h/out /tmp/h/out.c 2>&1 | head -10 && /tmp/h/out; echo "c rc: $?"